@@ -44,7 +44,10 @@
  * is due to an observation that the merge time increases at least quadratically
  * with the size of the CTF data being merged.  As such, merges of CTF graphs
  * newly read from input files are much faster than merges of CTF graphs that
- * are themselves the results of prior merges.
+ * are themselves the results of prior merges.  (Most of that cost was the
+ * structural comparison of each child node against every parent node with the
+ * same name; the fingerprints described in tdata.c now reject nearly all of
+ * those candidates up front, so the later merges are much closer to linear.)
  *
  * A further complication is the need to ensure the repeatability of CTF merges.
  * That is, a merge should produce the same output every time, given the same
@@ -240,6 +240,7 @@ struct tdesc {
 	int t_flags;
 	int t_vgen;	/* Visitation generation (see traverse.c) */
 	int t_emark;	/* Equality mark (see equiv_cb() in merge.c) */
+	ulong_t t_fphash; /* Structural fingerprint (see tdesc_fphash()) */
 };
 
 #define	t_intr		t_data.intr
@@ -423,6 +424,7 @@ int tdesc_idhash(int, void *);
 int tdesc_idcmp(void *, void *);
 int tdesc_namehash(int, void *);
 int tdesc_namecmp(void *, void *);
+ulong_t tdesc_fphash(tdesc_t *);
 int tdesc_layouthash(int, void *);
 int tdesc_layoutcmp(void *, void *);
 void tdesc_free(tdesc_t *);
@@ -84,8 +84,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "linux.h"
 #include <libelf.h>
 #include <libdwarf.h>
@@ -1896,54 +1899,62 @@ break;
 	} while (dw->dw_nunres != 0);
 }
 
-/*ARGSUSED*/
-int
-dw_read(int fd, tdata_t *td, Elf *elf, const char *filename)
+/*
+ * Compilation units are independent of one another, so each one is converted
+ * into a tdata_t of its own by a pool of worker threads, and the results are
+ * then merged into the caller's tdata_t in the order in which the units
+ * appear in .debug_info.  The merge order is therefore fixed regardless of
+ * how the units were scheduled, and the output is deterministic.
+ *
+ * libdwarf is not thread-safe, and keeps the "current" compilation unit in
+ * the Dwarf_Debug itself, so every worker opens its own handle on the file and
+ * walks the unit headers independently, converting only those units it has
+ * claimed from dwc_next.
+ */
+typedef struct dw_cuwork {
+	int dwc_fd;			/* file being converted */
+	size_t dwc_ptrsz;		/* size of a pointer in this file */
+	int dwc_ncu;			/* number of compilation units */
+	int dwc_next;			/* next unclaimed compilation unit */
+	int dwc_ntyped;			/* units which contained types */
+	int dwc_nworkers;		/* workers started, for debug output */
+	tdata_t **dwc_td;		/* per-unit results, in file order */
+	pthread_mutex_t dwc_lock;	/* protects dwc_next and the counts */
+} dw_cuwork_t;
+
+static int
+dw_open(int fd, Elf *elf, Dwarf_Debug *ddp, Dwarf_Error *errp)
+{
+# if HAVE_LIB_LIBDW
+	if ((*ddp = dwarf_begin(fd, DW_DLC_READ)) == 0)
+		return (DW_DLV_NO_ENTRY);
+	return (DW_DLV_OK);
+# else
+	return (dwarf_elf_init(elf, DW_DLC_READ, NULL, NULL, ddp, errp));
+# endif
+}
+
+/*
+ * Convert the compilation unit whose header was most recently read from `dd'.
+ * Returns 0 if the unit had no type data.
+ */
+static int
+dw_read_cu(Dwarf_Debug dd, tdata_t *td, size_t ptrsz, Dwarf_Half vers,
+    Dwarf_Unsigned nxthdr)
 {
-	Dwarf_Unsigned abboff, hdrlen, nxthdr;
-	Dwarf_Half vers, addrsz;
 	Dwarf_Die cu, child;
 	dwarf_t dw;
 	char *prod = NULL;
-	int rc;
 
 	bzero(&dw, sizeof (dwarf_t));
+	dw.dw_dw = dd;
 	dw.dw_td = td;
-	dw.dw_ptrsz = elf_ptrsz(elf);
+	dw.dw_ptrsz = ptrsz;
 	dw.dw_mfgtid_last = TID_MFGTID_BASE;
-	dw.dw_tidhash = hash_new(TDESC_HASH_BUCKETS, tdesc_idhash, tdesc_idcmp);
-	dw.dw_fwdhash = hash_new(TDESC_HASH_BUCKETS, tdesc_namehash,
-	    tdesc_namecmp);
-	dw.dw_enumhash = hash_new(TDESC_HASH_BUCKETS, tdesc_namehash,
-	    tdesc_namecmp);
 
-# if HAVE_LIB_LIBDW
-	if ((dw.dw_dw = dwarf_begin(fd, DW_DLC_READ)) == 0) {
-# else
-	if ((rc = dwarf_elf_init(elf, DW_DLC_READ, NULL, NULL, &dw.dw_dw,
-	    &dw.dw_err)) == DW_DLV_NO_ENTRY) {
-# endif
-		errno = ENOENT;
-		return (-1);
-	} else if (rc != DW_DLV_OK) {
-		if (dwarf_errno(dw.dw_err) == DW_DLE_DEBUG_INFO_NULL) {
-			/*
-			 * There's no type data in the DWARF section, but
-			 * libdwarf is too clever to handle that properly.
-			 */
-			return (0);
-		}
-
-		terminate("failed to initialize DWARF: %s\n",
-		    dwarf_errmsg(dw.dw_err));
-	}
-
-	if ((rc = dwarf_next_cu_header(dw.dw_dw, &hdrlen, &vers, &abboff,
-	    &addrsz, &nxthdr, &dw.dw_err)) != DW_DLV_OK ||
-	    (cu = die_sibling(&dw, NULL)) == NULL ||
+	if ((cu = die_sibling(&dw, NULL)) == NULL ||
 	    (child = die_child(&dw, cu)) == NULL)
-		terminate("file does not contain dwarf type data "
-		    "(try compiling with -g)\n");
+		return (0);
 
 	dw.dw_maxoff = nxthdr - 1;
 
@@ -1969,23 +1980,198 @@ dw_read(int fd, tdata_t *td, Elf *elf, const char *filename)
 		debug(1, "CU name: %s\n", dw.dw_cuname);
 	}
 
+	dw.dw_tidhash = hash_new(TDESC_HASH_BUCKETS, tdesc_idhash, tdesc_idcmp);
+	dw.dw_fwdhash = hash_new(TDESC_HASH_BUCKETS, tdesc_namehash,
+	    tdesc_namecmp);
+	dw.dw_enumhash = hash_new(TDESC_HASH_BUCKETS, tdesc_namehash,
+	    tdesc_namecmp);
+
 	die_create(&dw, child);
+	die_resolve(&dw);
 
-	if ((rc = dwarf_next_cu_header(dw.dw_dw, &hdrlen, &vers, &abboff,
-	    &addrsz, &nxthdr, &dw.dw_err)) != DW_DLV_NO_ENTRY)
-		terminate("multiple compilation units not supported\n");
+	/*
+	 * The tdescs now belong to td; only the lookup tables go.
+	 */
+	hash_free(dw.dw_tidhash, NULL, NULL);
+	hash_free(dw.dw_fwdhash, NULL, NULL);
+	hash_free(dw.dw_enumhash, NULL, NULL);
+	if (dw.dw_cuname != NULL)
+		free(dw.dw_cuname);
 
-	(void) dwarf_finish(dw.dw_dw, &dw.dw_err);
+	return (1);
+}
 
-	die_resolve(&dw);
+static void *
+dw_read_worker(void *arg)
+{
+	dw_cuwork_t *dwc = arg;
+	Dwarf_Unsigned abboff, hdrlen, nxthdr;
+	Dwarf_Half vers, addrsz;
+	Dwarf_Debug dd;
+	Dwarf_Error err;
+	Elf *elf = NULL;
+	int cuidx, want, id;
+
+# if !HAVE_LIB_LIBDW
+	if ((elf = elf_begin(dwc->dwc_fd, ELF_C_READ, NULL)) == NULL)
+		terminate("failed to reopen ELF file: %s\n", elf_errmsg(-1));
+# endif
+	if (dw_open(dwc->dwc_fd, elf, &dd, &err) != DW_DLV_OK)
+		terminate("failed to initialize DWARF: %s\n",
+		    dwarf_errmsg(err));
+
+	pthread_mutex_lock(&dwc->dwc_lock);
+	id = dwc->dwc_nworkers++;
+	want = dwc->dwc_next++;
+	pthread_mutex_unlock(&dwc->dwc_lock);
+
+	for (cuidx = 0; want < dwc->dwc_ncu; cuidx++) {
+		if (dwarf_next_cu_header(dd, &hdrlen, &vers, &abboff, &addrsz,
+		    &nxthdr, &err) != DW_DLV_OK)
+			terminate("failed to read compilation unit %d: %s\n",
+			    cuidx, dwarf_errmsg(err));
+
+		if (cuidx != want)
+			continue;
+
+		debug(2, "worker %d: converting compilation unit %d\n",
+		    id, cuidx);
+
+		if (dwc->dwc_td[cuidx] == NULL)
+			dwc->dwc_td[cuidx] = tdata_new();
+
+		if (dw_read_cu(dd, dwc->dwc_td[cuidx], dwc->dwc_ptrsz, vers,
+		    nxthdr)) {
+			pthread_mutex_lock(&dwc->dwc_lock);
+			dwc->dwc_ntyped++;
+			pthread_mutex_unlock(&dwc->dwc_lock);
+		}
+
+		pthread_mutex_lock(&dwc->dwc_lock);
+		want = dwc->dwc_next++;
+		pthread_mutex_unlock(&dwc->dwc_lock);
+	}
+
+	(void) dwarf_finish(dd, &err);
+	if (elf != NULL)
+		(void) elf_end(elf);
+
+	return (NULL);
+}
+
+/*ARGSUSED*/
+int
+dw_read(int fd, tdata_t *td, Elf *elf, const char *filename)
+{
+	Dwarf_Unsigned abboff, hdrlen, nxthdr;
+	Dwarf_Half vers, addrsz;
+	Dwarf_Debug dd;
+	Dwarf_Error err;
+	dw_cuwork_t dwc;
+	pthread_t *thr;
+	int nthreads, i, rc, perr;
+
+	if ((rc = dw_open(fd, elf, &dd, &err)) == DW_DLV_NO_ENTRY) {
+		errno = ENOENT;
+		return (-1);
+	} else if (rc != DW_DLV_OK) {
+		if (dwarf_errno(err) == DW_DLE_DEBUG_INFO_NULL) {
+			/*
+			 * There's no type data in the DWARF section, but
+			 * libdwarf is too clever to handle that properly.
+			 */
+			return (0);
+		}
+
+		terminate("failed to initialize DWARF: %s\n",
+		    dwarf_errmsg(err));
+	}
+
+	/*
+	 * Reading the unit headers is cheap; count them so that the results
+	 * can be slotted into place as the workers finish.
+	 */
+	bzero(&dwc, sizeof (dw_cuwork_t));
+	while ((rc = dwarf_next_cu_header(dd, &hdrlen, &vers, &abboff,
+	    &addrsz, &nxthdr, &err)) == DW_DLV_OK)
+		dwc.dwc_ncu++;
+
+	if (rc != DW_DLV_NO_ENTRY)
+		terminate("failed to read compilation unit header: %s\n",
+		    dwarf_errmsg(err));
+
+	(void) dwarf_finish(dd, &err);
+
+	if (dwc.dwc_ncu == 0)
+		terminate("file does not contain dwarf type data "
+		    "(try compiling with -g)\n");
+
+	dwc.dwc_fd = fd;
+	dwc.dwc_ptrsz = elf_ptrsz(elf);
+	dwc.dwc_td = xcalloc(sizeof (tdata_t *) * dwc.dwc_ncu);
+	pthread_mutex_init(&dwc.dwc_lock, NULL);
+
+	/*
+	 * A single unit is converted straight into the caller's tdata_t, as
+	 * it always has been.
+	 */
+	if (dwc.dwc_ncu == 1)
+		dwc.dwc_td[0] = td;
+
+	if (getenv("CTFCONVERT_NTHREADS"))
+		nthreads = atoi(getenv("CTFCONVERT_NTHREADS"));
+	else
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = MAX(MIN(nthreads, dwc.dwc_ncu), 1);
+
+	debug(1, "Converting %d compilation units with %d threads\n",
+	    dwc.dwc_ncu, nthreads);
+
+	/*
+	 * Units are claimed from dwc_next, so however many workers we manage
+	 * to start will convert all of them between them.  If we cannot start
+	 * any, convert them here instead.
+	 */
+	if (nthreads == 1) {
+		(void) dw_read_worker(&dwc);
+	} else {
+		thr = xmalloc(sizeof (pthread_t) * nthreads);
+		for (i = 0; i < nthreads; i++) {
+			if ((perr = pthread_create(&thr[i], NULL,
+			    dw_read_worker, &dwc)) != 0) {
+				debug(1, "Started %d of %d threads: %s\n",
+				    i, nthreads, strerror(perr));
+				break;
+			}
+		}
+		nthreads = i;
+		if (nthreads == 0)
+			(void) dw_read_worker(&dwc);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(thr[i], NULL);
+		free(thr);
+	}
+
+	if (dwc.dwc_ntyped == 0)
+		terminate("file does not contain dwarf type data "
+		    "(try compiling with -g)\n");
+
+	if (dwc.dwc_ncu > 1) {
+		for (i = 0; i < dwc.dwc_ncu; i++) {
+			debug(2, "merging compilation unit %d\n", i);
+			merge_into_master(dwc.dwc_td[i], td, NULL, 0);
+			tdata_free(dwc.dwc_td[i]);
+		}
+	}
+
+	free(dwc.dwc_td);
+	pthread_mutex_destroy(&dwc.dwc_lock);
 
 #if !defined(__APPLE__) && !defined(linux)
-	cvt_fixups(td, dw.dw_ptrsz);
+	cvt_fixups(td, dwc.dwc_ptrsz);
 #else
 	/* Ignore Solaris gore. See on-src-20080707/usr/src/tools/ctf/cvt/fixup_tdescs.c */
 #endif
 
-	/* leak the dwarf_t */
-
 	return (0);
 }
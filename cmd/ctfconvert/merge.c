@@ -375,6 +375,13 @@ equiv_node(tdesc_t *ctdp, tdesc_t *mtdp, equiv_data_t *ed)
 	    mapping == mtdp->t_id && !ed->ed_selfuniquify)
 		return (1);
 
+	/*
+	 * Equivalent subgraphs always have the same fingerprint, so this
+	 * rejects nearly every mismatch without walking either subgraph.
+	 */
+	if (tdesc_fphash(ctdp) != tdesc_fphash(mtdp))
+		return (0);
+
 	if (!streq(ctdp->t_name, mtdp->t_name))
 		return (0);
 
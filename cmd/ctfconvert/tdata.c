@@ -39,87 +39,150 @@
 #include "traverse.h"
 
 /*
- * The layout hash is used during the equivalency checking.  We have a node in
- * the child graph that may be equivalent to a node in the parent graph.  To
- * find the corresponding node (if any) in the parent, we need a quick way to
- * get to all nodes in the parent that look like the node in the child.  Since a
- * large number of nodes don't have names, we need to incorporate the layout of
- * the node into the hash.  If we don't, we'll end up with the vast majority of
- * nodes in bucket zero, with one or two nodes in each of the remaining buckets.
+ * Every tdesc_t carries a structural fingerprint - a hash over the node and,
+ * recursively, over the nodes it refers to - such that any two nodes that
+ * equiv_node() in merge.c would consider equivalent have the same fingerprint.
+ * The converse doesn't hold, but it very nearly does, so comparing
+ * fingerprints lets the merge throw out almost every inequivalent candidate
+ * without walking its subgraph.
  *
  * There are a couple of constraints, both of which concern forward
- * declarations.  Recall that a forward declaration tdesc is equivalent to a
- * tdesc that actually defines the structure or union.  As such, we cannot
- * incorporate anything into the hash for a named struct or union node that
- * couldn't be found by looking at the forward, and vice versa.
+ * declarations and cycles.  Recall that a forward declaration tdesc is
+ * equivalent to a tdesc that actually defines the structure or union.  As
+ * such, we cannot incorporate anything into the fingerprint of a named struct
+ * or union node that couldn't be found by looking at the forward, and vice
+ * versa - so we stop at the name.  Unnamed structures and unions can't have
+ * forwards pointing to them, so their member names and offsets go in, but not
+ * their member types.  Every cycle in a type graph runs through a struct or a
+ * union, so the recursion always terminates, and a node's fingerprint doesn't
+ * depend on where we entered the graph.  Member sizes are left out because
+ * equiv_su() doesn't always compare them.
+ *
+ * Fingerprints are computed on demand and cached in t_fphash, where zero means
+ * "not yet computed".  The merge redirects edges after the fact (forward
+ * resolution, remapping of conjured nodes), but only ever to equivalent nodes,
+ * so a cached fingerprint never goes stale.
  */
-int
-tdesc_layouthash(int nbuckets, void *node)
+static ulong_t
+fp_mix(ulong_t h, ulong_t v)
 {
-	tdesc_t *tdp = node;
-	char *name = NULL;
-	ulong_t h = 0;
+	return (h ^ (v + 0x9e3779b9UL + (h << 6) + (h >> 2)));
+}
 
-	if (tdp->t_name)
-		name = tdp->t_name;
-	else {
-		switch (tdp->t_type) {
-		case POINTER:
-		case TYPEDEF:
-		case VOLATILE:
-		case CONST:
-		case RESTRICT:
-			name = tdp->t_tdesc->t_name;
-			break;
-		case FUNCTION:
-			h = tdp->t_fndef->fn_nargs +
-			    tdp->t_fndef->fn_vargs;
-			name = tdp->t_fndef->fn_ret->t_name;
-			break;
-		case ARRAY:
-			h = tdp->t_ardef->ad_nelems;
-			name = tdp->t_ardef->ad_contents->t_name;
-			break;
-		case STRUCT:
-		case UNION:
-			/*
-			 * Unnamed structures, which cannot have forward
-			 * declarations pointing to them.  We can therefore
-			 * incorporate the name of the first member into
-			 * the hash value.
-			 */
-#if linux
-			if (tdp->t_members == NULL) {
-/*				printf("WARNING: struct/union with no members?\n");*/
-				name = "anonymous-su-member";
-			} else
-#endif
-				name = tdp->t_members->ml_name;
-			break;
-		case ENUM:
-			/* Use the first element in the hash value */
-			name = tdp->t_emem->el_name;
+static ulong_t
+fp_str(ulong_t h, const char *s)
+{
+	if (s == NULL)
+		return (fp_mix(h, 0));
+
+	h = fp_mix(h, 1);
+	while (*s != '\0')
+		h = fp_mix(h, (uchar_t)*s++);
+
+	return (h);
+}
+
+ulong_t
+tdesc_fphash(tdesc_t *tdp)
+{
+	mlist_t *ml;
+	elist_t *el;
+	ulong_t h;
+	int i;
+
+	if (tdp->t_fphash != 0)
+		return (tdp->t_fphash);
+
+	h = fp_str(0, tdp->t_name);
+
+	switch (tdp->t_type) {
+	case INTRINSIC:
+		h = fp_mix(h, INTRINSIC);
+		h = fp_mix(h, tdp->t_intr->intr_type);
+		h = fp_mix(h, tdp->t_intr->intr_signed);
+		h = fp_mix(h, tdp->t_intr->intr_offset);
+		h = fp_mix(h, tdp->t_intr->intr_nbits);
+		if (tdp->t_intr->intr_type == INTR_INT)
+			h = fp_mix(h, tdp->t_intr->intr_iformat);
+		else
+			h = fp_mix(h, tdp->t_intr->intr_fformat);
+		break;
+	case POINTER:
+	case TYPEDEF:
+	case VOLATILE:
+	case CONST:
+	case RESTRICT:
+		h = fp_mix(h, tdp->t_type);
+		h = fp_mix(h, tdesc_fphash(tdp->t_tdesc));
+		break;
+	case FUNCTION:
+		h = fp_mix(h, FUNCTION);
+		h = fp_mix(h, tdp->t_fndef->fn_nargs);
+		h = fp_mix(h, tdp->t_fndef->fn_vargs);
+		h = fp_mix(h, tdesc_fphash(tdp->t_fndef->fn_ret));
+		for (i = 0; i < tdp->t_fndef->fn_nargs; i++)
+			h = fp_mix(h, tdesc_fphash(tdp->t_fndef->fn_args[i]));
+		break;
+	case ARRAY:
+		h = fp_mix(h, ARRAY);
+		h = fp_mix(h, tdp->t_ardef->ad_nelems);
+		h = fp_mix(h, tdesc_fphash(tdp->t_ardef->ad_contents));
+		h = fp_mix(h, tdesc_fphash(tdp->t_ardef->ad_idxtype));
+		break;
+	case STRUCT:
+	case UNION:
+	case FORWARD:
+		/* A forward is equivalent to either, so they share a tag. */
+		h = fp_mix(h, FORWARD);
+		if (tdp->t_name != NULL || tdp->t_type == FORWARD)
 			break;
-		default:
-			/*
-			 * Intrinsics, forwards, and typedefs all have
-			 * names.
-			 */
-			warning("Unexpected unnamed %d tdesc (ID %d)\n",
-			    tdp->t_type, tdp->t_id);
+
+		h = fp_mix(h, tdp->t_type);
+		for (ml = tdp->t_members; ml != NULL; ml = ml->ml_next) {
+			h = fp_str(h, ml->ml_name);
+			h = fp_mix(h, ml->ml_offset);
 		}
+		break;
+	case ENUM:
+		h = fp_mix(h, ENUM);
+		for (el = tdp->t_emem; el != NULL; el = el->el_next) {
+			h = fp_str(h, el->el_name);
+			h = fp_mix(h, el->el_number);
+		}
+		break;
+	default:
+		h = fp_mix(h, tdp->t_type);
 	}
 
-	if (name)
-		return (hash_name(nbuckets, name));
+	if (h == 0)
+		h = 1;
 
-	return (h % nbuckets);
+	return (tdp->t_fphash = h);
+}
+
+/*
+ * The layout hash is used during the equivalency checking.  We have a node in
+ * the child graph that may be equivalent to a node in the parent graph.  To
+ * find the corresponding node (if any) in the parent, we need a quick way to
+ * get to all nodes in the parent that look like the node in the child.  Since a
+ * large number of nodes don't have names, hashing on the name alone would leave
+ * long chains of unrelated nodes in a few buckets, each of which would need a
+ * full subgraph comparison.  The structural fingerprint spreads them out.
+ */
+int
+tdesc_layouthash(int nbuckets, void *node)
+{
+	return (tdesc_fphash(node) % nbuckets);
 }
 
 int
 tdesc_layoutcmp(void *arg1, void *arg2)
 {
 	tdesc_t *tdp1 = arg1, *tdp2 = arg2;
+	ulong_t fp1 = tdesc_fphash(tdp1), fp2 = tdesc_fphash(tdp2);
+
+	if (fp1 != fp2)
+		return (fp1 < fp2 ? -1 : 1);
 
 	if (tdp1->t_name == NULL) {
 		if (tdp2->t_name == NULL)
@@ -68,7 +68,7 @@ typedef struct dtrace_cmd {
 int	dtrace_here = 1;
 
 static const char DTRACE_OPTSTR[] =
-	"3:6:a:Ab:Bc:CD:ef:FGhHi:I:lL:m:n:o:p:P:qs:SU:vVwx:X:Z";
+	"3:6:a:Ab:Bc:CD:ef:FGhHi:I:lL:m:n:o:O:p:P:qR:s:SU:vVwx:X:Z";
 
 static char **g_argv;
 static int g_argc;
@@ -94,6 +94,8 @@ static int g_mode = DMODE_EXEC;
 static int g_status = E_SUCCESS;
 static int g_grabanon = 0;
 static const char *g_ofile = NULL;
+static const char *g_capfile = NULL;
+static const char *g_replayfile = NULL;
 static FILE *g_ofp;
 static dtrace_hdl_t *g_dtp;
 static char *g_etcfile = "/etc/system";
@@ -122,8 +124,8 @@ usage(FILE *fp)
 
 	(void) fprintf(fp, "Usage: %s [-32|-64] [-aACeFGhHlqSvVwZ] "
 	    "[-b bufsz] [-c cmd] [-D name[=def]]\n\t[-I path] [-L path] "
-	    "[-o output] [-p pid] [-s script] [-U name]\n\t"
-	    "[-x opt[=val]] [-X a|c|s|t]\n\n"
+	    "[-o output] [-O capture] [-p pid] [-R capture]\n\t"
+	    "[-s script] [-U name] [-x opt[=val]] [-X a|c|s|t]\n\n"
 	    "\t[-P provider %s]\n"
 	    "\t[-m [ provider: ] module %s]\n"
 	    "\t[-f [[ provider: ] module: ] func %s]\n"
@@ -162,9 +164,11 @@ usage(FILE *fp)
 	    "\t-m  enable or list probes matching the specified module name\n"
 	    "\t-n  enable or list probes matching the specified probe name\n"
 	    "\t-o  set output file\n"
+	    "\t-O  write trace data to a capture file instead of processing it\n"
 	    "\t-p  grab specified process-ID and cache its symbol tables\n"
 	    "\t-P  enable or list probes matching the specified provider name\n"
 	    "\t-q  set quiet mode (only output explicitly traced data)\n"
+	    "\t-R  process trace data from a capture file written with -O\n"
 	    "\t-s  enable or list probes according to the specified D script\n"
 	    "\t-S  print D compiler intermediate code\n"
 	    "\t-U  undefine symbol when invoking preprocessor\n"
@@ -826,6 +830,16 @@ drophandler(const dtrace_dropdata_t *data, void *arg)
 	return (DTRACE_HANDLE_OK);
 }
 
+/*ARGSUSED*/
+static int
+specstat(dtrace_hdl_t *dtp, uint32_t id, const dtrace_specstat_t *ss,
+    void *arg)
+{
+	error("speculation %u: %llu drops, %u busy, %u unavailable\n", id,
+	    (u_longlong_t)ss->dtss_drops, ss->dtss_busy, ss->dtss_unavail);
+	return (0);
+}
+
 /*ARGSUSED*/
 static int
 setopthandler(const dtrace_setoptdata_t *data, void *arg)
@@ -1362,6 +1376,14 @@ main(int argc, char *argv[])
 				g_mode = DMODE_VERS;
 				mode++;
 				break;
+
+			case 'O':
+				g_capfile = optarg;
+				break;
+
+			case 'R':
+				g_replayfile = optarg;
+				break;
 				
 #if defined(__APPLE__)
 			case ':':
@@ -1458,8 +1480,17 @@ main(int argc, char *argv[])
 	/*
 	 * Open libdtrace.  If we are not actually going to be enabling any
 	 * instrumentation attempt to reopen libdtrace using DTRACE_O_NODEV.
+	 * If we are replaying a capture file, libdtrace takes its trace data
+	 * from the file rather than from the dtrace device.
 	 */
-	while ((g_dtp = dtrace_open(DTRACE_VERSION, g_oflags, &err)) == NULL) {
+	if (g_replayfile != NULL && (g_dtp = dtrace_replay_open(DTRACE_VERSION,
+	    g_oflags, &err, g_replayfile)) == NULL) {
+		fatal("failed to open capture file %s: %s\n", g_replayfile,
+		    dtrace_errmsg(NULL, err));
+	}
+
+	while (g_dtp == NULL &&
+	    (g_dtp = dtrace_open(DTRACE_VERSION, g_oflags, &err)) == NULL) {
 		if (!(g_oflags & DTRACE_O_NODEV) && !g_exec && !g_grabanon) {
 			g_oflags |= DTRACE_O_NODEV;
 			continue;
@@ -1743,12 +1774,23 @@ main(int argc, char *argv[])
 	 */
 	switch (g_mode) {
 	case DMODE_EXEC:
+		if (g_replayfile != NULL &&
+		    (g_cmdc != 0 || g_psc != 0 || g_capfile != NULL)) {
+			(void) fprintf(stderr, "%s: -R cannot be combined with "
+			    "probe descriptions or the -c, -O or -p options\n",
+			    g_pname);
+			return (E_USAGE);
+		}
+
 		if (g_ofile != NULL && (g_ofp = fopen(g_ofile, "a")) == NULL)
 			fatal("failed to open output file '%s'", g_ofile);
 
 		for (i = 0; i < g_cmdc; i++)
 			exec_prog(&g_cmdv[i]);
 
+		if (g_capfile != NULL && dtrace_capture(g_dtp, g_capfile) != 0)
+			dfatal("failed to open capture file %s", g_capfile);
+
 		if (done && !g_grabanon) {
 			dtrace_close(g_dtp);
 			return (g_status);
@@ -1886,10 +1928,11 @@ main(int argc, char *argv[])
 	}
 
 	/*
-	 * If -a and -Z were not specified and no probes have been matched, no
-	 * probe criteria was specified on the command line and we abort.
+	 * If -a, -R and -Z were not specified and no probes have been matched,
+	 * no probe criteria was specified on the command line and we abort.
 	 */
-	if (g_total == 0 && !g_grabanon && !(g_cflags & DTRACE_C_ZDEFS))
+	if (g_total == 0 && !g_grabanon && g_replayfile == NULL &&
+	    !(g_cflags & DTRACE_C_ZDEFS))
 		dfatal("no probes %s\n", g_cmdc ? "matched" : "specified");
 
 	/*
@@ -1970,12 +2013,34 @@ main(int argc, char *argv[])
 	} while (!done);
 
 	oprintf("\n");
-	if (!g_impatient) {
+	if (!g_impatient && g_capfile == NULL) {
 		if (dtrace_aggregate_print(g_dtp, g_ofp, NULL) == -1 &&
 		    dtrace_errno(g_dtp) != EINTR)
 			dfatal("failed to print aggregations");
 	}
 
+	/*
+	 * With -v, say which speculations dropped data; the drop handler
+	 * only gives us totals.  Also say if any per-CPU buffers ended up
+	 * away from their CPU's NUMA node, and what aggtopn held back.
+	 */
+	if (g_verbose && g_replayfile == NULL) {
+		uint64_t local, remote, held, unfiltered;
+
+		(void) dtrace_specstat_iter(g_dtp, specstat, NULL);
+
+		if (dtrace_aggtopnstat(g_dtp, &held, &unfiltered) == 0 &&
+		    (held != 0 || unfiltered != 0))
+			error("aggtopn held back %llu aggregation records; "
+			    "%llu snapshots unfiltered\n", (u_longlong_t)held,
+			    (u_longlong_t)unfiltered);
+
+		if (dtrace_numastat(g_dtp, &local, &remote) == 0 && remote != 0)
+			error("%llu of %llu per-CPU buffers not on their "
+			    "CPU's NUMA node\n", (u_longlong_t)remote,
+			    (u_longlong_t)(local + remote));
+	}
+
 	dtrace_close(g_dtp);
 	return (g_status);
 }
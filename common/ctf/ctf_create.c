@@ -56,6 +56,7 @@ ctf_create(int *errp)
 	ctf_dtdef_t **hash = ctf_alloc(hashlen * sizeof (ctf_dtdef_t *));
 	ctf_sect_t cts;
 	ctf_file_t *fp;
+	int err;
 
 	if (hash == NULL)
 		return (ctf_set_open_errno(errp, EAGAIN));
@@ -73,6 +74,12 @@ ctf_create(int *errp)
 		return (NULL);
 	}
 
+	if ((err = ctf_init_lookups(fp)) != 0) {
+		ctf_free(hash, hashlen * sizeof (ctf_dtdef_t *));
+		ctf_close(fp);
+		return (ctf_set_open_errno(errp, err));
+	}
+
 	fp->ctf_flags |= LCTF_RDWR;
 	fp->ctf_dthashlen = hashlen;
 	bzero(hash, hashlen * sizeof (ctf_dtdef_t *));
@@ -377,11 +384,21 @@ ctf_update(ctf_file_t *fp)
 		return (ctf_set_errno(fp, err));
 	}
 
+	/*
+	 * A writable container's hashes are used directly by ctf_add_*(),
+	 * so build them now rather than on demand.
+	 */
+	if ((err = ctf_init_lookups(nfp)) != 0) {
+		nfp->ctf_data.cts_data = NULL; /* force ctf_data_free() */
+		ctf_close(nfp);
+		return (ctf_set_errno(fp, err));
+	}
+
 	(void) ctf_setmodel(nfp, ctf_getmodel(fp));
 	(void) ctf_import(nfp, fp->ctf_parent);
 
 	nfp->ctf_refcnt = fp->ctf_refcnt;
-	nfp->ctf_flags |= fp->ctf_flags & ~LCTF_DIRTY;
+	nfp->ctf_flags |= fp->ctf_flags & ~(LCTF_DIRTY | LCTF_LAZY);
 	nfp->ctf_data.cts_data = NULL; /* force ctf_data_free() on close */
 	nfp->ctf_dthash = fp->ctf_dthash;
 	nfp->ctf_dthashlen = fp->ctf_dthashlen;
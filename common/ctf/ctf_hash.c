@@ -30,7 +30,12 @@ ctf_hash_create(ctf_hash_t *hp, ulong_t nelems)
 		return (0);
 	}
 
-	hp->h_nbuckets = 211;		/* use a prime number of hash buckets */
+	/*
+	 * Use a prime number of buckets for small tables, and about one
+	 * bucket per element for large ones (the kernel's container has
+	 * tens of thousands of names, which made for very long chains).
+	 */
+	hp->h_nbuckets = nelems < 211 ? 211 : (nelems | 1);
 	hp->h_nelems = nelems + 1;	/* we use index zero as a sentinel */
 	hp->h_free = 1;			/* first free element is index 1 */
 
@@ -204,6 +204,10 @@ struct ctf_file {
 	uint_t *ctf_txlate;	/* translation table for type IDs */
 	ushort_t *ctf_ptrtab;	/* translation table for pointer-to lookups */
 	ulong_t ctf_typemax;	/* maximum valid type ID number */
+	ulong_t ctf_nstructs;	/* number of struct and forward types */
+	ulong_t ctf_nunions;	/* number of union types */
+	ulong_t ctf_nenums;	/* number of enum types */
+	ulong_t ctf_nnames;	/* number of types hashed in ctf_names */
 	const ctf_dmodel_t *ctf_dmodel;	/* data model pointer (see above) */
 	struct ctf_file *ctf_parent;	/* parent CTF container (if any) */
 	const char *ctf_parlabel;	/* label in parent container (if any) */
@@ -232,6 +236,7 @@ struct ctf_file {
 #define	LCTF_CHILD	0x0002	/* CTF container is a child */
 #define	LCTF_RDWR	0x0004	/* CTF container is writable */
 #define	LCTF_DIRTY	0x0008	/* CTF container has been modified */
+#define	LCTF_LAZY	0x0010	/* name hashes and ptrtab not yet built */
 
 #define	ECTF_BASE	1000	/* base value for libctf errnos */
 
@@ -286,6 +291,7 @@ extern ssize_t ctf_get_ctt_size(const ctf_file_t *, const ctf_type_t *,
     ssize_t *, ssize_t *);
 
 extern const ctf_type_t *ctf_lookup_by_id(ctf_file_t **, ctf_id_t);
+extern int ctf_init_lookups(ctf_file_t *);
 
 extern int ctf_hash_create(ctf_hash_t *, ulong_t);
 extern int ctf_hash_insert(ctf_hash_t *, ctf_file_t *, ushort_t, uint_t);
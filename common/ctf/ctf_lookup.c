@@ -85,10 +85,14 @@ ctf_lookup_by_name(ctf_file_t *fp, const char *name)
 	const char *p, *q, *end;
 	ctf_id_t type = 0;
 	ctf_id_t ntype, ptype;
+	int err;
 
 	if (name == NULL)
 		return (ctf_set_errno(fp, EINVAL));
 
+	if ((err = ctf_init_lookups(fp)) != 0)
+		return (ctf_set_errno(fp, err));
+
 	for (p = name, end = name + strlen(name); *p != '\0'; p = q) {
 		while (isspace(*p))
 			p++; /* skip leading ws */
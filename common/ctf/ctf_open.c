@@ -200,8 +200,38 @@ init_symtab(ctf_file_t *fp, const ctf_header_t *hp,
 }
 
 /*
- * Initialize the type ID translation table with the byte offset of each type,
- * and initialize the hash tables of each named type.
+ * Return the number of bytes of variable-length data following a type.
+ */
+static size_t
+type_vbytes(const ctf_file_t *fp, ushort_t kind, ulong_t vlen, ssize_t size)
+{
+	switch (kind) {
+	case CTF_K_INTEGER:
+	case CTF_K_FLOAT:
+		return (sizeof (uint_t));
+	case CTF_K_ARRAY:
+		return (sizeof (ctf_array_t));
+	case CTF_K_FUNCTION:
+		return (sizeof (ushort_t) * (vlen + (vlen & 1)));
+	case CTF_K_STRUCT:
+	case CTF_K_UNION:
+		if (fp->ctf_version == CTF_VERSION_1 ||
+		    size < CTF_LSTRUCT_THRESH)
+			return (sizeof (ctf_member_t) * vlen);
+		return (sizeof (ctf_lmember_t) * vlen);
+	case CTF_K_ENUM:
+		return (sizeof (ctf_enum_t) * vlen);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Initialize the type ID translation table with the byte offset of each type.
+ * The hash tables of named types and the pointer table are built later, by
+ * ctf_init_lookups(), the first time somebody needs them: a large container
+ * such as the kernel's is typically opened just to resolve types by ID, and
+ * hashing every name in it would page in the whole string table for nothing.
  */
 static int
 init_types(ctf_file_t *fp, const ctf_header_t *hp)
@@ -213,7 +243,6 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 
 	ulong_t pop[CTF_K_MAX + 1] = { 0 };
 	const ctf_type_t *tp;
-	ushort_t id, dst;
 	uint_t *xp;
 
 	/*
@@ -223,8 +252,6 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 	 * to values in the range reserved for child types in our first pass.
 	 */
 	int child = hp->cth_parname != 0;
-	int nlstructs = 0, nlunions = 0;
-	int err;
 
 	/*
 	 * We make two passes through the entire type section.  In this first
@@ -234,23 +261,11 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 		ushort_t kind = LCTF_INFO_KIND(fp, tp->ctt_info);
 		ulong_t vlen = LCTF_INFO_VLEN(fp, tp->ctt_info);
 		ssize_t size, increment;
-
-		size_t vbytes;
 		uint_t n;
 
 		(void) ctf_get_ctt_size(fp, tp, &size, &increment);
 
 		switch (kind) {
-		case CTF_K_INTEGER:
-		case CTF_K_FLOAT:
-			vbytes = sizeof (uint_t);
-			break;
-		case CTF_K_ARRAY:
-			vbytes = sizeof (ctf_array_t);
-			break;
-		case CTF_K_FUNCTION:
-			vbytes = sizeof (ushort_t) * (vlen + (vlen & 1));
-			break;
 		case CTF_K_STRUCT:
 		case CTF_K_UNION:
 			if (fp->ctf_version == CTF_VERSION_1 ||
@@ -258,39 +273,38 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 				ctf_member_t *mp = (ctf_member_t *)
 				    ((uintptr_t)tp + increment);
 
-				vbytes = sizeof (ctf_member_t) * vlen;
 				for (n = vlen; n != 0; n--, mp++)
 					child |= CTF_TYPE_ISCHILD(mp->ctm_type);
 			} else {
 				ctf_lmember_t *lmp = (ctf_lmember_t *)
 				    ((uintptr_t)tp + increment);
 
-				vbytes = sizeof (ctf_lmember_t) * vlen;
 				for (n = vlen; n != 0; n--, lmp++)
 					child |=
 					    CTF_TYPE_ISCHILD(lmp->ctlm_type);
 			}
 			break;
-		case CTF_K_ENUM:
-			vbytes = sizeof (ctf_enum_t) * vlen;
-			break;
-		case CTF_K_FORWARD:
-		case CTF_K_UNKNOWN:
-			vbytes = 0;
-			break;
 		case CTF_K_POINTER:
 		case CTF_K_TYPEDEF:
 		case CTF_K_VOLATILE:
 		case CTF_K_CONST:
 		case CTF_K_RESTRICT:
 			child |= CTF_TYPE_ISCHILD(tp->ctt_type);
-			vbytes = 0;
+			break;
+		case CTF_K_INTEGER:
+		case CTF_K_FLOAT:
+		case CTF_K_ARRAY:
+		case CTF_K_FUNCTION:
+		case CTF_K_ENUM:
+		case CTF_K_FORWARD:
+		case CTF_K_UNKNOWN:
 			break;
 		default:
 			ctf_dprintf("detected invalid CTF kind -- %u\n", kind);
 			return (ECTF_CORRUPT);
 		}
-		tp = (ctf_type_t *)((uintptr_t)tp + increment + vbytes);
+		tp = (ctf_type_t *)((uintptr_t)tp + increment +
+		    type_vbytes(fp, kind, vlen, size));
 		pop[kind]++;
 	}
 
@@ -305,53 +319,96 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 		ctf_dprintf("CTF container %p is a parent\n", (void *)fp);
 
 	/*
-	 * Now that we've counted up the number of each type, we can allocate
-	 * the hash tables, type translation table, and pointer table.
+	 * Remember how big each hash table will need to be, for when we
+	 * get around to building them.
 	 */
-	if ((err = ctf_hash_create(&fp->ctf_structs,
-	    pop[CTF_K_STRUCT] + pop[CTF_K_FORWARD])) != 0)
-		return (err);
-
-	if ((err = ctf_hash_create(&fp->ctf_unions, pop[CTF_K_UNION])) != 0)
-		return (err);
-
-	if ((err = ctf_hash_create(&fp->ctf_enums, pop[CTF_K_ENUM])) != 0)
-		return (err);
-
-	if ((err = ctf_hash_create(&fp->ctf_names,
-	    pop[CTF_K_INTEGER] + pop[CTF_K_FLOAT] + pop[CTF_K_FUNCTION] +
-	    pop[CTF_K_TYPEDEF] + pop[CTF_K_POINTER] + pop[CTF_K_VOLATILE] +
-	    pop[CTF_K_CONST] + pop[CTF_K_RESTRICT])) != 0)
-		return (err);
+	fp->ctf_nstructs = pop[CTF_K_STRUCT] + pop[CTF_K_FORWARD];
+	fp->ctf_nunions = pop[CTF_K_UNION];
+	fp->ctf_nenums = pop[CTF_K_ENUM];
+	fp->ctf_nnames = pop[CTF_K_INTEGER] + pop[CTF_K_FLOAT] +
+	    pop[CTF_K_FUNCTION] + pop[CTF_K_TYPEDEF] + pop[CTF_K_POINTER] +
+	    pop[CTF_K_VOLATILE] + pop[CTF_K_CONST] + pop[CTF_K_RESTRICT];
 
 	fp->ctf_txlate = ctf_alloc(sizeof (uint_t) * (fp->ctf_typemax + 1));
-	fp->ctf_ptrtab = ctf_alloc(sizeof (ushort_t) * (fp->ctf_typemax + 1));
 
-	if (fp->ctf_txlate == NULL || fp->ctf_ptrtab == NULL)
+	if (fp->ctf_txlate == NULL)
 		return (EAGAIN); /* memory allocation failed */
 
 	xp = fp->ctf_txlate;
 	*xp++ = 0; /* type id 0 is used as a sentinel value */
 
-	bzero(fp->ctf_txlate, sizeof (uint_t) * (fp->ctf_typemax + 1));
-	bzero(fp->ctf_ptrtab, sizeof (ushort_t) * (fp->ctf_typemax + 1));
-
 	/*
 	 * In the second pass through the types, we fill in each entry of the
-	 * type and pointer tables and add names to the appropriate hashes.
+	 * type translation table.
 	 */
-	for (id = 1, tp = tbuf; tp < tend; xp++, id++) {
+	for (tp = tbuf; tp < tend; xp++) {
 		ushort_t kind = LCTF_INFO_KIND(fp, tp->ctt_info);
 		ulong_t vlen = LCTF_INFO_VLEN(fp, tp->ctt_info);
 		ssize_t size, increment;
 
+		(void) ctf_get_ctt_size(fp, tp, &size, &increment);
+
+		*xp = (uint_t)((uintptr_t)tp - (uintptr_t)fp->ctf_buf);
+		tp = (ctf_type_t *)((uintptr_t)tp + increment +
+		    type_vbytes(fp, kind, vlen, size));
+	}
+
+	ctf_dprintf("%lu total types processed\n", fp->ctf_typemax);
+
+	fp->ctf_flags |= LCTF_LAZY;
+	return (0);
+}
+
+/*
+ * Build the hash tables of named types and the pointer table for a container
+ * opened by ctf_bufopen(), if that hasn't been done already.  Everything that
+ * looks types up by name, or looks for a pointer to a type, calls this first.
+ * Returns zero or an error code; on failure the container is left as it was
+ * so that a later call can try again.
+ */
+int
+ctf_init_lookups(ctf_file_t *fp)
+{
+	int child = (fp->ctf_flags & LCTF_CHILD) != 0;
+	int nlstructs = 0, nlunions = 0;
+	const ctf_type_t *tp;
+	ushort_t id, dst;
+	int err;
+
+	if (!(fp->ctf_flags & LCTF_LAZY))
+		return (0);
+
+	if ((err = ctf_hash_create(&fp->ctf_structs, fp->ctf_nstructs)) != 0 ||
+	    (err = ctf_hash_create(&fp->ctf_unions, fp->ctf_nunions)) != 0 ||
+	    (err = ctf_hash_create(&fp->ctf_enums, fp->ctf_nenums)) != 0 ||
+	    (err = ctf_hash_create(&fp->ctf_names, fp->ctf_nnames)) != 0)
+		goto bad;
+
+	fp->ctf_ptrtab = ctf_alloc(sizeof (ushort_t) * (fp->ctf_typemax + 1));
+	if (fp->ctf_ptrtab == NULL) {
+		err = EAGAIN; /* memory allocation failed */
+		goto bad;
+	}
+
+	bzero(fp->ctf_ptrtab, sizeof (ushort_t) * (fp->ctf_typemax + 1));
+
+	/*
+	 * Walk the types by ID, filling in the pointer table and adding names
+	 * to the appropriate hashes.
+	 */
+	for (id = 1; id <= fp->ctf_typemax; id++) {
+		ushort_t kind;
+		ssize_t size, increment;
+
 		const char *name;
-		size_t vbytes;
 		ctf_helem_t *hep;
 		ctf_encoding_t cte;
 
+		tp = LCTF_INDEX_TO_TYPEPTR(fp, id);
+		kind = LCTF_INFO_KIND(fp, tp->ctt_info);
 		(void) ctf_get_ctt_size(fp, tp, &size, &increment);
 		name = ctf_strptr(fp, tp->ctt_name);
+		err = 0;
 
 		switch (kind) {
 		case CTF_K_INTEGER:
@@ -365,8 +422,6 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 			    name, strlen(name))) == NULL) {
 				err = ctf_hash_insert(&fp->ctf_names, fp,
 				    CTF_INDEX_TO_TYPE(id, child), tp->ctt_name);
-				if (err != 0 && err != ECTF_STRTAB)
-					return (err);
 			} else if (ctf_type_encoding(fp, hep->h_type,
 			    &cte) == 0 && cte.cte_bits == 0) {
 				/*
@@ -375,19 +430,6 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 				 */
 				hep->h_type = CTF_INDEX_TO_TYPE(id, child);
 			}
-			vbytes = sizeof (uint_t);
-			break;
-
-		case CTF_K_ARRAY:
-			vbytes = sizeof (ctf_array_t);
-			break;
-
-		case CTF_K_FUNCTION:
-			err = ctf_hash_insert(&fp->ctf_names, fp,
-			    CTF_INDEX_TO_TYPE(id, child), tp->ctt_name);
-			if (err != 0 && err != ECTF_STRTAB)
-				return (err);
-			vbytes = sizeof (ushort_t) * (vlen + (vlen & 1));
 			break;
 
 		case CTF_K_STRUCT:
@@ -399,49 +441,32 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 			    name, strlen(name))) == NULL) {
 				err = ctf_hash_insert(&fp->ctf_structs, fp,
 				    CTF_INDEX_TO_TYPE(id, child), tp->ctt_name);
-				if (err != 0 && err != ECTF_STRTAB)
-					return (err);
 			} else
 				hep->h_type = CTF_INDEX_TO_TYPE(id, child);
 
-			if (fp->ctf_version == CTF_VERSION_1 ||
-			    size < CTF_LSTRUCT_THRESH)
-				vbytes = sizeof (ctf_member_t) * vlen;
-			else {
-				vbytes = sizeof (ctf_lmember_t) * vlen;
+			if (fp->ctf_version != CTF_VERSION_1 &&
+			    size >= CTF_LSTRUCT_THRESH)
 				nlstructs++;
-			}
 			break;
 
 		case CTF_K_UNION:
 			err = ctf_hash_insert(&fp->ctf_unions, fp,
 			    CTF_INDEX_TO_TYPE(id, child), tp->ctt_name);
-			if (err != 0 && err != ECTF_STRTAB)
-				return (err);
 
-			if (fp->ctf_version == CTF_VERSION_1 ||
-			    size < CTF_LSTRUCT_THRESH)
-				vbytes = sizeof (ctf_member_t) * vlen;
-			else {
-				vbytes = sizeof (ctf_lmember_t) * vlen;
+			if (fp->ctf_version != CTF_VERSION_1 &&
+			    size >= CTF_LSTRUCT_THRESH)
 				nlunions++;
-			}
 			break;
 
 		case CTF_K_ENUM:
 			err = ctf_hash_insert(&fp->ctf_enums, fp,
 			    CTF_INDEX_TO_TYPE(id, child), tp->ctt_name);
-			if (err != 0 && err != ECTF_STRTAB)
-				return (err);
-			vbytes = sizeof (ctf_enum_t) * vlen;
 			break;
 
+		case CTF_K_FUNCTION:
 		case CTF_K_TYPEDEF:
 			err = ctf_hash_insert(&fp->ctf_names, fp,
 			    CTF_INDEX_TO_TYPE(id, child), tp->ctt_name);
-			if (err != 0 && err != ECTF_STRTAB)
-				return (err);
-			vbytes = 0;
 			break;
 
 		case CTF_K_FORWARD:
@@ -453,10 +478,7 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 			    name, strlen(name)) == NULL) {
 				err = ctf_hash_insert(&fp->ctf_structs, fp,
 				    CTF_INDEX_TO_TYPE(id, child), tp->ctt_name);
-				if (err != 0 && err != ECTF_STRTAB)
-					return (err);
 			}
-			vbytes = 0;
 			break;
 
 		case CTF_K_POINTER:
@@ -476,20 +498,13 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 		case CTF_K_RESTRICT:
 			err = ctf_hash_insert(&fp->ctf_names, fp,
 			    CTF_INDEX_TO_TYPE(id, child), tp->ctt_name);
-			if (err != 0 && err != ECTF_STRTAB)
-				return (err);
-			/*FALLTHRU*/
-
-		default:
-			vbytes = 0;
 			break;
 		}
 
-		*xp = (uint_t)((uintptr_t)tp - (uintptr_t)fp->ctf_buf);
-		tp = (ctf_type_t *)((uintptr_t)tp + increment + vbytes);
+		if (err != 0 && err != ECTF_STRTAB)
+			goto bad;
 	}
 
-	ctf_dprintf("%lu total types processed\n", fp->ctf_typemax);
 	ctf_dprintf("%u enum names hashed\n", ctf_hash_size(&fp->ctf_enums));
 	ctf_dprintf("%u struct names hashed (%d long)\n",
 	    ctf_hash_size(&fp->ctf_structs), nlstructs);
@@ -517,7 +532,20 @@ init_types(ctf_file_t *fp, const ctf_header_t *hp)
 		}
 	}
 
+	fp->ctf_flags &= ~LCTF_LAZY;
 	return (0);
+
+bad:
+	ctf_hash_destroy(&fp->ctf_structs);
+	ctf_hash_destroy(&fp->ctf_unions);
+	ctf_hash_destroy(&fp->ctf_enums);
+	ctf_hash_destroy(&fp->ctf_names);
+	if (fp->ctf_ptrtab != NULL) {
+		ctf_free(fp->ctf_ptrtab,
+		    sizeof (ushort_t) * (fp->ctf_typemax + 1));
+		fp->ctf_ptrtab = NULL;
+	}
+	return (err);
 }
 
 /*
@@ -492,10 +492,14 @@ ctf_type_pointer(ctf_file_t *fp, ctf_id_t type)
 {
 	ctf_file_t *ofp = fp;
 	ctf_id_t ntype;
+	int err;
 
 	if (ctf_lookup_by_id(&fp, type) == NULL)
 		return (CTF_ERR); /* errno is set for us */
 
+	if ((err = ctf_init_lookups(fp)) != 0)
+		return (ctf_set_errno(ofp, err));
+
 	if ((ntype = fp->ctf_ptrtab[CTF_TYPE_TO_INDEX(type)]) != 0)
 		return (CTF_INDEX_TO_TYPE(ntype, (fp->ctf_flags & LCTF_CHILD)));
 
@@ -505,6 +509,9 @@ ctf_type_pointer(ctf_file_t *fp, ctf_id_t type)
 	if (ctf_lookup_by_id(&fp, type) == NULL)
 		return (ctf_set_errno(ofp, ECTF_NOTYPE));
 
+	if ((err = ctf_init_lookups(fp)) != 0)
+		return (ctf_set_errno(ofp, err));
+
 	if ((ntype = fp->ctf_ptrtab[CTF_TYPE_TO_INDEX(type)]) != 0)
 		return (CTF_INDEX_TO_TYPE(ntype, (fp->ctf_flags & LCTF_CHILD)));
 
@@ -327,6 +327,19 @@ tp->ct_tinfo.t_opcode,
 		return;
 	}
 
+	/***********************************************/
+	/*   The  provider  has  a relocated copy of  */
+	/*   the   instruction(s)  (e.g.  an  fbt  jump  */
+	/*   probe  part  way  through  being patched  */
+	/*   in  or  out),  so  just  continue  there  */
+	/*   rather than single step.		       */
+	/***********************************************/
+	if (tp->ct_tinfo.t_resume) {
+		regs->r_pc = (greg_t) tp->ct_tinfo.t_resume;
+		this_cpu->cpuc_mode = CPUC_MODE_IDLE;
+		return;
+	}
+
 	tp->ct_instr_buf[0] = tp->ct_tinfo.t_opcode;
 	dtrace_memcpy(&tp->ct_instr_buf[1], 
 		(void *) regs->r_pc, 
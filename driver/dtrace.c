@@ -170,6 +170,7 @@ size_t		dtrace_actions_max = (16 * 1024);
 size_t          dtrace_retain_max = 1024;
 dtrace_optval_t	dtrace_helper_actions_max = 32;
 dtrace_optval_t	dtrace_helper_providers_max = 32;
+int		dtrace_helper_lazy = 1;
 dtrace_optval_t	dtrace_dstate_defsize = (1 * 1024 * 1024);
 size_t		dtrace_strsize_default = 256;
 dtrace_optval_t	dtrace_cleanrate_default = 9900990;		/* 101 hz */
@@ -185,6 +186,10 @@ dtrace_optval_t dtrace_stackframes_default = 20;
 dtrace_optval_t dtrace_ustackframes_default = 20;
 dtrace_optval_t dtrace_jstackframes_default = 50;
 dtrace_optval_t dtrace_jstackstrsize_default = 512;
+dtrace_optval_t	dtrace_aggtopn_max = 64 * 1024;
+size_t		dtrace_stacktab_defsize = (4 * 1024 * 1024);
+size_t		dtrace_stacktab_maxsize = (256 * 1024 * 1024);
+int		dtrace_stacktab_maxprobe = 64;
 int		dtrace_msgdsize_max = 128;
 hrtime_t	dtrace_chill_max = 500 * (NANOSEC / MILLISEC);	/* 500 ms */
 hrtime_t	dtrace_chill_interval = NANOSEC;		/* 1000 ms */
@@ -254,11 +259,17 @@ static kthread_t	*dtrace_panicked;	/* panicking thread */
 static dtrace_ecb_t	*dtrace_ecb_create_cache; /* cached created ECB */
 static dtrace_genid_t   dtrace_probegen;        /* current probe generation */
 static dtrace_helpers_t *dtrace_deferred_pid;	/* deferred helper list */
+static dtrace_helpers_t *dtrace_lazy_pid;	/* helpers awaiting a consumer */
+static dtrace_dofcache_t *dtrace_dofcache;	/* shared helper DOF */
 static dtrace_enabling_t *dtrace_retained;      /* list of retained enablings */
 static dtrace_genid_t	dtrace_retained_gen;	/* current retained enab gen */
 static dtrace_dynvar_t  dtrace_dynhash_sink;    /* end of dynamic hash chains */
 static int		dtrace_dynvar_failclean; /* dynvars failed to clean */
 
+#define	DTRACE_AGGCOMPACT_CHUNK	(16 * 1024)
+static uint64_t		dtrace_aggcompact_buf[DTRACE_AGGCOMPACT_CHUNK /
+			    sizeof (uint64_t)];	/* compaction staging */
+
 /**********************************************************************/
 /*   We wrap dtrace_probe(), so we have an extra frame to discount.   */
 /**********************************************************************/
@@ -389,11 +400,17 @@ static MUTEX_DEFINE(dtrace_errlock);
 #define	DTRACE_HASHPREV(hash, probe)	\
 	(dtrace_probe_t **)((uintptr_t)(probe) + (hash)->dth_prevoffs)
 
+#define	DTRACE_HASHKEY(hash, probe)	\
+	(*((char **)((uintptr_t)(probe) + (hash)->dth_stroffs)))
+
 #define	DTRACE_HASHEQ(hash, lhs, rhs)	\
 	(strcmp(*((char **)((uintptr_t)(lhs) + (hash)->dth_stroffs)), \
 	    *((char **)((uintptr_t)(rhs) + (hash)->dth_stroffs))) == 0)
 
+#define	DTRACE_HASH_MIGRATE		4
+
 #define	DTRACE_AGGHASHSIZE_SLEW		17
+#define	DTRACE_AGGTOPN_SKIP		0x40000000
 
 #define	DTRACE_V4MAPPED_OFFSET		(sizeof (uint32_t) * 3)
 
@@ -2205,6 +2222,105 @@ dtrace_aggregate_llquantize(uint64_t *llquanta, uint64_t nval, uint64_t incr)
 	    low, high, nsteps, nval)] += incr;
 }
 
+/*
+ * For distinct(), the value is first run through the 64-bit finalizer from
+ * MurmurHash3:  register selection and rank must be uniformly distributed
+ * even for the sequential values (pids, addresses, inode numbers) that are
+ * typically being counted.
+ */
+/*ARGSUSED*/
+static void
+dtrace_aggregate_distinct(uint64_t *data, uint64_t nval, uint64_t arg)
+{
+	uint8_t *regs = (uint8_t *)data;
+	uint64_t h = nval;
+	uint_t ndx;
+	uint8_t rank = 1;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	ndx = (uint_t)(h >> (64 - DTRACE_DISTINCT_PRECISION));
+	h <<= DTRACE_DISTINCT_PRECISION;
+
+	while (rank <= 64 - DTRACE_DISTINCT_PRECISION &&
+	    !(h & (1ULL << 63))) {
+		h <<= 1;
+		rank++;
+	}
+
+	if (regs[ndx] < rank)
+		regs[ndx] = rank;
+}
+
+static uint64_t
+dtrace_aggregate_percentiles_bucket(uint64_t val)
+{
+	uint64_t v = val;
+	int i, msb = 0;
+
+	if (val < DTRACE_PCTL_NSUB)
+		return (val);
+
+	for (i = 32; i != 0; i >>= 1) {
+		if (v >> i) {
+			v >>= i;
+			msb += i;
+		}
+	}
+
+	return (((uint64_t)(msb - DTRACE_PCTL_SUBBITS + 1) <<
+	    DTRACE_PCTL_SUBBITS) | ((val >> (msb - DTRACE_PCTL_SUBBITS)) &
+	    (DTRACE_PCTL_NSUB - 1)));
+}
+
+static void
+dtrace_aggregate_percentiles(uint64_t *data, uint64_t nval, uint64_t incr)
+{
+	uint64_t base = data[0], ndx, shift, i;
+	uint64_t *buckets = &data[2];
+
+	if ((int64_t)nval <= 0) {
+		data[1] += incr;
+		return;
+	}
+
+	ndx = dtrace_aggregate_percentiles_bucket(nval);
+
+	if (ndx < base) {
+		buckets[0] += incr;
+		return;
+	}
+
+	if (ndx < base + DTRACE_PCTL_NBUCKETS) {
+		buckets[ndx - base] += incr;
+		return;
+	}
+
+	/*
+	 * The value is above the window.  Slide the window up so that this
+	 * value lands in its top bucket, folding everything that falls off
+	 * the bottom into the new lowest bucket.  This is rare:  it happens
+	 * at most once per bucket of growth in the largest value seen.
+	 */
+	shift = ndx - (DTRACE_PCTL_NBUCKETS - 1) - base;
+
+	for (i = 1; i <= shift && i < DTRACE_PCTL_NBUCKETS; i++)
+		buckets[0] += buckets[i];
+
+	for (i = 1; i + shift < DTRACE_PCTL_NBUCKETS; i++)
+		buckets[i] = buckets[i + shift];
+
+	for (; i < DTRACE_PCTL_NBUCKETS; i++)
+		buckets[i] = 0;
+
+	data[0] = base + shift;
+	buckets[DTRACE_PCTL_NBUCKETS - 1] += incr;
+}
+
 /*ARGSUSED*/
 static void
 dtrace_aggregate_avg(uint64_t *data, uint64_t nval, uint64_t arg)
@@ -2510,45 +2626,80 @@ next:
 }
 
 /*
- * Given consumer state, this routine finds a speculation in the INACTIVE
- * state and transitions it into the ACTIVE state.  If there is no speculation
+ * Push a speculation onto the free or dirty list.  The caller must own the
+ * speculation -- that is, it must have just made the state transition that
+ * puts the speculation on the list.
+ */
+static void
+dtrace_speculation_push(dtrace_state_t *state, uintptr_t *list,
+    dtrace_specid_t which)
+{
+	dtrace_speculation_t *spec = &state->dts_speculations[which - 1];
+	uintptr_t head;
+
+	do {
+		head = *list;
+		spec->dtsp_next = DTRACESPEC_LISTID(head);
+	} while (dtrace_casptr(list, (void *)head,
+	    (void *)DTRACESPEC_LISTNEXT(head, which)) != (void *)head);
+}
+
+/*
+ * Count a drop against a speculation statistic.
+ */
+static void
+dtrace_speculation_count(uint32_t *stat)
+{
+	uint32_t count;
+
+	do {
+		count = *stat;
+	} while (dtrace_cas32(stat, count, count + 1) != count);
+}
+
+/*
+ * Given consumer state, this routine takes a speculation off the free list
+ * and transitions it into the ACTIVE state.  If there is no speculation
  * in the INACTIVE state, 0 is returned.  In this case, no error counter is
  * incremented -- it is up to the caller to take appropriate action.
  */
 static int
 dtrace_speculation(dtrace_state_t *state)
 {
-	int i = 0;
-	dtrace_speculation_state_t scurrent;
-	uint32_t *stat = &state->dts_speculations_unavail, count;
+	dtrace_speculation_t *spec;
+	dtrace_specid_t which;
+	uintptr_t head;
+	uint32_t rval;
 
-	while (i < state->dts_nspeculations) {
-		dtrace_speculation_t *spec = &state->dts_speculations[i];
+	do {
+		head = state->dts_specfree;
 
-		scurrent = spec->dtsp_state;
+		if ((which = DTRACESPEC_LISTID(head)) == 0)
+			break;
 
-		if (scurrent != DTRACESPEC_INACTIVE) {
-			if (scurrent == DTRACESPEC_COMMITTINGMANY ||
-			    scurrent == DTRACESPEC_COMMITTING ||
-			    scurrent == DTRACESPEC_DISCARDING)
-				stat = &state->dts_speculations_busy;
-			i++;
-			continue;
-		}
+		spec = &state->dts_speculations[which - 1];
+	} while (dtrace_casptr(&state->dts_specfree, (void *)head,
+	    (void *)DTRACESPEC_LISTNEXT(head, spec->dtsp_next)) !=
+	    (void *)head);
 
-		if (dtrace_cas32((uint32_t *)&spec->dtsp_state,
-		    scurrent, DTRACESPEC_ACTIVE) == scurrent)
-			return (i + 1);
+	if (which != 0) {
+		rval = dtrace_cas32((uint32_t *)&spec->dtsp_state,
+		    DTRACESPEC_INACTIVE, DTRACESPEC_ACTIVE);
+		ASSERT(rval == DTRACESPEC_INACTIVE);
+		return (which);
 	}
 
 	/*
-	 * We couldn't find a speculation.  If we found as much as a single
-	 * busy speculation buffer, we'll attribute this failure as "busy"
-	 * instead of "unavail".
+	 * We couldn't find a speculation.  If any speculation is waiting to
+	 * be cleaned, we'll attribute this failure as "busy" instead of
+	 * "unavail".
 	 */
-	do {
-		count = *stat;
-	} while (dtrace_cas32(stat, count, count + 1) != count);
+	if (DTRACESPEC_LISTID(state->dts_specdirty) != 0 ||
+	    state->dts_specclean != 0) {
+		dtrace_speculation_count(&state->dts_speculations_busy);
+	} else {
+		dtrace_speculation_count(&state->dts_speculations_unavail);
+	}
 
 	return (0);
 }
@@ -2631,6 +2782,12 @@ dtrace_speculation_commit(dtrace_state_t *state, processorid_t cpu,
 	} while (dtrace_cas32((uint32_t *)&spec->dtsp_state,
 	    scurrent, new) != scurrent);
 
+	/*
+	 * If other CPUs have speculative data, leave it for the cleaner.
+	 */
+	if (new == DTRACESPEC_COMMITTINGMANY)
+		dtrace_speculation_push(state, &state->dts_specdirty, which);
+
 	/*
 	 * We have set the state to indicate that we are committing this
 	 * speculation.  Now reserve the necessary space in the destination
@@ -2684,6 +2841,7 @@ out:
 		    DTRACESPEC_COMMITTING, DTRACESPEC_INACTIVE);
 
 		ASSERT(rval == DTRACESPEC_COMMITTING);
+		dtrace_speculation_push(state, &state->dts_specfree, which);
 	}
 
 	src->dtb_offset = 0;
@@ -2747,12 +2905,19 @@ dtrace_speculation_discard(dtrace_state_t *state, processorid_t cpu,
 
 	buf->dtb_offset = 0;
 	buf->dtb_drops = 0;
+
+	if (new == DTRACESPEC_INACTIVE) {
+		dtrace_speculation_push(state, &state->dts_specfree, which);
+	} else {
+		dtrace_speculation_push(state, &state->dts_specdirty, which);
+	}
 }
 
 /*
  * Note:  not called from probe context.  This function is called
- * asynchronously from cross call context to clean any speculations that are
- * in the COMMITTINGMANY or DISCARDING states.  These speculations may not be
+ * asynchronously from cross call context to clean the speculations on the
+ * list taken by dtrace_speculation_clean(), all of which are in the
+ * COMMITTINGMANY or DISCARDING states.  These speculations may not be
  * transitioned back to the INACTIVE state until all CPUs have cleaned the
  * speculation.
  */
@@ -2771,10 +2936,13 @@ dtrace_speculation_clean_here(dtrace_state_t *state)
 		return;
 	}
 
-	for (i = 0; i < state->dts_nspeculations; i++) {
-		dtrace_speculation_t *spec = &state->dts_speculations[i];
+	for (i = state->dts_specclean; i != 0;
+	    i = state->dts_speculations[i - 1].dtsp_next) {
+		dtrace_speculation_t *spec = &state->dts_speculations[i - 1];
 		dtrace_buffer_t *src = &spec->dtsp_buffer[cpu];
 
+		ASSERT(spec->dtsp_cleaning);
+
 		if (src->dtb_tomax == NULL)
 			continue;
 
@@ -2789,7 +2957,7 @@ dtrace_speculation_clean_here(dtrace_state_t *state)
 		if (src->dtb_offset == 0)
 			continue;
 
-		dtrace_speculation_commit(state, cpu, i + 1);
+		dtrace_speculation_commit(state, cpu, i);
 	}
 
 	dtrace_interrupt_enable(cookie);
@@ -2798,47 +2966,51 @@ dtrace_speculation_clean_here(dtrace_state_t *state)
 /*
  * Note:  not called from probe context.  This function is called
  * asynchronously (and at a regular interval) to clean any speculations that
- * are in the COMMITTINGMANY or DISCARDING states.  If it discovers that there
- * is work to be done, it cross calls all CPUs to perform that work;
- * COMMITMANY and DISCARDING speculations may not be transitioned back to the
- * INACTIVE state until they have been cleaned by all CPUs.
+ * are in the COMMITTINGMANY or DISCARDING states.  If the dirty list is not
+ * empty, it takes the whole list and cross calls all CPUs to perform that
+ * work; COMMITMANY and DISCARDING speculations may not be transitioned back
+ * to the INACTIVE state until they have been cleaned by all CPUs.  The cost
+ * is in proportion to the number of dirty speculations, not to nspec.
  */
 static void
 dtrace_speculation_clean(dtrace_state_t *state)
 {
-	int work = 0, rv;
-	dtrace_specid_t i;
+	dtrace_specid_t i, next;
+	uintptr_t head;
+	int rv;
 
-	for (i = 0; i < state->dts_nspeculations; i++) {
-		dtrace_speculation_t *spec = &state->dts_speculations[i];
+	do {
+		head = state->dts_specdirty;
 
-		ASSERT(!spec->dtsp_cleaning);
+		if (DTRACESPEC_LISTID(head) == 0)
+			return;
+	} while (dtrace_casptr(&state->dts_specdirty, (void *)head,
+	    (void *)DTRACESPEC_LISTNEXT(head, 0)) != (void *)head);
 
-		if (spec->dtsp_state != DTRACESPEC_DISCARDING &&
-		    spec->dtsp_state != DTRACESPEC_COMMITTINGMANY)
-			continue;
+	state->dts_specclean = DTRACESPEC_LISTID(head);
+
+	for (i = state->dts_specclean; i != 0;
+	    i = state->dts_speculations[i - 1].dtsp_next) {
+		dtrace_speculation_t *spec = &state->dts_speculations[i - 1];
 
-		work++;
+		ASSERT(!spec->dtsp_cleaning);
 		spec->dtsp_cleaning = 1;
 	}
 
-	if (!work)
-		return;
-
 	dtrace_xcall(DTRACE_CPUALL,
 	    (dtrace_xcall_t)dtrace_speculation_clean_here, state);
 
 	/*
 	 * We now know that all CPUs have committed or discarded their
 	 * speculation buffers, as appropriate.  We can now set the state
-	 * to inactive.
+	 * to inactive and return the speculations to the free list.
 	 */
-	for (i = 0; i < state->dts_nspeculations; i++) {
-		dtrace_speculation_t *spec = &state->dts_speculations[i];
+	for (i = state->dts_specclean; i != 0; i = next) {
+		dtrace_speculation_t *spec = &state->dts_speculations[i - 1];
 		dtrace_speculation_state_t scurrent, new;
 
-		if (!spec->dtsp_cleaning)
-			continue;
+		ASSERT(spec->dtsp_cleaning);
+		next = spec->dtsp_next;
 
 		scurrent = spec->dtsp_state;
 		ASSERT(scurrent == DTRACESPEC_DISCARDING ||
@@ -2849,15 +3021,20 @@ dtrace_speculation_clean(dtrace_state_t *state)
 		rv = dtrace_cas32((uint32_t *)&spec->dtsp_state, scurrent, new);
 		ASSERT(rv == scurrent);
 		spec->dtsp_cleaning = 0;
+
+		dtrace_speculation_push(state, &state->dts_specfree, i);
 	}
+
+	state->dts_specclean = 0;
 }
 
 /*
  * Called as part of a speculate() to get the speculative buffer associated
  * with a given speculation.  Returns NULL if the specified speculation is not
- * in an ACTIVE state.  If the speculation is in the ACTIVEONE state -- and
- * the active CPU is not the specified CPU -- the speculation will be
- * atomically transitioned into the ACTIVEMANY state.
+ * in an ACTIVE state, counting the drop against the speculation.  If the
+ * speculation is in the ACTIVEONE state -- and the active CPU is not the
+ * specified CPU -- the speculation will be atomically transitioned into the
+ * ACTIVEMANY state.
  */
 static dtrace_buffer_t *
 dtrace_speculation_buffer(dtrace_state_t *state, processorid_t cpuid,
@@ -2883,12 +3060,17 @@ dtrace_speculation_buffer(dtrace_state_t *state, processorid_t cpuid,
 
 		switch (scurrent) {
 		case DTRACESPEC_INACTIVE:
+			dtrace_speculation_count(&spec->dtsp_unavail);
+			return (NULL);
+
 		case DTRACESPEC_COMMITTINGMANY:
 		case DTRACESPEC_DISCARDING:
+			dtrace_speculation_count(&spec->dtsp_busy);
 			return (NULL);
 
 		case DTRACESPEC_COMMITTING:
 			ASSERT(buf->dtb_offset == 0);
+			dtrace_speculation_count(&spec->dtsp_busy);
 			return (NULL);
 
 		case DTRACESPEC_ACTIVEONE:
@@ -6226,6 +6408,207 @@ out:
 	TODO_END();
 }
 
+/*
+ * DTrace Stack Table Functions
+ */
+static int
+dtrace_stacktab_init(dtrace_stacktab_t *stk, size_t size)
+{
+	uint32_t words = size / sizeof (uint64_t), hashsize;
+
+	if (words < 2)
+		return (EINVAL);
+
+	/*
+	 * Average stacks are well over eight words, so this keeps the hash
+	 * sparse until the data fills.
+	 */
+	for (hashsize = 64; hashsize < words / 8; hashsize <<= 1)
+		continue;
+
+	stk->dtstk_data = kmem_zalloc(words * sizeof (uint64_t),
+	    KM_NOSLEEP | KM_NORMALPRI);
+	stk->dtstk_hash = kmem_zalloc(hashsize * sizeof (uint32_t),
+	    KM_NOSLEEP | KM_NORMALPRI);
+
+	if (stk->dtstk_data == NULL || stk->dtstk_hash == NULL) {
+		if (stk->dtstk_data != NULL)
+			kmem_free(stk->dtstk_data, words * sizeof (uint64_t));
+		if (stk->dtstk_hash != NULL)
+			kmem_free(stk->dtstk_hash, hashsize * sizeof (uint32_t));
+		bzero(stk, sizeof (dtrace_stacktab_t));
+		return (ENOMEM);
+	}
+
+	stk->dtstk_size = words;
+	stk->dtstk_hashsize = hashsize;
+	stk->dtstk_next = 0;
+
+	return (0);
+}
+
+static void
+dtrace_stacktab_destroy(dtrace_stacktab_t *stk)
+{
+	if (stk->dtstk_data == NULL)
+		return;
+
+	kmem_free(stk->dtstk_data, stk->dtstk_size * sizeof (uint64_t));
+	kmem_free(stk->dtstk_hash, stk->dtstk_hashsize * sizeof (uint32_t));
+	bzero(stk, sizeof (dtrace_stacktab_t));
+}
+
+/*
+ * Return the ID of the given stack, adding it to the stack table if it isn't
+ * already there.  Trailing NULL frames are not stored.  Returns 0 (and counts
+ * a drop) if the stack cannot be interned.
+ */
+static uint64_t
+dtrace_stacktab_intern(dtrace_state_t *state, const uint64_t *pcs,
+    int nframes)
+{
+	dtrace_stacktab_t *stk = &state->dts_stacktab;
+	uint64_t h = 0, hdr, *data = stk->dtstk_data;
+	uint32_t hash, mask, ndx, id, next, new = 0;
+	int i, j;
+
+	if (data == NULL)
+		goto drop;
+
+	while (nframes > 0 && pcs[nframes - 1] == 0)
+		nframes--;
+
+	for (i = 0; i < nframes; i++) {
+		h = (h ^ pcs[i]) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+
+	hash = (uint32_t)(h >> 32) ^ (uint32_t)h;
+
+	/*
+	 * A zero header word means "not yet written" to the consumer, so an
+	 * empty stack (which would otherwise hash to zero) gets a fixed hash.
+	 */
+	if (nframes == 0)
+		hash = DTRACE_STACKID_EMPTYHASH;
+
+	hdr = ((uint64_t)hash << 32) | (uint32_t)nframes;
+	mask = stk->dtstk_hashsize - 1;
+
+	for (i = 0, ndx = hash & mask; i < dtrace_stacktab_maxprobe &&
+	    i < stk->dtstk_hashsize; i++, ndx = (ndx + 1) & mask) {
+		if ((id = stk->dtstk_hash[ndx]) == 0) {
+			if (new == 0) {
+				/*
+				 * Reserve space for the stack and fill it in
+				 * before we try to publish it.  The consumer
+				 * may copy out the table while we are doing
+				 * this, and takes a non-zero header word to
+				 * mean the frames behind it are complete; so
+				 * the frames go in first and the header last.
+				 */
+				do {
+					next = stk->dtstk_next;
+
+					if (next + nframes + 1 > stk->dtstk_size)
+						goto drop;
+				} while (dtrace_cas32(&stk->dtstk_next, next,
+				    next + nframes + 1) != next);
+
+				for (j = 0; j < nframes; j++)
+					data[next + 1 + j] = pcs[j];
+
+				dtrace_membar_producer();
+				data[next] = hdr;
+
+				new = next + 1;
+				dtrace_membar_producer();
+			}
+
+			if ((id = dtrace_cas32(&stk->dtstk_hash[ndx],
+			    0, new)) == 0)
+				return (new);
+
+			/*
+			 * Someone else got this slot first; if it's the same
+			 * stack, we use theirs.
+			 */
+		}
+
+		dtrace_membar_consumer();
+
+		if (data[id - 1] != hdr)
+			continue;
+
+		for (j = 0; j < nframes; j++) {
+			if (data[id + j] != pcs[j])
+				break;
+		}
+
+		if (j == nframes)
+			return (id);
+	}
+
+drop:
+	dtrace_error(&state->dts_stacktabdrops);
+	return (0);
+}
+
+/*
+ * Perform a stack() or ustack() whose result is an aggregation key:  gather
+ * the stack into scratch space and store its stack ID.
+ */
+static void
+dtrace_action_stackid(dtrace_mstate_t *mstate, dtrace_state_t *state,
+    dtrace_actkind_t kind, uint64_t arg, uint64_t *dest, uintptr_t arg0)
+{
+	dtrace_probe_t *probe = mstate->dtms_probe;
+	uintptr_t old = mstate->dtms_scratch_ptr;
+	uint64_t *pcs;
+	int nframes, size, i;
+
+	if (kind == DTRACEACT_STACKID)
+		nframes = (int)arg;
+	else
+		nframes = DTRACE_USTACK_NFRAMES(arg) + 1;
+
+	pcs = (uint64_t *)P2ROUNDUP(mstate->dtms_scratch_ptr, 8);
+	size = (uintptr_t)pcs - mstate->dtms_scratch_ptr +
+	    (nframes * sizeof (uint64_t));
+
+	if (!DTRACE_INSCRATCH(mstate, size)) {
+		DTRACE_CPUFLAG_SET(CPU_DTRACE_NOSCRATCH);
+		*dest = 0;
+		return;
+	}
+
+	if (kind == DTRACEACT_STACKID) {
+		dtrace_getpcstack((pc_t *)pcs, nframes, probe->dtpr_aframes,
+		    DTRACE_ANCHORED(probe) ? NULL : (uint32_t *)arg0);
+
+		/*
+		 * Widen the frames in place if pc_t is narrower than what we
+		 * store; walking backwards means we never overwrite a frame
+		 * we haven't yet read.
+		 */
+		for (i = nframes - 1; sizeof (pc_t) != sizeof (uint64_t) &&
+		    i >= 0; i--)
+			pcs[i] = ((pc_t *)pcs)[i];
+	} else if (DTRACE_ANCHORED(probe) && CPU_ON_INTR(CPU)) {
+		/*
+		 * See comment in DIF_VAR_PID.
+		 */
+		dtrace_bzero(pcs, nframes * sizeof (uint64_t));
+	} else {
+		DTRACE_CPUFLAG_SET(CPU_DTRACE_NOFAULT);
+		dtrace_getupcstack(pcs, nframes);
+		DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_NOFAULT);
+	}
+
+	*dest = dtrace_stacktab_intern(state, pcs, nframes);
+	mstate->dtms_scratch_ptr = old;
+}
+
 #if linux
 /**********************************************************************/
 /*   The following is a locking wrapper around dtrace_probe. We need  */
@@ -6685,6 +7068,26 @@ PRINT_CASE(DTRACEACT_STACK);
 
 				continue;
 
+			case DTRACEACT_STACKID:
+PRINT_CASE(DTRACEACT_STACKID);
+				if (!dtrace_priv_kernel(state))
+					continue;
+
+				dtrace_action_stackid(&mstate, state,
+				    act->dta_kind, rec->dtrd_arg,
+				    (uint64_t *)(tomax + valoffs), arg0);
+				continue;
+
+			case DTRACEACT_USTACKID:
+PRINT_CASE(DTRACEACT_USTACKID);
+				if (!dtrace_priv_proc(state, &mstate))
+					continue;
+
+				dtrace_action_stackid(&mstate, state,
+				    act->dta_kind, rec->dtrd_arg,
+				    (uint64_t *)(tomax + valoffs), arg0);
+				continue;
+
 			case DTRACEACT_JSTACK:
 			case DTRACEACT_USTACK:
 PRINT_CASE(DTRACEACT_JSTACK/DTRACEACT_USTACK);
@@ -7038,18 +7441,28 @@ HERE();
  * probe tuple -- allowing for fast lookups, regardless of what was
  * specified.)
  */
+/*
+ * FNV-1a over the string, followed by the MurmurHash3 32-bit finalizer.  The
+ * tables are indexed by the low bits of the hash, and probe function names
+ * often share long prefixes and differ only in their last few characters;
+ * the finalizer makes every low bit depend on every character.
+ */
 static uint_t
 dtrace_hash_str(char *p)
 {
-	unsigned int g;
-	uint_t hval = 0;
+	uint_t hval = 2166136261U;
 
 	while (*p) {
-		hval = (hval << 4) + *p++;
-		if ((g = (hval & 0xf0000000)) != 0)
-			hval ^= g >> 24;
-		hval &= ~g;
+		hval ^= (unsigned char)*p++;
+		hval *= 16777619U;
 	}
+
+	hval ^= hval >> 16;
+	hval *= 0x85ebca6bU;
+	hval ^= hval >> 13;
+	hval *= 0xc2b2ae35U;
+	hval ^= hval >> 16;
+
 	return (hval);
 }
 
@@ -7079,66 +7492,141 @@ dtrace_hash_destroy(dtrace_hash_t *hash)
 
 	for (i = 0; i < hash->dth_size; i++)
 		ASSERT(hash->dth_tab[i] == NULL);
+
+	for (i = hash->dth_migrate; i < hash->dth_oldsize; i++)
+		ASSERT(hash->dth_oldtab[i] == NULL);
 #endif
 
+	if (hash->dth_oldtab != NULL) {
+		kmem_free(hash->dth_oldtab,
+		    hash->dth_oldsize * sizeof (dtrace_hashbucket_t *));
+	}
+
 	kmem_free(hash->dth_tab,
 	    hash->dth_size * sizeof (dtrace_hashbucket_t *));
 	kmem_free(hash, sizeof (dtrace_hash_t));
 }
 
+/*
+ * Move up to n slots of the table being migrated (if any) into the current
+ * table, freeing the old table once it is empty.
+ */
+static void
+dtrace_hash_migrate(dtrace_hash_t *hash, int n)
+{
+	dtrace_hashbucket_t *bucket, *next;
+	int ndx;
+
+	if (hash->dth_oldtab == NULL)
+		return;
+
+	for (; n > 0 && hash->dth_migrate < hash->dth_oldsize; n--) {
+		bucket = hash->dth_oldtab[hash->dth_migrate];
+		hash->dth_oldtab[hash->dth_migrate++] = NULL;
+
+		for (; bucket != NULL; bucket = next) {
+			ASSERT(bucket->dthb_chain != NULL);
+			ndx = DTRACE_HASHSTR(hash, bucket->dthb_chain) &
+			    hash->dth_mask;
+
+			next = bucket->dthb_next;
+			bucket->dthb_next = hash->dth_tab[ndx];
+			hash->dth_tab[ndx] = bucket;
+		}
+	}
+
+	if (hash->dth_migrate < hash->dth_oldsize)
+		return;
+
+	kmem_free(hash->dth_oldtab,
+	    hash->dth_oldsize * sizeof (dtrace_hashbucket_t *));
+	hash->dth_oldtab = NULL;
+	hash->dth_oldsize = 0;
+	hash->dth_migrate = 0;
+}
+
+/*
+ * Return the slot that holds (or would hold) the bucket for the given hash
+ * value:  in the old table if its slot there has yet to be migrated, and in
+ * the current table otherwise.
+ */
+static dtrace_hashbucket_t **
+dtrace_hash_slot(dtrace_hash_t *hash, uint_t hashval)
+{
+	int ndx;
+
+	if (hash->dth_oldtab != NULL &&
+	    (ndx = hashval & (hash->dth_oldsize - 1)) >= hash->dth_migrate)
+		return (&hash->dth_oldtab[ndx]);
+
+	return (&hash->dth_tab[hashval & hash->dth_mask]);
+}
+
+/*
+ * Double the size of the hash table.  Rather than rehashing every bucket now
+ * -- which fbt would pay for repeatedly while registering tens of thousands
+ * of probes -- the old table is kept and migrated DTRACE_HASH_MIGRATE slots
+ * at a time by subsequent operations, keeping each operation constant-time.
+ * Growth is fast enough relative to the migration that any previous resize
+ * has normally completed by the time another is needed.
+ */
 static void
 dtrace_hash_resize(dtrace_hash_t *hash)
 {
-	int size = hash->dth_size, i, ndx;
 	int new_size = hash->dth_size << 1;
 	int new_mask = new_size - 1;
-	dtrace_hashbucket_t **new_tab, *bucket, *next;
 
 	ASSERT((new_size & new_mask) == 0);
 
-	new_tab = kmem_zalloc(new_size * sizeof (void *), KM_SLEEP);
+	dtrace_hash_migrate(hash, INT_MAX);
+	ASSERT(hash->dth_oldtab == NULL);
+
+	hash->dth_oldtab = hash->dth_tab;
+	hash->dth_oldsize = hash->dth_size;
+	hash->dth_migrate = 0;
+
+	hash->dth_tab = kmem_zalloc(new_size * sizeof (void *), KM_SLEEP);
+	hash->dth_size = new_size;
+	hash->dth_mask = new_mask;
+	hash->dth_resizes++;
+}
+
+static dtrace_hashbucket_t *
+dtrace_hash_find(dtrace_hash_t *hash, dtrace_probe_t *template, uint_t hashval)
+{
+	dtrace_hashbucket_t *bucket;
 
-	for (i = 0; i < size; i++) {
-		for (bucket = hash->dth_tab[i]; bucket != NULL; bucket = next) {
-			dtrace_probe_t *probe = bucket->dthb_chain;
+	dtrace_hash_migrate(hash, DTRACE_HASH_MIGRATE);
+	hash->dth_lookups++;
 
-			ASSERT(probe != NULL);
-			ndx = DTRACE_HASHSTR(hash, probe) & new_mask;
+	for (bucket = *dtrace_hash_slot(hash, hashval); bucket != NULL;
+	    bucket = bucket->dthb_next) {
+		hash->dth_steps++;
 
-			next = bucket->dthb_next;
-			bucket->dthb_next = new_tab[ndx];
-			new_tab[ndx] = bucket;
-		}
+		if (DTRACE_HASHEQ(hash, bucket->dthb_chain, template))
+			return (bucket);
 	}
 
-	kmem_free(hash->dth_tab, hash->dth_size * sizeof (void *));
-	hash->dth_tab = new_tab;
-	hash->dth_size = new_size;
-	hash->dth_mask = new_mask;
+	return (NULL);
 }
 
 static void
 dtrace_hash_add(dtrace_hash_t *hash, dtrace_probe_t *new)
 {
-	int hashval = DTRACE_HASHSTR(hash, new);
-	int ndx = hashval & hash->dth_mask;
-	dtrace_hashbucket_t *bucket = hash->dth_tab[ndx];
+	uint_t hashval = DTRACE_HASHSTR(hash, new);
+	dtrace_hashbucket_t *bucket, **slot;
 	dtrace_probe_t **nextp, **prevp;
 
-	for (; bucket != NULL; bucket = bucket->dthb_next) {
-		if (DTRACE_HASHEQ(hash, bucket->dthb_chain, new))
-			goto add;
-	}
+	if ((bucket = dtrace_hash_find(hash, new, hashval)) != NULL)
+		goto add;
 
-	if ((hash->dth_nbuckets >> 1) > hash->dth_size) {
+	if ((hash->dth_nbuckets >> 1) > hash->dth_size)
 		dtrace_hash_resize(hash);
-		dtrace_hash_add(hash, new);
-		return;
-	}
 
+	slot = dtrace_hash_slot(hash, hashval);
 	bucket = kmem_zalloc(sizeof (dtrace_hashbucket_t), KM_SLEEP);
-	bucket->dthb_next = hash->dth_tab[ndx];
-	hash->dth_tab[ndx] = bucket;
+	bucket->dthb_next = *slot;
+	*slot = bucket;
 	hash->dth_nbuckets++;
 
 add:
@@ -7159,46 +7647,100 @@ add:
 static dtrace_probe_t *
 dtrace_hash_lookup(dtrace_hash_t *hash, dtrace_probe_t *template)
 {
-	int hashval = DTRACE_HASHSTR(hash, template);
-	int ndx = hashval & hash->dth_mask;
-	dtrace_hashbucket_t *bucket = hash->dth_tab[ndx];
+	dtrace_hashbucket_t *bucket;
 
-	for (; bucket != NULL; bucket = bucket->dthb_next) {
-		if (DTRACE_HASHEQ(hash, bucket->dthb_chain, template))
-			return (bucket->dthb_chain);
-	}
+	bucket = dtrace_hash_find(hash, template,
+	    DTRACE_HASHSTR(hash, template));
 
-	return (NULL);
+	return (bucket != NULL ? bucket->dthb_chain : NULL);
 }
 
 static int
 dtrace_hash_collisions(dtrace_hash_t *hash, dtrace_probe_t *template)
 {
-	int hashval = DTRACE_HASHSTR(hash, template);
-	int ndx = hashval & hash->dth_mask;
-	dtrace_hashbucket_t *bucket = hash->dth_tab[ndx];
+	dtrace_hashbucket_t *bucket;
 
-	for (; bucket != NULL; bucket = bucket->dthb_next) {
-		if (DTRACE_HASHEQ(hash, bucket->dthb_chain, template))
-			return (bucket->dthb_len);
+	bucket = dtrace_hash_find(hash, template,
+	    DTRACE_HASHSTR(hash, template));
+
+	return (bucket != NULL ? bucket->dthb_len : 0);
+}
+
+/*
+ * Report the shape of one of the probe hashes:  0 is the module hash, 1 the
+ * function hash and 2 the name hash.  Returns -1 if there is no such hash.
+ */
+int
+dtrace_hash_stats(int which, dtrace_hashstat_t *st)
+{
+	static const char *names[] = { "mod", "func", "name" };
+	dtrace_hashbucket_t **tab, *bucket;
+	dtrace_hash_t *hash;
+	int i, t, size, n;
+
+	if (which < 0 || which >= sizeof (names) / sizeof (names[0]))
+		return (-1);
+
+	bzero(st, sizeof (dtrace_hashstat_t));
+	st->dths_name = names[which];
+
+	mutex_enter(&dtrace_lock);
+
+	hash = which == 0 ? dtrace_bymod :
+	    which == 1 ? dtrace_byfunc : dtrace_byname;
+
+	if (hash == NULL) {
+		mutex_exit(&dtrace_lock);
+		return (0);
 	}
 
-	return (NULL);
+	st->dths_size = hash->dth_size;
+	st->dths_nbuckets = hash->dth_nbuckets;
+	st->dths_lookups = hash->dth_lookups;
+	st->dths_steps = hash->dth_steps;
+	st->dths_resizes = hash->dth_resizes;
+
+	for (t = 0; t < 2; t++) {
+		tab = t == 0 ? hash->dth_tab : hash->dth_oldtab;
+		size = t == 0 ? hash->dth_size : hash->dth_oldsize;
+
+		for (i = t == 0 ? 0 : hash->dth_migrate; i < size; i++) {
+			if ((bucket = tab[i]) == NULL)
+				continue;
+
+			st->dths_used++;
+
+			for (n = 0; bucket != NULL; bucket = bucket->dthb_next) {
+				if (bucket->dthb_len > st->dths_maxlen)
+					st->dths_maxlen = bucket->dthb_len;
+				n++;
+			}
+
+			if (n > st->dths_maxchain)
+				st->dths_maxchain = n;
+		}
+	}
+
+	mutex_exit(&dtrace_lock);
+
+	return (0);
 }
 
 static void
 dtrace_hash_remove(dtrace_hash_t *hash, dtrace_probe_t *probe)
 {
-	int ndx = DTRACE_HASHSTR(hash, probe) & hash->dth_mask;
-	dtrace_hashbucket_t *bucket = hash->dth_tab[ndx];
+	dtrace_hashbucket_t **slot, *bucket;
 
 	dtrace_probe_t **prevp = DTRACE_HASHPREV(hash, probe);
 	dtrace_probe_t **nextp = DTRACE_HASHNEXT(hash, probe);
 
+	dtrace_hash_migrate(hash, DTRACE_HASH_MIGRATE);
+	slot = dtrace_hash_slot(hash, DTRACE_HASHSTR(hash, probe));
+
 	/*
 	 * Find the bucket that we're removing this probe from.
 	 */
-	for (; bucket != NULL; bucket = bucket->dthb_next) {
+	for (bucket = *slot; bucket != NULL; bucket = bucket->dthb_next) {
 		if (DTRACE_HASHEQ(hash, bucket->dthb_chain, probe))
 			break;
 	}
@@ -7211,13 +7753,13 @@ dtrace_hash_remove(dtrace_hash_t *hash, dtrace_probe_t *probe)
 			 * The removed probe was the only probe on this
 			 * bucket; we need to remove the bucket.
 			 */
-			dtrace_hashbucket_t *b = hash->dth_tab[ndx];
+			dtrace_hashbucket_t *b = *slot;
 
 			ASSERT(bucket->dthb_chain == probe);
 			ASSERT(b != NULL);
 
 			if (b == bucket) {
-				hash->dth_tab[ndx] = bucket->dthb_next;
+				*slot = bucket->dthb_next;
 			} else {
 				while (b->dthb_next != bucket)
 					b = b->dthb_next;
@@ -7574,12 +8116,42 @@ dtrace_match_nonzero(const char *s, const char *p, int depth)
 	return (s != NULL && s[0] != '\0');
 }
 
+/*
+ * Cheap necessary condition for a string to match a glob pattern:  the string
+ * must contain the pattern's longest literal run (see dtrace_probehint_t).
+ */
+static int
+dtrace_match_hint(const char *s, const dtrace_probehint_t *hint)
+{
+	const char *h = hint->dtph_str;
+	size_t len = hint->dtph_len;
+
+	if (len == 0)
+		return (1);
+
+	if (s == NULL)
+		s = "";
+
+	if (hint->dtph_anchored)
+		return (strncmp(s, h, len) == 0);
+
+	for (; *s != '\0'; s++) {
+		if (*s == *h && strncmp(s, h, len) == 0)
+			return (1);
+	}
+
+	return (0);
+}
+
 static int
 dtrace_match(const dtrace_probekey_t *pkp, uint32_t priv, uid_t uid,
     zoneid_t zoneid, int (*matched)(dtrace_probe_t *, void *), void *arg)
 {
 	dtrace_probe_t template, *probe;
-	dtrace_hash_t *hash = NULL;
+	dtrace_hash_t *hash = NULL, *ghash = NULL;
+	dtrace_hashbucket_t *bucket;
+	const dtrace_probehint_t *hint = NULL;
+	const char *pattern = NULL;
 	int len, rc, best = INT_MAX, nmatched = 0;
 	dtrace_id_t i;
 
@@ -7628,6 +8200,82 @@ dtrace_match(const dtrace_probekey_t *pkp, uint32_t priv, uid_t uid,
 		hash = dtrace_byname;
 	}
 
+	/*
+	 * Each bucket of a probe hash holds every probe sharing one distinct
+	 * module, function or name string, so a glob over one of those fields
+	 * can be evaluated once per distinct string rather than once per
+	 * probe -- and most strings are rejected by the literal hint without
+	 * evaluating the glob at all.  Walking the buckets costs one step per
+	 * distinct string; prefer that to walking a chain of more probes than
+	 * that, and to a scan of every probe.  Patterns without a literal run
+	 * (e.g. "*") would admit every bucket and are not worth indexing.
+	 */
+	if (best > dtrace_nprobes)
+		best = dtrace_nprobes;
+
+	if (pkp->dtpk_mmatch == &dtrace_match_glob &&
+	    pkp->dtpk_mhint.dtph_len != 0 &&
+	    dtrace_bymod->dth_nbuckets < best) {
+		best = dtrace_bymod->dth_nbuckets;
+		ghash = dtrace_bymod;
+		pattern = pkp->dtpk_mod;
+		hint = &pkp->dtpk_mhint;
+	}
+
+	if (pkp->dtpk_fmatch == &dtrace_match_glob &&
+	    pkp->dtpk_fhint.dtph_len != 0 &&
+	    dtrace_byfunc->dth_nbuckets < best) {
+		best = dtrace_byfunc->dth_nbuckets;
+		ghash = dtrace_byfunc;
+		pattern = pkp->dtpk_func;
+		hint = &pkp->dtpk_fhint;
+	}
+
+	if (pkp->dtpk_nmatch == &dtrace_match_glob &&
+	    pkp->dtpk_nhint.dtph_len != 0 &&
+	    dtrace_byname->dth_nbuckets < best) {
+		best = dtrace_byname->dth_nbuckets;
+		ghash = dtrace_byname;
+		pattern = pkp->dtpk_name;
+		hint = &pkp->dtpk_nhint;
+	}
+
+	if (ghash != NULL) {
+		dtrace_hash_migrate(ghash, INT_MAX);
+
+		for (i = 0; i < ghash->dth_size; i++) {
+			for (bucket = ghash->dth_tab[i]; bucket != NULL;
+			    bucket = bucket->dthb_next) {
+				char *key = DTRACE_HASHKEY(ghash,
+				    bucket->dthb_chain);
+
+				if (!dtrace_match_hint(key, hint) ||
+				    dtrace_match_glob(key, pattern, 0) <= 0)
+					continue;
+
+				for (probe = bucket->dthb_chain; probe != NULL;
+				    probe = *(DTRACE_HASHNEXT(ghash, probe))) {
+					if (dtrace_match_probe(probe, pkp, priv,
+					    uid, zoneid) <= 0)
+						continue;
+
+					nmatched++;
+
+					if ((rc = (*matched)(probe, arg)) ==
+					    DTRACE_MATCH_NEXT)
+						continue;
+
+					if (rc == DTRACE_MATCH_FAIL)
+						return (DTRACE_MATCH_FAIL);
+
+					return (nmatched);
+				}
+			}
+		}
+
+		return (nmatched);
+	}
+
 	/*
 	 * If we did not select a hash table, iterate over every probe and
 	 * invoke our callback for each one that matches our input probe key.
@@ -7700,6 +8348,77 @@ dtrace_probekey_func(const char *p)
 	return (&dtrace_match_string);
 }
 
+/*
+ * Record the longest run of literal characters in a glob pattern.  Bracket
+ * expressions and escaped characters end a run without contributing to one;
+ * the hint is only ever used as a necessary condition, so being conservative
+ * is always safe.
+ */
+static void
+dtrace_probekey_hint(const char *p, dtrace_probehint_t *hint)
+{
+	const char *start = p, *run = p;
+	char c;
+
+	hint->dtph_str = NULL;
+	hint->dtph_len = 0;
+	hint->dtph_anchored = 0;
+
+	if (p == NULL)
+		return;
+
+	for (;;) {
+		c = *p;
+
+		if (c != '\0' && c != '*' && c != '?' &&
+		    c != '[' && c != '\\') {
+			p++;
+			continue;
+		}
+
+		if (p - run > hint->dtph_len) {
+			hint->dtph_str = run;
+			hint->dtph_len = p - run;
+			hint->dtph_anchored = (run == start);
+		}
+
+		if (c == '\0')
+			return;
+
+		p++;
+
+		if (c == '[') {
+			/*
+			 * The first member of a bracket expression (after any
+			 * negation) may itself be a ']'.
+			 */
+			if (*p == '!')
+				p++;
+
+			if (*p != '\0')
+				p++;
+
+			while (*p != '\0' && *p != ']') {
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+				p++;
+			}
+
+			if (*p == '\0')
+				return;
+
+			p++;
+		} else if (c == '\\') {
+			if (*p == '\0')
+				return;
+
+			p++;
+		}
+
+		run = p;
+	}
+}
+
 /*
  * Build a probe comparison key for use with dtrace_match_probe() from the
  * given probe description.  By convention, a null key only matches anchored
@@ -7723,6 +8442,13 @@ dtrace_probekey(const dtrace_probedesc_t *pdp, dtrace_probekey_t *pkp)
 
 	pkp->dtpk_id = pdp->dtpd_id;
 
+	dtrace_probekey_hint(pkp->dtpk_mmatch == &dtrace_match_glob ?
+	    pdp->dtpd_mod : NULL, &pkp->dtpk_mhint);
+	dtrace_probekey_hint(pkp->dtpk_fmatch == &dtrace_match_glob ?
+	    pdp->dtpd_func : NULL, &pkp->dtpk_fhint);
+	dtrace_probekey_hint(pkp->dtpk_nmatch == &dtrace_match_glob ?
+	    pdp->dtpd_name : NULL, &pkp->dtpk_nhint);
+
 	if (pkp->dtpk_id == DTRACE_IDNONE &&
 	    pkp->dtpk_pmatch == &dtrace_match_nul &&
 	    pkp->dtpk_mmatch == &dtrace_match_nul &&
@@ -8514,14 +9240,17 @@ dtrace_dofprov2hprov(dtrace_helper_provdesc_t *hprov,
 }
 
 static void
-dtrace_helper_provide_one(dof_helper_t *dhp, dof_sec_t *sec, pid_t pid)
+dtrace_helper_provide_one(dof_helper_t *dhp, dof_sec_t *sec, pid_t pid,
+    uint64_t bias)
 {
 	uintptr_t daddr = (uintptr_t)dhp->dofhp_dof;
 	dof_hdr_t *dof = (dof_hdr_t *)daddr;
 	dof_sec_t *str_sec, *prb_sec, *arg_sec, *off_sec, *enoff_sec;
+	dof_sec_t *sema_sec;
 	dof_provider_t *provider;
 	dof_probe_t *probe;
 	uint32_t *off, *enoff;
+	uint64_t *sema;
 	uint8_t *arg;
 	char *strtab;
 	uint_t i, nprobes;
@@ -8556,6 +9285,15 @@ dtrace_helper_provide_one(dof_helper_t *dhp, dof_sec_t *sec, pid_t pid)
 		enoff = (uint32_t *)(uintptr_t)(daddr + enoff_sec->dofs_offset);
 	}
 
+	sema = NULL;
+
+	if (dof->dofh_ident[DOF_ID_VERSION] >= DOF_VERSION_3 &&
+	    provider->dofpv_prsemas != DOF_SECT_NONE) {
+		sema_sec = (dof_sec_t *)(uintptr_t)(daddr + dof->dofh_secoff +
+		    provider->dofpv_prsemas * dof->dofh_secsize);
+		sema = (uint64_t *)(uintptr_t)(daddr + sema_sec->dofs_offset);
+	}
+
 	nprobes = prb_sec->dofs_size / prb_sec->dofs_entsize;
 
 	/*
@@ -8581,7 +9319,7 @@ HERE();
 		dhpb.dthpb_func = strtab + probe->dofpr_func;
 		dhpb.dthpb_name = strtab + probe->dofpr_name;
 //printk("probe %d: func=%s name=%s\n", i, dhpb.dthpb_func, dhpb.dthpb_name);
-		dhpb.dthpb_base = probe->dofpr_addr;
+		dhpb.dthpb_base = probe->dofpr_addr + bias;
 		dhpb.dthpb_offs = off + probe->dofpr_offidx;
 		dhpb.dthpb_noffs = probe->dofpr_noffs;
 		if (enoff != NULL) {
@@ -8596,20 +9334,31 @@ HERE();
 		dhpb.dthpb_xargc = probe->dofpr_xargc;
 		dhpb.dthpb_ntypes = strtab + probe->dofpr_nargv;
 		dhpb.dthpb_xtypes = strtab + probe->dofpr_xargv;
+		dhpb.dthpb_semaphore = sema != NULL && sema[i] != 0 ?
+		    sema[i] + bias : 0;
 
 		mops->dtms_create_probe(meta->dtm_arg, parg, &dhpb);
 	}
 }
 
 static void
-dtrace_helper_provide(dof_helper_t *dhp, pid_t pid)
+dtrace_helper_provide(dtrace_helper_provider_t *hprov, pid_t pid)
 {
+	dof_helper_t *dhp = &hprov->dthp_prov;
 	uintptr_t daddr = (uintptr_t)dhp->dofhp_dof;
 	dof_hdr_t *dof = (dof_hdr_t *)daddr;
+	uint64_t bias = 0;
 	int i;
 
 	ASSERT(MUTEX_HELD(&dtrace_meta_lock));
 
+	/*
+	 * If the DOF is shared with another process, it was relocated for
+	 * that process's load address rather than ours.
+	 */
+	if (hprov->dthp_cache != NULL)
+		bias = dhp->dofhp_addr - hprov->dthp_cache->dtdc_ubase;
+
 	for (i = 0; i < dof->dofh_secnum; i++) {
 		dof_sec_t *sec = (dof_sec_t *)(uintptr_t)(daddr +
 		    dof->dofh_secoff + i * dof->dofh_secsize);
@@ -8617,7 +9366,7 @@ dtrace_helper_provide(dof_helper_t *dhp, pid_t pid)
 		if (sec->dofs_type != DOF_SECT_PROVIDER)
 			continue;
 
-		dtrace_helper_provide_one(dhp, sec, pid);
+		dtrace_helper_provide_one(dhp, sec, pid, bias);
 	}
 
 	/*
@@ -8747,7 +9496,7 @@ dtrace_meta_register(const char *name, const dtrace_mops_t *mops, void *arg,
 
 	while (help != NULL) {
 		for (i = 0; i < help->dthps_nprovs; i++) {
-			dtrace_helper_provide(&help->dthps_provs[i]->dthp_prov,
+			dtrace_helper_provide(help->dthps_provs[i],
 			    help->dthps_pid);
 		}
 
@@ -8755,6 +9504,7 @@ dtrace_meta_register(const char *name, const dtrace_mops_t *mops, void *arg,
 		help->dthps_next = NULL;
 		help->dthps_prev = NULL;
 		help->dthps_deferred = 0;
+		help->dthps_provided = 1;
 		help = next;
 	}
 
@@ -8767,6 +9517,7 @@ int
 dtrace_meta_unregister(dtrace_meta_provider_id_t id)
 {
 	dtrace_meta_t **pp, *old = (dtrace_meta_t *)id;
+	dtrace_helpers_t *help;
 
 	dmutex_enter(&dtrace_meta_lock);
 	dmutex_enter(&dtrace_lock);
@@ -8786,6 +9537,18 @@ dtrace_meta_unregister(dtrace_meta_provider_id_t id)
 
 	*pp = NULL;
 
+	/*
+	 * Helpers still waiting for a consumer never got as far as the meta
+	 * provider; they now wait for the next one to register instead.
+	 */
+	ASSERT(dtrace_deferred_pid == NULL);
+	for (help = dtrace_lazy_pid; help != NULL; help = help->dthps_next) {
+		help->dthps_lazy = 0;
+		help->dthps_deferred = 1;
+	}
+	dtrace_deferred_pid = dtrace_lazy_pid;
+	dtrace_lazy_pid = NULL;
+
 	dmutex_exit(&dtrace_lock);
 	dmutex_exit(&dtrace_meta_lock);
 
@@ -10361,6 +11124,16 @@ HERE();
 		break;
 	}
 
+	case DTRACEAGG_DISTINCT:
+		agg->dtag_aggregate = dtrace_aggregate_distinct;
+		size = DTRACE_DISTINCT_NREGS;
+		break;
+
+	case DTRACEAGG_PERCENTILES:
+		agg->dtag_aggregate = dtrace_aggregate_percentiles;
+		size = DTRACE_PCTL_SIZE;
+		break;
+
 	case DTRACEAGG_AVG:
 		agg->dtag_aggregate = dtrace_aggregate_avg;
 		size = sizeof (uint64_t) * 2;
@@ -10585,6 +11358,37 @@ PRINT_CASE("DTRACEACT_STACK");
 			size = nframes * sizeof (pc_t);
 			break;
 
+		case DTRACEACT_STACKID:
+PRINT_CASE("DTRACEACT_STACKID");
+			if ((nframes = arg) == 0) {
+				nframes = opt[DTRACEOPT_STACKFRAMES];
+				ASSERT(nframes > 0);
+				arg = nframes;
+			}
+
+			size = sizeof (uint64_t);
+			state->dts_stackids = 1;
+			break;
+
+		case DTRACEACT_USTACKID:
+PRINT_CASE("DTRACEACT_USTACKID");
+			/*
+			 * There is no string table in an interned stack, so
+			 * ustack() with a string size can't be interned.
+			 */
+			if (DTRACE_USTACK_STRSIZE(arg) != 0)
+				RETURN(EINVAL);
+
+			if ((nframes = DTRACE_USTACK_NFRAMES(arg)) == 0) {
+				nframes = opt[DTRACEOPT_USTACKFRAMES];
+				ASSERT(nframes > 0);
+				arg = DTRACE_USTACK_ARG(nframes, 0);
+			}
+
+			size = sizeof (uint64_t);
+			state->dts_stackids = 1;
+			break;
+
 		case DTRACEACT_JSTACK:
 PRINT_CASE("DTRACEACT_JSTACK");
 			if ((strsize = DTRACE_USTACK_STRSIZE(arg)) == 0)
@@ -11116,6 +11920,8 @@ dtrace_buffer_switch(dtrace_buffer_t *buf)
 {
 	caddr_t tomax = buf->dtb_tomax;
 	caddr_t xamot = buf->dtb_xamot;
+	uint64_t size = buf->dtb_size;
+	uint64_t carry = buf->dtb_xamot_carry;
 	dtrace_icookie_t cookie;
 	hrtime_t now = dtrace_gethrtime();
 
@@ -11126,11 +11932,14 @@ dtrace_buffer_switch(dtrace_buffer_t *buf)
 //dtrace_printf("buffersw\n");
 	buf->dtb_tomax = xamot;
 	buf->dtb_xamot = tomax;
+	buf->dtb_size = buf->dtb_xamot_size;
+	buf->dtb_xamot_size = size;
 	buf->dtb_xamot_drops = buf->dtb_drops;
 	buf->dtb_xamot_offset = buf->dtb_offset;
 	buf->dtb_xamot_errors = buf->dtb_errors;
 	buf->dtb_xamot_flags = buf->dtb_flags;
-	buf->dtb_offset = 0;
+	buf->dtb_xamot_carry = 0;
+	buf->dtb_offset = carry;
 	buf->dtb_drops = 0;
 	buf->dtb_errors = 0;
 	buf->dtb_flags &= ~(DTRACEBUF_ERROR | DTRACEBUF_DROPPED);
@@ -11199,14 +12008,19 @@ dtrace_buffer_alloc(dtrace_buffer_t *bufs, size_t size, int flags,
 		 * the buffer size must match our specified size.
 		 */
 		if (buf->dtb_tomax != NULL) {
-			ASSERT(buf->dtb_size == size);
+			ASSERT(buf->dtb_size == size ||
+			    (buf->dtb_flags & DTRACEBUF_ADAPTIVE));
 			continue;
 		}
 
 		ASSERT(buf->dtb_xamot == NULL);
 
-		if ((buf->dtb_tomax = kmem_zalloc(size,
-		    KM_NOSLEEP | KM_NORMALPRI)) == NULL)
+		/*
+		 * Each CPU writes only its own buffers from probe context, so
+		 * allocate them on that CPU's node rather than ours.
+		 */
+		if ((buf->dtb_tomax = kmem_zalloc_cpu(size,
+		    KM_NOSLEEP | KM_NORMALPRI, cp->cpu_id)) == NULL)
 			goto err;
 
 		buf->dtb_size = size;
@@ -11217,9 +12031,12 @@ dtrace_buffer_alloc(dtrace_buffer_t *bufs, size_t size, int flags,
 		if (flags & DTRACEBUF_NOSWITCH)
 			continue;
 
-		if ((buf->dtb_xamot = kmem_zalloc(size,
-		    KM_NOSLEEP | KM_NORMALPRI)) == NULL)
+		if ((buf->dtb_xamot = kmem_zalloc_cpu(size,
+		    KM_NOSLEEP | KM_NORMALPRI, cp->cpu_id)) == NULL)
 			goto err;
+
+		buf->dtb_xamot_size = size;
+		buf->dtb_xamot_carry = 0;
 	} while ((cp = cp->cpu_next) != cpu_list);
 
 	return (0);
@@ -11236,20 +12053,23 @@ err:
 
 		if (buf->dtb_xamot != NULL) {
 			ASSERT(buf->dtb_tomax != NULL);
-			ASSERT(buf->dtb_size == size);
-			kmem_free(buf->dtb_xamot, size);
+			ASSERT(buf->dtb_xamot_size == size ||
+			    (buf->dtb_flags & DTRACEBUF_ADAPTIVE));
+			kmem_free(buf->dtb_xamot, buf->dtb_xamot_size);
 			allocated++;
 		}
 
 		if (buf->dtb_tomax != NULL) {
-			ASSERT(buf->dtb_size == size);
-			kmem_free(buf->dtb_tomax, size);
+			ASSERT(buf->dtb_size == size ||
+			    (buf->dtb_flags & DTRACEBUF_ADAPTIVE));
+			kmem_free(buf->dtb_tomax, buf->dtb_size);
 			allocated++;
 		}
 
 		buf->dtb_tomax = NULL;
 		buf->dtb_xamot = NULL;
 		buf->dtb_size = 0;
+		buf->dtb_xamot_size = 0;
 	} while ((cp = cp->cpu_next) != cpu_list);
 
 	*factor = desired / (allocated > 0 ? allocated : 1);
@@ -11257,6 +12077,87 @@ err:
 	RETURN(ENOMEM);
 }
 
+/*
+ * Called once the inactive half of an adaptive principal buffer has been
+ * copied out by DTRACEIOC_BUFSNAP.  If that half dropped data or was more than
+ * three quarters full, it is doubled; if it was less than an eighth full, it
+ * is halved.  Growth is clipped to what remains of the state's budget.  As the
+ * two halves alternate, each is resized on every other snapshot.  If the
+ * allocation fails, the buffer is simply left as it is.
+ */
+static void
+dtrace_buffer_adapt(dtrace_state_t *state, dtrace_buffer_t *buf,
+    processorid_t cpu)
+{
+	uint64_t size = buf->dtb_xamot_size, nsize = size;
+	uint64_t budget = state->dts_options[DTRACEOPT_BUFBUDGET], avail;
+	caddr_t xamot;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+	ASSERT(buf->dtb_flags & DTRACEBUF_ADAPTIVE);
+	ASSERT(buf->dtb_xamot != NULL);
+
+	if (buf->dtb_xamot_drops != 0 ||
+	    buf->dtb_xamot_offset > size - (size >> 2)) {
+		if (size >= state->dts_bufmax)
+			return;
+
+		nsize = MIN(size << 1, state->dts_bufmax);
+		avail = budget > state->dts_bufbytes ?
+		    budget - state->dts_bufbytes : 0;
+
+		avail &= ~(uint64_t)(sizeof (uint64_t) - 1);
+
+		if (nsize - size > avail)
+			nsize = size + avail;
+	} else if (buf->dtb_xamot_offset < (size >> 3) &&
+	    size > state->dts_bufmin) {
+		nsize = MAX(size >> 1, state->dts_bufmin);
+	}
+
+	if (nsize == size)
+		return;
+
+	if ((xamot = kmem_zalloc_cpu(nsize,
+	    KM_NOSLEEP | KM_NORMALPRI, cpu)) == NULL)
+		return;
+
+	kmem_free(buf->dtb_xamot, size);
+	buf->dtb_xamot = xamot;
+	buf->dtb_xamot_size = nsize;
+	buf->dtb_xamot_offset = 0;
+	state->dts_bufbytes = state->dts_bufbytes - size + nsize;
+}
+
+/*
+ * Count the halves of a CPU's buffer that are on and off that CPU's NUMA
+ * node, for DTRACEIOC_STATUS.  Placement is judged by the first page of each
+ * half; halves whose placement cannot be determined are not counted.
+ */
+static void
+dtrace_status_numa(dtrace_status_t *stat, dtrace_buffer_t *buf,
+    processorid_t cpu)
+{
+	caddr_t half[2];
+	int i;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	half[0] = buf->dtb_tomax;
+	half[1] = buf->dtb_xamot;
+
+	for (i = 0; i < 2; i++) {
+		switch (dtrace_mem_local(half[i], cpu)) {
+		case 1:
+			stat->dtst_numalocal++;
+			break;
+		case 0:
+			stat->dtst_numaremote++;
+			break;
+		}
+	}
+}
+
 /*
  * Note:  called from probe context.  This function just increments the drop
  * count on a buffer.  It has been made a function to allow for the
@@ -11555,69 +12456,478 @@ dtrace_buffer_polish(dtrace_buffer_t *buf)
 	}
 }
 
+static size_t
+dtrace_aggcompact_varint(uint8_t *out, uint64_t val)
+{
+	size_t n = 0;
+
+	while (val >= 0x80) {
+		out[n++] = (uint8_t)(val | 0x80);
+		val >>= 7;
+	}
+
+	out[n++] = (uint8_t)val;
+
+	return (n);
+}
+
 /*
- * This routine determines if data generated at the specified time has likely
- * been entirely consumed at user-level.  This routine is called to determine
- * if an ECB on a defunct probe (but for an active enabling) can be safely
- * disabled and destroyed.
+ * Return the weight by which a record is ranked for the "aggtopn" option:
+ * the value itself for count(), sum(), min() and max(), and the number of
+ * values aggregated for avg(), stddev(), percentiles() and the quantizations.
  */
-static int
-dtrace_buffer_consumed(dtrace_buffer_t *bufs, hrtime_t when)
+static int64_t
+dtrace_aggregate_weight(dtrace_aggregation_t *agg, uint64_t *data)
 {
-	int i;
+	dtrace_recdesc_t *rec = &agg->dtag_action.dta_rec;
+	int i, n = rec->dtrd_size / sizeof (uint64_t);
+	int64_t weight = 0;
 
-	for (i = 0; i < NCPU; i++) {
-		dtrace_buffer_t *buf = &bufs[i];
+	switch (agg->dtag_action.dta_kind) {
+	case DTRACEAGG_QUANTIZE:
+		for (i = 0; i < n; i++)
+			weight += data[i];
+		break;
 
-		if (buf->dtb_size == 0)
-			continue;
+	case DTRACEAGG_LQUANTIZE:
+	case DTRACEAGG_LLQUANTIZE:
+		/*
+		 * The first word is the encoded argument, not a bucket.
+		 */
+		for (i = 1; i < n; i++)
+			weight += data[i];
+		break;
 
-		if (buf->dtb_flags & DTRACEBUF_RING)
-			return (0);
+	case DTRACEAGG_PERCENTILES:
+		/*
+		 * The first word is the window base; the rest are counts.
+		 */
+		for (i = 1; i < n; i++)
+			weight += data[i];
+		break;
 
-		if (!buf->dtb_switched && buf->dtb_offset != 0)
-			return (0);
+	case DTRACEAGG_DISTINCT: {
+		/*
+		 * The sum of the registers grows with the cardinality.
+		 */
+		uint8_t *regs = (uint8_t *)data;
 
-		if (buf->dtb_switched - buf->dtb_interval < when)
-			return (0);
+		for (i = 0; i < DTRACE_DISTINCT_NREGS; i++)
+			weight += regs[i];
+		break;
 	}
 
-	return (1);
+	default:
+		weight = (int64_t)data[0];
+		break;
+	}
+
+	return (weight);
 }
 
+/*
+ * Select the topn heaviest keys of each aggregation in an aggregation buffer
+ * snapshot, marking every other record with DTRACE_AGGTOPN_SKIP so that
+ * dtrace_aggregate_snapshot() leaves it out and dtrace_aggregate_carry() keeps
+ * it.  This is a single pass over the buffer with a bounded min-heap per
+ * aggregation, in the scratch space dtrace_state_go() set aside; records of
+ * an aggregation created since then have no heap and are not marked, and a
+ * snapshot holding any is counted in dts_aggunfiltered.
+ *
+ * Note:  not called from probe context.
+ */
 static void
-dtrace_buffer_free(dtrace_buffer_t *bufs)
+dtrace_aggregate_topn(dtrace_state_t *state, caddr_t data, size_t len,
+    uint32_t topn)
 {
-	int i;
+	int naggs = state->dts_aggtopnaggs;
+	dtrace_aggtopn_t *heaps = state->dts_aggtopn, *heap;
+	uint32_t *nheap;
+	size_t offs = 0;
+	int unfiltered = 0;
 
-	for (i = 0; i < NCPU; i++) {
-		dtrace_buffer_t *buf = &bufs[i];
+	ASSERT(MUTEX_HELD(&dtrace_lock));
 
-		if (buf->dtb_tomax == NULL) {
-			ASSERT(buf->dtb_xamot == NULL);
-			ASSERT(buf->dtb_size == 0);
+	if (heaps == NULL)
+		return;
+
+	nheap = (uint32_t *)&heaps[naggs * topn];
+	bzero(nheap, naggs * sizeof (uint32_t));
+
+	while (offs < len) {
+		dtrace_aggid_t id = *((dtrace_aggid_t *)(data + offs));
+		dtrace_aggregation_t *agg;
+		dtrace_recdesc_t *rec;
+		uint32_t size, i, child;
+		uintptr_t victim;
+		int64_t weight;
+
+		if (id == DTRACE_AGGIDNONE) {
+			offs += sizeof (id);
 			continue;
 		}
 
-		if (buf->dtb_xamot != NULL) {
-			ASSERT(!(buf->dtb_flags & DTRACEBUF_NOSWITCH));
-			kmem_free(buf->dtb_xamot, buf->dtb_size);
+		if ((agg = dtrace_aggid2agg(state, id)) == NULL) {
+			ASSERT(0);
+			break;
 		}
 
-		kmem_free(buf->dtb_tomax, buf->dtb_size);
-		buf->dtb_size = 0;
-		buf->dtb_tomax = NULL;
-		buf->dtb_xamot = NULL;
-	}
-}
+		rec = &agg->dtag_action.dta_rec;
+		size = rec->dtrd_offset - agg->dtag_base;
 
-/*
- * DTrace Enabling Functions
- */
-static dtrace_enabling_t *
-dtrace_enabling_create(dtrace_vstate_t *vstate)
-{
-	dtrace_enabling_t *enab;
+		if (id > (dtrace_aggid_t)naggs) {
+			unfiltered = 1;
+			offs += size + rec->dtrd_size;
+			continue;
+		}
+
+		weight = dtrace_aggregate_weight(agg,
+		    (uint64_t *)(data + offs + size));
+		heap = &heaps[(id - 1) * topn];
+
+		if (nheap[id - 1] < topn) {
+			/*
+			 * The heap isn't full yet; sift the new record up.
+			 */
+			for (i = nheap[id - 1]++; i > 0; i = (i - 1) / 2) {
+				if (heap[(i - 1) / 2].dtat_weight <= weight)
+					break;
+
+				heap[i] = heap[(i - 1) / 2];
+			}
+
+			heap[i].dtat_weight = weight;
+			heap[i].dtat_offs = offs;
+		} else if (weight > heap[0].dtat_weight) {
+			/*
+			 * This record displaces the lightest of the current
+			 * candidates; replace the root and sift it down.
+			 */
+			victim = heap[0].dtat_offs;
+
+			for (i = 0; (child = 2 * i + 1) < topn; i = child) {
+				if (child + 1 < topn &&
+				    heap[child + 1].dtat_weight <
+				    heap[child].dtat_weight)
+					child++;
+
+				if (weight <= heap[child].dtat_weight)
+					break;
+
+				heap[i] = heap[child];
+			}
+
+			heap[i].dtat_weight = weight;
+			heap[i].dtat_offs = offs;
+
+			*((dtrace_aggid_t *)(data + victim)) |=
+			    DTRACE_AGGTOPN_SKIP;
+		} else {
+			*((dtrace_aggid_t *)(data + offs)) |=
+			    DTRACE_AGGTOPN_SKIP;
+		}
+
+		offs += size + rec->dtrd_size;
+	}
+
+	if (unfiltered)
+		state->dts_aggunfiltered++;
+}
+
+/*
+ * Once a filtered snapshot has been copied out, keep the records that
+ * dtrace_aggregate_topn() held back:  move them to the front of the inactive
+ * buffer, rebuild its hash over them, and set dtb_xamot_carry so that
+ * dtrace_buffer_switch() makes them the start of the next active buffer
+ * instead of starting it empty.  Their keys are allocated downwards from the
+ * hash table as the records are allocated upwards, so walking the keys from
+ * the top visits the records in buffer order, and both can be compacted in
+ * place.
+ *
+ * Note:  not called from probe context.
+ */
+static void
+dtrace_aggregate_carry(dtrace_state_t *state, dtrace_buffer_t *buf)
+{
+	caddr_t xamot = buf->dtb_xamot;
+	dtrace_aggbuffer_t *agb;
+	dtrace_aggkey_t *key, *nkey, tmp;
+	uintptr_t offs = 0;
+	uint32_t fsize, ndx, i;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	buf->dtb_xamot_carry = 0;
+
+	if (buf->dtb_xamot_offset == 0)
+		return;
+
+	agb = (dtrace_aggbuffer_t *)(xamot + buf->dtb_xamot_size -
+	    sizeof (dtrace_aggbuffer_t));
+	key = nkey = (dtrace_aggkey_t *)agb->dtagb_hash;
+
+	for (i = 0; i < agb->dtagb_hashsize; i++)
+		agb->dtagb_hash[i] = NULL;
+
+	while ((uintptr_t)--key >= agb->dtagb_free) {
+		dtrace_aggid_t id = *((dtrace_aggid_t *)key->dtak_data);
+		dtrace_aggregation_t *agg;
+
+		if (!(id & DTRACE_AGGTOPN_SKIP))
+			continue;
+
+		id &= ~DTRACE_AGGTOPN_SKIP;
+
+		if ((agg = dtrace_aggid2agg(state, id)) == NULL) {
+			ASSERT(0);
+			break;
+		}
+
+		fsize = key->dtak_size + agg->dtag_action.dta_rec.dtrd_size;
+
+		while (offs & (sizeof (uint64_t) - 1)) {
+			*((dtrace_aggid_t *)(xamot + offs)) = DTRACE_AGGIDNONE;
+			offs += sizeof (dtrace_aggid_t);
+		}
+
+		ASSERT(xamot + offs <= key->dtak_data);
+		memmove(xamot + offs, key->dtak_data, fsize);
+		*((dtrace_aggid_t *)(xamot + offs)) = id;
+
+		/*
+		 * The new key can only be at or above the old one, and
+		 * everything above the old one has been dealt with.
+		 */
+		tmp = *key;
+		tmp.dtak_data = xamot + offs;
+		ndx = tmp.dtak_hashval % agb->dtagb_hashsize;
+		tmp.dtak_next = agb->dtagb_hash[ndx];
+		*--nkey = tmp;
+		agb->dtagb_hash[ndx] = nkey;
+
+		offs += fsize;
+		state->dts_aggheld++;
+	}
+
+	agb->dtagb_free = (uintptr_t)nkey;
+	buf->dtb_xamot_carry = offs;
+}
+
+/*
+ * Copy an aggregation buffer snapshot out to user-level, leaving out any
+ * records that dtrace_aggregate_topn() has marked.  If compact is set,
+ * quantize(), lquantize() and llquantize() records are also rewritten into
+ * the compact encoding described in <sys/dtrace.h>.  Histograms are
+ * overwhelmingly made up of zero buckets, so this typically shrinks the
+ * snapshot by an order of magnitude.  Records are staged through
+ * dtrace_aggcompact_buf (which, like the rest of the snapshot path, is
+ * protected by dtrace_lock) and copied out a chunk at a time.  Returns the
+ * number of bytes copied out, or -1 if the copyout faulted.
+ *
+ * Note:  not called from probe context.
+ */
+static ssize_t
+dtrace_aggregate_snapshot(dtrace_state_t *state, caddr_t src, size_t len,
+    caddr_t dst, int compact)
+{
+	caddr_t chunk = (caddr_t)dtrace_aggcompact_buf;
+	size_t offs = 0, coffs = 0, total = 0;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	while (offs < len) {
+		dtrace_aggid_t id = *((dtrace_aggid_t *)(src + offs));
+		dtrace_aggregation_t *agg;
+		dtrace_recdesc_t *rec;
+		dtrace_actkind_t kind;
+		uint32_t size, fsize, budget, nbytes, i, n, last;
+		uint64_t *val;
+		uint8_t *stream;
+		caddr_t out;
+
+		if (id == DTRACE_AGGIDNONE) {
+			/*
+			 * Alignment filler; we generate our own below.
+			 */
+			offs += sizeof (id);
+			continue;
+		}
+
+		if ((agg = dtrace_aggid2agg(state,
+		    id & ~DTRACE_AGGTOPN_SKIP)) == NULL) {
+			/*
+			 * This can't happen with a sane buffer; rather than
+			 * guess at the layout, copy the remainder out as is.
+			 */
+			ASSERT(0);
+			if (copyout(chunk, dst + total, coffs) != 0 ||
+			    copyout(src + offs, dst + total + coffs,
+			    len - offs) != 0)
+				return (-1);
+
+			return (total + coffs + len - offs);
+		}
+
+		rec = &agg->dtag_action.dta_rec;
+		kind = agg->dtag_action.dta_kind;
+		size = rec->dtrd_offset - agg->dtag_base;
+		fsize = size + rec->dtrd_size;
+
+		if (id & DTRACE_AGGTOPN_SKIP) {
+			offs += fsize;
+			continue;
+		}
+
+		/*
+		 * Make sure that the worst case -- alignment filler plus the
+		 * dense record -- fits in what remains of the chunk.
+		 */
+		if (coffs + sizeof (id) + fsize > DTRACE_AGGCOMPACT_CHUNK) {
+			if (copyout(chunk, dst + total, coffs) != 0)
+				return (-1);
+
+			total += coffs;
+			coffs = 0;
+		}
+
+		if ((total + coffs) & (sizeof (uint64_t) - 1)) {
+			*((dtrace_aggid_t *)(chunk + coffs)) = DTRACE_AGGIDNONE;
+			coffs += sizeof (dtrace_aggid_t);
+		}
+
+		if (coffs + fsize > DTRACE_AGGCOMPACT_CHUNK) {
+			/*
+			 * This record is too large to be staged; copy it
+			 * out in its dense form.
+			 */
+			if (copyout(chunk, dst + total, coffs) != 0 ||
+			    copyout(src + offs, dst + total + coffs, fsize) != 0)
+				return (-1);
+
+			total += coffs + fsize;
+			coffs = 0;
+			offs += fsize;
+			continue;
+		}
+
+		out = chunk + coffs;
+		bcopy(src + offs, out, size);
+
+		if (!compact || (kind != DTRACEAGG_QUANTIZE &&
+		    kind != DTRACEAGG_LQUANTIZE && kind != DTRACEAGG_LLQUANTIZE))
+			goto dense;
+
+		/*
+		 * Only keep the compacted form if it is strictly smaller than
+		 * the dense one, even after padding.
+		 */
+		budget = rec->dtrd_size - sizeof (uint32_t) - sizeof (uint64_t);
+		stream = (uint8_t *)out + size + sizeof (uint32_t);
+		val = (uint64_t *)(src + offs + size);
+		n = rec->dtrd_size / sizeof (uint64_t);
+
+		for (i = 0, last = 0, nbytes = 0; i < n; i++) {
+			if (val[i] == 0)
+				continue;
+
+			if (nbytes + 2 * DTRACE_AGGCOMPACT_VARINTMAX > budget)
+				break;
+
+			nbytes += dtrace_aggcompact_varint(stream + nbytes,
+			    i - last);
+			nbytes += dtrace_aggcompact_varint(stream + nbytes,
+			    DTRACE_AGGCOMPACT_ZIGZAG(val[i]));
+			last = i;
+		}
+
+		if (i < n)
+			goto dense;
+
+		*((dtrace_aggid_t *)out) = id | DTRACE_AGGCOMPACT_FLAG;
+		*((uint32_t *)(out + size)) = nbytes;
+		coffs += size + sizeof (uint32_t) + nbytes;
+
+		while (coffs & (sizeof (uint32_t) - 1))
+			chunk[coffs++] = 0;
+
+		offs += fsize;
+		continue;
+dense:
+		bcopy(src + offs + size, out + size, rec->dtrd_size);
+		coffs += fsize;
+		offs += fsize;
+	}
+
+	if (coffs != 0 && copyout(chunk, dst + total, coffs) != 0)
+		return (-1);
+
+	return (total + coffs);
+}
+
+/*
+ * This routine determines if data generated at the specified time has likely
+ * been entirely consumed at user-level.  This routine is called to determine
+ * if an ECB on a defunct probe (but for an active enabling) can be safely
+ * disabled and destroyed.
+ */
+static int
+dtrace_buffer_consumed(dtrace_buffer_t *bufs, hrtime_t when)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		dtrace_buffer_t *buf = &bufs[i];
+
+		if (buf->dtb_size == 0)
+			continue;
+
+		if (buf->dtb_flags & DTRACEBUF_RING)
+			return (0);
+
+		if (!buf->dtb_switched && buf->dtb_offset != 0)
+			return (0);
+
+		if (buf->dtb_switched - buf->dtb_interval < when)
+			return (0);
+	}
+
+	return (1);
+}
+
+static void
+dtrace_buffer_free(dtrace_buffer_t *bufs)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		dtrace_buffer_t *buf = &bufs[i];
+
+		if (buf->dtb_tomax == NULL) {
+			ASSERT(buf->dtb_xamot == NULL);
+			ASSERT(buf->dtb_size == 0);
+			continue;
+		}
+
+		if (buf->dtb_xamot != NULL) {
+			ASSERT(!(buf->dtb_flags & DTRACEBUF_NOSWITCH));
+			kmem_free(buf->dtb_xamot, buf->dtb_xamot_size);
+		}
+
+		kmem_free(buf->dtb_tomax, buf->dtb_size);
+		buf->dtb_size = 0;
+		buf->dtb_xamot_size = 0;
+		buf->dtb_tomax = NULL;
+		buf->dtb_xamot = NULL;
+	}
+}
+
+/*
+ * DTrace Enabling Functions
+ */
+static dtrace_enabling_t *
+dtrace_enabling_create(dtrace_vstate_t *vstate)
+{
+	dtrace_enabling_t *enab;
 
 	enab = kmem_zalloc(sizeof (dtrace_enabling_t), KM_SLEEP);
 	enab->dten_vstate = vstate;
@@ -13006,7 +14316,8 @@ dtrace_dof_slurp(dof_hdr_t *dof, dtrace_vstate_t *vstate, cred_t *cr,
 	}
 
 	if (dof->dofh_ident[DOF_ID_VERSION] != DOF_VERSION_1 &&
-            dof->dofh_ident[DOF_ID_VERSION] != DOF_VERSION_2) {
+            dof->dofh_ident[DOF_ID_VERSION] != DOF_VERSION_2 &&
+            dof->dofh_ident[DOF_ID_VERSION] != DOF_VERSION_3) {
 		dtrace_dof_error(dof, "DOF version mismatch");
 		return (-1);
 	}
@@ -13253,7 +14564,28 @@ dtrace_dstate_init(dtrace_dstate_t *dstate, size_t size)
 	if (size < (min = dstate->dtds_chunksize + sizeof (dtrace_dynhash_t)))
 		size = min;
 
-	if ((base = kmem_zalloc(size, KM_NOSLEEP | KM_NORMALPRI)) == NULL)
+	hashsize = size / (dstate->dtds_chunksize + sizeof (dtrace_dynhash_t));
+
+	if (hashsize != 1 && (hashsize & 1))
+		hashsize--;
+
+	/*
+	 * Determine number of active CPUs.  Divide free list evenly among
+	 * active CPUs.
+	 */
+	maxper = (size - hashsize * sizeof (dtrace_dynhash_t)) / NCPU;
+	maxper = (maxper / dstate->dtds_chunksize) * dstate->dtds_chunksize;
+
+	/*
+	 * Each CPU's slice of chunks is carved from pages on that CPU's node.
+	 * The space must stay virtually contiguous for DTRACE_INRANGE(), so
+	 * this is done page by page and mapped as one region.  If that fails,
+	 * we fall back to an ordinary allocation and take what we are given.
+	 */
+	if ((base = dtrace_stripe_zalloc(size,
+	    hashsize * sizeof (dtrace_dynhash_t), maxper,
+	    &dstate->dtds_stripe)) == NULL &&
+	    (base = kmem_zalloc(size, KM_NOSLEEP | KM_NORMALPRI)) == NULL)
 		RETURN(ENOMEM);
 
 	dstate->dtds_size = size;
@@ -13261,11 +14593,6 @@ dtrace_dstate_init(dtrace_dstate_t *dstate, size_t size)
 	dstate->dtds_percpu = kmem_cache_alloc(dtrace_state_cache, KM_SLEEP);
 	bzero(dstate->dtds_percpu, NCPU * sizeof (dtrace_dstate_percpu_t));
 
-	hashsize = size / (dstate->dtds_chunksize + sizeof (dtrace_dynhash_t));
-
-	if (hashsize != 1 && (hashsize & 1))
-		hashsize--;
-
 	dstate->dtds_hashsize = hashsize;
 	dstate->dtds_hash = dstate->dtds_base;
 
@@ -13282,20 +14609,21 @@ dtrace_dstate_init(dtrace_dstate_t *dstate, size_t size)
 	if (dtrace_dynhash_sink.dtdv_hashval != DTRACE_DYNHASH_SINK)
 		dtrace_dynhash_sink.dtdv_hashval = DTRACE_DYNHASH_SINK;
 
-	/*
-	 * Determine number of active CPUs.  Divide free list evenly among
-	 * active CPUs.
-	 */
 	start = (dtrace_dynvar_t *)
 	    ((uintptr_t)base + hashsize * sizeof (dtrace_dynhash_t));
-	limit = (uintptr_t)base + size;
-
-	maxper = (limit - (uintptr_t)start) / NCPU;
-	maxper = (maxper / dstate->dtds_chunksize) * dstate->dtds_chunksize;
 
 	for (i = 0; i < NCPU; i++) {
 		dstate->dtds_percpu[i].dtdsc_free = dvar = start;
 
+		switch (dtrace_mem_local(start, i)) {
+		case 1:
+			dstate->dtds_numalocal++;
+			break;
+		case 0:
+			dstate->dtds_numaremote++;
+			break;
+		}
+
 		/*
 		 * If we don't even have enough chunks to make it once through
 		 * NCPUs, we're just going to allocate everything to the first
@@ -13339,7 +14667,10 @@ dtrace_dstate_fini(dtrace_dstate_t *dstate)
 	if (dstate->dtds_base == NULL)
 		return;
 
-	kmem_free(dstate->dtds_base, dstate->dtds_size);
+	if (dstate->dtds_stripe != NULL)
+		dtrace_stripe_free(dstate->dtds_base, dstate->dtds_stripe);
+	else
+		kmem_free(dstate->dtds_base, dstate->dtds_size);
 	kmem_cache_free(dtrace_state_cache, dstate->dtds_percpu);
 }
 
@@ -13377,6 +14708,7 @@ dtrace_state_clean(dtrace_state_t *state)
 
 	dtrace_dynvar_clean(&state->dts_vstate.dtvs_dynvars);
 	dtrace_speculation_clean(state);
+	dtrace_unwind_kick();
 }
 
 static void
@@ -13665,6 +14997,10 @@ dtrace_state_buffer(dtrace_state_t *state, dtrace_buffer_t *buf, int which)
 		if (opt[DTRACEOPT_BUFPOLICY] == DTRACEOPT_BUFPOLICY_FILL)
 			flags |= DTRACEBUF_FILL;
 
+		if (opt[DTRACEOPT_BUFPOLICY] == DTRACEOPT_BUFPOLICY_SWITCH &&
+		    opt[DTRACEOPT_BUFRESIZE] == DTRACEOPT_BUFRESIZE_ADAPTIVE)
+			flags |= DTRACEBUF_ADAPTIVE;
+
 
 		if (state != dtrace_anon.dta_state ||
 		    state->dts_activity != DTRACE_ACTIVITY_ACTIVE)
@@ -13672,7 +15008,32 @@ dtrace_state_buffer(dtrace_state_t *state, dtrace_buffer_t *buf, int which)
 //printk("flags=%x state=%p %p %x %x\n", flags, state, dtrace_anon.dta_state, state->dts_activity, DTRACE_ACTIVITY_ACTIVE);
 	}
 
-	for (size = opt[which]; size >= sizeof (uint64_t); size /= divisor) {
+	size = opt[which];
+
+	if ((flags & DTRACEBUF_ADAPTIVE) &&
+	    opt[DTRACEOPT_BUFBUDGET] != DTRACEOPT_UNSET &&
+	    opt[DTRACEOPT_BUFBUDGET] != 0 &&
+	    state->dts_activity == DTRACE_ACTIVITY_INACTIVE) {
+		dtrace_optval_t share;
+		cpu_t *cp = cpu_list;
+		int ncpus = 0;
+
+		/*
+		 * Start every CPU off with an equal share of the budget if
+		 * the requested size would exceed it.
+		 */
+		do {
+			if (cpu == DTRACE_CPUALL || cpu == cp->cpu_id)
+				ncpus++;
+		} while ((cp = cp->cpu_next) != cpu_list);
+
+		share = opt[DTRACEOPT_BUFBUDGET] / (2 * MAX(ncpus, 1));
+
+		if (size > share)
+			size = share;
+	}
+
+	for (; size >= sizeof (uint64_t); size /= divisor) {
 		/*
 		 * The size must be 8-byte aligned.  If the size is not 8-byte
 		 * aligned, drop it down by the difference.
@@ -13802,7 +15163,7 @@ HERE();
 	nspec = opt[DTRACEOPT_NSPEC];
 	ASSERT(nspec != DTRACEOPT_UNSET);
 
-	if (nspec > INT_MAX) {
+	if (nspec > DTRACESPEC_IDMASK) {
 		rval = ENOMEM;
 		goto out;
 	}
@@ -13827,7 +15188,12 @@ HERE();
 		}
 
 		spec[i].dtsp_buffer = buf;
+		spec[i].dtsp_next = i + 1 < nspec ? i + 2 : 0;
 	}
+
+	state->dts_specfree = nspec != 0 ? 1 : 0;
+	state->dts_specdirty = 0;
+	state->dts_specclean = 0;
 HERE();
 
 	if (opt[DTRACEOPT_GRABANON] != DTRACEOPT_UNSET) {
@@ -13925,6 +15291,34 @@ HERE();
 	if ((rval = dtrace_state_buffers(state)) != 0)
 		goto err;
 
+	/*
+	 * For adaptive principal buffers, total up what we have allocated
+	 * and set the bounds within which dtrace_buffer_adapt() may resize
+	 * each buffer.  If no budget was given, what we have is the budget.
+	 */
+	if (opt[DTRACEOPT_BUFPOLICY] == DTRACEOPT_BUFPOLICY_SWITCH &&
+	    opt[DTRACEOPT_BUFRESIZE] == DTRACEOPT_BUFRESIZE_ADAPTIVE) {
+		state->dts_bufbytes = 0;
+
+		for (i = 0; i < NCPU; i++) {
+			state->dts_bufbytes += state->dts_buffer[i].dtb_size +
+			    state->dts_buffer[i].dtb_xamot_size;
+		}
+
+		if (opt[DTRACEOPT_BUFBUDGET] == DTRACEOPT_UNSET ||
+		    opt[DTRACEOPT_BUFBUDGET] < state->dts_bufbytes)
+			opt[DTRACEOPT_BUFBUDGET] = state->dts_bufbytes;
+
+		state->dts_bufmin = P2ROUNDUP(MAX(opt[DTRACEOPT_BUFSIZE] / 16,
+		    state->dts_needed), sizeof (uint64_t));
+		state->dts_bufmax = DTRACE_BUFADAPT_MAX(opt[DTRACEOPT_BUFSIZE],
+		    opt[DTRACEOPT_BUFBUDGET]);
+
+		if (state->dts_bufmax > dtrace_nonroot_maxsize &&
+		    !PRIV_POLICY_CHOICE(CRED(), PRIV_ALL, B_FALSE))
+			state->dts_bufmax = dtrace_nonroot_maxsize;
+	}
+
 	if ((sz = opt[DTRACEOPT_DYNVARSIZE]) == DTRACEOPT_UNSET)
 		sz = dtrace_dstate_defsize;
 
@@ -13943,6 +15337,51 @@ HERE();
 	if (rval != 0)
 		goto err;
 
+	if (state->dts_stackids) {
+		if ((sz = opt[DTRACEOPT_STACKTABSIZE]) == DTRACEOPT_UNSET ||
+		    sz == 0)
+			sz = dtrace_stacktab_defsize;
+
+		if (sz > dtrace_stacktab_maxsize)
+			sz = dtrace_stacktab_maxsize;
+
+		do {
+			rval = dtrace_stacktab_init(&state->dts_stacktab, sz);
+
+			if (rval == 0)
+				break;
+
+			if (opt[DTRACEOPT_BUFRESIZE] ==
+			    DTRACEOPT_BUFRESIZE_MANUAL)
+				goto err;
+		} while (sz >>= 1);
+
+		opt[DTRACEOPT_STACKTABSIZE] = sz;
+
+		if (rval != 0)
+			goto err;
+	}
+
+	/*
+	 * The aggtopn heaps are sized for the aggregations we have now, and
+	 * are reused by every snapshot; like the speculations, we fail the
+	 * operation rather than run without them.
+	 */
+	if ((sz = opt[DTRACEOPT_AGGTOPN]) != DTRACEOPT_UNSET && sz > 0 &&
+	    state->dts_naggregations > 0) {
+		size_t tsize = state->dts_naggregations * (sz *
+		    sizeof (dtrace_aggtopn_t) + sizeof (uint32_t));
+
+		if ((state->dts_aggtopn = kmem_zalloc(tsize,
+		    KM_NOSLEEP | KM_NORMALPRI)) == NULL) {
+			rval = ENOMEM;
+			goto err;
+		}
+
+		state->dts_aggtopnsize = tsize;
+		state->dts_aggtopnaggs = state->dts_naggregations;
+	}
+
 HERE();
 	if (opt[DTRACEOPT_STATUSRATE] > dtrace_statusrate_max)
 		opt[DTRACEOPT_STATUSRATE] = dtrace_statusrate_max;
@@ -14020,6 +15459,14 @@ HERE();
 err:
 	dtrace_buffer_free(state->dts_buffer);
 	dtrace_buffer_free(state->dts_aggbuffer);
+	dtrace_stacktab_destroy(&state->dts_stacktab);
+
+	if (state->dts_aggtopn != NULL) {
+		kmem_free(state->dts_aggtopn, state->dts_aggtopnsize);
+		state->dts_aggtopn = NULL;
+		state->dts_aggtopnsize = 0;
+		state->dts_aggtopnaggs = 0;
+	}
 
 	if ((nspec = state->dts_nspeculations) == 0) {
 		ASSERT(state->dts_speculations == NULL);
@@ -14040,6 +15487,7 @@ err:
 	kmem_free(spec, nspec * sizeof (dtrace_speculation_t));
 	state->dts_nspeculations = 0;
 	state->dts_speculations = NULL;
+	state->dts_specfree = 0;
 
 out:
 	mutex_exit(&dtrace_lock);
@@ -14126,6 +15574,7 @@ PRINT_CASE(DTRACEOPT_DESTRUCTIVE);
 		break;
 
 	case DTRACEOPT_BUFSIZE:
+	case DTRACEOPT_BUFBUDGET:
 	case DTRACEOPT_DYNVARSIZE:
 	case DTRACEOPT_AGGSIZE:
 	case DTRACEOPT_SPECSIZE:
@@ -14151,6 +15600,12 @@ PRINT_CASE(DTRACEOPT_BUFSIZE);
 			 */
 			val = LONG_MAX - (1 << 27) + 1;
 		}
+		break;
+
+	case DTRACEOPT_AGGTOPN:
+		if (val > dtrace_aggtopn_max)
+			RETURN(EINVAL);
+		break;
 	}
 
 HERE();
@@ -14262,6 +15717,10 @@ dtrace_printf("teardown start xcalls=%lu probes=%llu\n", cnt_xcall1, cnt_probes
 	dtrace_buffer_free(state->dts_buffer);
 HERE();
 	dtrace_buffer_free(state->dts_aggbuffer);
+	dtrace_stacktab_destroy(&state->dts_stacktab);
+
+	if (state->dts_aggtopn != NULL)
+		kmem_free(state->dts_aggtopn, state->dts_aggtopnsize);
 HERE();
 
 	for (i = 0; i < nspec; i++)
@@ -14682,7 +16141,7 @@ dtrace_helper_destroygen(int gen)
 		 * If we have a meta provider, remove this helper provider.
 		 */
 		dmutex_enter(&dtrace_meta_lock);
-		if (dtrace_meta_pid != NULL) {
+		if (dtrace_meta_pid != NULL && help->dthps_provided) {
 			ASSERT(dtrace_deferred_pid == NULL);
 			dtrace_helper_provider_remove(&prov->dthp_prov,
 			    p->p_pid);
@@ -14789,9 +16248,172 @@ err:
 	RETURN(EINVAL);
 }
 
+/*
+ * Returns non-zero if any probe described by the helper provider would match
+ * the probe description.  Provider names are formed as the meta provider forms
+ * them, from the name in the DOF and the pid.  We don't try to match the
+ * module, which the consumer may have put in a different form; creating a
+ * process's probes a little early is harmless, failing to create them is not.
+ */
+static int
+dtrace_helper_provider_match(dtrace_helper_provider_t *hprov, pid_t pid,
+    const dtrace_probedesc_t *desc)
+{
+	uintptr_t daddr = (uintptr_t)hprov->dthp_prov.dofhp_dof;
+	dof_hdr_t *dof = (dof_hdr_t *)daddr;
+	dtrace_probekey_t pkey;
+	char name[DTRACE_PROVNAMELEN];
+	uint_t i, j, nprobes;
+
+	dtrace_probekey(desc, &pkey);
+
+	for (i = 0; i < dof->dofh_secnum; i++) {
+		dof_sec_t *sec = (dof_sec_t *)(uintptr_t)(daddr +
+		    dof->dofh_secoff + i * dof->dofh_secsize);
+		dof_sec_t *str_sec, *prb_sec;
+		dof_provider_t *provider;
+		dof_probe_t *probe;
+		char *strtab;
+
+		if (sec->dofs_type != DOF_SECT_PROVIDER)
+			continue;
+
+		provider = (dof_provider_t *)(uintptr_t)(daddr +
+		    sec->dofs_offset);
+		str_sec = (dof_sec_t *)(uintptr_t)(daddr + dof->dofh_secoff +
+		    provider->dofpv_strtab * dof->dofh_secsize);
+		prb_sec = (dof_sec_t *)(uintptr_t)(daddr + dof->dofh_secoff +
+		    provider->dofpv_probes * dof->dofh_secsize);
+		strtab = (char *)(uintptr_t)(daddr + str_sec->dofs_offset);
+
+		(void) snprintf(name, sizeof (name), "%s%u",
+		    strtab + provider->dofpv_name, (uint_t)pid);
+
+		if (pkey.dtpk_pmatch(name, pkey.dtpk_prov, 0) <= 0)
+			continue;
+
+		nprobes = prb_sec->dofs_size / prb_sec->dofs_entsize;
+
+		for (j = 0; j < nprobes; j++) {
+			probe = (dof_probe_t *)(uintptr_t)(daddr +
+			    prb_sec->dofs_offset + j * prb_sec->dofs_entsize);
+
+			if (pkey.dtpk_fmatch(strtab + probe->dofpr_func,
+			    pkey.dtpk_func, 0) > 0 &&
+			    pkey.dtpk_nmatch(strtab + probe->dofpr_name,
+			    pkey.dtpk_name, 0) > 0)
+				return (1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Returns non-zero if the probe description matches the given helper
+ * provider or, if hprov is NULL, any of the process's helper providers.  If
+ * desc is NULL, the descriptions in the retained enablings are tried.
+ */
+static int
+dtrace_helper_wanted(dtrace_helpers_t *help, dtrace_helper_provider_t *hprov,
+    pid_t pid, const dtrace_probedesc_t *desc)
+{
+	dtrace_enabling_t *enab;
+	int i;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	if (desc == NULL) {
+		for (enab = dtrace_retained; enab != NULL;
+		    enab = enab->dten_next) {
+			for (i = 0; i < enab->dten_ndesc; i++) {
+				if (dtrace_helper_wanted(help, hprov, pid,
+				    &enab->dten_desc[i]->dted_probe))
+					return (1);
+			}
+		}
+
+		return (0);
+	}
+
+	if (hprov != NULL)
+		return (dtrace_helper_provider_match(hprov, pid, desc));
+
+	for (i = 0; i < help->dthps_nprovs; i++) {
+		if (dtrace_helper_provider_match(help->dthps_provs[i], pid,
+		    desc))
+			return (1);
+	}
+
+	return (0);
+}
+
+static void
+dtrace_helper_lazy_remove(dtrace_helpers_t *help)
+{
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	if (!help->dthps_lazy)
+		return;
+
+	if (help->dthps_next != NULL)
+		help->dthps_next->dthps_prev = help->dthps_prev;
+	if (help->dthps_prev != NULL)
+		help->dthps_prev->dthps_next = help->dthps_next;
+	if (dtrace_lazy_pid == help) {
+		dtrace_lazy_pid = help->dthps_next;
+		ASSERT(help->dthps_prev == NULL);
+	}
+
+	help->dthps_next = NULL;
+	help->dthps_prev = NULL;
+	help->dthps_lazy = 0;
+}
+
+/*
+ * Called before a consumer looks for or enables probes:  any helpers on the
+ * lazy list which describe probes matching desc (or, if desc is NULL, matching
+ * a retained enabling) have their providers created now.
+ */
+static void
+dtrace_helper_provide_lazy(const dtrace_probedesc_t *desc)
+{
+	dtrace_helpers_t *help;
+	int i;
+
+	dmutex_enter(&dtrace_meta_lock);
+	dmutex_enter(&dtrace_lock);
+
+	while (dtrace_meta_pid != NULL) {
+		for (help = dtrace_lazy_pid; help != NULL;
+		    help = help->dthps_next) {
+			if (dtrace_helper_wanted(help, NULL, help->dthps_pid,
+			    desc))
+				break;
+		}
+
+		if (help == NULL)
+			break;
+
+		dtrace_helper_lazy_remove(help);
+		help->dthps_provided = 1;
+		dmutex_exit(&dtrace_lock);
+
+		for (i = 0; i < help->dthps_nprovs; i++) {
+			dtrace_helper_provide(help->dthps_provs[i],
+			    help->dthps_pid);
+		}
+
+		dmutex_enter(&dtrace_lock);
+	}
+
+	dmutex_exit(&dtrace_lock);
+	dmutex_exit(&dtrace_meta_lock);
+}
+
 static void
 dtrace_helper_provider_register(proc_t *p, dtrace_helpers_t *help,
-    dof_helper_t *dofhp)
+    dtrace_helper_provider_t *hprov)
 {
 	ASSERT(MUTEX_NOT_HELD(&dtrace_lock));
 
@@ -14822,7 +16444,29 @@ HERE();
 
 		dmutex_exit(&dtrace_lock);
 
-	} else if (dofhp != NULL) {
+	} else if (dtrace_helper_lazy && !help->dthps_provided &&
+	    !dtrace_helper_wanted(help, hprov, p->p_pid, NULL)) {
+		/*
+		 * No consumer wants these probes yet, so rather than have
+		 * the meta provider create them now, park the helpers on the
+		 * lazy list for dtrace_helper_provide_lazy() to find.  Laziness
+		 * is all or nothing for a set of helpers:  once any of its
+		 * providers exist (dthps_provided), later ones are created
+		 * eagerly, so that teardown always knows what to remove.
+		 */
+		if (!help->dthps_lazy) {
+			help->dthps_lazy = 1;
+			help->dthps_pid = p->p_pid;
+			help->dthps_next = dtrace_lazy_pid;
+			help->dthps_prev = NULL;
+			if (dtrace_lazy_pid != NULL)
+				dtrace_lazy_pid->dthps_prev = help;
+			dtrace_lazy_pid = help;
+		}
+
+		dmutex_exit(&dtrace_lock);
+
+	} else if (hprov != NULL && !help->dthps_lazy) {
 		/*
 		 * If the dtrace module is loaded and we have a particular
 		 * helper provider description, pass that off to the
@@ -14830,24 +16474,27 @@ HERE();
 		 */
 
 HERE();
+		help->dthps_provided = 1;
 		dmutex_exit(&dtrace_lock);
 
-		dtrace_helper_provide(dofhp, p->p_pid);
+		dtrace_helper_provide(hprov, p->p_pid);
 
 	} else {
 		/*
 		 * Otherwise, just pass all the helper provider descriptions
-		 * off to the meta provider.
+		 * off to the meta provider -- including any which were
+		 * waiting on the lazy list.
 		 */
 
 		int i;
+		dtrace_helper_lazy_remove(help);
+		help->dthps_provided = 1;
 		dmutex_exit(&dtrace_lock);
 
 HERE();
 		for (i = 0; i < help->dthps_nprovs; i++) {
 HERE();
-			dtrace_helper_provide(&help->dthps_provs[i]->dthp_prov,
-			    p->p_pid);
+			dtrace_helper_provide(help->dthps_provs[i], p->p_pid);
 		}
 	}
 
@@ -14855,8 +16502,91 @@ HERE();
 HERE();
 }
 
+/*
+ * DTrace Shared Helper DOF Functions
+ *
+ * See the description of dtrace_dofcache_t in <sys/dtrace_impl.h>.  Only DOF
+ * consisting purely of providers is cached:  helper actions belong to the
+ * process's own variable state and can't be shared.
+ */
+static uint64_t
+dtrace_dofcache_hash(dof_hdr_t *dof)
+{
+	const uint8_t *p = (const uint8_t *)dof;
+	uint64_t hval = 14695981039346656037ULL;
+	uint64_t i;
+
+	for (i = 0; i < dof->dofh_loadsz; i++) {
+		hval ^= p[i];
+		hval *= 1099511628211ULL;
+	}
+
+	return (hval);
+}
+
+static dtrace_dofcache_t *
+dtrace_dofcache_lookup(dof_hdr_t *dof, uint64_t hash)
+{
+	dtrace_dofcache_t *dc;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	for (dc = dtrace_dofcache; dc != NULL; dc = dc->dtdc_next) {
+		if (dc->dtdc_hash == hash &&
+		    dc->dtdc_raw->dofh_loadsz == dof->dofh_loadsz &&
+		    bcmp(dc->dtdc_raw, dof, dof->dofh_loadsz) == 0)
+			return (dc);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Enter validated DOF in the cache.  The caller's reference is the first.
+ */
+static dtrace_dofcache_t *
+dtrace_dofcache_create(dof_hdr_t *raw, dof_hdr_t *dof, uint64_t hash,
+    uint64_t ubase)
+{
+	dtrace_dofcache_t *dc;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+
+	dc = kmem_zalloc(sizeof (dtrace_dofcache_t), KM_SLEEP);
+	dc->dtdc_hash = hash;
+	dc->dtdc_raw = raw;
+	dc->dtdc_dof = dof;
+	dc->dtdc_ubase = ubase;
+	dc->dtdc_ref = 1;
+	dc->dtdc_next = dtrace_dofcache;
+	dtrace_dofcache = dc;
+
+	return (dc);
+}
+
+static void
+dtrace_dofcache_rele(dtrace_dofcache_t *dc)
+{
+	dtrace_dofcache_t **dcp;
+
+	ASSERT(MUTEX_HELD(&dtrace_lock));
+	ASSERT(dc->dtdc_ref > 0);
+
+	if (--dc->dtdc_ref != 0)
+		return;
+
+	for (dcp = &dtrace_dofcache; *dcp != dc; dcp = &(*dcp)->dtdc_next)
+		ASSERT(*dcp != NULL);
+
+	*dcp = dc->dtdc_next;
+
+	dtrace_dof_destroy(dc->dtdc_raw);
+	dtrace_dof_destroy(dc->dtdc_dof);
+	kmem_free(dc, sizeof (dtrace_dofcache_t));
+}
+
 static int
-dtrace_helper_provider_add(dof_helper_t *dofhp, int gen)
+dtrace_helper_provider_add(dof_helper_t *dofhp, int gen, dtrace_dofcache_t *dc)
 {
 	dtrace_helpers_t *help;
 	dtrace_helper_provider_t *hprov, **tmp_provs;
@@ -14891,6 +16621,7 @@ HERE();
 	hprov->dthp_prov = *dofhp;
 	hprov->dthp_ref = 1;
 	hprov->dthp_generation = gen;
+	hprov->dthp_cache = dc;
 
 	/*
 	 * Allocate a bigger table for helper providers if it's already full.
@@ -14933,9 +16664,16 @@ dtrace_helper_provider_destroy(dtrace_helper_provider_t *hprov)
 
 	if (--hprov->dthp_ref == 0) {
 		dof_hdr_t *dof;
-		dmutex_exit(&dtrace_lock);
-		dof = (dof_hdr_t *)(uintptr_t)hprov->dthp_prov.dofhp_dof;
-		dtrace_dof_destroy(dof);
+
+		if (hprov->dthp_cache != NULL) {
+			dtrace_dofcache_rele(hprov->dthp_cache);
+			dmutex_exit(&dtrace_lock);
+		} else {
+			dmutex_exit(&dtrace_lock);
+			dof = (dof_hdr_t *)(uintptr_t)
+			    hprov->dthp_prov.dofhp_dof;
+			dtrace_dof_destroy(dof);
+		}
 		kmem_free(hprov, sizeof (dtrace_helper_provider_t));
 	} else {
 		dmutex_exit(&dtrace_lock);
@@ -14947,6 +16685,7 @@ dtrace_helper_provider_validate(dof_hdr_t *dof, dof_sec_t *sec)
 {
 	uintptr_t daddr = (uintptr_t)dof;
 	dof_sec_t *str_sec, *prb_sec, *arg_sec, *off_sec, *enoff_sec;
+	dof_sec_t *sema_sec;
 	dof_provider_t *provider;
 	dof_probe_t *probe;
 	uint8_t *arg;
@@ -14970,6 +16709,8 @@ static char buf[64];
 	if (sec->dofs_size <
 	    ((dof->dofh_ident[DOF_ID_VERSION] == DOF_VERSION_1) ?
 	    offsetof(dof_provider_t, dofpv_prenoffs) :
+	    (dof->dofh_ident[DOF_ID_VERSION] == DOF_VERSION_2) ?
+	    offsetof(dof_provider_t, dofpv_prsemas) :
 	    sizeof (dof_provider_t))) {
 		dtrace_dof_error(dof, "provider section too small");
 		return (-1);
@@ -14993,6 +16734,14 @@ static char buf[64];
 	    provider->dofpv_prenoffs)) == NULL)
 		return (-1);
 
+	sema_sec = NULL;
+
+	if (dof->dofh_ident[DOF_ID_VERSION] >= DOF_VERSION_3 &&
+	    provider->dofpv_prsemas != DOF_SECT_NONE &&
+	    (sema_sec = dtrace_dof_sect(dof, DOF_SECT_PRSEMAS,
+	    provider->dofpv_prsemas)) == NULL)
+		return (-1);
+
 	strtab = (char *)(uintptr_t)(daddr + str_sec->dofs_offset);
 
 	if (provider->dofpv_name >= str_sec->dofs_size ||
@@ -15037,6 +16786,18 @@ static char buf[64];
 
 	nprobes = prb_sec->dofs_size / prb_sec->dofs_entsize;
 
+	/*
+	 * There is one semaphore address for each probe, zero if the probe
+	 * has no semaphore.
+	 */
+	if (sema_sec != NULL &&
+	    (sema_sec->dofs_entsize != sizeof (uint64_t) ||
+	    (sema_sec->dofs_offset & (sizeof (uint64_t) - 1)) ||
+	    sema_sec->dofs_size != nprobes * sizeof (uint64_t))) {
+		dtrace_dof_error(dof, "invalid semaphore section");
+		return (-1);
+	}
+
 	/*
 	 * Take a pass through the probes to check for errors.
 	 */
@@ -15166,9 +16927,13 @@ static int
 dtrace_helper_slurp(dof_hdr_t *dof, dof_helper_t *dhp)
 {
 	dtrace_helpers_t *help;
+	dtrace_helper_provider_t *hprov;
 	dtrace_vstate_t *vstate;
 	dtrace_enabling_t *enab = NULL;
-	int i, gen, rv, nhelpers = 0, nprovs = 0, destroy = 1;
+	dtrace_dofcache_t *dc = NULL;
+	dof_hdr_t *raw = NULL;
+	uint64_t hash = 0;
+	int i, gen, rv, ndesc, nhelpers = 0, nprovs = 0, destroy = 1;
 	uintptr_t daddr = (uintptr_t)dof;
 
 	ASSERT(MUTEX_HELD(&dtrace_lock));
@@ -15190,9 +16955,32 @@ HERE();
 # endif
 	vstate = &help->dthps_vstate;
 
+	/*
+	 * If another process running the same object has already given us
+	 * this DOF, share the copy we validated then.  Otherwise keep the DOF
+	 * as it was copied in, so that we can recognise it next time; the
+	 * slurp below relocates it in place.
+	 */
+	if (dhp != NULL) {
+		hash = dtrace_dofcache_hash(dof);
+
+		if ((dc = dtrace_dofcache_lookup(dof, hash)) != NULL) {
+			dtrace_dof_destroy(dof);
+			dof = dc->dtdc_dof;
+			dc->dtdc_ref++;
+			gen = help->dthps_generation++;
+			goto provide;
+		}
+
+		raw = kmem_alloc(dof->dofh_loadsz, KM_SLEEP);
+		bcopy(dof, raw, dof->dofh_loadsz);
+	}
+
 printk("helper slurp\n");
 	if ((rv = dtrace_dof_slurp(dof, vstate, NULL, &enab,
 	    dhp != NULL ? dhp->dofhp_addr : 0, B_FALSE)) != 0) {
+		if (raw != NULL)
+			dtrace_dof_destroy(raw);
 		dtrace_dof_destroy(dof);
 		return (rv);
 	}
@@ -15210,6 +16998,8 @@ printk("helper slurp\n");
 
 			if (dtrace_helper_provider_validate(dof, sec) != 0) {
 				dtrace_enabling_destroy(enab);
+				if (raw != NULL)
+					dtrace_dof_destroy(raw);
 				dtrace_dof_destroy(dof);
 				return (-1);
 			}
@@ -15245,6 +17035,8 @@ HERE();
 			 */
 			(void) dtrace_helper_destroygen(help->dthps_generation);
 			dtrace_enabling_destroy(enab);
+			if (raw != NULL)
+				dtrace_dof_destroy(raw);
 			dtrace_dof_destroy(dof);
 HERE();
 			return (-1);
@@ -15258,18 +17050,35 @@ HERE();
 		dtrace_dof_error(dof, "unmatched helpers");
 
 	gen = help->dthps_generation++;
+	ndesc = enab->dten_ndesc;
 	dtrace_enabling_destroy(enab);
 HERE();
 
-	if (dhp != NULL && nprovs > 0) {
+	if (dhp != NULL && nprovs > 0 && ndesc == 0) {
+		dc = dtrace_dofcache_create(raw, dof, hash, dhp->dofhp_addr);
+		raw = NULL;
+	}
+
+	if (raw != NULL)
+		dtrace_dof_destroy(raw);
+
+provide:
+	if (dhp != NULL && (nprovs > 0 || dc != NULL)) {
 		dhp->dofhp_dof = (uint64_t)(uintptr_t)dof;
 HERE();
-		if (dtrace_helper_provider_add(dhp, gen) == 0) {
+		if (dtrace_helper_provider_add(dhp, gen, dc) == 0) {
+			hprov = help->dthps_provs[help->dthps_nprovs - 1];
 			dmutex_exit(&dtrace_lock);
 HERE();
-			dtrace_helper_provider_register(curproc, help, dhp);
+			dtrace_helper_provider_register(curproc, help, hprov);
 			dmutex_enter(&dtrace_lock);
 
+			destroy = 0;
+		} else if (dc != NULL) {
+			/*
+			 * The cache owns the DOF.
+			 */
+			dtrace_dofcache_rele(dc);
 			destroy = 0;
 		}
 else
@@ -15342,7 +17151,7 @@ dtrace_helpers_destroy(void)
 	 */
 	if (help->dthps_maxprovs > 0) {
 		dmutex_enter(&dtrace_meta_lock);
-		if (dtrace_meta_pid != NULL) {
+		if (dtrace_meta_pid != NULL && help->dthps_provided) {
 			ASSERT(dtrace_deferred_pid == NULL);
 
 			for (i = 0; i < help->dthps_nprovs; i++) {
@@ -15355,9 +17164,13 @@ dtrace_helpers_destroy(void)
 			    help->dthps_next != NULL ||
 			    help->dthps_prev != NULL ||
 			    help == dtrace_deferred_pid);
+			ASSERT(help->dthps_lazy == 0 ||
+			    help->dthps_next != NULL ||
+			    help->dthps_prev != NULL ||
+			    help == dtrace_lazy_pid);
 
 			/*
-			 * Remove the helper from the deferred list.
+			 * Remove the helper from the deferred or lazy list.
 			 */
 			if (help->dthps_next != NULL)
 				help->dthps_next->dthps_prev = help->dthps_prev;
@@ -15367,6 +17180,10 @@ dtrace_helpers_destroy(void)
 				dtrace_deferred_pid = help->dthps_next;
 				ASSERT(help->dthps_prev == NULL);
 			}
+			if (dtrace_lazy_pid == help) {
+				dtrace_lazy_pid = help->dthps_next;
+				ASSERT(help->dthps_prev == NULL);
+			}
 
 			dmutex_exit(&dtrace_lock);
 		}
@@ -16535,6 +18352,13 @@ PRINT_CASE(DTRACEIOC_ENABLE);
 		mutex_exit(&dtrace_lock);
 		dtrace_dof_destroy(dof);
 
+		/*
+		 * Create any lazy helper providers the new enabling wants;
+		 * their probes are matched against it as they are created.
+		 */
+		if (err == 0)
+			dtrace_helper_provide_lazy(NULL);
+
 //printk("err=%d rv=%d\n", err, *rv);
 		if (err == 0) {
 			if (copy_to_user((void *) arg, &rv, sizeof rv))
@@ -16592,9 +18416,11 @@ PRINT_CASE(DTRACEIOC_ENABLE);
 
 		/*
 		 * Before we attempt to match this probe, we want to give
-		 * all providers the opportunity to provide it.
+		 * all providers the opportunity to provide it -- including
+		 * the helper providers of processes nobody has asked about.
 		 */
 		if (desc.dtpd_id == DTRACE_IDNONE) {
+			dtrace_helper_provide_lazy(&desc);
 			mutex_enter(&dtrace_provider_lock);
 			dtrace_probe_provide(&desc, NULL);
 			mutex_exit(&dtrace_provider_lock);
@@ -16765,11 +18591,108 @@ PRINT_CASE(DTRACEIOC_DOFGET);
 		return (rval == 0 ? 0 : EFAULT);
 	}
 
+	case DTRACEIOC_STACKTAB: {
+		dtrace_stackdesc_t desc;
+		dtrace_stacktab_t *stk = &state->dts_stacktab;
+		uint64_t *data;
+		uint64_t nwords = 0;
+
+PRINT_CASE(DTRACEIOC_STACKTAB);
+		if (copyin((void *)arg, &desc, sizeof (desc)) != 0)
+			RETURN(EFAULT);
+
+		/*
+		 * The table is only freed when the state is destroyed, so
+		 * we need only take a consistent look at where it ends.
+		 * Words past the end of a published stack may still be in
+		 * the process of being written; the consumer only looks up
+		 * IDs that it has seen in a snapshot, and those stacks were
+		 * complete before the ID was stored.
+		 */
+		mutex_enter(&dtrace_lock);
+		data = stk->dtstk_data;
+		desc.dtsd_next = stk->dtstk_next;
+		mutex_exit(&dtrace_lock);
+
+		if (data != NULL && desc.dtsd_offs < desc.dtsd_next)
+			nwords = MIN(desc.dtsd_next - desc.dtsd_offs,
+			    desc.dtsd_size);
+
+		if (nwords != 0 && copyout(data + desc.dtsd_offs,
+		    desc.dtsd_data, nwords * sizeof (uint64_t)) != 0)
+			RETURN(EFAULT);
+
+		if (copyout(&desc, (void *)arg, sizeof (desc)) != 0)
+			RETURN(EFAULT);
+
+		return (0);
+	}
+
+	case DTRACEIOC_SPECSTAT: {
+		dtrace_specdesc_t desc;
+		dtrace_specstat_t *stats;
+		uint32_t i, n = 0;
+		size_t size;
+		int j, err = 0;
+
+PRINT_CASE(DTRACEIOC_SPECSTAT);
+		if (copyin((void *)arg, &desc, sizeof (desc)) != 0)
+			RETURN(EFAULT);
+
+		if (desc.dtspd_first == 0)
+			RETURN(EINVAL);
+
+		/*
+		 * Bound the kernel copy; the consumer walks the IDs a chunk
+		 * at a time.
+		 */
+		desc.dtspd_count = MIN(desc.dtspd_count, 4096);
+		size = MAX(desc.dtspd_count, 1) * sizeof (dtrace_specstat_t);
+		stats = kmem_zalloc(size, KM_SLEEP);
+
+		mutex_enter(&dtrace_lock);
+		desc.dtspd_nspec = state->dts_nspeculations;
+
+		for (i = desc.dtspd_first; i <= desc.dtspd_nspec &&
+		    n < desc.dtspd_count; i++, n++) {
+			dtrace_speculation_t *spec;
+
+			spec = &state->dts_speculations[i - 1];
+			stats[n].dtss_busy = spec->dtsp_busy;
+			stats[n].dtss_unavail = spec->dtsp_unavail;
+
+			for (j = 0; j < NCPU; j++) {
+				stats[n].dtss_drops +=
+				    spec->dtsp_buffer[j].dtb_xamot_drops;
+			}
+		}
+
+		mutex_exit(&dtrace_lock);
+
+		desc.dtspd_count = n;
+
+		if (n != 0 && copyout(stats, desc.dtspd_data,
+		    n * sizeof (dtrace_specstat_t)) != 0)
+			err = EFAULT;
+
+		kmem_free(stats, size);
+
+		if (err == 0 && copyout(&desc, (void *)arg,
+		    sizeof (desc)) != 0)
+			err = EFAULT;
+
+		if (err != 0)
+			RETURN(err);
+
+		return (0);
+	}
+
 	case DTRACEIOC_AGGSNAP:
 	case DTRACEIOC_BUFSNAP: {
 		dtrace_bufdesc_t desc;
 		caddr_t cached;
 		dtrace_buffer_t *buf;
+		dtrace_optval_t topn = state->dts_options[DTRACEOPT_AGGTOPN];
 
 //PRINT_CASE(DTRACEIOC_BUFSNAP);
 		if (copyin((void *)arg, &desc, sizeof (desc)) != 0)
@@ -16882,17 +18805,60 @@ HERE();
 //int i = buf->dtb_xamot_offset;
 //printk("cpu=%d copyout..%p offset=%d\n", desc.dtbd_cpu, cp, i);
 //}
-		if (copyout(buf->dtb_xamot, desc.dtbd_data,
-		    buf->dtb_xamot_offset) != 0) {
-			mutex_exit(&dtrace_lock);
-			RETURN(EFAULT);
+		/*
+		 * Once tracing has stopped, nothing more will be aggregated,
+		 * so nothing more is held back:  every record still held in
+		 * either buffer is copied out by the next two snapshots.
+		 */
+		if (topn == DTRACEOPT_UNSET || topn <= 0 ||
+		    state->dts_activity == DTRACE_ACTIVITY_STOPPED)
+			topn = 0;
+
+		if (cmd == DTRACEIOC_AGGSNAP &&
+		    (state->dts_options[DTRACEOPT_AGGCOMPACT] !=
+		    DTRACEOPT_UNSET || topn > 0)) {
+			ssize_t csize;
+
+			if (topn > 0) {
+				dtrace_aggregate_topn(state, buf->dtb_xamot,
+				    buf->dtb_xamot_offset, (uint32_t)topn);
+			}
+
+			csize = dtrace_aggregate_snapshot(state,
+			    buf->dtb_xamot, buf->dtb_xamot_offset,
+			    desc.dtbd_data, state->dts_options[
+			    DTRACEOPT_AGGCOMPACT] != DTRACEOPT_UNSET);
+
+			if (topn > 0)
+				dtrace_aggregate_carry(state, buf);
+
+			if (csize < 0) {
+				mutex_exit(&dtrace_lock);
+				RETURN(EFAULT);
+			}
+
+			desc.dtbd_size = csize;
+		} else {
+			if (copyout(buf->dtb_xamot, desc.dtbd_data,
+			    buf->dtb_xamot_offset) != 0) {
+				mutex_exit(&dtrace_lock);
+				RETURN(EFAULT);
+			}
+
+			desc.dtbd_size = buf->dtb_xamot_offset;
 		}
 
-		desc.dtbd_size = buf->dtb_xamot_offset;
 		desc.dtbd_drops = buf->dtb_xamot_drops;
 		desc.dtbd_errors = buf->dtb_xamot_errors;
 		desc.dtbd_oldest = 0;
 
+		/*
+		 * The inactive buffer is ours until the next switch; this is
+		 * when an adaptive buffer can be resized.
+		 */
+		if (buf->dtb_flags & DTRACEBUF_ADAPTIVE)
+			dtrace_buffer_adapt(state, buf, desc.dtbd_cpu);
+
 		mutex_exit(&dtrace_lock);
 
 		/*
@@ -16970,6 +18936,9 @@ PRINT_CASE(DTRACEIOC_CONF);
 			if (state->dts_buffer[i].dtb_flags & DTRACEBUF_FULL)
 				stat.dtst_filled++;
 
+			dtrace_status_numa(&stat, &state->dts_buffer[i], i);
+			dtrace_status_numa(&stat, &state->dts_aggbuffer[i], i);
+
 			nerrs += state->dts_buffer[i].dtb_errors;
 
 			for (j = 0; j < state->dts_nspeculations; j++) {
@@ -16986,6 +18955,11 @@ PRINT_CASE(DTRACEIOC_CONF);
 		stat.dtst_specdrops_unavail = state->dts_speculations_unavail;
 		stat.dtst_stkstroverflows = state->dts_stkstroverflows;
 		stat.dtst_dblerrors = state->dts_dblerrors;
+		stat.dtst_stacktabdrops = state->dts_stacktabdrops;
+		stat.dtst_aggheld = state->dts_aggheld;
+		stat.dtst_aggunfiltered = state->dts_aggunfiltered;
+		stat.dtst_numalocal += dstate->dtds_numalocal;
+		stat.dtst_numaremote += dstate->dtds_numaremote;
 		stat.dtst_killed =
 		    (state->dts_activity == DTRACE_ACTIVITY_KILLED);
 		stat.dtst_errors = nerrs;
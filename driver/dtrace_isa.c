@@ -214,6 +214,14 @@ dtrace_getpcstack(pc_t *pcstack, int pcstack_limit, int aframes,
 	else
 		sp = (uintptr_t *) regs->r_rsp;
 
+	/***********************************************/
+	/*   If  the  kernel  has ORC tables, use them  */
+	/*   -  exact, and no false positives. Else we  */
+	/*   fall into the guess-work below.	       */
+	/***********************************************/
+	if ((depth = dtrace_unwind_kernel(pcstack, pcstack_limit, regs)) > 0)
+		goto end_stack;
+
 	/***********************************************/
 	/*   Daisy  chain the interrupt and any other  */
 	/*   stacks.  Limit  ourselves in case of bad  */
@@ -288,6 +296,7 @@ dtrace_getupcstack(uint64_t *pcstack, int pcstack_limit)
 	    (volatile uint8_t *)&cpu_core[cpu_get_id()].cpuc_dtrace_flags;
 	unsigned long *sp;
 	unsigned long *bos;
+	int	depth;
 
 	if (*flags & CPU_DTRACE_FAULT)
 		return;
@@ -300,6 +309,16 @@ dtrace_getupcstack(uint64_t *pcstack, int pcstack_limit)
 	if (pcstack >= pcstack_end)
 		return;
 
+	/***********************************************/
+	/*   Use  the  process's  unwind tables if we  */
+	/*   have  built  them  (see unwind.c). If not  */
+	/*   yet, a build is queued and we guess.      */
+	/***********************************************/
+	if ((depth = dtrace_unwind_user(pcstack, pcstack_end - pcstack)) > 0) {
+		pcstack += depth;
+		goto erase;
+	}
+
 	/***********************************************/
 	/*   Linux provides a built in function which  */
 	/*   is  good  because  stack walking is arch  */
@@ -426,6 +445,7 @@ dtrace_getupcstack(uint64_t *pcstack, int pcstack_limit)
 	}
 	}
 
+erase:
 	/***********************************************/
 	/*   Erase  anything  else  in  the buffer to  */
 	/*   avoid confusion.			       */
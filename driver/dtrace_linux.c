@@ -58,8 +58,13 @@ int dtrace_unhandled;
 module_param(dtrace_unhandled, int, 0);
 int fbt_name_opcodes;
 module_param(fbt_name_opcodes, int, 0);
+int fbt_jmp;
+module_param(fbt_jmp, int, 0);
 int grab_panic;
 module_param(grab_panic, int, 0);
+extern int dtrace_helper_lazy;	/* Set to 0 to create USDT probes at */
+				/* registration, not on first use. */
+module_param(dtrace_helper_lazy, int, 0);
 char *arg_kallsyms_lookup_name; /* Done as a string, because kernel doesnt */
 				/* like 0xfffffff12345678 as a number. */
 module_param(arg_kallsyms_lookup_name, charp, 0);
@@ -1326,6 +1331,161 @@ kmem_free(void *ptr, int size)
 		kfree(ptr);
 }
 
+/**********************************************************************/
+/*   NUMA  placement  of  per-CPU  buffers.  The  ioctl  which  sets  */
+/*   things up runs on one CPU, and plain kmem_zalloc/vmalloc give us  */
+/*   memory  from that CPU's node. On a multi-socket box, every other  */
+/*   socket then does its probe context stores across the link. These  */
+/*   let  the buffer code ask for memory near the CPU which will write  */
+/*   it.							      */
+/**********************************************************************/
+# if !defined(NUMA_NO_NODE)
+#	define	NUMA_NO_NODE	(-1)
+# endif
+
+int
+dtrace_cpu_node(processorid_t cpu)
+{
+	if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_possible(cpu))
+		return NUMA_NO_NODE;
+	return cpu_to_node(cpu);
+}
+
+/**********************************************************************/
+/*   kmem_zalloc()  on  the  node  local  to  'cpu'.  Freed with the  */
+/*   ordinary  kmem_free()  -  the  size  picks  vfree/kfree just as  */
+/*   before.							      */
+/**********************************************************************/
+void *
+kmem_zalloc_cpu(size_t size, int flags, processorid_t cpu)
+{	void *ptr;
+	int	node = dtrace_cpu_node(cpu);
+
+	if (node == NUMA_NO_NODE)
+		return kmem_zalloc(size, flags);
+
+	if (size > VMALLOC_SIZE) {
+		ptr = vmalloc_node(size, node);
+		if (ptr)
+			bzero(ptr, size);
+	} else {
+		ptr = kzalloc_node(size, flags, node);
+	}
+	if (TRACE_ALLOC || dtrace_mem_alloc)
+		dtrace_printf("kmem_zalloc_cpu(%d, cpu=%d node=%d) := %p\n", (int) size, cpu, node, ptr);
+	return ptr;
+}
+
+/**********************************************************************/
+/*   Return  1  if  the  page  holding  'addr' is on the node of the  */
+/*   given CPU, 0 if not, and -1 if we cannot tell or the box is not  */
+/*   NUMA, so the caller can leave it out of the placement counts.   */
+/**********************************************************************/
+int
+dtrace_mem_local(void *addr, processorid_t cpu)
+{	struct page *pg;
+	int	node;
+
+	if (addr == NULL || num_online_nodes() <= 1)
+		return -1;
+	if ((node = dtrace_cpu_node(cpu)) == NUMA_NO_NODE)
+		return -1;
+
+	if (is_vmalloc_addr(addr))
+		pg = vmalloc_to_page(addr);
+	else
+		pg = virt_to_page(addr);
+	if (pg == NULL)
+		return -1;
+
+	return page_to_nid(pg) == node;
+}
+
+/**********************************************************************/
+/*   The  dynamic  variable  space  is  one  region  (DTRACE_INRANGE  */
+/*   checks  against  its  base and size) carved into a hash table at  */
+/*   the  front,  then  NCPU  equal slices of chunks, one per CPU. So  */
+/*   we  cannot  just  make  NCPU  allocations.  Instead  we allocate  */
+/*   page  by  page,  from  the  node of the CPU whose slice the page  */
+/*   lands  in,  and  vmap()  the  lot into one contiguous range. The  */
+/*   page  array  goes  back to the caller as a cookie, which we need  */
+/*   to undo it.						      */
+/**********************************************************************/
+typedef struct dtrace_stripe {
+	unsigned long	ds_npages;
+	struct page	*ds_pages[1];
+} dtrace_stripe_t;
+
+static void
+dtrace_stripe_release(dtrace_stripe_t *dsp)
+{	unsigned long	i;
+
+	for (i = 0; i < dsp->ds_npages; i++) {
+		if (dsp->ds_pages[i])
+			__free_page(dsp->ds_pages[i]);
+	}
+	vfree(dsp);
+}
+
+void *
+dtrace_stripe_zalloc(size_t size, size_t start, size_t per, void **cookie)
+{	dtrace_stripe_t *dsp;
+	unsigned long	i, npages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	void	*addr;
+
+	*cookie = NULL;
+	dsp = vmalloc(sizeof *dsp + npages * sizeof(struct page *));
+	if (dsp == NULL)
+		return NULL;
+	bzero(dsp, sizeof *dsp + npages * sizeof(struct page *));
+	dsp->ds_npages = npages;
+
+	for (i = 0; i < npages; i++) {
+		size_t	off = i << PAGE_SHIFT;
+		processorid_t cpu = -1;
+		int	node;
+
+		/***********************************************/
+		/*   The  hash  table  is  shared  by all the  */
+		/*   CPUs, so let it fall where it may.	       */
+		/***********************************************/
+		if (off >= start) {
+			cpu = per ? (off - start) / per : 0;
+			if (cpu >= NCPU)
+				cpu = NCPU - 1;
+		}
+		node = dtrace_cpu_node(cpu);
+		if (node == NUMA_NO_NODE)
+			dsp->ds_pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+		else
+			dsp->ds_pages[i] = alloc_pages_node(node,
+				GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN, 0);
+		if (dsp->ds_pages[i] == NULL) {
+			dtrace_stripe_release(dsp);
+			return NULL;
+		}
+	}
+
+	if ((addr = vmap(dsp->ds_pages, npages, VM_MAP, PAGE_KERNEL)) == NULL) {
+		dtrace_stripe_release(dsp);
+		return NULL;
+	}
+
+	*cookie = dsp;
+	if (TRACE_ALLOC || dtrace_mem_alloc)
+		dtrace_printf("dtrace_stripe_zalloc(%d, %lu pages) := %p\n", (int) size, npages, addr);
+	return addr;
+}
+
+void
+dtrace_stripe_free(void *addr, void *cookie)
+{
+	if (TRACE_ALLOC || dtrace_mem_alloc)
+		dtrace_printf("dtrace_stripe_free(%p)\n", addr);
+	vunmap(addr);
+	dtrace_stripe_release(cookie);
+}
+
 int
 lx_get_curthread_id()
 {
@@ -2039,6 +2199,8 @@ proc_exit_notifier(struct notifier_block *n, unsigned long code, void *ptr)
 	sol_proc_t sol_proc;
 
 //printk("proc_exit_notifier: code=%lu ptr=%p\n", code, ptr);
+	dtrace_unwind_exit(current);
+
 	/***********************************************/
 	/*   See  if  we know this proc - if so, need  */
 	/*   to let fasttrap retire the probes.	       */
@@ -2327,6 +2489,12 @@ syms_write(struct file *file, const char __user *buf,
 		/***********************************************/
 		signal_init();
 
+		/***********************************************/
+		/*   Find  the  ORC  tables  and  the  bits we  */
+		/*   need to build user unwind tables.	       */
+		/***********************************************/
+		dtrace_unwind_init();
+
 	}
 	return orig_count;
 }
@@ -2804,6 +2972,7 @@ static struct file_operations proc_dtrace_security = {
 /** "proc/dtrace/stats" */
 static int proc_dtrace_stats_show(struct seq_file *seq, void *v)
 {	int	i;
+	dtrace_hashstat_t hs;
 	extern unsigned long cnt_0x7f;
 	extern unsigned long cnt_gpf1;
 	extern unsigned long cnt_gpf2;
@@ -2811,6 +2980,10 @@ static int proc_dtrace_stats_show(struct seq_file *seq, void *v)
 	extern unsigned long long cnt_int3_1;
 	extern unsigned long long cnt_int3_2;
 	extern unsigned long long cnt_int3_3;
+	extern unsigned long long cnt_invop_miss;
+	extern unsigned long long cnt_unwind_user;
+	extern unsigned long long cnt_unwind_user_miss;
+	extern unsigned long long cnt_unwind_build;
 	extern unsigned long cnt_ipi1;
 	extern unsigned long long cnt_probe_recursion;
 	extern unsigned long cnt_probes;
@@ -2842,6 +3015,10 @@ static int proc_dtrace_stats_show(struct seq_file *seq, void *v)
 		LONG_LONG(cnt_int3_1, "int3_1"),
 		LONG_LONG(cnt_int3_2, "int3_2(ours)"),
 		LONG_LONG(cnt_int3_3, "int3_3(reentr)"),
+		LONG_LONG(cnt_invop_miss, "invop_miss"),
+		LONG_LONG(cnt_unwind_user, "unwind_user"),
+		LONG_LONG(cnt_unwind_user_miss, "unwind_user_miss"),
+		LONG_LONG(cnt_unwind_build, "unwind_build"),
 		LONG_LONG(cnt_0x7f, "int_0x7f"),
 		LONG_LONG(cnt_gpf1, "gpf1"),
 		LONG_LONG(cnt_gpf2, "gpf2"),
@@ -2892,6 +3069,22 @@ static int proc_dtrace_stats_show(struct seq_file *seq, void *v)
 			seq_printf(seq, "%s=%d\n", stats[i].name, *(int *) stats[i].ptr);
 	}
 
+	/***********************************************/
+	/*   Shape  of  the  probe  hash tables, so we  */
+	/*   can  see how well the hash function and  */
+	/*   resizing are behaving.		       */
+	/***********************************************/
+	for (i = 0; dtrace_hash_stats(i, &hs) == 0; i++) {
+		seq_printf(seq, "hash_%s_size=%llu\n", hs.dths_name, (unsigned long long) hs.dths_size);
+		seq_printf(seq, "hash_%s_strings=%llu\n", hs.dths_name, (unsigned long long) hs.dths_nbuckets);
+		seq_printf(seq, "hash_%s_used=%llu\n", hs.dths_name, (unsigned long long) hs.dths_used);
+		seq_printf(seq, "hash_%s_maxchain=%llu\n", hs.dths_name, (unsigned long long) hs.dths_maxchain);
+		seq_printf(seq, "hash_%s_maxprobes=%llu\n", hs.dths_name, (unsigned long long) hs.dths_maxlen);
+		seq_printf(seq, "hash_%s_lookups=%llu\n", hs.dths_name, (unsigned long long) hs.dths_lookups);
+		seq_printf(seq, "hash_%s_steps=%llu\n", hs.dths_name, (unsigned long long) hs.dths_steps);
+		seq_printf(seq, "hash_%s_resizes=%llu\n", hs.dths_name, (unsigned long long) hs.dths_resizes);
+	}
+
 	return 0;
 }
 
@@ -3207,6 +3400,7 @@ static void __exit dtracedrv_exit(void)
 		return;
 	}
 
+	dtrace_unwind_fini();
 	signal_fini();
 	intr_exit();
 	dcpc_exit();
@@ -374,6 +374,7 @@ typedef struct pf_info_t {
 	int		symndx;
 	int		do_print;
 	uint8_t		*st_value;
+	uint8_t		*st_end;	/* End of the function. */
 	int		(*func_entry)(struct pf_info_t *, uint8_t *, int, int);
 	int		(*func_return)(struct pf_info_t *, uint8_t *, int);
 	int		(*func_sdt)(struct pf_info_t *, uint8_t *, int, int);
@@ -35,6 +35,10 @@ proc_t *prfind(int p);
 int	tsignal(proc_t *, int);
 void	trap(struct pt_regs *rp, caddr_t addr, processorid_t cpu);
 int	dtrace_invop(uintptr_t addr, uintptr_t *stack, uintptr_t eax, trap_instr_t *);
+void	dtrace_invop_addr_add(int (*)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *), uintptr_t);
+void	dtrace_invop_addr_remove(int (*)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *), uintptr_t);
+int	dtrace_invop_addr_shared(int (*)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *), uintptr_t, size_t);
+int	dtrace_invop_patched(uintptr_t);
 void dtrace_cpu_emulate(int instr, int opcode, struct pt_regs *regs);
 void	dtrace_print_regs(struct pt_regs *);
 void	dtrace_vprintf(const char *fmt, va_list ap);
@@ -43,12 +47,24 @@ void	dtrace_printf(const char *fmt, ...);
 int dtrace_user_probe(int, struct pt_regs *rp, caddr_t addr, processorid_t cpuid);
 void	fbt_provide_kernel(void);
 void	instr_provide_kernel(void);
+void	dtrace_unwind_init(void);
+void	dtrace_unwind_fini(void);
+int	dtrace_unwind_kernel(pc_t *, int, struct pt_regs *);
+int	dtrace_unwind_user(uint64_t *, int);
+void	dtrace_unwind_request(pid_t);
+void	dtrace_unwind_kick(void);
+void	dtrace_unwind_exit(struct task_struct *);
 
 # if !defined(kmem_alloc)
 void	*kmem_alloc(size_t, int);
 void	*kmem_zalloc(size_t, int);
 void	kmem_free(void *, int size);
 # endif
+int	dtrace_cpu_node(processorid_t);
+void	*kmem_zalloc_cpu(size_t, int, processorid_t);
+int	dtrace_mem_local(void *, processorid_t);
+void	*dtrace_stripe_zalloc(size_t, size_t, size_t, void **);
+void	dtrace_stripe_free(void *, void *);
 
 char	*dtrace_memchr(const char *, int, int);
 int	is_toxic_func(unsigned long a, const char *name);
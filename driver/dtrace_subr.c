@@ -39,36 +39,289 @@ typedef struct dtrace_invop_hdlr {
 
 dtrace_invop_hdlr_t *dtrace_invop_hdlr;
 
+/**********************************************************************/
+/*   Shared  patch-point index. Providers which plant breakpoints in  */
+/*   the  kernel  register  each  address  with dtrace_invop_addr_add */
+/*   so  that  a  trap is offered only to the handlers which own a    */
+/*   patch  point  at  that  address:  an  fbt  hit no longer pays    */
+/*   for  instr  and  prov_common, and a stray int3 (e.g. from user   */
+/*   space)  is  rejected  after one probe of the table. Handlers     */
+/*   which  never register an address are offered every trap, as      */
+/*   before.							      */
+/*   								      */
+/*   Each  handler  function  is given a bit the first time we see    */
+/*   it  (fbt  creates  probes before it adds its handler). The       */
+/*   table  is  open-addressed  with  one  entry per (address,        */
+/*   handler)  pair,  and  is read without locks from trap context:  */
+/*   an  entry's  handler bit is written before its address is        */
+/*   published,  entries never move (a removed entry just drops to    */
+/*   a  zero  reference  count), and a rebuilt table replaces the     */
+/*   old one only after dtrace_sync() has let any trap in flight      */
+/*   drain.  Updates are serialised by dtrace_invop_mtx.	      */
+/**********************************************************************/
+# define	DTRACE_INVOP_MAXHDLR	32
+# define	DTRACE_INVOP_MINSIZE	1024
+# define	DTRACE_INVOP_HASH(addr)	\
+	((uint_t) (((uint64_t) (addr) * 0x9E3779B97F4A7C15ULL) >> 32))
+
+typedef struct dtrace_invop_addr {
+	uintptr_t	dtia_addr;	/* patch point; 0 if slot is free */
+	uint32_t	dtia_mask;	/* bit of the owning handler */
+	uint32_t	dtia_ref;	/* patch points registered here */
+} dtrace_invop_addr_t;
+
+typedef struct dtrace_invop_tab {
+	int		dtit_size;	/* slots; a power of two */
+	int		dtit_used;	/* slots with an address */
+	dtrace_invop_addr_t dtit_ent[1];
+} dtrace_invop_tab_t;
+
+static dtrace_invop_tab_t *dtrace_invop_tab;
+static int (*dtrace_invop_func[DTRACE_INVOP_MAXHDLR])(uintptr_t, uintptr_t *,
+    uintptr_t, trap_instr_t *);
+static uint32_t dtrace_invop_live;	/* handlers added */
+static uint32_t dtrace_invop_indexed;	/* handlers with addresses */
+static MUTEX_DEFINE(dtrace_invop_mtx);
+unsigned long long cnt_invop_miss;
+
+/**********************************************************************/
+/*   Return the handlers with a patch point at addr.		      */
+/**********************************************************************/
+static uint32_t
+dtrace_invop_lookup(uintptr_t addr)
+{
+	dtrace_invop_tab_t *tab = dtrace_invop_tab;
+	dtrace_invop_addr_t *ent;
+	uint32_t mask = 0;
+	uintptr_t a;
+	uint_t i;
+
+	if (tab == NULL)
+		return 0;
+
+	for (i = DTRACE_INVOP_HASH(addr); ; i++) {
+		ent = &tab->dtit_ent[i & (tab->dtit_size - 1)];
+		if ((a = ent->dtia_addr) == 0)
+			return mask;
+		if (a != addr)
+			continue;
+		smp_rmb();
+		if (ent->dtia_ref)
+			mask |= ent->dtia_mask;
+	}
+}
+
+/**********************************************************************/
+/*   Map  a  handler  to its bit, allocating one if asked to. Called  */
+/*   with dtrace_invop_mtx held.				      */
+/**********************************************************************/
+static int
+dtrace_invop_bit(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *),
+    int create)
+{
+	int	i, free = -1;
+
+	for (i = 0; i < DTRACE_INVOP_MAXHDLR; i++) {
+		if (dtrace_invop_func[i] == func)
+			return i;
+		if (dtrace_invop_func[i] == NULL && free < 0)
+			free = i;
+	}
+	if (!create)
+		return -1;
+
+	if (free < 0) {
+		printk("dtrace_invop: too many invop handlers\n");
+		return -1;
+	}
+	dtrace_invop_func[free] = func;
+	return free;
+}
+
+/**********************************************************************/
+/*   Find  the  entry  for  (addr,  bit), or the free slot where it  */
+/*   would go. Called with dtrace_invop_mtx held.		      */
+/**********************************************************************/
+static dtrace_invop_addr_t *
+dtrace_invop_slot(dtrace_invop_tab_t *tab, uintptr_t addr, uint32_t mask)
+{
+	dtrace_invop_addr_t *ent;
+	uint_t i;
+
+	for (i = DTRACE_INVOP_HASH(addr); ; i++) {
+		ent = &tab->dtit_ent[i & (tab->dtit_size - 1)];
+		if (ent->dtia_addr == 0 ||
+		    (ent->dtia_addr == addr && ent->dtia_mask == mask))
+			return ent;
+	}
+}
+
+/**********************************************************************/
+/*   Replace  the table with one sized for the live entries, leaving  */
+/*   behind  those  whose reference count has dropped to zero. Keep  */
+/*   the load under a half so that lookups stay short.		      */
+/**********************************************************************/
+static void
+dtrace_invop_rebuild(void)
+{
+	dtrace_invop_tab_t *otab = dtrace_invop_tab, *ntab;
+	dtrace_invop_addr_t *ent, *nent;
+	int size = DTRACE_INVOP_MINSIZE, live = 0, i;
+
+	if (otab) {
+		for (i = 0; i < otab->dtit_size; i++) {
+			if (otab->dtit_ent[i].dtia_ref)
+				live++;
+		}
+	}
+	while (size < live * 4)
+		size <<= 1;
+
+	ntab = kmem_zalloc(sizeof *ntab + (size - 1) * sizeof *ent, KM_SLEEP);
+	ntab->dtit_size = size;
+
+	for (i = 0; otab && i < otab->dtit_size; i++) {
+		ent = &otab->dtit_ent[i];
+		if (ent->dtia_ref == 0)
+			continue;
+		nent = dtrace_invop_slot(ntab, ent->dtia_addr, ent->dtia_mask);
+		*nent = *ent;
+		ntab->dtit_used++;
+	}
+
+	smp_wmb();
+	dtrace_invop_tab = ntab;
+
+	if (otab) {
+		dtrace_sync();
+		kmem_free(otab, sizeof *otab +
+		    (otab->dtit_size - 1) * sizeof *ent);
+	}
+}
+
+/**********************************************************************/
+/*   Register  a patch point owned by the given handler. A handler's  */
+/*   first  registration  takes  it  off  the  list of handlers that  */
+/*   are offered every trap.					      */
+/**********************************************************************/
+void
+dtrace_invop_addr_add(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *),
+    uintptr_t addr)
+{
+	dtrace_invop_addr_t *ent;
+	uint32_t bit;
+	int	n;
+
+	mutex_enter(&dtrace_invop_mtx);
+	if ((n = dtrace_invop_bit(func, TRUE)) < 0) {
+		mutex_exit(&dtrace_invop_mtx);
+		return;
+	}
+	bit = 1U << n;
+
+	if (dtrace_invop_tab == NULL ||
+	    (dtrace_invop_tab->dtit_used + 1) * 2 > dtrace_invop_tab->dtit_size)
+		dtrace_invop_rebuild();
+
+	ent = dtrace_invop_slot(dtrace_invop_tab, addr, bit);
+	if (ent->dtia_addr == 0) {
+		ent->dtia_mask = bit;
+		ent->dtia_ref = 1;
+		smp_wmb();
+		ent->dtia_addr = addr;
+		dtrace_invop_tab->dtit_used++;
+	} else {
+		ent->dtia_ref++;
+	}
+
+	/***********************************************/
+	/*   Only  stop offering every trap once this  */
+	/*   address is visible in the table.	       */
+	/***********************************************/
+	smp_wmb();
+	dtrace_invop_indexed |= bit;
+
+	mutex_exit(&dtrace_invop_mtx);
+}
+
+void
+dtrace_invop_addr_remove(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *),
+    uintptr_t addr)
+{
+	dtrace_invop_addr_t *ent;
+	int	n;
+
+	mutex_enter(&dtrace_invop_mtx);
+	if ((n = dtrace_invop_bit(func, FALSE)) >= 0 && dtrace_invop_tab) {
+		ent = dtrace_invop_slot(dtrace_invop_tab, addr, 1U << n);
+		if (ent->dtia_addr != 0 && ent->dtia_ref != 0)
+			ent->dtia_ref--;
+	}
+	mutex_exit(&dtrace_invop_mtx);
+}
+
+/**********************************************************************/
+/*   Does  any  other  handler  have  a  patch point in [addr, addr +  */
+/*   len)?  Used  before  rewriting more than the first byte of an    */
+/*   instruction, which would pull it out from under them.	      */
+/**********************************************************************/
+int
+dtrace_invop_addr_shared(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *),
+    uintptr_t addr, size_t len)
+{
+	uint32_t mask = 0;
+	size_t	i;
+	int	n;
+
+	mutex_enter(&dtrace_invop_mtx);
+	for (i = 0; i < len; i++)
+		mask |= dtrace_invop_lookup(addr + i);
+	if ((n = dtrace_invop_bit(func, FALSE)) >= 0)
+		mask &= ~(1U << n);
+	mutex_exit(&dtrace_invop_mtx);
+
+	return mask != 0;
+}
+
+/**********************************************************************/
+/*   Is  addr  a  patch  point  of  any  handler?  Lockless,  for the  */
+/*   stack unwinder in probe context.				      */
+/**********************************************************************/
+int
+dtrace_invop_patched(uintptr_t addr)
+{
+	return dtrace_invop_lookup(addr) != 0;
+}
+
 /**********************************************************************/
 /*   On a breakpoint trap, see which provider or providers will take  */
 /*   the  trap.  Because of our prov provider, we can end up hitting  */
 /*   the  same  probe  instruction  from  fbt  and  prov  (or  other  */
 /*   providers).  We  need  to  let each provider have a go, not the  */
 /*   first provider, to avoid FBT covering up for a later provider.   */
+/*   The  patch-point  index  tells  us which providers those are in  */
+/*   one lookup, however many providers are loaded.		      */
 /**********************************************************************/
 int
 dtrace_invop(uintptr_t addr, uintptr_t *stack, uintptr_t eax, trap_instr_t *tinfo)
 {
-	dtrace_invop_hdlr_t *hdlr;
+	int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *);
+	uint32_t live = dtrace_invop_live;
+	uint32_t mask;
 	int rval = 0;
-static int once = TRUE;
+	int i;
 
-	/***********************************************/
-	/*   Let  us see the handler chain, so we can  */
-	/*   check  if its in the right logical order  */
-	/*   for performance reasons.		       */
-	/***********************************************/
-	if (once) {
-		once = FALSE;
-		dtrace_printf("hdlr chain:\n");
-		for (hdlr = dtrace_invop_hdlr; hdlr != NULL; hdlr = hdlr->dtih_next) {
-			dtrace_printf("  %p\n", hdlr->dtih_func);
-		}
+	mask = live & ~dtrace_invop_indexed;
+	mask = (mask | dtrace_invop_lookup(addr)) & live;
+	if (mask == 0) {
+		cnt_invop_miss++;
+		return 0;
 	}
 
-	for (hdlr = dtrace_invop_hdlr; hdlr != NULL; hdlr = hdlr->dtih_next) {
-		int	ret;
-		if ((ret = hdlr->dtih_func(addr, stack, eax, tinfo)) != 0)
+	for (i = 0; mask != 0; i++, mask >>= 1) {
+		if ((mask & 1) == 0 || (func = dtrace_invop_func[i]) == NULL)
+			continue;
+		if (func(addr, stack, eax, tinfo) != 0)
 			rval = 1;
 	}
 
@@ -79,18 +332,31 @@ void
 dtrace_invop_add(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *))
 {
 	dtrace_invop_hdlr_t *hdlr;
+	int	n;
 
 	hdlr = kmem_alloc(sizeof (dtrace_invop_hdlr_t), KM_SLEEP);
 	hdlr->dtih_func = func;
+
+	mutex_enter(&dtrace_invop_mtx);
 	hdlr->dtih_next = dtrace_invop_hdlr;
 	dtrace_invop_hdlr = hdlr;
+
+	if ((n = dtrace_invop_bit(func, TRUE)) >= 0) {
+		smp_wmb();
+		dtrace_invop_live |= 1U << n;
+	}
+	mutex_exit(&dtrace_invop_mtx);
 }
 
 void
 dtrace_invop_remove(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t *))
 {
 	dtrace_invop_hdlr_t *hdlr = dtrace_invop_hdlr, *prev = NULL;
+	dtrace_invop_addr_t *ent;
+	uint32_t bit;
+	int	i, n;
 
+	mutex_enter(&dtrace_invop_mtx);
 	for (;;) {
 		if (hdlr == NULL)
 			panic("attempt to remove non-existent invop handler");
@@ -110,6 +376,27 @@ dtrace_invop_remove(int (*func)(uintptr_t, uintptr_t *, uintptr_t, trap_instr_t
 		prev->dtih_next = hdlr->dtih_next;
 	}
 
+	/***********************************************/
+	/*   Drop  any  patch  points  the handler did  */
+	/*   not  remove itself, and wait for traps in  */
+	/*   flight  before  its  bit  is  reused  for  */
+	/*   another handler.			       */
+	/***********************************************/
+	if ((n = dtrace_invop_bit(func, FALSE)) >= 0) {
+		bit = 1U << n;
+		dtrace_invop_live &= ~bit;
+		dtrace_invop_indexed &= ~bit;
+		for (i = 0; dtrace_invop_tab &&
+		    i < dtrace_invop_tab->dtit_size; i++) {
+			ent = &dtrace_invop_tab->dtit_ent[i];
+			if (ent->dtia_mask == bit)
+				ent->dtia_ref = 0;
+		}
+		dtrace_sync();
+		dtrace_invop_func[n] = NULL;
+	}
+	mutex_exit(&dtrace_invop_mtx);
+
 	kmem_free(hdlr, sizeof (dtrace_invop_hdlr_t));
 }
 
@@ -506,6 +506,31 @@ HERE();
 	dmutex_exit(&fasttrap_cleanup_mtx);
 }
 
+/*
+ * USDT probes may come with a semaphore: a 16-bit counter in the process
+ * which the application tests to decide whether to compute the probe's
+ * arguments. We count the enabled probes which share each semaphore, so that
+ * it is non-zero exactly when at least one of them is enabled. The counter is
+ * only ever written by us, with the process held, so a read-modify-write of
+ * the process's memory is safe. If the page has gone away the application
+ * simply doesn't see the probe as enabled.
+ */
+static void
+fasttrap_semaphore_adjust(proc_t *p, fasttrap_probe_t *probe, int delta)
+{
+	uint16_t count;
+
+	if (probe->ftp_semaphore == 0 ||
+	    uread(p, &count, sizeof (count), probe->ftp_semaphore) != 0)
+		return;
+
+	if (delta < 0 && count == 0)
+		return;
+
+	count += delta;
+	(void) uwrite(p, &count, sizeof (count), probe->ftp_semaphore);
+}
+
 /*
  * This is called from cfork() via dtrace_fasttrap_fork(). The child
  * process's address space is (roughly) a copy of the parent process's so
@@ -544,7 +569,9 @@ printk("in fasttrap_fork\n");
 
 	/*
 	 * Iterate over every tracepoint looking for ones that belong to the
-	 * parent process, and remove each from the child process.
+	 * parent process, and remove each from the child process. The child
+	 * also inherits the parent's semaphore counts, which describe the
+	 * parent's probes rather than its own, so clear those too.
 	 */
 	for (i = 0; i < fasttrap_tpoints.fth_nent; i++) {
 		fasttrap_tracepoint_t *tp;
@@ -554,10 +581,21 @@ printk("in fasttrap_fork\n");
 		for (tp = bucket->ftb_data; tp != NULL; tp = tp->ftt_next) {
 			if (tp->ftt_pid == ppid &&
 			    tp->ftt_proc->ftpc_acount != 0) {
+				fasttrap_id_t *id;
+				uint16_t zero = 0;
 				int ret = fasttrap_tracepoint_remove(cp, tp);
 				ret = ret; // avoid compiler warning
 				ASSERT(ret == 0);
 
+				for (id = tp->ftt_ids; id != NULL;
+				    id = id->fti_next) {
+					if (id->fti_probe->ftp_semaphore != 0) {
+						(void) uwrite(cp, &zero,
+						    sizeof (zero), id->fti_probe->
+						    ftp_semaphore);
+					}
+				}
+
 				/*
 				 * The count of active providers can only be
 				 * decremented (i.e. to zero) during exec,
@@ -1062,6 +1100,12 @@ fasttrap_pid_enable(void *arg, dtrace_id_t id, void *parg)
 	if (probe->ftp_prov->ftp_retired)
 		return 0;
 
+	/*
+	 * Get the unwind tables for ustack() built now, rather than on
+	 * the first probe to fire.
+	 */
+	dtrace_unwind_request(probe->ftp_pid);
+
 	/*
 	 * If we can't find the process, it may be that we're in the context of
 	 * a fork in which the traced process is being born and we're copying
@@ -1144,6 +1188,8 @@ HERE();
 		}
 	}
 
+	fasttrap_semaphore_adjust(p, probe, 1);
+
 	dmutex_enter(&p->p_lock);
 	sprunlock(p);
 
@@ -1186,6 +1232,9 @@ HERE();
 		for (i = 0; i < probe->ftp_ntps; i++) {
 			fasttrap_tracepoint_disable(p, probe, i);
 		}
+
+		if (p != NULL)
+			fasttrap_semaphore_adjust(p, probe, -1);
 	}
 
 HERE();
@@ -2178,6 +2227,7 @@ HERE();
 	pp->ftp_nargs = dhpb->dthpb_xargc;
 	pp->ftp_xtypes = dhpb->dthpb_xtypes;
 	pp->ftp_ntypes = dhpb->dthpb_ntypes;
+	pp->ftp_semaphore = dhpb->dthpb_semaphore;
 
 	/*
 	 * First create a tracepoint for each actual point of interest.
@@ -2255,6 +2305,101 @@ static dtrace_mops_t fasttrap_mops = {
 	fasttrap_meta_remove
 };
 
+/*
+ * Copy in and create the probe described by the spec at uprobe, which must
+ * lie within the avail bytes there.  The size of the spec is returned in
+ * *sizep so that callers walking a packed array can find the next one.
+ */
+static int
+fasttrap_makeprobe(fasttrap_probe_spec_t *uprobe, size_t avail, cred_t *cr,
+    size_t *sizep)
+{
+	fasttrap_probe_spec_t *probe;
+	uint64_t noffs;
+	size_t size;
+	int ret;
+	char *c;
+
+	if (copyin(&uprobe->ftps_noffs, &noffs,
+	    sizeof (uprobe->ftps_noffs)))
+		return (EFAULT);
+
+	/*
+	 * Probes must have at least one tracepoint.
+	 */
+	if (noffs == 0)
+		return (EINVAL);
+
+	size = sizeof (fasttrap_probe_spec_t) +
+	    sizeof (probe->ftps_offs[0]) * (noffs - 1);
+
+	if (size > 1024 * 1024)
+		return (ENOMEM);
+
+	if (size > avail)
+		return (EINVAL);
+
+	*sizep = size;
+
+	probe = kmem_alloc(size, KM_SLEEP);
+
+	if (copyin(uprobe, probe, size) != 0 ||
+	    probe->ftps_noffs != noffs) {
+		kmem_free(probe, size);
+		return (EFAULT);
+	}
+
+	/*
+	 * Verify that the function and module strings contain no
+	 * funny characters.
+	 */
+	for (c = &probe->ftps_func[0]; *c != '\0'; c++) {
+		if (*c < 0x20 || 0x7f <= *c) {
+			ret = EINVAL;
+			goto err;
+		}
+	}
+
+	for (c = &probe->ftps_mod[0]; *c != '\0'; c++) {
+		if (*c < 0x20 || 0x7f <= *c) {
+			ret = EINVAL;
+			goto err;
+		}
+	}
+
+	if (!PRIV_POLICY_CHOICE(cr, PRIV_ALL, B_FALSE)) {
+		proc_t *p;
+		pid_t pid = probe->ftps_pid;
+
+		dmutex_enter(&pidlock);
+		/*
+		 * Report an error if the process doesn't exist
+		 * or is actively being birthed.
+		 */
+		if ((p = prfind(pid)) == NULL || p->p_stat == SIDL) {
+			dmutex_exit(&pidlock);
+			ret = ESRCH;
+			goto err;
+		}
+		dmutex_enter(&p->p_lock);
+		dmutex_exit(&pidlock);
+
+		if ((ret = priv_proc_cred_perm(cr, p, NULL,
+		    VREAD | VWRITE)) != 0) {
+			dmutex_exit(&p->p_lock);
+			goto err;
+		}
+
+		dmutex_exit(&p->p_lock);
+	}
+
+	ret = fasttrap_add_probe(probe);
+err:
+	kmem_free(probe, size);
+
+	return (ret);
+}
+
 # if defined(sun)
 /*ARGSUSED*/
 static int
@@ -2277,83 +2422,37 @@ fasttrap_ioctl(struct file *fp, int cmd, intptr_t arg, int md, cred_t *cr, int *
 		return (EAGAIN);
 
 	if (cmd == FASTTRAPIOC_MAKEPROBE) {
-		fasttrap_probe_spec_t *uprobe = (void *)arg;
-		fasttrap_probe_spec_t *probe;
-		uint64_t noffs;
 		size_t size;
-		int ret;
-		char *c;
-
-		if (copyin(&uprobe->ftps_noffs, &noffs,
-		    sizeof (uprobe->ftps_noffs)))
-			return (EFAULT);
-
-		/*
-		 * Probes must have at least one tracepoint.
-		 */
-		if (noffs == 0)
-			return (EINVAL);
 
-		size = sizeof (fasttrap_probe_spec_t) +
-		    sizeof (probe->ftps_offs[0]) * (noffs - 1);
+		return (fasttrap_makeprobe((void *)arg, 1024 * 1024, cr,
+		    &size));
 
-		if (size > 1024 * 1024)
-			return (ENOMEM);
+	} else if (cmd == FASTTRAPIOC_MAKEPROBES) {
+		fasttrap_probe_batch_t batch;
+		uintptr_t uaddr;
+		size_t left, size;
+		int ret = 0;
 
-		probe = kmem_alloc(size, KM_SLEEP);
-
-		if (copyin(uprobe, probe, size) != 0 ||
-		    probe->ftps_noffs != noffs) {
-			kmem_free(probe, size);
+		if (copyin((void *)arg, &batch, sizeof (batch)) != 0)
 			return (EFAULT);
-		}
-
-		/*
-		 * Verify that the function and module strings contain no
-		 * funny characters.
-		 */
-		for (c = &probe->ftps_func[0]; *c != '\0'; c++) {
-			if (*c < 0x20 || 0x7f <= *c) {
-				ret = EINVAL;
-				goto err;
-			}
-		}
-
-		for (c = &probe->ftps_mod[0]; *c != '\0'; c++) {
-			if (*c < 0x20 || 0x7f <= *c) {
-				ret = EINVAL;
-				goto err;
-			}
-		}
-
-		if (!PRIV_POLICY_CHOICE(cr, PRIV_ALL, B_FALSE)) {
-			proc_t *p;
-			pid_t pid = probe->ftps_pid;
 
-			dmutex_enter(&pidlock);
-			/*
-			 * Report an error if the process doesn't exist
-			 * or is actively being birthed.
-			 */
-			if ((p = prfind(pid)) == NULL || p->p_stat == SIDL) {
-				dmutex_exit(&pidlock);
-				return (ESRCH);
-			}
-			dmutex_enter(&p->p_lock);
-			dmutex_exit(&pidlock);
+		uaddr = (uintptr_t)batch.ftpb_specs;
+		left = batch.ftpb_size;
 
-			if ((ret = priv_proc_cred_perm(cr, p, NULL,
-			    VREAD | VWRITE)) != 0) {
-				dmutex_exit(&p->p_lock);
-				return (ret);
-			}
+		for (batch.ftpb_ndone = 0; batch.ftpb_ndone < batch.ftpb_nspecs;
+		    batch.ftpb_ndone++) {
+			if ((ret = fasttrap_makeprobe((void *)uaddr, left, cr,
+			    &size)) != 0)
+				break;
 
-			dmutex_exit(&p->p_lock);
+			uaddr += size;
+			left -= size;
 		}
 
-		ret = fasttrap_add_probe(probe);
-err:
-		kmem_free(probe, size);
+		if (copyout(&batch.ftpb_ndone,
+		    &((fasttrap_probe_batch_t *)arg)->ftpb_ndone,
+		    sizeof (batch.ftpb_ndone)) != 0 && ret == 0)
+			ret = EFAULT;
 
 		return (ret);
 
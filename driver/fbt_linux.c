@@ -120,6 +120,11 @@ typedef struct fbt_probe {
 	unsigned int	fbtp_fired;
 //	int		fbtp_primary;
 	struct fbt_probe *fbtp_next;
+	uint8_t		fbtp_jmplen;	/* Bytes a jump would displace, 0 if unsafe */
+	uint8_t		fbtp_jmpstate;	/* FBT_JMP_xxx */
+	uint8_t		fbtp_jmpqueued;
+	uint8_t		*fbtp_tramp;	/* Jump probe trampoline */
+	struct fbt_probe *fbtp_jmpnext;	/* fbt_jmp_queue link */
 # if defined(__arm__)
 	/***********************************************/
 	/*   Because  ARM doesnt handle a single-step  */
@@ -146,6 +151,20 @@ static int			invop_loaded;
 
 extern int dtrace_unhandled;
 extern int fbt_name_opcodes;
+extern int fbt_jmp;
+
+/**********************************************************************/
+/*   State of a jump probe (see fbt_jmp_enable).		      */
+/**********************************************************************/
+# define	FBT_JMP_NONE		0	/* INT3 only */
+# define	FBT_JMP_ARMING		1	/* INT3 down, jump to follow */
+# define	FBT_JMP_ARMED		2	/* Jump in place */
+# define	FBT_JMP_DISARMING	3	/* Jump in place, to be removed */
+
+# if defined(__amd64)
+extern void fbt_jmp_template(void);
+extern int fbt_jmp_template_size;
+# endif
 
 static void fbt_provide_function(struct modctl *mp, 
     	par_module_t *pmp,
@@ -192,13 +211,43 @@ fbt_get_instr_buf(instr_t *addr)
 }
 # endif
 /**********************************************************************/
+/*   Fire  an  entry  probe.  Called  from  the INT3 handler or from  */
+/*   the jump trampoline; both present us with a pt_regs.	      */
+/**********************************************************************/
+static void
+fbt_probe_entry(fbt_probe_t *fbt, struct pt_regs *ptregs)
+{
+	uintptr_t stack0, stack1, stack2, stack3, stack4;
+
+	/*
+	 * When accessing the arguments on the stack,
+	 * we must protect against accessing beyond
+	 * the stack.  We can safely set NOFAULT here
+	 * -- we know that interrupts are already
+	 * disabled.
+	 */
+	DTRACE_CPUFLAG_SET(CPU_DTRACE_NOFAULT);
+	CPU->cpu_dtrace_caller = ptregs->r_pc;
+	stack0 = ptregs->c_arg0;
+	stack1 = ptregs->c_arg1;
+	stack2 = ptregs->c_arg2;
+	stack3 = ptregs->c_arg3;
+	stack4 = ptregs->c_arg4;
+	DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_NOFAULT |
+	    CPU_DTRACE_BADADDR);
+
+	dtrace_probe(fbt->fbtp_id, stack0, stack1,
+	    stack2, stack3, stack4);
+
+	CPU->cpu_dtrace_caller = NULL;
+}
+/**********************************************************************/
 /*   Here  from  INT3 interrupt context to see if the address we hit  */
 /*   is one of ours.						      */
 /**********************************************************************/
 static int
 fbt_invop(uintptr_t addr, uintptr_t *stack, uintptr_t rval, trap_instr_t *tinfo)
 {
-	uintptr_t stack0, stack1, stack2, stack3, stack4;
 	fbt_probe_t *fbt = fbt_probetab[FBT_ADDR2NDX(addr)];
 
 //HERE();
@@ -237,32 +286,21 @@ fbt_invop(uintptr_t addr, uintptr_t *stack, uintptr_t rval, trap_instr_t *tinfo)
 //printk("fbt: opc=%p %p\n", tinfo->t_opcode, fbt->fbtp_savedval);
 			tinfo->t_inslen = fbt->fbtp_inslen;
 			tinfo->t_modrm = fbt->fbtp_modrm;
+# if defined(__amd64)
+			/***********************************************/
+			/*   Bytes  after  the  first may already be  */
+			/*   part of a jump, so continue in the copy  */
+			/*   kept in the trampoline.		       */
+			/***********************************************/
+			if (fbt->fbtp_jmpstate != FBT_JMP_NONE)
+				tinfo->t_resume = (uintptr_t) fbt->fbtp_tramp +
+				    fbt_jmp_template_size;
+# endif
 			if (!tinfo->t_doprobe)
 				return fbt->fbtp_rval;
 			fbt->fbtp_fired++;
 			if (fbt->fbtp_roffset == 0) {
-				struct pt_regs *ptregs = (struct pt_regs *) stack;
-				/*
-				 * When accessing the arguments on the stack,
-				 * we must protect against accessing beyond
-				 * the stack.  We can safely set NOFAULT here
-				 * -- we know that interrupts are already
-				 * disabled.
-				 */
-				DTRACE_CPUFLAG_SET(CPU_DTRACE_NOFAULT);
-				CPU->cpu_dtrace_caller = ptregs->r_pc;
-				stack0 = ptregs->c_arg0;
-				stack1 = ptregs->c_arg1;
-				stack2 = ptregs->c_arg2;
-				stack3 = ptregs->c_arg3;
-				stack4 = ptregs->c_arg4;
-				DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_NOFAULT |
-				    CPU_DTRACE_BADADDR);
-
-				dtrace_probe(fbt->fbtp_id, stack0, stack1,
-				    stack2, stack3, stack4);
-
-				CPU->cpu_dtrace_caller = NULL;
+				fbt_probe_entry(fbt, (struct pt_regs *) stack);
 			} else {
 #ifdef __amd64
 				/*
@@ -289,6 +327,717 @@ fbt_invop(uintptr_t addr, uintptr_t *stack, uintptr_t rval, trap_instr_t *tinfo)
 
 	return (0);
 }
+# if defined(__amd64)
+/**********************************************************************/
+/*   Jump  probes  (fbt_jmp=1).  An  INT3  costs  a  trap,  a single  */
+/*   step  trap  and  all the notifier-chain work in between. For an  */
+/*   entry  probe  whose  first few instructions can be moved, we do  */
+/*   what  ftrace and optimised kprobes do: replace them with a JMP  */
+/*   to  a  per-probe  trampoline which saves a pt_regs, calls us,  */
+/*   restores,  executes  the  displaced  instructions and jumps back  */
+/*   into the function.						      */
+/*   								      */
+/*   Slot layout:						      */
+/*   								      */
+/*   	[fbt_jmp_template][displaced][jmp *0(%rip)][.quad back]	      */
+/*   								      */
+/*   We  never write five bytes atomically. The INT3 goes down first  */
+/*   (and  any  CPU  hitting  it  resumes  in the displaced copy, see  */
+/*   t_resume),  we  wait  for  every  task  to  leave  the  window,  */
+/*   write  the  rel32 and then the opcode, with a dtrace_sync() after  */
+/*   each  step.  Disarming  is  the  reverse.  Arming is batched from  */
+/*   a  timeout  so  a  wide  enabling pays for one RCU-tasks grace  */
+/*   period rather than one per probe.				      */
+/**********************************************************************/
+# define	FBT_JMP_OPCODE		0xe9
+# define	FBT_JMP_LEN		5
+# define	FBT_JMP_MAXDISP		16
+# define	FBT_JMP_SLOT		256
+# define	FBT_JMP_CHUNK		(64 * 1024)
+# define	FBT_JMP_MAGIC		0x123456789abcdef0ULL
+# define	FBT_JMP_INDIRECT	((uint8_t *) -1)
+/**********************************************************************/
+/*   Free/limbo  list  link.  Kept  at the end of the slot, away from  */
+/*   the code, in case a preempted task is still inside it.	      */
+/**********************************************************************/
+# define	FBT_JMP_LINK(slot) \
+	(*(uint8_t **) ((slot) + FBT_JMP_SLOT - sizeof(uint8_t *)))
+
+extern int dtrace_int_disable;
+
+static MUTEX_DEFINE(fbt_jmp_mtx);
+static int	fbt_jmp_ok = -1;
+static int	fbt_jmp_magic;		/* Offset of FBT_JMP_MAGIC in template */
+static fbt_probe_t *fbt_jmp_queue;
+static timeout_id_t fbt_jmp_timeout;
+static uint8_t	*fbt_jmp_chunks;
+static int	fbt_jmp_chunkused;
+static uint8_t	*fbt_jmp_free;
+static uint8_t	*fbt_jmp_limbo;
+static int	fbt_jmp_pinned;
+static uint8_t	*fbt_thunk_start;
+static uint8_t	*fbt_thunk_end;
+static void	*(*fbt_module_alloc)(unsigned long);
+static void	(*fbt_module_memfree)(void *);
+static int	(*fbt_set_memory_x)(unsigned long, int);
+static int	(*fbt_set_memory_nx)(unsigned long, int);
+static void	(*fbt_synchronize_rcu_tasks)(void);
+
+void fbt_jmp_probe(fbt_probe_t *fbt, struct pt_regs *regs);
+static void fbt_jmp_optimize(void *);
+
+/**********************************************************************/
+/*   Trampoline  template. Builds a pt_regs on the stack in the same  */
+/*   layout the INT3 handler sees, and calls fbt_jmp_probe(fbt, regs).  */
+/*   The magic is replaced by the fbt_probe_t in each copy.	      */
+/**********************************************************************/
+void
+fbt_jmp_dummy(void)
+{
+	__asm(
+		FUNCTION(fbt_jmp_template)
+		"sub $16,%rsp\n"	// ss, sp
+		"pushfq\n"
+		"sub $24,%rsp\n"	// cs, ip, orig_ax
+		"push %rdi\n"
+		"push %rsi\n"
+		"push %rdx\n"
+		"push %rcx\n"
+		"push %rax\n"
+		"push %r8\n"
+		"push %r9\n"
+		"push %r10\n"
+		"push %r11\n"
+		"push %rbx\n"
+		"push %rbp\n"
+		"push %r12\n"
+		"push %r13\n"
+		"push %r14\n"
+		"push %r15\n"
+		"mov %rsp,%rsi\n"
+		"movabs $0x123456789abcdef0,%rdi\n"
+		"movabs $fbt_jmp_probe,%rax\n"
+		"call *%rax\n"
+		"pop %r15\n"
+		"pop %r14\n"
+		"pop %r13\n"
+		"pop %r12\n"
+		"pop %rbp\n"
+		"pop %rbx\n"
+		"pop %r11\n"
+		"pop %r10\n"
+		"pop %r9\n"
+		"pop %r8\n"
+		"pop %rax\n"
+		"pop %rcx\n"
+		"pop %rdx\n"
+		"pop %rsi\n"
+		"pop %rdi\n"
+		"add $24,%rsp\n"
+		"popfq\n"
+		"add $16,%rsp\n"
+		"1:\n"
+		END_FUNCTION(fbt_jmp_template)
+		"fbt_jmp_template_size: .long 1b-fbt_jmp_template\n"
+		);
+}
+/**********************************************************************/
+/*   Called from the trampoline. Make the pt_regs look like the INT3  */
+/*   one so stack(), regs[] and arg0..4 behave identically.	      */
+/**********************************************************************/
+void
+fbt_jmp_probe(fbt_probe_t *fbt, struct pt_regs *regs)
+{	cpu_core_t *this_cpu;
+	struct pt_regs *old_regs;
+	unsigned long flags;
+
+	if (!fbt->fbtp_enabled || dtrace_int_disable)
+		return;
+
+	local_irq_save(flags);
+	this_cpu = cpu_get_this();
+	if (this_cpu->cpuc_mode != CPUC_MODE_IDLE) {
+		local_irq_restore(flags);
+		return;
+	}
+
+	regs->r_pc = (unsigned long) (fbt->fbtp_patchpoint + 1);
+	regs->r_sp = (unsigned long) (regs + 1);
+	regs->r_cs = __KERNEL_CS;
+	regs->r_ss = __KERNEL_DS;
+	regs->r_trapno = -1;
+
+	old_regs = this_cpu->cpuc_regs;
+	this_cpu->cpuc_regs = regs;
+	fbt->fbtp_fired++;
+	fbt_probe_entry(fbt, regs);
+	this_cpu->cpuc_regs = old_regs;
+
+	local_irq_restore(flags);
+}
+/**********************************************************************/
+/*   Skip legacy and REX prefixes.				      */
+/**********************************************************************/
+static uint8_t *
+fbt_jmp_opcode(uint8_t *ip, int len)
+{	uint8_t	*end = ip + len;
+
+	while (ip < end - 1) {
+		switch (*ip) {
+		  case 0x26: case 0x2e: case 0x36: case 0x3e:
+		  case 0x64: case 0x65: case 0x66: case 0x67:
+		  case 0xf0: case 0xf2: case 0xf3:
+			ip++;
+			continue;
+		}
+		if ((*ip & 0xf0) == 0x40) {
+			ip++;
+			continue;
+		}
+		break;
+	}
+	return ip;
+}
+/**********************************************************************/
+/*   Where  does  this  instruction branch to? NULL if it doesnt, or  */
+/*   FBT_JMP_INDIRECT if we cannot know (jump tables, retpolines).    */
+/**********************************************************************/
+static uint8_t *
+fbt_jmp_target(uint8_t *ip, int len)
+{	uint8_t	*op = fbt_jmp_opcode(ip, len);
+	uint8_t	*target;
+
+	if ((*op >= 0x70 && *op <= 0x7f) || (*op >= 0xe0 && *op <= 0xe3) ||
+	    *op == 0xeb)
+		return ip + len + (int8_t) op[1];
+
+	if (*op == 0xe8 || *op == 0xe9)
+		target = ip + len + *(int32_t *) (op + 1);
+	else if (*op == 0x0f && op[1] >= 0x80 && op[1] <= 0x8f)
+		target = ip + len + *(int32_t *) (op + 2);
+	else if (*op == 0xff && ((op[1] >> 3) & 7) >= 4 && ((op[1] >> 3) & 7) <= 5)
+		return FBT_JMP_INDIRECT;
+	else
+		return NULL;
+
+	/***********************************************/
+	/*   A  jump  into  a retpoline thunk is just  */
+	/*   an indirect jump.			       */
+	/***********************************************/
+	if (*op != 0xe8 && target >= fbt_thunk_start && target < fbt_thunk_end)
+		return FBT_JMP_INDIRECT;
+	return target;
+}
+/**********************************************************************/
+/*   Can  this  instruction  run from the trampoline instead of from  */
+/*   where it is?						      */
+/**********************************************************************/
+static int
+fbt_jmp_relocatable(uint8_t *ip, int len, int modrm)
+{	uint8_t	*op = fbt_jmp_opcode(ip, len);
+
+	if (modrm >= 0 && (ip[modrm] & 0xc7) == 0x05)
+		return FALSE;
+	if (fbt_jmp_target(ip, len) != NULL)
+		return FALSE;
+
+	switch (*op) {
+	  case 0x0f:
+	  	switch (op[1]) {
+		  case 0x05: case 0x07: case 0x0b: case 0x1e:
+		  case 0x34: case 0x35:
+		  	return FALSE;
+		}
+		break;
+	  case 0x9a: case 0xc2: case 0xc3: case 0xca: case 0xcb:
+	  case 0xcc: case 0xcd: case 0xce: case 0xcf:
+	  case 0xea: case 0xf4: case 0xfa: case 0xfb:
+	  	return FALSE;
+	  case 0xff:
+	  	if (((op[1] >> 3) & 7) >= 2 && ((op[1] >> 3) & 7) <= 5)
+			return FALSE;
+		break;
+	}
+	return TRUE;
+}
+/**********************************************************************/
+/*   Work  out  how  many  bytes  a jump at instr would displace, or  */
+/*   zero  if  it  isnt  safe. Nothing in the function may branch into  */
+/*   the  middle  of  the  displaced  instructions, so we decode the  */
+/*   whole function looking for branch targets.			      */
+/**********************************************************************/
+static int
+fbt_jmp_window(uint8_t *start, uint8_t *end, uint8_t *instr)
+{	uint8_t	*ip, *target;
+	int	len, size, modrm;
+
+	if (start == NULL || end == NULL)
+		return 0;
+
+	for (len = 0, ip = instr; len < FBT_JMP_LEN; ip += size, len += size) {
+		if (ip >= end || *ip == 0xcc)
+			return 0;
+		if ((size = dtrace_instr_size_modrm(ip, &modrm)) <= 0)
+			return 0;
+		if (len + size > FBT_JMP_MAXDISP || ip + size > end)
+			return 0;
+		if (!fbt_jmp_relocatable(ip, size, modrm))
+			return 0;
+	}
+
+	for (ip = start; ip < end; ip += size) {
+		/***********************************************/
+		/*   INT3  padding  to  the end is fine, but  */
+		/*   one in the middle may be someone elses  */
+		/*   breakpoint and we would lose sync.	       */
+		/***********************************************/
+		if (*ip == 0xcc) {
+			while (ip < end && *ip == 0xcc)
+				ip++;
+			if (ip < end)
+				return 0;
+			break;
+		}
+		if ((size = dtrace_instr_size(ip)) <= 0)
+			return 0;
+		target = fbt_jmp_target(ip, size);
+		if (target == FBT_JMP_INDIRECT)
+			return 0;
+		if (target > instr && target < instr + len)
+			return 0;
+	}
+	return len;
+}
+/**********************************************************************/
+/*   Resolve what we need from the kernel, once.		      */
+/**********************************************************************/
+static int
+fbt_jmp_init(void)
+{	uint8_t	*cp;
+
+	if (fbt_jmp_ok >= 0)
+		return fbt_jmp_ok;
+
+	fbt_jmp_ok = FALSE;
+	fbt_module_alloc = get_proc_addr("module_alloc");
+	if ((fbt_module_memfree = get_proc_addr("module_memfree")) == NULL)
+		fbt_module_memfree = (void (*)(void *)) vfree;
+	fbt_set_memory_x = get_proc_addr("set_memory_x");
+	fbt_set_memory_nx = get_proc_addr("set_memory_nx");
+	fbt_synchronize_rcu_tasks = get_proc_addr("synchronize_rcu_tasks");
+	fbt_thunk_start = get_proc_addr("__indirect_thunk_start");
+	fbt_thunk_end = get_proc_addr("__indirect_thunk_end");
+
+	if (fbt_module_alloc == NULL || fbt_synchronize_rcu_tasks == NULL) {
+		printk("fbt: jump probes need module_alloc and synchronize_rcu_tasks - using INT3\n");
+		return FALSE;
+	}
+
+	for (cp = (uint8_t *) fbt_jmp_template; 
+	     cp + 8 <= (uint8_t *) fbt_jmp_template + fbt_jmp_template_size; cp++) {
+		if (*(unsigned long long *) cp == FBT_JMP_MAGIC) {
+			fbt_jmp_magic = cp - (uint8_t *) fbt_jmp_template;
+			break;
+		}
+	}
+	if (fbt_jmp_magic == 0 ||
+	    fbt_jmp_template_size + FBT_JMP_MAXDISP + 14 > FBT_JMP_SLOT - sizeof(uint8_t *)) {
+		printk("fbt: bad jump probe template - using INT3\n");
+		return FALSE;
+	}
+	fbt_jmp_ok = TRUE;
+	return TRUE;
+}
+/**********************************************************************/
+/*   Allocate  a  trampoline  slot.  Slots  are carved out of module  */
+/*   space so they are within rel32 reach of the kernel text.	      */
+/**********************************************************************/
+static uint8_t *
+fbt_jmp_alloc(void)
+{	uint8_t	*slot;
+
+	if ((slot = fbt_jmp_free) != NULL) {
+		fbt_jmp_free = FBT_JMP_LINK(slot);
+		return slot;
+	}
+
+	if (fbt_jmp_chunks == NULL || fbt_jmp_chunkused >= FBT_JMP_CHUNK) {
+		/***********************************************/
+		/*   First slot of each chunk is the header,  */
+		/*   linking the chunks for fbt_jmp_release.  */
+		/***********************************************/
+		if ((slot = fbt_module_alloc(FBT_JMP_CHUNK)) == NULL)
+			return NULL;
+		if (fbt_set_memory_x)
+			fbt_set_memory_x((unsigned long) slot, FBT_JMP_CHUNK >> PAGE_SHIFT);
+		FBT_JMP_LINK(slot) = fbt_jmp_chunks;
+		fbt_jmp_chunks = slot;
+		fbt_jmp_chunkused = FBT_JMP_SLOT;
+	}
+	slot = fbt_jmp_chunks + fbt_jmp_chunkused;
+	fbt_jmp_chunkused += FBT_JMP_SLOT;
+	return slot;
+}
+/**********************************************************************/
+/*   Fill in the trampoline for a probe.			      */
+/**********************************************************************/
+static int
+fbt_jmp_build(fbt_probe_t *fbt)
+{	uint8_t	*tramp, *cp;
+	long	disp;
+	int	len = fbt->fbtp_jmplen;
+
+	if ((tramp = fbt_jmp_alloc()) == NULL)
+		return FALSE;
+
+	disp = (long) tramp - (long) (fbt->fbtp_patchpoint + FBT_JMP_LEN);
+	if (disp != (int32_t) disp) {
+		FBT_JMP_LINK(tramp) = fbt_jmp_free;
+		fbt_jmp_free = tramp;
+		return FALSE;
+	}
+
+	memcpy(tramp, fbt_jmp_template, fbt_jmp_template_size);
+	*(fbt_probe_t **) (tramp + fbt_jmp_magic) = fbt;
+
+	cp = tramp + fbt_jmp_template_size;
+	memcpy(cp, fbt->fbtp_patchpoint, len);
+	cp[0] = fbt->fbtp_savedval;
+	cp += len;
+	cp[0] = 0xff;		/* jmp *0(%rip) */
+	cp[1] = 0x25;
+	*(int32_t *) (cp + 2) = 0;
+	*(uint8_t **) (cp + 6) = fbt->fbtp_patchpoint + len;
+
+	fbt->fbtp_tramp = tramp;
+	return TRUE;
+}
+/**********************************************************************/
+/*   Write into kernel text.					      */
+/**********************************************************************/
+static void
+fbt_jmp_poke(uint8_t *addr, void *buf, int len)
+{	int	npages = ((unsigned long) addr & ~PAGE_MASK) + len > PAGE_SIZE ? 2 : 1;
+
+	if (memory_set_rw(addr, npages, TRUE))
+		dtrace_memcpy(addr, buf, len);
+}
+static void
+fbt_jmp_queue_probe(fbt_probe_t *fbt)
+{
+	if (!fbt->fbtp_jmpqueued) {
+		fbt->fbtp_jmpqueued = 1;
+		fbt->fbtp_jmpnext = fbt_jmp_queue;
+		fbt_jmp_queue = fbt;
+	}
+	if (fbt_jmp_timeout == 0)
+		fbt_jmp_timeout = timeout(fbt_jmp_optimize, NULL, hz);
+}
+/**********************************************************************/
+/*   Take  a  list  of armed probes back to their original bytes. Called  */
+/*   with fbt_jmp_mtx held.					      */
+/**********************************************************************/
+static void
+fbt_jmp_disarm(fbt_probe_t *list)
+{	fbt_probe_t *fbt, *next, *todo = NULL;
+	uint8_t	patchval = FBT_PATCHVAL;
+
+	for (fbt = list; fbt; fbt = next) {
+		next = fbt->fbtp_jmpnext;
+		/***********************************************/
+		/*   Somebody  has planted a breakpoint over  */
+		/*   our  jump  and  saved  the  JMP as their  */
+		/*   original  instruction.  Leave it - the  */
+		/*   trampoline is a passthrough while we are  */
+		/*   disabled, and it can never be freed.      */
+		/***********************************************/
+		if (*fbt->fbtp_patchpoint != FBT_JMP_OPCODE) {
+			fbt->fbtp_jmpstate = FBT_JMP_ARMED;
+			fbt_jmp_pinned++;
+			continue;
+		}
+		fbt->fbtp_jmpnext = todo;
+		todo = fbt;
+	}
+	if (todo == NULL)
+		return;
+
+	for (fbt = todo; fbt; fbt = fbt->fbtp_jmpnext)
+		fbt_jmp_poke(fbt->fbtp_patchpoint, &patchval, 1);
+	dtrace_sync();
+	for (fbt = todo; fbt; fbt = fbt->fbtp_jmpnext)
+		fbt_jmp_poke(fbt->fbtp_patchpoint + 1, 
+			fbt->fbtp_tramp + fbt_jmp_template_size + 1, FBT_JMP_LEN - 1);
+	dtrace_sync();
+	for (fbt = todo; fbt; fbt = fbt->fbtp_jmpnext) {
+		fbt_jmp_poke(fbt->fbtp_patchpoint, &fbt->fbtp_savedval, 1);
+		fbt->fbtp_jmpstate = FBT_JMP_NONE;
+	}
+	dtrace_sync();
+}
+/**********************************************************************/
+/*   Process  the  queue:  arm  probes  which  have  been sitting on  */
+/*   their  INT3  for  a  full  RCU-tasks grace period, and disarm those  */
+/*   which have been disabled.					      */
+/**********************************************************************/
+static void
+fbt_jmp_flush(void)
+{	fbt_probe_t *fbt, **pp, *arm = NULL, *disarm = NULL;
+	uint8_t	*limbo, *slot;
+	uint8_t	opcode = FBT_JMP_OPCODE;
+	int32_t	rel;
+	int	sync = FALSE;
+
+	/***********************************************/
+	/*   Mark  what  the  grace  period  is going  */
+	/*   to  cover. Anything enabled whilst we are  */
+	/*   waiting has to wait for the next round.   */
+	/***********************************************/
+	mutex_enter(&fbt_jmp_mtx);
+	for (fbt = fbt_jmp_queue; fbt; fbt = fbt->fbtp_jmpnext) {
+		if (fbt->fbtp_jmpstate == FBT_JMP_ARMING) {
+			fbt->fbtp_jmpqueued = 2;
+			sync = TRUE;
+		}
+	}
+	limbo = fbt_jmp_limbo;
+	fbt_jmp_limbo = NULL;
+	mutex_exit(&fbt_jmp_mtx);
+
+	if (sync || limbo)
+		fbt_synchronize_rcu_tasks();
+
+	mutex_enter(&fbt_jmp_mtx);
+	while ((slot = limbo) != NULL) {
+		limbo = FBT_JMP_LINK(slot);
+		FBT_JMP_LINK(slot) = fbt_jmp_free;
+		fbt_jmp_free = slot;
+	}
+
+	for (pp = &fbt_jmp_queue; (fbt = *pp) != NULL; ) {
+		if (fbt->fbtp_jmpstate == FBT_JMP_ARMING && fbt->fbtp_jmpqueued != 2) {
+			pp = &fbt->fbtp_jmpnext;
+			continue;
+		}
+		*pp = fbt->fbtp_jmpnext;
+		fbt->fbtp_jmpqueued = 0;
+
+		switch (fbt->fbtp_jmpstate) {
+		  case FBT_JMP_ARMING:
+			/***********************************************/
+			/*   If  someone  else  arrived in the window  */
+			/*   meanwhile, stay on the INT3.	       */
+			/***********************************************/
+		  	if (*fbt->fbtp_patchpoint != fbt->fbtp_patchval ||
+			    dtrace_invop_addr_shared(fbt_invop, 
+			    	(uintptr_t) fbt->fbtp_patchpoint, fbt->fbtp_jmplen)) {
+				fbt->fbtp_jmpstate = FBT_JMP_NONE;
+				break;
+			}
+			fbt->fbtp_jmpnext = arm;
+			arm = fbt;
+			break;
+		  case FBT_JMP_DISARMING:
+			fbt->fbtp_jmpnext = disarm;
+			disarm = fbt;
+			break;
+		}
+	}
+
+	if (arm) {
+		for (fbt = arm; fbt; fbt = fbt->fbtp_jmpnext) {
+			rel = (int32_t) (fbt->fbtp_tramp - (fbt->fbtp_patchpoint + FBT_JMP_LEN));
+			fbt_jmp_poke(fbt->fbtp_patchpoint + 1, &rel, sizeof rel);
+		}
+		dtrace_sync();
+		for (fbt = arm; fbt; fbt = fbt->fbtp_jmpnext) {
+			fbt_jmp_poke(fbt->fbtp_patchpoint, &opcode, 1);
+			fbt->fbtp_jmpstate = FBT_JMP_ARMED;
+		}
+		dtrace_sync();
+	}
+	fbt_jmp_disarm(disarm);
+
+	if (fbt_jmp_queue && fbt_jmp_timeout == 0)
+		fbt_jmp_timeout = timeout(fbt_jmp_optimize, NULL, hz);
+	mutex_exit(&fbt_jmp_mtx);
+}
+static void
+fbt_jmp_optimize(void *arg)
+{
+	mutex_enter(&fbt_jmp_mtx);
+	fbt_jmp_timeout = 0;
+	mutex_exit(&fbt_jmp_mtx);
+
+	fbt_jmp_flush();
+}
+/**********************************************************************/
+/*   Called  from  fbt_enable.  Returns TRUE if the probe is handled  */
+/*   here, else the caller plants the INT3 as usual.		      */
+/**********************************************************************/
+static int
+fbt_jmp_enable(fbt_probe_t *fbt)
+{
+	if (fbt->fbtp_jmplen == 0)
+		return FALSE;
+
+	mutex_enter(&fbt_jmp_mtx);
+	switch (fbt->fbtp_jmpstate) {
+	  case FBT_JMP_NONE:
+		if (dtrace_invop_addr_shared(fbt_invop, 
+		    (uintptr_t) fbt->fbtp_patchpoint, fbt->fbtp_jmplen) ||
+		    (fbt->fbtp_tramp == NULL && !fbt_jmp_build(fbt)) ||
+		    !memory_set_rw(fbt->fbtp_patchpoint, 1, TRUE)) {
+			mutex_exit(&fbt_jmp_mtx);
+			return FALSE;
+		}
+		fbt->fbtp_enabled = TRUE;
+		fbt->fbtp_jmpstate = FBT_JMP_ARMING;
+		smp_wmb();
+		*fbt->fbtp_patchpoint = fbt->fbtp_patchval;
+		fbt_jmp_queue_probe(fbt);
+		/***********************************************/
+		/*   We  may  still  be on the queue, marked  */
+		/*   by  a  flush  which  is waiting for its  */
+		/*   grace  period.  That  started before this  */
+		/*   INT3 went down, so it does not count.     */
+		/***********************************************/
+		fbt->fbtp_jmpqueued = 1;
+		break;
+	  case FBT_JMP_DISARMING:
+	  	fbt->fbtp_jmpstate = FBT_JMP_ARMED;
+		/* FALLTHROUGH */
+	  default:
+		fbt->fbtp_enabled = TRUE;
+		break;
+	}
+	mutex_exit(&fbt_jmp_mtx);
+	return TRUE;
+}
+/**********************************************************************/
+/*   Called from fbt_disable. Returns TRUE if handled here.	      */
+/**********************************************************************/
+static int
+fbt_jmp_disable(fbt_probe_t *fbt)
+{
+	if (fbt->fbtp_tramp == NULL)
+		return FALSE;
+
+	mutex_enter(&fbt_jmp_mtx);
+	switch (fbt->fbtp_jmpstate) {
+	  case FBT_JMP_NONE:
+		mutex_exit(&fbt_jmp_mtx);
+		return FALSE;
+	  case FBT_JMP_ARMING:
+		/***********************************************/
+		/*   Only the INT3 is down - just remove it.  */
+		/***********************************************/
+		*fbt->fbtp_patchpoint = fbt->fbtp_savedval;
+		fbt->fbtp_jmpstate = FBT_JMP_NONE;
+		break;
+	  case FBT_JMP_ARMED:
+	  	fbt->fbtp_jmpstate = FBT_JMP_DISARMING;
+		fbt_jmp_queue_probe(fbt);
+		break;
+	}
+	fbt->fbtp_enabled = FALSE;
+	mutex_exit(&fbt_jmp_mtx);
+	return TRUE;
+}
+/**********************************************************************/
+/*   Probe  is  going  away.  If  the module is still loaded, put the  */
+/*   text  back  now;  the  slot goes into limbo until the next grace  */
+/*   period.  Returns TRUE if the jump is pinned under someone elses  */
+/*   breakpoint.  The  trampoline is then still live and passes this  */
+/*   fbt_probe_t  to  fbt_jmp_probe(), so the caller must not free it  */
+/*   - it stays behind, disabled, as the trampoline's stub.	      */
+/**********************************************************************/
+static int
+fbt_jmp_destroy(fbt_probe_t *fbt, int live)
+{	fbt_probe_t **pp;
+
+	if (fbt->fbtp_tramp == NULL)
+		return FALSE;
+
+	mutex_enter(&fbt_jmp_mtx);
+	if (fbt->fbtp_jmpqueued) {
+		for (pp = &fbt_jmp_queue; *pp; pp = &(*pp)->fbtp_jmpnext) {
+			if (*pp == fbt) {
+				*pp = fbt->fbtp_jmpnext;
+				break;
+			}
+		}
+		fbt->fbtp_jmpqueued = 0;
+	}
+	if (live && fbt->fbtp_jmpstate == FBT_JMP_DISARMING) {
+		fbt->fbtp_jmpnext = NULL;
+		fbt_jmp_disarm(fbt);
+	}
+	if (live && fbt->fbtp_jmpstate != FBT_JMP_NONE) {
+		fbt->fbtp_enabled = FALSE;
+		fbt->fbtp_next = NULL;
+		mutex_exit(&fbt_jmp_mtx);
+		return TRUE;
+	}
+	FBT_JMP_LINK(fbt->fbtp_tramp) = fbt_jmp_limbo;
+	fbt_jmp_limbo = fbt->fbtp_tramp;
+	fbt->fbtp_tramp = NULL;
+	mutex_exit(&fbt_jmp_mtx);
+	return FALSE;
+}
+/**********************************************************************/
+/*   Driver unload: cancel the timer and drain the queue.	      */
+/**********************************************************************/
+static void
+fbt_jmp_fini(void)
+{	timeout_id_t id;
+
+	if (fbt_jmp_ok <= 0)
+		return;
+
+	mutex_enter(&fbt_jmp_mtx);
+	id = fbt_jmp_timeout;
+	fbt_jmp_timeout = 0;
+	mutex_exit(&fbt_jmp_mtx);
+	if (id)
+		untimeout(id);
+	fbt_jmp_flush();
+}
+/**********************************************************************/
+/*   Free the trampolines, once all probes are destroyed.	      */
+/**********************************************************************/
+static void
+fbt_jmp_release(void)
+{	uint8_t	*chunk, *next;
+
+	if (fbt_jmp_chunks == NULL)
+		return;
+	if (fbt_jmp_pinned) {
+		printk("fbt: %d jump probes pinned by another provider - leaking trampolines\n", 
+			fbt_jmp_pinned);
+		return;
+	}
+
+	fbt_synchronize_rcu_tasks();
+	for (chunk = fbt_jmp_chunks; chunk; chunk = next) {
+		next = FBT_JMP_LINK(chunk);
+		if (fbt_set_memory_nx)
+			fbt_set_memory_nx((unsigned long) chunk, FBT_JMP_CHUNK >> PAGE_SHIFT);
+		fbt_module_memfree(chunk);
+	}
+	fbt_jmp_chunks = NULL;
+	fbt_jmp_free = NULL;
+	fbt_jmp_limbo = NULL;
+}
+# else
+#	define	fbt_jmp_init()			FALSE
+#	define	fbt_jmp_window(start, end, instr) 0
+#	define	fbt_jmp_enable(fbt)		FALSE
+#	define	fbt_jmp_disable(fbt)		FALSE
+#	define	fbt_jmp_destroy(fbt, live)	FALSE
+#	define	fbt_jmp_fini()
+#	define	fbt_jmp_release()
+# endif
 static int
 get_refcount(struct module *mp)
 {	int	sum = 0;
@@ -694,10 +1443,13 @@ fbt_prov_entry(pf_info_t *infp, instr_t *instr, int size, int modrm)
 //if (modrm >= 0 && (instr[modrm] & 0xc7) == 0x05) printk("modrm %s %p rm=%d\n", name, instr, modrm);
 	fbt->fbtp_modrm = modrm;
 	fbt->fbtp_patchval = FBT_PATCHVAL;
+	if (fbt_jmp && fbt_jmp_init())
+		fbt->fbtp_jmplen = fbt_jmp_window(infp->st_value, infp->st_end, instr);
 
 	fbt->fbtp_hashnext = fbt_probetab[FBT_ADDR2NDX(instr)];
 	fbt->fbtp_symndx = infp->symndx;
 	fbt_probetab[FBT_ADDR2NDX(instr)] = fbt;
+	dtrace_invop_addr_add(fbt_invop, (uintptr_t) instr);
 
 	infp->pmp->fbt_nentries++;
 	infp->retptr = NULL;
@@ -773,6 +1525,7 @@ fbt_prov_return(pf_info_t *infp, instr_t *instr, int size)
 	fbt->fbtp_symndx = infp->symndx;
 
 	fbt_probetab[FBT_ADDR2NDX(instr)] = fbt;
+	dtrace_invop_addr_add(fbt_invop, (uintptr_t) instr);
 
 	infp->pmp->fbt_nentries++;
 	return 1;
@@ -803,6 +1556,7 @@ int io_prov_sdt(pf_info_t *infp, uint8_t *instr, int size, int modrm);
 	inf.name = name;
 	inf.symndx = symndx;
 	inf.st_value = st_value;
+	inf.st_end = limit;
 	inf.do_print = FALSE;
 
 	inf.func_entry = fbt_prov_entry;
@@ -849,9 +1603,11 @@ fbt_destroy(void *arg, dtrace_id_t id, void *parg)
 		} else {
 			fbt_probetab[ndx] = fbt->fbtp_hashnext;
 		}
+		dtrace_invop_addr_remove(fbt_invop, (uintptr_t) fbt->fbtp_patchpoint);
 
 		next = fbt->fbtp_next;
-		kmem_free(fbt, sizeof (fbt_probe_t));
+		if (!fbt_jmp_destroy(fbt, mp != NULL && mp->state == MODULE_STATE_LIVE))
+			kmem_free(fbt, sizeof (fbt_probe_t));
 
 		fbt = next;
 	} while (fbt != NULL);
@@ -894,6 +1650,8 @@ fbt_enable(void *arg, dtrace_id_t id, void *parg)
 	}
 
 	for (; fbt != NULL; fbt = fbt->fbtp_next) {
+		if (fbt_jmp_enable(fbt))
+			continue;
 		fbt->fbtp_enabled = TRUE;
 		if (dtrace_here) 
 			printk("fbt_enable:patch %p p:%02x %s\n", fbt->fbtp_patchpoint, fbt->fbtp_patchval, fbt->fbtp_name);
@@ -933,6 +1691,8 @@ fbt_disable(void *arg, dtrace_id_t id, void *parg)
 				fbt->fbtp_ctl->name,
 				fbt->fbtp_name);
 		}
+		if (fbt_jmp_disable(fbt))
+			continue;
 		/***********************************************/
 		/*   Memory  should  be  writable,  but if we  */
 		/*   failed  in  the  fbt_enable  code,  e.g.  */
@@ -977,8 +1737,17 @@ fbt_suspend(void *arg, dtrace_id_t id, void *parg)
 		return;
 # endif
 
-	for (; fbt != NULL; fbt = fbt->fbtp_next)
+	for (; fbt != NULL; fbt = fbt->fbtp_next) {
+		/***********************************************/
+		/*   Dont  touch  the  text of a jump probe -  */
+		/*   just stop it firing.		       */
+		/***********************************************/
+		if (fbt->fbtp_jmpstate != FBT_JMP_NONE) {
+			fbt->fbtp_enabled = FALSE;
+			continue;
+		}
 		*fbt->fbtp_patchpoint = fbt->fbtp_savedval;
+	}
 }
 
 /*ARGSUSED*/
@@ -1000,8 +1769,13 @@ fbt_resume(void *arg, dtrace_id_t id, void *parg)
 		return;
 # endif
 
-	for (; fbt != NULL; fbt = fbt->fbtp_next)
+	for (; fbt != NULL; fbt = fbt->fbtp_next) {
+		if (fbt->fbtp_jmpstate != FBT_JMP_NONE) {
+			fbt->fbtp_enabled = TRUE;
+			continue;
+		}
 		*fbt->fbtp_patchpoint = fbt->fbtp_patchval;
+	}
 }
 
 /*ARGSUSED*/
@@ -1128,10 +1902,12 @@ static dtrace_pops_t fbt_pops = {
 static void
 fbt_cleanup(dev_info_t *devi)
 {
+	fbt_jmp_fini();
 	if (invop_loaded)
 		dtrace_invop_remove(fbt_invop);
 	if (fbt_id)
 		dtrace_unregister(fbt_id);
+	fbt_jmp_release();
 
 //	ddi_remove_minor_node(devi, NULL);
 	if (fbt_probetab)
@@ -1387,7 +2163,8 @@ static int fbt_seq_show(struct seq_file *seq, void *v)
 	seq_printf(seq, "%d %04u%c %p %02x %d %2d %s:%s:%s %s\n", n-1, 
 # endif
 		fbt->fbtp_fired,
-		fbt->fbtp_overrun ? '*' : ' ',
+		fbt->fbtp_overrun ? '*' : 
+			fbt->fbtp_jmpstate == FBT_JMP_ARMED ? 'j' : ' ',
 		fbt->fbtp_patchpoint,
 		fbt->fbtp_savedval,
 		fbt->fbtp_inslen,
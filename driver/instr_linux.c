@@ -678,6 +678,7 @@ do_instr:
 		fbt->insp_hashnext = instr_probetab[INSTR_ADDR2NDX(instr)];
 		fbt->insp_symndx = symndx;
 		instr_probetab[INSTR_ADDR2NDX(instr)] = fbt;
+		dtrace_invop_addr_add(instr_invop, (uintptr_t) instr);
 
 		if (do_print)
 			printk("%d:alloc entry-patchpoint: %s %p sz=%d %02x %02x %02x\n", 
@@ -727,6 +728,7 @@ instr_destroy(void *arg, dtrace_id_t id, void *parg)
 		} else {
 			instr_probetab[ndx] = fbt->insp_hashnext;
 		}
+		dtrace_invop_addr_remove(instr_invop, (uintptr_t) fbt->insp_patchpoint);
 
 		next = fbt->insp_next;
 		kmem_free(fbt, sizeof (instr_probe_t));
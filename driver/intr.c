@@ -417,6 +417,7 @@ dtrace_int3_handler(int type, struct pt_regs *regs)
 		/***********************************************/
 		tp = &this_cpu->cpuc_trap[0];
 		tp->ct_tinfo.t_doprobe = TRUE;
+		tp->ct_tinfo.t_resume = 0;
 		/***********************************************/
 		/*   Save   original   location   for   debug  */
 		/*   purposes in cpu_x86.c		       */
@@ -528,9 +529,21 @@ switch_off:
 //	tp = &this_cpu->cpuc_trap[1];
 	tp = &trap_info;
 	tp->ct_tinfo.t_doprobe = FALSE;
+	tp->ct_tinfo.t_resume = 0;
 	ret = dtrace_invop(regs->r_pc - 1, (uintptr_t *) regs, 
 		regs->r_rax, &tp->ct_tinfo);
 //preempt_enable_no_resched();
+	/***********************************************/
+	/*   If  the  breakpoint  sits  on  top  of a  */
+	/*   partially  written  jump,  we  cannot put  */
+	/*   the  old  byte  back,  but  we  can carry  */
+	/*   on in the relocated copy.		       */
+	/***********************************************/
+	if (ret && tp->ct_tinfo.t_resume) {
+		regs->r_pc = tp->ct_tinfo.t_resume;
+		return NOTIFY_DONE;
+	}
+
 	/***********************************************/
 	/*   If  we  own  the  breakpoint  area, then  */
 	/*   unpatch  the instruction so we will lose  */
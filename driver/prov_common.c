@@ -75,6 +75,7 @@ typedef struct provider {
 	dtrace_provider_id_t 	p_provider_id;
 	int			p_want_return;
 	int			(*p_callback)(dtrace_id_t, struct pt_regs *);
+	struct provider		*p_hashnext;
 	} provider_t;
 #define MAX_PROVIDER_TBL 1024
 static provider_t map[MAX_PROVIDER_TBL] = {
@@ -275,6 +276,14 @@ static provider_t map[MAX_PROVIDER_TBL] = {
 	};
 static int probe_cnt;
 
+/**********************************************************************/
+/*   Resolved  probe addresses, chained in map[] order, so the trap  */
+/*   handler only looks at the entries for the address that fired.   */
+/**********************************************************************/
+#define	PRCOM_HASHSIZE	256
+#define	PRCOM_ADDR2NDX(addr)	((((uintptr_t)(addr)) >> 4) & (PRCOM_HASHSIZE - 1))
+static provider_t *prcom_hash[PRCOM_HASHSIZE];
+
 /**********************************************************************/
 /*   Prototypes.						      */
 /**********************************************************************/
@@ -283,6 +292,7 @@ static	const char *(*my_kallsyms_lookup)(unsigned long addr,
                         unsigned long *offset,
                         char **modname, char *namebuf);
 uint64_t prcom_getarg(void *arg, dtrace_id_t id, void *parg, int argno, int aframes);
+static int prcom_invop(uintptr_t addr, uintptr_t *stack, uintptr_t eax, trap_instr_t *tinfo);
 void prov_proc_init(void);
 void prov_tcp_init(void);
 void vminfo_init(void);
@@ -880,6 +890,23 @@ prcom_init(void)
 			}
 		}
 	}
+
+	/***********************************************/
+	/*   Build  the  per-address chains (walking  */
+	/*   backwards  so  each chain stays in table  */
+	/*   order)  before  telling the trap handler  */
+	/*   about the addresses.		       */
+	/***********************************************/
+	for (pp = &map[probe_cnt]; pp-- > map; ) {
+		if (pp->p_func_addr == NULL)
+			continue;
+		pp->p_hashnext = prcom_hash[PRCOM_ADDR2NDX(pp->p_func_addr)];
+		prcom_hash[PRCOM_ADDR2NDX(pp->p_func_addr)] = pp;
+	}
+	for (pp = map; pp < &map[probe_cnt]; pp++) {
+		if (pp->p_func_addr)
+			dtrace_invop_addr_add(prcom_invop, (uintptr_t) pp->p_func_addr);
+	}
 }
 
 /**********************************************************************/
@@ -948,15 +975,15 @@ prcom_invop(uintptr_t addr, uintptr_t *stack, uintptr_t eax, trap_instr_t *tinfo
 	/***********************************************/
 
 	/***********************************************/
-	/*   We need to hash the addresses since they  */
-	/*   are  likely  rarely to fire, yet we will  */
-	/*   get called for all FBT traffic.	       */
+	/*   We  are  only  offered  traps  at  our own  */
+	/*   addresses  (see  dtrace_invop_addr_add),  */
+	/*   and walk just the chain for this one.     */
 	/***********************************************/
 	regs = (struct pt_regs *) stack;
 	DTRACE_CPUFLAG_SET(CPU_DTRACE_NOFAULT);
 	stack0 = regs->c_arg0;
 	DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_NOFAULT | CPU_DTRACE_BADADDR);
-	for (pp = map; pp < &map[probe_cnt]; pp++) {
+	for (pp = prcom_hash[PRCOM_ADDR2NDX(addr)]; pp != NULL; pp = pp->p_hashnext) {
 		if (addr != (uintptr_t) pp->p_func_addr)
 			continue;
 		if (!pp->p_enabled) {
@@ -0,0 +1,1255 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/**********************************************************************/
+/*   Table  driven  stack  unwinding  for  stack()  and ustack(). The  */
+/*   heuristic  walkers  in  dtrace_isa.c  look  at  every word on the  */
+/*   stack  and  guess  -  which gives truncated or bogus stacks on a  */
+/*   kernel  or  distro  built  without frame pointers. Here, we use  */
+/*   the unwind tables the compiler already generated:		      */
+/*   								      */
+/*   Kernel: the ORC tables (CONFIG_UNWINDER_ORC). These are already  */
+/*   in  memory  and  sorted,  with  a  block  index  (orc_lookup) so  */
+/*   finding  the entry for an address is a couple of compares.	      */
+/*   								      */
+/*   User:  the  .eh_frame  CFA  programs of each executable mapping,  */
+/*   flattened  (outside  of  probe  context) into a sorted table of  */
+/*   {pc, cfa-rule, rbp-rule} rows with a block index on top. In probe  */
+/*   context we only do lookups and read the stack.		      */
+/*   								      */
+/*   User  tables  are  built by a work item, for pids which the pid  */
+/*   provider  enables  probes  in,  or  which  a  ustack()  found no  */
+/*   table  for. Until the table exists, ustack() falls back to the  */
+/*   old heuristic.						      */
+/**********************************************************************/
+
+#include <dtrace_linux.h>
+#include <sys/dtrace_impl.h>
+#include <sys/dtrace.h>
+#include <dtrace_proto.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/module.h>
+#include <linux/workqueue.h>
+#include <linux/sort.h>
+#include <linux/elf.h>
+#include <sys/privregs.h>
+#if defined(__amd64) && defined(CONFIG_UNWINDER_ORC)
+#	include <asm/orc_types.h>
+#	include <asm/orc_lookup.h>
+#endif
+
+unsigned long long cnt_unwind_user;
+unsigned long long cnt_unwind_user_miss;
+unsigned long long cnt_unwind_build;
+
+# if defined(__amd64)
+/**********************************************************************/
+/*   Kernel: ORC.						      */
+/**********************************************************************/
+# if defined(CONFIG_UNWINDER_ORC)
+# if defined(ORC_TYPE_REGS_IRET) && !defined(ORC_TYPE_REGS_PARTIAL)
+#	define	ORC_TYPE_REGS_PARTIAL	ORC_TYPE_REGS_IRET
+# endif
+static int		*orc_ip_start;
+static int		*orc_ip_end;
+static struct orc_entry	*orc_start;
+static unsigned int	*orc_lookup_start;
+static unsigned int	*orc_lookup_stop;
+static char		*orc_text;
+static char		*orc_etext;
+static struct module	*(*orc_module_address)(unsigned long);
+
+/**********************************************************************/
+/*   Binary  search  for  the  last entry at or before ip. Table is a  */
+/*   list of self-relative ints.				      */
+/**********************************************************************/
+static struct orc_entry *
+orc_search(int *ip_table, struct orc_entry *table, unsigned int num, unsigned long ip)
+{	int	*first = ip_table;
+	int	*last = ip_table + num - 1;
+	int	*mid, *found = NULL;
+
+	if (num == 0)
+		return NULL;
+
+	while (first <= last) {
+		mid = first + (last - first) / 2;
+		if ((unsigned long) mid + *mid <= ip) {
+			found = mid;
+			first = mid + 1;
+		} else
+			last = mid - 1;
+	}
+	if (found == NULL)
+		return NULL;
+	return table + (found - ip_table);
+}
+static struct orc_entry *
+orc_find(unsigned long ip)
+{	struct module *mod;
+	unsigned int idx, start, stop;
+
+	if (ip >= (unsigned long) orc_text && ip < (unsigned long) orc_etext) {
+		idx = (ip - (unsigned long) orc_text) / LOOKUP_BLOCK_SIZE;
+		if (orc_lookup_start + idx + 1 >= orc_lookup_stop)
+			return NULL;
+		start = orc_lookup_start[idx];
+		stop = orc_lookup_start[idx + 1] + 1;
+		if (orc_ip_start + stop > orc_ip_end)
+			return NULL;
+		return orc_search(orc_ip_start + start, orc_start + start,
+			stop - start, ip);
+	}
+
+	if (orc_module_address == NULL ||
+	    (mod = orc_module_address(ip)) == NULL ||
+	    mod->arch.orc_unwind_ip == NULL)
+		return NULL;
+	return orc_search(mod->arch.orc_unwind_ip, mod->arch.orc_unwind,
+		mod->arch.num_orcs, ip);
+}
+/**********************************************************************/
+/*   Read  a  kernel  stack  word.  Caller  has  set NOFAULT; we just  */
+/*   check whether that tripped.				      */
+/**********************************************************************/
+static int
+orc_read(unsigned long addr, unsigned long *val)
+{
+	if (addr & (sizeof(long) - 1))
+		return FALSE;
+	*val = *(unsigned long *) addr;
+	return !DTRACE_CPUFLAG_ISSET(CPU_DTRACE_FAULT);
+}
+# endif /* CONFIG_UNWINDER_ORC */
+
+/**********************************************************************/
+/*   Walk  the  kernel  stack. If regs is NULL, we start from here and  */
+/*   skip  our  own  frames. Returns the depth, or -1 if we cannot (no  */
+/*   ORC) so the caller can fall back to the heuristic.		      */
+/**********************************************************************/
+int
+dtrace_unwind_kernel(pc_t *pcstack, int pcstack_limit, struct pt_regs *regs)
+{
+# if defined(CONFIG_UNWINDER_ORC)
+	struct orc_entry *orc;
+	unsigned long ip, sp, bp, prev_sp, val;
+	int	depth = 0;
+	int	full_regs;
+	int	lookup_prev;
+	int	skip;
+	int	n;
+	uint16_t saved;
+
+	if (orc_ip_start == NULL)
+		return -1;
+
+	if (regs) {
+		ip = regs->r_pc;
+		sp = regs->r_sp;
+		bp = regs->r_fp;
+		full_regs = TRUE;
+		skip = FALSE;
+		/***********************************************/
+		/*   An   fbt   probe  (INT3  or  jump)  hands  */
+		/*   us  the  address  after  the patch point,  */
+		/*   but  the instruction there hasnt run yet.  */
+		/***********************************************/
+		lookup_prev = dtrace_invop_patched(ip - 1);
+	} else {
+		__asm__ __volatile__("lea 0(%%rip), %0\n"
+			"mov %%rsp, %1\n"
+			"mov %%rbp, %2\n"
+			: "=r" (ip), "=r" (sp), "=r" (bp));
+		full_regs = FALSE;
+		skip = TRUE;
+		lookup_prev = FALSE;
+	}
+
+	/***********************************************/
+	/*   We  may  be  called  from probe context,  */
+	/*   where  the  caller  already owns NOFAULT  */
+	/*   and  may  have a fault pending. Save the  */
+	/*   bits  so  we can hand them back as they  */
+	/*   were, and start our own walk clean.       */
+	/***********************************************/
+	saved = DTRACE_CPUFLAG_ISSET(CPU_DTRACE_NOFAULT | CPU_DTRACE_FAULT | CPU_DTRACE_BADADDR);
+	DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_FAULT | CPU_DTRACE_BADADDR);
+	DTRACE_CPUFLAG_SET(CPU_DTRACE_NOFAULT);
+	for (n = 0; depth < pcstack_limit && n < 2 * pcstack_limit + 16; n++) {
+		if ((orc = orc_find(lookup_prev ? ip - 1 : ip)) == NULL)
+			break;
+# if defined(ORC_TYPE_END_OF_STACK)
+		if (orc->type == ORC_TYPE_END_OF_STACK || orc->type == ORC_TYPE_UNDEFINED)
+			break;
+# else
+		if (orc->end)
+			break;
+# endif
+
+		switch (orc->sp_reg) {
+		  case ORC_REG_SP:
+		  	prev_sp = sp + orc->sp_offset;
+			break;
+		  case ORC_REG_BP:
+		  	prev_sp = bp + orc->sp_offset;
+			break;
+		  case ORC_REG_SP_INDIRECT:
+		  	if (!orc_read(sp, &prev_sp))
+				goto done;
+			prev_sp += orc->sp_offset;
+			break;
+		  case ORC_REG_BP_INDIRECT:
+		  	if (!orc_read(bp + orc->sp_offset, &prev_sp))
+				goto done;
+			break;
+		  case ORC_REG_R10:
+		  	if (!full_regs)
+				goto done;
+			prev_sp = regs->r_r10;
+			break;
+		  case ORC_REG_R13:
+		  	if (!full_regs)
+				goto done;
+			prev_sp = regs->r_r13;
+			break;
+		  case ORC_REG_DI:
+		  	if (!full_regs)
+				goto done;
+			prev_sp = regs->r_rdi;
+			break;
+		  case ORC_REG_DX:
+		  	if (!full_regs)
+				goto done;
+			prev_sp = regs->r_rdx;
+			break;
+		  default:
+		  	goto done;
+		}
+
+		switch (orc->type) {
+		  case ORC_TYPE_CALL:
+		  	if (!orc_read(prev_sp - sizeof(long), &ip))
+				goto done;
+			regs = NULL;
+			full_regs = FALSE;
+			lookup_prev = TRUE;
+			break;
+		  case ORC_TYPE_REGS:
+		  	regs = (struct pt_regs *) prev_sp;
+			full_regs = TRUE;
+			goto regs_frame;
+		  case ORC_TYPE_REGS_PARTIAL:
+		  	regs = (struct pt_regs *) (prev_sp - offsetof(struct pt_regs, r_pc));
+			full_regs = FALSE;
+		  regs_frame:
+		  	/***********************************************/
+		  	/*   Interrupt  or  exception  frame. Stop if  */
+		  	/*   it came from user space.		       */
+		  	/***********************************************/
+		  	if (!orc_read((unsigned long) &regs->r_cs, &val) || (val & 3))
+				goto done;
+		  	if (!orc_read((unsigned long) &regs->r_pc, &ip) ||
+			    !orc_read((unsigned long) &regs->r_sp, &prev_sp))
+				goto done;
+			if (full_regs && !orc_read((unsigned long) &regs->r_fp, &bp))
+				goto done;
+			lookup_prev = FALSE;
+			break;
+		  default:
+		  	goto done;
+		}
+
+		switch (orc->bp_reg) {
+		  case ORC_REG_PREV_SP:
+		  	if (!orc_read(prev_sp + orc->bp_offset, &bp))
+				goto done;
+			break;
+		  case ORC_REG_BP:
+		  	if (!orc_read(bp + orc->bp_offset, &bp))
+				goto done;
+			break;
+		}
+
+		/***********************************************/
+		/*   Stacks  only  grow  one way, unless we hop  */
+		/*   from an irq stack via a regs frame.       */
+		/***********************************************/
+		if (prev_sp <= sp && orc->type == ORC_TYPE_CALL)
+			break;
+		sp = prev_sp;
+
+		if (ip == 0)
+			break;
+		if (skip) {
+			if (orc_module_address && orc_module_address(ip) == THIS_MODULE)
+				continue;
+			skip = FALSE;
+		}
+		pcstack[depth++] = (pc_t) ip;
+	}
+done:
+	DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_NOFAULT | CPU_DTRACE_FAULT | CPU_DTRACE_BADADDR);
+	DTRACE_CPUFLAG_SET(saved);
+	return depth;
+# else
+	return -1;
+# endif
+}
+
+/**********************************************************************/
+/*   User:  compact  unwind  rows.  Each row applies from r_off up to  */
+/*   the next row.						      */
+/**********************************************************************/
+# define	UW_REG_RBP		6
+# define	UW_REG_RSP		7
+# define	UW_REG_UNDEF		0xff
+# define	UW_BP_SAME		0
+# define	UW_BP_LOST		0x7fff
+# define	UW_BLOCK_SHIFT		8	/* Same idea as ORC's orc_lookup */
+# define	UW_HASH			64
+# define	UW_PENDING		32
+# define	UW_MAXOBJ		64
+# define	UW_MAXFDE		4096
+# define	UW_TABBUF		4096	/* Bytes of FDE search table per read */
+# define	UW_STATES		8
+
+typedef struct uw_row_t {
+	uint32_t	r_off;		/* Offset from o_start */
+	int32_t		r_cfa_off;
+	int16_t		r_bp_off;	/* Where rbp was saved, CFA relative */
+	uint8_t		r_cfa_reg;	/* UW_REG_xxx */
+	uint8_t		r_pad;
+	} uw_row_t;
+
+typedef struct uw_obj_t {
+	unsigned long	o_start;
+	unsigned long	o_end;
+	unsigned int	o_nrows;
+	unsigned int	o_nblk;
+	uw_row_t	*o_rows;
+	unsigned int	*o_blk;		/* First row for each block */
+	} uw_obj_t;
+
+typedef struct uw_tab_t {
+	struct uw_tab_t	*u_next;
+	struct mm_struct *u_mm;
+	void		*u_exe;
+	pid_t		u_tgid;
+	int		u_nobj;
+	unsigned long	u_built;	/* jiffies */
+	uw_obj_t	u_obj[UW_MAXOBJ];
+	} uw_tab_t;
+
+# define UW_HASHMM(mm)	((((unsigned long) (mm)) >> 6) & (UW_HASH - 1))
+
+static uw_tab_t	*uw_hash[UW_HASH];
+static pid_t	uw_pending[UW_PENDING];
+static MUTEX_DEFINE(uw_mtx);
+static struct work_struct uw_work;
+static int	uw_initted;
+
+static struct task_struct *(*uw_find_task_by_vpid)(pid_t);
+static struct mm_struct *(*uw_get_task_mm)(struct task_struct *);
+static void	(*uw_mmput)(struct mm_struct *);
+static int	(*uw_access_remote_vm)(struct mm_struct *, unsigned long, void *, int, int);
+
+/**********************************************************************/
+/*   Ask  for a table to be built for a process. Safe from probe context  */
+/*   - we just drop the pid into a slot.			      */
+/**********************************************************************/
+void
+dtrace_unwind_request(pid_t pid)
+{	int	i;
+
+	if (!uw_initted)
+		return;
+	for (i = 0; i < UW_PENDING; i++) {
+		if (uw_pending[i] == pid)
+			return;
+	}
+	for (i = 0; i < UW_PENDING; i++) {
+		if (dtrace_cas32((uint32_t *) &uw_pending[i], 0, pid) == 0)
+			return;
+	}
+}
+/**********************************************************************/
+/*   Called from dtrace_state_clean (a cyclic) to get the pending work  */
+/*   going. We dont schedule work from probe context.		      */
+/**********************************************************************/
+void
+dtrace_unwind_kick(void)
+{	int	i;
+
+	if (!uw_initted)
+		return;
+	for (i = 0; i < UW_PENDING; i++) {
+		if (uw_pending[i]) {
+			schedule_work(&uw_work);
+			return;
+		}
+	}
+}
+static uw_tab_t *
+uw_find(struct mm_struct *mm)
+{	uw_tab_t *ut;
+
+	for (ut = uw_hash[UW_HASHMM(mm)]; ut; ut = ut->u_next) {
+		if (ut->u_mm == mm && ut->u_tgid == current->tgid)
+			return ut;
+	}
+	return NULL;
+}
+static uw_row_t *
+uw_lookup(uw_tab_t *ut, unsigned long pc)
+{	uw_obj_t *op;
+	unsigned int lo, hi, mid, blk;
+	int	i;
+
+	for (i = 0, op = ut->u_obj; i < ut->u_nobj; i++, op++) {
+		if (pc < op->o_start || pc >= op->o_end)
+			continue;
+		pc -= op->o_start;
+		blk = pc >> UW_BLOCK_SHIFT;
+		if (blk >= op->o_nblk)
+			return NULL;
+		lo = op->o_blk[blk];
+		hi = blk + 1 < op->o_nblk ? op->o_blk[blk + 1] + 1 : op->o_nrows;
+		if (hi > op->o_nrows)
+			hi = op->o_nrows;
+		while (lo + 1 < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (op->o_rows[mid].r_off <= pc)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		if (lo >= op->o_nrows || op->o_rows[lo].r_off > pc ||
+		    op->o_rows[lo].r_cfa_reg == UW_REG_UNDEF)
+			return NULL;
+		return &op->o_rows[lo];
+	}
+	return NULL;
+}
+/**********************************************************************/
+/*   Walk  the  user stack of the current process. Returns the number  */
+/*   of  entries,  or  -1  if  we have no table (and have asked for one  */
+/*   to be built).						      */
+/**********************************************************************/
+int
+dtrace_unwind_user(uint64_t *pcstack, int pcstack_limit)
+{	struct mm_struct *mm = current->mm;
+	struct pt_regs *regs;
+	uw_tab_t *ut;
+	uw_row_t *row;
+	unsigned long pc, sp, bp, cfa, ra;
+	int	depth = 0;
+	int	n;
+	uint16_t saved;
+
+	if (mm == NULL || !uw_initted)
+		return -1;
+	regs = task_pt_regs(current);
+	if (!user_64bit_mode(regs))
+		return -1;
+
+	if ((ut = uw_find(mm)) == NULL || ut->u_exe != (void *) mm->exe_file) {
+		cnt_unwind_user_miss++;
+		dtrace_unwind_request(current->tgid);
+		return -1;
+	}
+	cnt_unwind_user++;
+
+	pc = regs->r_pc;
+	sp = regs->r_sp;
+	bp = regs->r_fp;
+	pcstack[depth++] = pc;
+
+	/***********************************************/
+	/*   A  fault  on  a  user stack word ends the  */
+	/*   walk,  but  must  not  eat a fault the  */
+	/*   caller had already recorded.	       */
+	/***********************************************/
+	saved = DTRACE_CPUFLAG_ISSET(CPU_DTRACE_FAULT | CPU_DTRACE_BADADDR);
+	DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_FAULT | CPU_DTRACE_BADADDR);
+
+	for (n = 0; depth < pcstack_limit && n < pcstack_limit; n++) {
+		/***********************************************/
+		/*   After  the  first frame, pc is a return  */
+		/*   address  and  may be the first byte of  */
+		/*   the next function.			       */
+		/***********************************************/
+		row = uw_lookup(ut, n == 0 ? pc : pc - 1);
+		if (row == NULL) {
+			/***********************************************/
+			/*   No  unwind info (hand written asm, JIT  */
+			/*   code):  try the frame pointer; ask for  */
+			/*   a  rebuild  in  case  something  was  */
+			/*   dlopen()ed since.			       */
+			/***********************************************/
+			if (jiffies - ut->u_built > HZ)
+				dtrace_unwind_request(current->tgid);
+			if (bp == 0 || bp <= sp || (bp & 7))
+				break;
+			cfa = bp + 16;
+			ra = dtrace_fuword64((void *) (bp + 8));
+			bp = dtrace_fuword64((void *) bp);
+		} else {
+			cfa = (row->r_cfa_reg == UW_REG_RSP ? sp : bp) + row->r_cfa_off;
+			ra = dtrace_fuword64((void *) (cfa - 8));
+			if (row->r_bp_off == UW_BP_LOST)
+				bp = 0;
+			else if (row->r_bp_off != UW_BP_SAME)
+				bp = dtrace_fuword64((void *) (cfa + row->r_bp_off));
+		}
+		if (DTRACE_CPUFLAG_ISSET(CPU_DTRACE_FAULT | CPU_DTRACE_BADADDR)) {
+			DTRACE_CPUFLAG_CLEAR(CPU_DTRACE_FAULT | CPU_DTRACE_BADADDR);
+			break;
+		}
+		if (ra == 0 || cfa <= sp)
+			break;
+		sp = cfa;
+		pc = ra;
+		pcstack[depth++] = pc;
+	}
+	DTRACE_CPUFLAG_SET(saved);
+	return depth;
+}
+
+/**********************************************************************/
+/*   Table  building. Runs from a work item, so we can sleep and read  */
+/*   the target's memory with access_remote_vm.			      */
+/**********************************************************************/
+typedef struct uw_build_t {
+	struct mm_struct *b_mm;
+	unsigned long	b_start;	/* Text mapping being built */
+	unsigned long	b_end;
+	uw_row_t	*b_rows;
+	unsigned int	b_nrows;
+	unsigned int	b_size;
+	unsigned long	b_cie;		/* Cached CIE */
+	int		b_code_align;
+	int		b_data_align;
+	int		b_fde_enc;
+	int		b_aug_z;
+	uint8_t		*b_init;	/* CIE initial instructions */
+	uint8_t		*b_init_end;
+	uint8_t		b_ciebuf[UW_MAXFDE];
+	uint8_t		b_fdebuf[UW_MAXFDE];
+	int32_t		b_tabbuf[UW_TABBUF / sizeof(int32_t)];
+	} uw_build_t;
+
+typedef struct uw_state_t {
+	int	s_cfa_reg;
+	long	s_cfa_off;
+	int	s_bp_off;
+	} uw_state_t;
+
+static int
+uw_read(uw_build_t *b, unsigned long addr, void *buf, int len)
+{
+	return uw_access_remote_vm(b->b_mm, addr, buf, len, 0) == len;
+}
+static unsigned long
+uw_uleb(uint8_t **pp, uint8_t *end)
+{	unsigned long result = 0;
+	int	shift = 0;
+	uint8_t	*p = *pp;
+
+	while (p < end) {
+		result |= (unsigned long) (*p & 0x7f) << shift;
+		shift += 7;
+		if ((*p++ & 0x80) == 0)
+			break;
+	}
+	*pp = p;
+	return result;
+}
+static long
+uw_sleb(uint8_t **pp, uint8_t *end)
+{	long	result = 0;
+	int	shift = 0;
+	uint8_t	*p = *pp, byte = 0;
+
+	while (p < end) {
+		byte = *p++;
+		result |= (long) (byte & 0x7f) << shift;
+		shift += 7;
+		if ((byte & 0x80) == 0)
+			break;
+	}
+	if (shift < 64 && (byte & 0x40))
+		result |= -1L << shift;
+	*pp = p;
+	return result;
+}
+/**********************************************************************/
+/*   Decode  a DW_EH_PE_xxx encoded pointer. uaddr is where *pp lives  */
+/*   in the target.						      */
+/**********************************************************************/
+static unsigned long
+uw_encoded(uint8_t **pp, uint8_t *end, int enc, unsigned long uaddr)
+{	unsigned long val;
+	uint8_t	*p = *pp;
+
+	if (enc == 0xff)
+		return 0;
+	switch (enc & 0x0f) {
+	  case 0x00: val = *(uint64_t *) p; p += 8; break;
+	  case 0x01: val = uw_uleb(&p, end); break;
+	  case 0x02: val = *(uint16_t *) p; p += 2; break;
+	  case 0x03: val = *(uint32_t *) p; p += 4; break;
+	  case 0x04: val = *(uint64_t *) p; p += 8; break;
+	  case 0x09: val = uw_sleb(&p, end); break;
+	  case 0x0a: val = *(int16_t *) p; p += 2; break;
+	  case 0x0b: val = *(int32_t *) p; p += 4; break;
+	  case 0x0c: val = *(int64_t *) p; p += 8; break;
+	  default:
+	  	*pp = end;
+		return 0;
+	}
+	if ((enc & 0x70) == 0x10)
+		val += uaddr;
+	*pp = p;
+	return val;
+}
+static int
+uw_emit(uw_build_t *b, unsigned long pc, uw_state_t *st)
+{	uw_row_t *row;
+
+	if (pc < b->b_start || pc >= b->b_end)
+		return TRUE;
+
+	/***********************************************/
+	/*   Same  pc  as  the last row - the later  */
+	/*   rule wins.				       */
+	/***********************************************/
+	if (b->b_nrows && b->b_rows[b->b_nrows - 1].r_off == pc - b->b_start)
+		b->b_nrows--;
+
+	if (b->b_nrows >= b->b_size) {
+		unsigned int size = b->b_size ? b->b_size * 2 : 1024;
+		uw_row_t *rows = kmem_alloc(size * sizeof *rows, KM_SLEEP);
+
+		if (rows == NULL)
+			return FALSE;
+		if (b->b_rows) {
+			memcpy(rows, b->b_rows, b->b_nrows * sizeof *rows);
+			kmem_free(b->b_rows, b->b_size * sizeof *rows);
+		}
+		b->b_rows = rows;
+		b->b_size = size;
+	}
+	row = &b->b_rows[b->b_nrows++];
+	row->r_off = pc - b->b_start;
+	row->r_cfa_reg = st->s_cfa_reg;
+	row->r_cfa_off = st->s_cfa_off;
+	row->r_bp_off = st->s_bp_off;
+	row->r_pad = 0;
+	return TRUE;
+}
+/**********************************************************************/
+/*   Run a CFA program, emitting a row each time the location moves.  */
+/*   We only track what we need on x86-64: the CFA and rbp.	      */
+/**********************************************************************/
+static int
+uw_exec(uw_build_t *b, uint8_t *p, uint8_t *end, unsigned long uaddr,
+	uw_state_t *st, uw_state_t *init, unsigned long *locp)
+{	uw_state_t stack[UW_STATES];
+	int	sp = 0;
+	int	op, opa, reg;
+	long	off;
+	unsigned long loc = locp ? *locp : 0;
+	uint8_t	*start = p;
+
+	while (p < end) {
+		op = *p++;
+		opa = op & 0x3f;
+		switch (op & 0xc0) {
+		  case 0x40:	/* DW_CFA_advance_loc */
+			if (locp && !uw_emit(b, loc, st))
+				return FALSE;
+			loc += opa * b->b_code_align;
+			continue;
+		  case 0x80:	/* DW_CFA_offset */
+		  	off = uw_uleb(&p, end) * b->b_data_align;
+			if (opa == UW_REG_RBP)
+				st->s_bp_off = off;
+			continue;
+		  case 0xc0:	/* DW_CFA_restore */
+			if (opa == UW_REG_RBP && init)
+				st->s_bp_off = init->s_bp_off;
+			continue;
+		}
+
+		switch (op) {
+		  case 0x00:	/* DW_CFA_nop */
+		  	break;
+		  case 0x01:	/* DW_CFA_set_loc */
+			if (locp && !uw_emit(b, loc, st))
+				return FALSE;
+		  	loc = uw_encoded(&p, end, b->b_fde_enc, uaddr + (p - start));
+			break;
+		  case 0x02:	/* DW_CFA_advance_loc1 */
+		  case 0x03:	/* DW_CFA_advance_loc2 */
+		  case 0x04:	/* DW_CFA_advance_loc4 */
+			if (locp && !uw_emit(b, loc, st))
+				return FALSE;
+			if (op == 0x02) {
+				loc += *p * b->b_code_align;
+				p += 1;
+			} else if (op == 0x03) {
+				loc += *(uint16_t *) p * b->b_code_align;
+				p += 2;
+			} else {
+				loc += *(uint32_t *) p * b->b_code_align;
+				p += 4;
+			}
+			break;
+		  case 0x05:	/* DW_CFA_offset_extended */
+		  	reg = uw_uleb(&p, end);
+		  	off = uw_uleb(&p, end) * b->b_data_align;
+			if (reg == UW_REG_RBP)
+				st->s_bp_off = off;
+			break;
+		  case 0x06:	/* DW_CFA_restore_extended */
+		  	reg = uw_uleb(&p, end);
+			if (reg == UW_REG_RBP && init)
+				st->s_bp_off = init->s_bp_off;
+			break;
+		  case 0x07:	/* DW_CFA_undefined */
+		  case 0x08:	/* DW_CFA_same_value */
+		  	reg = uw_uleb(&p, end);
+			if (reg == UW_REG_RBP)
+				st->s_bp_off = op == 0x08 ? UW_BP_SAME : UW_BP_LOST;
+			break;
+		  case 0x09:	/* DW_CFA_register */
+		  	reg = uw_uleb(&p, end);
+			uw_uleb(&p, end);
+			if (reg == UW_REG_RBP)
+				st->s_bp_off = UW_BP_LOST;
+			break;
+		  case 0x0a:	/* DW_CFA_remember_state */
+		  	if (sp < UW_STATES)
+				stack[sp] = *st;
+			sp++;
+			break;
+		  case 0x0b:	/* DW_CFA_restore_state */
+		  	if (sp > 0 && --sp < UW_STATES)
+				*st = stack[sp];
+			break;
+		  case 0x0c:	/* DW_CFA_def_cfa */
+		  	st->s_cfa_reg = uw_uleb(&p, end);
+			st->s_cfa_off = uw_uleb(&p, end);
+			break;
+		  case 0x0d:	/* DW_CFA_def_cfa_register */
+		  	st->s_cfa_reg = uw_uleb(&p, end);
+			break;
+		  case 0x0e:	/* DW_CFA_def_cfa_offset */
+			st->s_cfa_off = uw_uleb(&p, end);
+			break;
+		  case 0x0f:	/* DW_CFA_def_cfa_expression */
+			off = uw_uleb(&p, end);
+			p += off;
+			st->s_cfa_reg = UW_REG_UNDEF;
+			break;
+		  case 0x10:	/* DW_CFA_expression */
+		  case 0x16:	/* DW_CFA_val_expression */
+		  	reg = uw_uleb(&p, end);
+			off = uw_uleb(&p, end);
+			p += off;
+			if (reg == UW_REG_RBP)
+				st->s_bp_off = UW_BP_LOST;
+			break;
+		  case 0x11:	/* DW_CFA_offset_extended_sf */
+		  	reg = uw_uleb(&p, end);
+		  	off = uw_sleb(&p, end) * b->b_data_align;
+			if (reg == UW_REG_RBP)
+				st->s_bp_off = off;
+			break;
+		  case 0x12:	/* DW_CFA_def_cfa_sf */
+		  	st->s_cfa_reg = uw_uleb(&p, end);
+			st->s_cfa_off = uw_sleb(&p, end) * b->b_data_align;
+			break;
+		  case 0x13:	/* DW_CFA_def_cfa_offset_sf */
+			st->s_cfa_off = uw_sleb(&p, end) * b->b_data_align;
+			break;
+		  case 0x14:	/* DW_CFA_val_offset */
+		  case 0x15:	/* DW_CFA_val_offset_sf */
+		  	reg = uw_uleb(&p, end);
+			if (op == 0x14)
+				uw_uleb(&p, end);
+			else
+				uw_sleb(&p, end);
+			if (reg == UW_REG_RBP)
+				st->s_bp_off = UW_BP_LOST;
+			break;
+		  case 0x2e:	/* DW_CFA_GNU_args_size */
+		  	uw_uleb(&p, end);
+			break;
+		  default:
+		  	/***********************************************/
+		  	/*   Something  we dont know - stop trusting  */
+		  	/*   this FDE from here.		       */
+		  	/***********************************************/
+		  	st->s_cfa_reg = UW_REG_UNDEF;
+			p = end;
+			break;
+		}
+		if (st->s_cfa_reg != UW_REG_RSP && st->s_cfa_reg != UW_REG_RBP)
+			st->s_cfa_reg = UW_REG_UNDEF;
+	}
+	if (locp)
+		*locp = loc;
+	return TRUE;
+}
+/**********************************************************************/
+/*   Read and parse a CIE, unless it is the one we have already.      */
+/**********************************************************************/
+static int
+uw_cie(uw_build_t *b, unsigned long addr)
+{	uint32_t len;
+	uint8_t	*p, *end, *aug, *a;
+	int	version;
+	unsigned long aug_len;
+
+	if (b->b_cie == addr)
+		return TRUE;
+	b->b_cie = 0;
+
+	if (!uw_read(b, addr, &len, 4) || len == 0 || len >= UW_MAXFDE ||
+	    !uw_read(b, addr + 4, b->b_ciebuf, len))
+		return FALSE;
+	p = b->b_ciebuf;
+	end = p + len;
+
+	if (*(uint32_t *) p != 0)
+		return FALSE;
+	p += 4;
+	version = *p++;
+	aug = p;
+	while (p < end && *p)
+		p++;
+	p++;
+	b->b_code_align = uw_uleb(&p, end);
+	b->b_data_align = uw_sleb(&p, end);
+	if (version == 1)
+		p++;
+	else
+		uw_uleb(&p, end);
+
+	b->b_fde_enc = 0;
+	b->b_aug_z = *aug == 'z';
+	if (b->b_aug_z) {
+		aug_len = uw_uleb(&p, end);
+		a = p;
+		for (aug++; *aug && a < end; aug++) {
+			switch (*aug) {
+			  case 'R':
+			  	b->b_fde_enc = *a++;
+				break;
+			  case 'L':
+			  	a++;
+				break;
+			  case 'P':
+			  	{int enc = *a++;
+				uw_encoded(&a, end, enc & 0x7f, addr + 4 + (a - b->b_ciebuf));
+				}
+				break;
+			  case 'S':
+			  	break;
+			  default:
+			  	return FALSE;
+			}
+		}
+		p += aug_len;
+	}
+	if (p > end)
+		return FALSE;
+	b->b_init = p;
+	b->b_init_end = end;
+	b->b_cie = addr;
+	return TRUE;
+}
+/**********************************************************************/
+/*   Flatten one FDE into rows.					      */
+/**********************************************************************/
+static int
+uw_fde(uw_build_t *b, unsigned long addr)
+{	uint32_t len;
+	uint8_t	*p, *end;
+	unsigned long cie, pc_begin, pc_range, loc;
+	uw_state_t st, init;
+
+	if (!uw_read(b, addr, &len, 4) || len == 0 || len >= UW_MAXFDE ||
+	    !uw_read(b, addr + 4, b->b_fdebuf, len))
+		return TRUE;
+	p = b->b_fdebuf;
+	end = p + len;
+
+	cie = addr + 4 - *(uint32_t *) p;
+	p += 4;
+	if (!uw_cie(b, cie))
+		return TRUE;
+
+	pc_begin = uw_encoded(&p, end, b->b_fde_enc, addr + 4 + (p - b->b_fdebuf));
+	pc_range = uw_encoded(&p, end, b->b_fde_enc & 0x0f, 0);
+	if (b->b_aug_z) {
+		unsigned long aug_len = uw_uleb(&p, end);
+		p += aug_len;
+	}
+	if (p > end)
+		return TRUE;
+
+	memset(&st, 0, sizeof st);
+	st.s_cfa_reg = UW_REG_UNDEF;
+	uw_exec(b, b->b_init, b->b_init_end, 0, &st, NULL, NULL);
+	init = st;
+
+	loc = pc_begin;
+	if (!uw_exec(b, p, end, addr + 4 + (p - b->b_fdebuf), &st, &init, &loc) ||
+	    !uw_emit(b, loc, &st))
+		return FALSE;
+
+	/***********************************************/
+	/*   Terminate  the  FDE  so a gap before the  */
+	/*   next one isnt covered by our last row.    */
+	/***********************************************/
+	st.s_cfa_reg = UW_REG_UNDEF;
+	return uw_emit(b, pc_begin + pc_range, &st);
+}
+static int
+uw_row_cmp(const void *a, const void *b)
+{	const uw_row_t *r1 = a, *r2 = b;
+
+	return r1->r_off < r2->r_off ? -1 : r1->r_off > r2->r_off;
+}
+/**********************************************************************/
+/*   Build  the  rows for one executable mapping, using the ELF image  */
+/*   mapped at base.						      */
+/**********************************************************************/
+static int
+uw_load_obj(uw_build_t *b, uw_obj_t *op, unsigned long base)
+{	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdr;
+	unsigned long bias, hdr = 0;
+	uint8_t	hbuf[16], *p;
+	unsigned long eh_frame, nfde, i, j, n, tab, addr;
+	int32_t	*ent;
+	unsigned int blk, r;
+
+	if (!uw_read(b, base, &ehdr, sizeof ehdr) ||
+	    memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ehdr.e_ident[EI_CLASS] != ELFCLASS64)
+		return FALSE;
+	bias = ehdr.e_type == ET_DYN ? base : 0;
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		if (!uw_read(b, base + ehdr.e_phoff + i * sizeof phdr, &phdr, sizeof phdr))
+			return FALSE;
+		if (phdr.p_type == PT_GNU_EH_FRAME) {
+			hdr = bias + phdr.p_vaddr;
+			break;
+		}
+	}
+	if (hdr == 0 || !uw_read(b, hdr, hbuf, sizeof hbuf))
+		return FALSE;
+
+	/***********************************************/
+	/*   We  only  handle  the  binary search table  */
+	/*   layout everyone uses (datarel sdata4).    */
+	/***********************************************/
+	if (hbuf[0] != 1 || hbuf[3] != 0x3b)
+		return FALSE;
+	p = hbuf + 4;
+	eh_frame = uw_encoded(&p, hbuf + sizeof hbuf, hbuf[1], hdr + 4);
+	nfde = uw_encoded(&p, hbuf + sizeof hbuf, hbuf[2], hdr + (p - hbuf));
+	tab = hdr + (p - hbuf);
+	if (eh_frame == 0 || nfde == 0 || nfde > (1 << 20))
+		return FALSE;
+
+	b->b_nrows = 0;
+	b->b_cie = 0;
+	/***********************************************/
+	/*   Pull  the  search table in a page at a  */
+	/*   time  -  one access_remote_vm per entry  */
+	/*   is  far too slow on a big library. Each  */
+	/*   read  stops at a page boundary so a hole  */
+	/*   only costs us the tail of the table.      */
+	/***********************************************/
+	for (i = 0; i < nfde; i += n) {
+		addr = tab + i * 8;
+		n = (UW_TABBUF - (addr & (UW_TABBUF - 1))) / 8;
+		if (n == 0)
+			n = 1;
+		if (n > nfde - i)
+			n = nfde - i;
+		if (!uw_read(b, addr, b->b_tabbuf, n * 8))
+			break;
+		for (j = 0, ent = b->b_tabbuf; j < n; j++, ent += 2) {
+			if (hdr + ent[0] < b->b_start || hdr + ent[0] >= b->b_end)
+				continue;
+			if (!uw_fde(b, hdr + ent[1]))
+				goto done;
+		}
+	}
+done:
+	if (b->b_nrows == 0)
+		return FALSE;
+
+	/***********************************************/
+	/*   The  table is sorted by start address, so  */
+	/*   this is normally a no-op.		       */
+	/***********************************************/
+	sort(b->b_rows, b->b_nrows, sizeof(uw_row_t), uw_row_cmp, NULL);
+
+	op->o_start = b->b_start;
+	op->o_end = b->b_end;
+	op->o_nrows = b->b_nrows;
+	op->o_rows = kmem_alloc(b->b_nrows * sizeof(uw_row_t), KM_SLEEP);
+	op->o_nblk = ((b->b_end - b->b_start) >> UW_BLOCK_SHIFT) + 1;
+	op->o_blk = kmem_alloc(op->o_nblk * sizeof(unsigned int), KM_SLEEP);
+	if (op->o_rows == NULL || op->o_blk == NULL) {
+		if (op->o_rows)
+			kmem_free(op->o_rows, b->b_nrows * sizeof(uw_row_t));
+		if (op->o_blk)
+			kmem_free(op->o_blk, op->o_nblk * sizeof(unsigned int));
+		op->o_rows = NULL;
+		op->o_blk = NULL;
+		return FALSE;
+	}
+	memcpy(op->o_rows, b->b_rows, b->b_nrows * sizeof(uw_row_t));
+
+	for (blk = 0, r = 0; blk < op->o_nblk; blk++) {
+		while (r + 1 < op->o_nrows &&
+		       op->o_rows[r + 1].r_off <= (blk << UW_BLOCK_SHIFT))
+			r++;
+		op->o_blk[blk] = r;
+	}
+	return TRUE;
+}
+static void
+uw_free_tab(uw_tab_t *ut)
+{	int	i;
+	uw_obj_t *op;
+
+	for (i = 0, op = ut->u_obj; i < UW_MAXOBJ; i++, op++) {
+		if (op->o_rows)
+			kmem_free(op->o_rows, op->o_nrows * sizeof(uw_row_t));
+		if (op->o_blk)
+			kmem_free(op->o_blk, op->o_nblk * sizeof(unsigned int));
+	}
+	kmem_free(ut, sizeof *ut);
+}
+/**********************************************************************/
+/*   Replace (or remove, if new is NULL) the table for an mm.	      */
+/**********************************************************************/
+static void
+uw_publish(struct mm_struct *mm, uw_tab_t *new)
+{	uw_tab_t **utp, *old = NULL;
+
+	mutex_enter(&uw_mtx);
+	for (utp = &uw_hash[UW_HASHMM(mm)]; *utp; utp = &(*utp)->u_next) {
+		if ((*utp)->u_mm == mm) {
+			old = *utp;
+			break;
+		}
+	}
+	if (new) {
+		new->u_next = old ? old->u_next : *utp;
+		smp_wmb();
+		*utp = new;
+	} else if (old)
+		*utp = old->u_next;
+	mutex_exit(&uw_mtx);
+
+	if (old) {
+		dtrace_sync();
+		uw_free_tab(old);
+	}
+}
+static void
+uw_build(pid_t pid)
+{	struct task_struct *task;
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	struct { unsigned long start, end, base; } maps[UW_MAXOBJ];
+	int	nmaps = 0, i;
+	uw_build_t *b;
+	uw_tab_t *ut;
+	pid_t	tgid = 0;
+
+	rcu_read_lock();
+	task = uw_find_task_by_vpid(pid);
+	mm = task ? uw_get_task_mm(task) : NULL;
+	if (mm)
+		tgid = task->tgid;
+	rcu_read_unlock();
+	if (mm == NULL)
+		return;
+
+	/***********************************************/
+	/*   Note  the  text mappings, then drop the  */
+	/*   lock - access_remote_vm wants it.	       */
+	/***********************************************/
+	down_read(&mm->mmap_sem);
+	for (vma = mm->mmap; vma && nmaps < UW_MAXOBJ; vma = vma->vm_next) {
+		if ((vma->vm_flags & VM_EXEC) == 0 || vma->vm_file == NULL)
+			continue;
+		maps[nmaps].start = vma->vm_start;
+		maps[nmaps].end = vma->vm_end;
+		maps[nmaps].base = vma->vm_start - (vma->vm_pgoff << PAGE_SHIFT);
+		nmaps++;
+	}
+	up_read(&mm->mmap_sem);
+
+	b = kmem_zalloc(sizeof *b, KM_SLEEP);
+	ut = kmem_zalloc(sizeof *ut, KM_SLEEP);
+	if (b == NULL || ut == NULL)
+		goto out;
+	b->b_mm = mm;
+	ut->u_mm = mm;
+	ut->u_exe = (void *) mm->exe_file;
+	ut->u_tgid = tgid;
+	ut->u_built = jiffies;
+	for (i = 0; i < nmaps; i++) {
+		b->b_start = maps[i].start;
+		b->b_end = maps[i].end;
+		if (uw_load_obj(b, &ut->u_obj[ut->u_nobj], maps[i].base))
+			ut->u_nobj++;
+	}
+	cnt_unwind_build++;
+	uw_publish(mm, ut);
+	ut = NULL;
+
+out:
+	if (ut)
+		uw_free_tab(ut);
+	if (b) {
+		if (b->b_rows)
+			kmem_free(b->b_rows, b->b_size * sizeof(uw_row_t));
+		kmem_free(b, sizeof *b);
+	}
+	uw_mmput(mm);
+}
+static void
+uw_worker(struct work_struct *work)
+{	int	i;
+	pid_t	pid;
+
+	for (i = 0; i < UW_PENDING; i++) {
+		if ((pid = uw_pending[i]) == 0)
+			continue;
+		/***********************************************/
+		/*   Free  the slot before we build, so that a  */
+		/*   request  arriving  meanwhile  (say, after  */
+		/*   an mmap) queues a rebuild, rather than be  */
+		/*   taken as already pending and lost.	       */
+		/***********************************************/
+		if (dtrace_cas32((uint32_t *) &uw_pending[i], pid, 0) != pid)
+			continue;
+		uw_build(pid);
+	}
+}
+/**********************************************************************/
+/*   Process is exiting. Drop the table once the last thread goes.    */
+/**********************************************************************/
+void
+dtrace_unwind_exit(struct task_struct *task)
+{	struct mm_struct *mm = task->mm;
+
+	if (!uw_initted || mm == NULL || atomic_read(&mm->mm_users) > 1)
+		return;
+	uw_publish(mm, NULL);
+}
+# else /* !defined(__amd64) */
+int
+dtrace_unwind_kernel(pc_t *pcstack, int pcstack_limit, struct pt_regs *regs)
+{
+	return -1;
+}
+int
+dtrace_unwind_user(uint64_t *pcstack, int pcstack_limit)
+{
+	return -1;
+}
+void
+dtrace_unwind_request(pid_t pid)
+{
+}
+void
+dtrace_unwind_kick(void)
+{
+}
+void
+dtrace_unwind_exit(struct task_struct *task)
+{
+}
+# endif /* defined(__amd64) */
+
+/**********************************************************************/
+/*   Find the kernel pieces we need. Called from dtrace_linux_init.   */
+/**********************************************************************/
+void
+dtrace_unwind_init(void)
+{
+# if defined(__amd64)
+# if defined(CONFIG_UNWINDER_ORC)
+	orc_ip_start = get_proc_addr("__start_orc_unwind_ip");
+	orc_ip_end = get_proc_addr("__stop_orc_unwind_ip");
+	orc_start = get_proc_addr("__start_orc_unwind");
+	orc_lookup_start = get_proc_addr("orc_lookup");
+	orc_lookup_stop = get_proc_addr("orc_lookup_end");
+	orc_text = get_proc_addr("_stext");
+	orc_etext = get_proc_addr("_etext");
+	orc_module_address = get_proc_addr("__module_address");
+	if (orc_ip_end == NULL || orc_start == NULL || orc_lookup_start == NULL ||
+	    orc_lookup_stop == NULL || orc_text == NULL || orc_etext == NULL)
+		orc_ip_start = NULL;
+# endif
+	uw_find_task_by_vpid = get_proc_addr("find_task_by_vpid");
+	uw_get_task_mm = get_proc_addr("get_task_mm");
+	uw_mmput = get_proc_addr("mmput");
+	uw_access_remote_vm = get_proc_addr("access_remote_vm");
+	if (uw_find_task_by_vpid && uw_get_task_mm && uw_mmput && uw_access_remote_vm) {
+		INIT_WORK(&uw_work, uw_worker);
+		uw_initted = TRUE;
+	}
+# endif
+}
+void
+dtrace_unwind_fini(void)
+{
+# if defined(__amd64)
+	int	i;
+	uw_tab_t *ut;
+
+	if (!uw_initted)
+		return;
+	uw_initted = FALSE;
+	cancel_work_sync(&uw_work);
+	for (i = 0; i < UW_HASH; i++) {
+		while ((ut = uw_hash[i]) != NULL) {
+			uw_hash[i] = ut->u_next;
+			uw_free_tab(ut);
+		}
+	}
+# endif
+}
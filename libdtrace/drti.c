@@ -59,6 +59,11 @@
  *	DTRACE_DOF_INIT_DEBUG		enable debugging output
  *	DTRACE_DOF_INIT_DISABLE		disable helper loading
  *	DTRACE_DOF_INIT_DEVNAME		set the path to the helper node
+ *
+ * Handing the DOF to the kernel is cheap: the kernel does not create the
+ * providers and probes it describes until a consumer enables a matching
+ * provider, and processes running the same object share one validated copy
+ * of its DOF.  So we register unconditionally at startup, without waiting.
  */
 
 # if defined(linux)
@@ -95,18 +100,73 @@ dprintf1(int debug, const char *fmt, ...)
 	va_end(ap);
 }
 
+# if defined(linux)
+/**********************************************************************/
+/*   glibc's  <link.h>  clashes with the Solaris one we pick up from  */
+/*   ../linux,  so  declare  just  the  parts of dl_iterate_phdr() we  */
+/*   need. The leading members of dl_phdr_info are fixed by the ABI.  */
+/**********************************************************************/
+#ifdef _LP64
+typedef Elf64_Phdr drti_phdr_t;
+#else
+typedef Elf32_Phdr drti_phdr_t;
+#endif
+struct dl_phdr_info {
+	uintptr_t	dlpi_addr;
+	const char	*dlpi_name;
+	const drti_phdr_t *dlpi_phdr;
+	uint16_t	dlpi_phnum;
+	};
+extern int dl_iterate_phdr(int (*)(struct dl_phdr_info *, size_t, void *),
+	void *);
+
+/**********************************************************************/
+/*   Callback  for  dl_iterate_phdr():  find the loaded object whose  */
+/*   text contains ds_pc, ie the one drti.o was linked into.	      */
+/**********************************************************************/
+struct drti_self {
+	uintptr_t	ds_pc;
+	uintptr_t	ds_addr;
+	const char	*ds_name;
+	};
+
+static int
+drti_find_self(struct dl_phdr_info *info, size_t size, void *arg)
+{	struct drti_self *self = arg;
+	int	i;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		const drti_phdr_t *ph = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+
+		if (ph->p_type != PT_LOAD)
+			continue;
+		if (self->ds_pc < start || self->ds_pc >= start + ph->p_memsz)
+			continue;
+
+		self->ds_addr = info->dlpi_addr;
+		self->ds_name = info->dlpi_name;
+		return 1;
+	}
+	return 0;
+}
+# endif
+
 #pragma init(dtrace_dof_init)
 static void pragma_init
 dtrace_dof_init(void)
 {
 	dof_hdr_t *dof = &__SUNW_dof;
-#ifdef _LP64
+#if defined(linux)
+#elif defined(_LP64)
 	Elf64_Ehdr *elf;
 #else
 	Elf32_Ehdr *elf;
 #endif
 	dof_helper_t dh;
+#if !defined(linux)
 	Link_map *lmp = 0;
+#endif
 	Lmid_t lmid;
 	int fd;
 	const char *p;
@@ -116,56 +176,45 @@ dtrace_dof_init(void)
 
 # if defined(linux)
 	{
-	char	buf[PATH_MAX];
-	FILE	*fp;
+	struct drti_self self;
 
 	/***********************************************/
-	/*   Initialise this, but its wrong - we need  */
-	/*   RTLD_SELF  under  Linux.  We  may  be an  */
-	/*   instrumented   shlib,   rather  than  an  */
-	/*   executable.			       */
+	/*   Find  the  object  we  were linked into.  */
+	/*   dl_iterate_phdr()  is in libc, so we can  */
+	/*   use  it  without  -ldl, and it saves us  */
+	/*   reading  /proc/self/maps on every exec.   */
+	/*   dlpi_addr  is  the  load  bias, which is  */
+	/*   zero  for  a  fixed executable, so it is  */
+	/*   exactly what dofhp_addr wants.	       */
 	/***********************************************/
 	lmid = 0;
-
-	snprintf(buf, sizeof buf, "/proc/%d/maps", (int) getpid());
-	if ((fp = fopen(buf, "r")) == NULL) {
-		dprintf1(0, "drti: failed to open %s\n", buf);
+	memset(&self, 0, sizeof self);
+	self.ds_pc = (uintptr_t) dtrace_dof_init;
+	if (dl_iterate_phdr(drti_find_self, &self) == 0) {
+		dprintf1(0, "drti: cannot locate self in shlibs\n");
 		return;
-		}
-	while (fgets(buf, sizeof buf, fp)) {
-		char	*s1 = strtok(buf, "-");
-		char	*s2 = strtok(NULL, " ");
-		unsigned long p = (unsigned long) dtrace_dof_init;
-		unsigned long start;
-		unsigned long end;
-		if (s1 == NULL || s2 == NULL)
-			continue;
+	}
 
-		start = strtol(s1, NULL, 16);
-		end = strtol(s2, NULL, 16);
-		if (!(start <= p && p < end))
-			continue;
-		s1 = strtok(NULL, "\n");
-		modname = strchr(s1, '/');
-		elf = start;
-		break;
+	modname = self.ds_name;
+	if (modname == NULL || *modname == '\0') {
+		/***********************************************/
+		/*   The main program has no name here.	       */
+		/***********************************************/
+		static char exename[PATH_MAX];
+		int	n = readlink("/proc/self/exe", exename,
+			    sizeof exename - 1);
+		if (n <= 0) {
+			dprintf1(0, "drti: cannot find executable name\n");
+			return;
 		}
-
-	fclose(fp);
-
-	/***********************************************/
-	/*   We  want  to  find  our base address and  */
-	/*   module  name.  Dont  seem  to be able to  */
-	/*   rely on -lelf/-ldl so just do it here.    */
-	/***********************************************/
-	if (modname == NULL) {
-		dprintf1(0, "drti: cannot locate self in shlibs\n");
-		return;
+		exename[n] = '\0';
+		modname = exename;
 	}
 
 	if (strchr(modname, '/'))
 		modname = strrchr(modname, '/') + 1;
 
+	dh.dofhp_addr = self.ds_addr;
 	}
 # else
 //printf("dof=__SUNW_dof\n");
@@ -198,17 +247,7 @@ dtrace_dof_init(void)
 #endif
 
 	dh.dofhp_dof = (uintptr_t)dof;
-#if defined(linux)
-	/***********************************************/
-	/*   Avoid  causing  a core dump, as reported  */
-	/*   by Martin Englund when compiling Ruby.    */
-	/***********************************************/
-	if (lmp == NULL) {
-		dprintf1(1, "drti: lmp is null - giving up");
-		return;
-	}
-	dh.dofhp_addr = elf->e_type == ET_DYN ? lmp->l_addr : 0;
-#else
+#if !defined(linux)
 	dh.dofhp_addr = elf->e_type == ET_DYN ? lmp->l_addr : 0;
 #endif
 
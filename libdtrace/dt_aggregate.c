@@ -53,13 +53,51 @@ static int dt_keypos;
 #define	DT_LESSTHAN	(dt_revsort == 0 ? -1 : 1)
 #define	DT_GREATERTHAN	(dt_revsort == 0 ? 1 : -1)
 
+/*
+ * Add n 64-bit words of src into dst.  This is the inner loop of merging
+ * every count(), sum() and histogram from every CPU, so it is unrolled into
+ * independent lanes that the compiler is free to schedule (or vectorize) in
+ * parallel rather than as one serial chain of loads and adds.
+ */
+static void
+dt_aggregate_addv(int64_t *dst, const int64_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		dst[i] += src[i];
+		dst[i + 1] += src[i + 1];
+		dst[i + 2] += src[i + 2];
+		dst[i + 3] += src[i + 3];
+	}
+
+	for (; i < n; i++)
+		dst[i] += src[i];
+}
+
 static void
 dt_aggregate_count(int64_t *existing, int64_t *new, size_t size)
 {
-	uint_t i;
+	dt_aggregate_addv(existing, new, size / sizeof (int64_t));
+}
 
-	for (i = 0; i < size / sizeof (int64_t); i++)
-		existing[i] = existing[i] + new[i];
+/*
+ * Merge a record that arrived compacted (see DTRACE_AGGCOMPACT_FLAG) by
+ * touching only its non-zero words, as recorded by dt_aggregate_expand().
+ * The first word of an lquantize() or llquantize() value is its encoded
+ * argument rather than a bucket, and must not be summed.
+ */
+static void
+dt_aggregate_sparse(int64_t *existing, dt_aggregate_t *agp,
+    dtrace_actkind_t action)
+{
+	dt_aggsparse_t *sparse = agp->dtat_sparse;
+	uint_t i, first = action == DTRACEAGG_QUANTIZE ? 0 : 1;
+
+	for (i = 0; i < agp->dtat_nsparse; i++) {
+		if (sparse[i].dtas_ndx >= first)
+			existing[sparse[i].dtas_ndx] += sparse[i].dtas_val;
+	}
 }
 
 static int
@@ -127,12 +165,9 @@ dt_aggregate_stddevcmp(int64_t *lhs, int64_t *rhs)
 static void
 dt_aggregate_lquantize(int64_t *existing, int64_t *new, size_t size)
 {
-	int64_t arg = *existing++;
-	uint16_t levels = DTRACE_LQUANTIZE_LEVELS(arg);
-	int i;
+	uint16_t levels = DTRACE_LQUANTIZE_LEVELS(*existing);
 
-	for (i = 0; i <= levels + 1; i++)
-		existing[i] = existing[i] + new[i + 1];
+	dt_aggregate_addv(existing + 1, new + 1, levels + 2);
 }
 
 static long double
@@ -209,10 +244,7 @@ dt_aggregate_lquantizedcmp(int64_t *lhs, int64_t *rhs)
 static void
 dt_aggregate_llquantize(int64_t *existing, int64_t *new, size_t size)
 {
-	int i;
-
-	for (i = 1; i < size / sizeof (int64_t); i++)
-		existing[i] = existing[i] + new[i];
+	dt_aggregate_addv(existing + 1, new + 1, size / sizeof (int64_t) - 1);
 }
 
 static long double
@@ -283,6 +315,125 @@ dt_aggregate_llquantizedcmp(int64_t *lhs, int64_t *rhs)
 	return (0);
 }
 
+/*ARGSUSED*/
+static void
+dt_aggregate_distinct(int64_t *existing, int64_t *new, size_t size)
+{
+	uint8_t *eregs = (uint8_t *)existing, *nregs = (uint8_t *)new;
+	int i;
+
+	for (i = 0; i < DTRACE_DISTINCT_NREGS; i++) {
+		if (nregs[i] > eregs[i])
+			eregs[i] = nregs[i];
+	}
+}
+
+static int
+dt_aggregate_distinctcmp(int64_t *lhs, int64_t *rhs)
+{
+	uint64_t lval = dt_distinct_estimate((uint8_t *)lhs);
+	uint64_t rval = dt_distinct_estimate((uint8_t *)rhs);
+
+	if (lval < rval)
+		return (DT_LESSTHAN);
+
+	if (lval > rval)
+		return (DT_GREATERTHAN);
+
+	return (0);
+}
+
+/*
+ * Slide the window of a percentiles() sketch up so that its lowest bucket
+ * is base, folding the buckets that fall off into the new lowest bucket.
+ * This mirrors what the kernel does when a value lands above the window.
+ */
+static void
+dt_aggregate_pctlrebase(int64_t *pctl, uint64_t base)
+{
+	int64_t *buckets = &pctl[2];
+	uint64_t shift, i;
+
+	if (base <= (uint64_t)pctl[0])
+		return;
+
+	shift = base - (uint64_t)pctl[0];
+
+	for (i = 1; i <= shift && i < DTRACE_PCTL_NBUCKETS; i++)
+		buckets[0] += buckets[i];
+
+	for (i = 1; i + shift < DTRACE_PCTL_NBUCKETS; i++)
+		buckets[i] = buckets[i + shift];
+
+	for (; i < DTRACE_PCTL_NBUCKETS; i++)
+		buckets[i] = 0;
+
+	pctl[0] = (int64_t)base;
+}
+
+/*ARGSUSED*/
+static void
+dt_aggregate_percentiles(int64_t *existing, int64_t *new, size_t size)
+{
+	uint64_t nbase = (uint64_t)new[0], ebase, ndx, i;
+
+	dt_aggregate_pctlrebase(existing, nbase);
+	ebase = (uint64_t)existing[0];
+	existing[1] += new[1];
+
+	/*
+	 * Having rebased, the existing window starts at or above the new one,
+	 * so every incoming bucket lands either in the window or in its
+	 * lowest bucket.
+	 */
+	for (i = 0; i < DTRACE_PCTL_NBUCKETS; i++) {
+		if (new[i + 2] == 0)
+			continue;
+
+		ndx = nbase + i;
+		existing[2 + (ndx < ebase ? 0 : ndx - ebase)] += new[i + 2];
+	}
+}
+
+static long double
+dt_aggregate_percentilessum(int64_t *pctl)
+{
+	uint64_t base = (uint64_t)pctl[0], i;
+	long double total = 0;
+
+	for (i = 0; i < DTRACE_PCTL_NBUCKETS; i++) {
+		total += (long double)pctl[i + 2] *
+		    (long double)DTRACE_PCTL_BUCKETMIN(base + i);
+	}
+
+	return (total);
+}
+
+static int
+dt_aggregate_percentilescmp(int64_t *lhs, int64_t *rhs)
+{
+	long double lsum = dt_aggregate_percentilessum(lhs);
+	long double rsum = dt_aggregate_percentilessum(rhs);
+
+	if (lsum < rsum)
+		return (DT_LESSTHAN);
+
+	if (lsum > rsum)
+		return (DT_GREATERTHAN);
+
+	/*
+	 * If the sums are equal, compare based on the number of values that
+	 * were less than or equal to zero.
+	 */
+	if (lhs[1] < rhs[1])
+		return (DT_LESSTHAN);
+
+	if (lhs[1] > rhs[1])
+		return (DT_GREATERTHAN);
+
+	return (0);
+}
+
 static int
 dt_aggregate_quantizedcmp(int64_t *lhs, int64_t *rhs)
 {
@@ -298,8 +449,15 @@ dt_aggregate_quantizedcmp(int64_t *lhs, int64_t *rhs)
 			rzero = rhs[i];
 		}
 
-		ltotal += (long double)bucketval * (long double)lhs[i];
-		rtotal += (long double)bucketval * (long double)rhs[i];
+		/*
+		 * Nearly all buckets of a typical quantization are empty;
+		 * skip the (slow) long double arithmetic for those.
+		 */
+		if (lhs[i] != 0)
+			ltotal += (long double)bucketval * (long double)lhs[i];
+
+		if (rhs[i] != 0)
+			rtotal += (long double)bucketval * (long double)rhs[i];
 	}
 
 	if (ltotal < rtotal)
@@ -327,22 +485,11 @@ dt_aggregate_usym(dtrace_hdl_t *dtp, uint64_t *data)
 {
 	uint64_t pid = data[0];
 	uint64_t *pc = &data[1];
-	struct ps_prochandle *P;
-	GElf_Sym sym;
-
-	if (dtp->dt_vector != NULL)
-		return;
-
-	if ((P = dt_proc_grab(dtp, pid, PGRAB_RDONLY | PGRAB_FORCE, 0)) == NULL)
-		return;
+	const dt_symcache_ent_t *dse;
 
-	dt_proc_lock(dtp, P);
-
-	if (Plookup_by_addr(P, *pc, NULL, 0, &sym) == 0)
-		*pc = sym.st_value;
-
-	dt_proc_unlock(dtp, P);
-	dt_proc_release(dtp, P);
+	if ((dse = dt_symcache_ulookup(dtp, pid, *pc)) != NULL &&
+	    (dse->dse_flags & DT_SYMCACHE_SYM))
+		*pc = dse->dse_value;
 }
 
 static void
@@ -350,32 +497,22 @@ dt_aggregate_umod(dtrace_hdl_t *dtp, uint64_t *data)
 {
 	uint64_t pid = data[0];
 	uint64_t *pc = &data[1];
-	struct ps_prochandle *P;
-	const prmap_t *map;
-
-	if (dtp->dt_vector != NULL)
-		return;
-
-	if ((P = dt_proc_grab(dtp, pid, PGRAB_RDONLY | PGRAB_FORCE, 0)) == NULL)
-		return;
-
-	dt_proc_lock(dtp, P);
-
-	if ((map = Paddr_to_map(P, *pc)) != NULL)
-		*pc = map->pr_vaddr;
+	const dt_symcache_ent_t *dse;
 
-	dt_proc_unlock(dtp, P);
-	dt_proc_release(dtp, P);
+	if ((dse = dt_symcache_ulookup(dtp, pid, *pc)) != NULL &&
+	    (dse->dse_flags & DT_SYMCACHE_MAP))
+		*pc = dse->dse_mapva;
 }
 
 static void
 dt_aggregate_sym(dtrace_hdl_t *dtp, uint64_t *data)
 {
-	GElf_Sym sym;
+	const dt_symcache_ent_t *dse;
 	uint64_t *pc = data;
 
-	if (dtrace_lookup_by_addr(dtp, *pc, &sym, NULL) == 0)
-		*pc = sym.st_value;
+	if ((dse = dt_symcache_lookup(dtp, NULL, 0, *pc)) != NULL &&
+	    (dse->dse_flags & DT_SYMCACHE_SYM))
+		*pc = dse->dse_value;
 }
 
 static void
@@ -426,14 +563,106 @@ dt_aggregate_aggvarid(dt_ahashent_t *ent)
 	return (agg->dtagd_varid);
 }
 
+static uint8_t *
+dt_aggregate_varint(uint8_t *p, uint8_t *end, uint64_t *valp)
+{
+	uint64_t val = 0;
+	int shift;
+
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		val |= (uint64_t)(*p & 0x7f) << shift;
+
+		if (!(*p++ & 0x80)) {
+			*valp = val;
+			return (p);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Expand a record that the kernel compacted (see DTRACE_AGGCOMPACT_FLAG in
+ * <sys/dtrace.h>) into dtat_scratch, where it looks exactly like a dense
+ * record.  The non-zero words are also left in dtat_sparse, so that merging
+ * into an existing entry need only touch those.  On success, the number of
+ * snapshot bytes the compacted record occupied is returned in lenp.
+ */
+static int
+dt_aggregate_expand(dtrace_hdl_t *dtp, dtrace_aggdesc_t *agg, caddr_t addr,
+    size_t avail, size_t *lenp)
+{
+	dt_aggregate_t *agp = &dtp->dt_aggregate;
+	dtrace_recdesc_t *rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
+	size_t size = rec->dtrd_offset, len;
+	uint_t n = rec->dtrd_size / sizeof (int64_t);
+	uint64_t ndx = 0, delta, v;
+	uint32_t nbytes;
+	uint8_t *p, *end;
+	int64_t *val;
+
+	if (size + sizeof (uint32_t) > avail)
+		return (dt_set_errno(dtp, EDT_BADAGG));
+
+	/* LINTED - alignment */
+	nbytes = *((uint32_t *)(addr + size));
+	len = size + sizeof (uint32_t) + nbytes;
+
+	if (len > avail)
+		return (dt_set_errno(dtp, EDT_BADAGG));
+
+	if (agp->dtat_scratchsize < agg->dtagd_size) {
+		caddr_t scratch = malloc(agg->dtagd_size);
+		dt_aggsparse_t *sparse = malloc(n * sizeof (dt_aggsparse_t));
+
+		if (scratch == NULL || sparse == NULL) {
+			free(scratch);
+			free(sparse);
+			return (dt_set_errno(dtp, EDT_NOMEM));
+		}
+
+		free(agp->dtat_scratch);
+		free(agp->dtat_sparse);
+		agp->dtat_scratch = scratch;
+		agp->dtat_sparse = sparse;
+		agp->dtat_scratchsize = agg->dtagd_size;
+	}
+
+	bcopy(addr, agp->dtat_scratch, size);
+	/* LINTED - alignment */
+	*((dtrace_aggid_t *)agp->dtat_scratch) &= ~DTRACE_AGGCOMPACT_FLAG;
+
+	/* LINTED - alignment */
+	val = (int64_t *)(agp->dtat_scratch + size);
+	bzero(val, rec->dtrd_size);
+	agp->dtat_nsparse = 0;
+
+	p = (uint8_t *)addr + size + sizeof (uint32_t);
+	end = p + nbytes;
+
+	while (p < end) {
+		if ((p = dt_aggregate_varint(p, end, &delta)) == NULL ||
+		    (p = dt_aggregate_varint(p, end, &v)) == NULL ||
+		    (ndx += delta) >= n || agp->dtat_nsparse >= n)
+			return (dt_set_errno(dtp, EDT_BADAGG));
+
+		val[ndx] = DTRACE_AGGCOMPACT_UNZIGZAG(v);
+		agp->dtat_sparse[agp->dtat_nsparse].dtas_ndx = (uint32_t)ndx;
+		agp->dtat_sparse[agp->dtat_nsparse++].dtas_val = val[ndx];
+	}
+
+	*lenp = (len + sizeof (uint32_t) - 1) & ~(sizeof (uint32_t) - 1);
+
+	return (0);
+}
 
 static int
 dt_aggregate_snap_cpu(dtrace_hdl_t *dtp, processorid_t cpu)
 {
 	dtrace_epid_t id;
 	uint64_t hashval;
-	size_t offs, roffs, size, ndx;
-	int i, j, rval;
+	size_t offs, roffs, size, rsize, ndx;
+	int i, j, rval, compact;
 	caddr_t addr, data;
 	dtrace_recdesc_t *rec;
 	dt_aggregate_t *agp = &dtp->dt_aggregate;
@@ -459,6 +688,9 @@ dt_aggregate_snap_cpu(dtrace_hdl_t *dtp, processorid_t cpu)
 		return (dt_set_errno(dtp, errno));
 	}
 
+	if (dtp->dt_capture != NULL && dt_capture_aggsnap(dtp, buf) == -1)
+		return (-1);
+
 	if (buf->dtbd_drops != 0) {
 		if (dt_handle_cpudrop(dtp, cpu,
 		    DTRACEDROP_AGGREGATION, buf->dtbd_drops) == -1)
@@ -496,10 +728,24 @@ dt_aggregate_snap_cpu(dtrace_hdl_t *dtp, processorid_t cpu)
 			continue;
 		}
 
+		compact = (id & DTRACE_AGGCOMPACT_FLAG) != 0;
+		id &= ~DTRACE_AGGCOMPACT_FLAG;
+
 		if ((rval = dt_aggid_lookup(dtp, id, &agg)) != 0)
 			return (rval);
 
-		addr = buf->dtbd_data + offs;
+		if (compact) {
+			if (dt_aggregate_expand(dtp, agg,
+			    buf->dtbd_data + offs, buf->dtbd_size - offs,
+			    &rsize) != 0)
+				return (-1);
+
+			addr = agp->dtat_scratch;
+		} else {
+			addr = buf->dtbd_data + offs;
+			rsize = agg->dtagd_size;
+		}
+
 		size = agg->dtagd_size;
 		hashval = 0;
 
@@ -565,10 +811,17 @@ dt_aggregate_snap_cpu(dtrace_hdl_t *dtp, processorid_t cpu)
 			 */
 			rec = &agg->dtagd_rec[agg->dtagd_nrecs - 1];
 			roffs = rec->dtrd_offset;
-			/* LINTED - alignment */
-			h->dtahe_aggregate((int64_t *)&data[roffs],
-			    /* LINTED - alignment */
-			    (int64_t *)&addr[roffs], rec->dtrd_size);
+
+			if (compact) {
+				/* LINTED - alignment */
+				dt_aggregate_sparse((int64_t *)&data[roffs],
+				    agp, rec->dtrd_action);
+			} else {
+				/* LINTED - alignment */
+				h->dtahe_aggregate((int64_t *)&data[roffs],
+				    /* LINTED - alignment */
+				    (int64_t *)&addr[roffs], rec->dtrd_size);
+			}
 
 			/*
 			 * If we're keeping per CPU data, apply the aggregating
@@ -577,10 +830,17 @@ dt_aggregate_snap_cpu(dtrace_hdl_t *dtp, processorid_t cpu)
 			if (aggdata->dtada_percpu != NULL) {
 				data = aggdata->dtada_percpu[cpu];
 
-				/* LINTED - alignment */
-				h->dtahe_aggregate((int64_t *)data,
-				    /* LINTED - alignment */
-				    (int64_t *)&addr[roffs], rec->dtrd_size);
+				if (compact) {
+					/* LINTED - alignment */
+					dt_aggregate_sparse((int64_t *)data,
+					    agp, rec->dtrd_action);
+				} else {
+					/* LINTED - alignment */
+					h->dtahe_aggregate((int64_t *)data,
+					    /* LINTED - alignment */
+					    (int64_t *)&addr[roffs],
+					    rec->dtrd_size);
+				}
 			}
 
 			goto bufnext;
@@ -665,6 +925,14 @@ hashnext:
 			h->dtahe_aggregate = dt_aggregate_llquantize;
 			break;
 
+		case DTRACEAGG_DISTINCT:
+			h->dtahe_aggregate = dt_aggregate_distinct;
+			break;
+
+		case DTRACEAGG_PERCENTILES:
+			h->dtahe_aggregate = dt_aggregate_percentiles;
+			break;
+
 		case DTRACEAGG_COUNT:
 		case DTRACEAGG_SUM:
 		case DTRACEAGG_AVG:
@@ -689,7 +957,7 @@ hashnext:
 		h->dtahe_nextall = hash->dtah_all;
 		hash->dtah_all = h;
 bufnext:
-		offs += agg->dtagd_size;
+		offs += rsize;
 	}
 
 	return (0);
@@ -723,6 +991,20 @@ dtrace_aggregate_snap(dtrace_hdl_t *dtp)
 			return (rval);
 	}
 
+	/*
+	 * With aggtopn, the kernel holds back the records that did not rank,
+	 * in either of each CPU's buffers.  Once we have stopped it copies
+	 * them all out, but only one buffer per snapshot; so take a second.
+	 */
+	if (dtp->dt_stopped && dtp->dt_options[DTRACEOPT_AGGTOPN] !=
+	    DTRACEOPT_UNSET && dtp->dt_options[DTRACEOPT_AGGTOPN] > 0) {
+		for (i = 0; i < agp->dtat_ncpus; i++) {
+			if (rval = dt_aggregate_snap_cpu(dtp,
+			    agp->dtat_cpus[i]))
+				return (rval);
+		}
+	}
+
 	return (0);
 }
 
@@ -936,6 +1218,14 @@ dt_aggregate_valcmp(const void *lhs, const void *rhs)
 		rval = dt_aggregate_llquantizedcmp(laddr, raddr);
 		break;
 
+	case DTRACEAGG_DISTINCT:
+		rval = dt_aggregate_distinctcmp(laddr, raddr);
+		break;
+
+	case DTRACEAGG_PERCENTILES:
+		rval = dt_aggregate_percentilescmp(laddr, raddr);
+		break;
+
 	case DTRACEAGG_COUNT:
 	case DTRACEAGG_SUM:
 	case DTRACEAGG_MIN:
@@ -1953,4 +2243,6 @@ dt_aggregate_destroy(dtrace_hdl_t *dtp)
 
 	free(agp->dtat_buf.dtbd_data);
 	free(agp->dtat_cpus);
+	free(agp->dtat_scratch);
+	free(agp->dtat_sparse);
 }
@@ -0,0 +1,1023 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Trace capture and replay.
+ *
+ * A consumer that has called dtrace_capture() does no formatting of its own:
+ * dtrace_consume() writes each principal buffer snapshot to the capture file
+ * as it comes out of the kernel, and the aggregation, status and start/stop
+ * paths do the same for what they get back from the kernel.  Enabled probe
+ * descriptions, format strings and aggregation descriptions are written as
+ * they are first looked up, and the stack table once tracing has stopped,
+ * so that the file holds everything needed to interpret the buffers.
+ *
+ * dtrace_replay_open() maps such a file and returns a handle opened with a
+ * dtrace_vector_t that answers the same ioctls from it.  dtrace_work(),
+ * dtrace_consume() and the aggregation code then run unmodified: each
+ * BUFSNAP or AGGSNAP for a CPU returns that CPU's next captured snapshot and
+ * each STATUS the next captured status, until the file runs dry and the
+ * replay reports that tracing has exited.  Rate options are zeroed on replay
+ * so that the file is processed as fast as it can be read.
+ *
+ * A capture file is a dt_capture_hdr_t followed by records, each of which is
+ * a dt_capture_rec_t and a payload padded out to a multiple of eight bytes.
+ * The file is in the byte order and data model of the consumer that wrote it;
+ * replay refuses a file written by a consumer with a different one.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <dt_impl.h>
+
+#define	DT_CAPTURE_MAGIC	"\177DTCAPT"	/* includes terminating NUL */
+#define	DT_CAPTURE_VERSION	3	/* 3: dtrace_status_t aggtopn counts */
+#define	DT_CAPTURE_ORDER	0x01020304	/* reads back reversed if swapped */
+
+typedef struct dt_capture_hdr {
+	char dtch_magic[8];		/* DT_CAPTURE_MAGIC */
+	uint32_t dtch_version;		/* DT_CAPTURE_VERSION */
+	uint32_t dtch_hdrsize;		/* size of this header */
+	uint32_t dtch_order;		/* DT_CAPTURE_ORDER */
+	uint32_t dtch_ptrsize;		/* sizeof (void *) of capturing consumer */
+	uint32_t dtch_maxcpu;		/* _SC_CPUID_MAX at capture */
+	uint32_t dtch_ncpu;		/* _SC_NPROCESSORS_MAX at capture */
+} dt_capture_hdr_t;
+
+#define	DT_CAPTURE_GO		1	/* id: beganon; dtrace_optval_t[] */
+#define	DT_CAPTURE_STOP		2	/* id: endedon; no payload */
+#define	DT_CAPTURE_STATUS	3	/* dtrace_status_t */
+#define	DT_CAPTURE_BUFSNAP	4	/* id: CPU; dt_capture_buf_t, data */
+#define	DT_CAPTURE_AGGSNAP	5	/* id: CPU; dt_capture_buf_t, data */
+#define	DT_CAPTURE_EPROBE	6	/* id: EPID; dtrace_eprobedesc_t */
+#define	DT_CAPTURE_PROBE	7	/* id: probe ID; dtrace_probedesc_t */
+#define	DT_CAPTURE_FORMAT	8	/* id: format ID; string */
+#define	DT_CAPTURE_AGGDESC	9	/* id: aggregation ID; desc, then name */
+#define	DT_CAPTURE_STACKTAB	10	/* stack table words, from zero */
+
+typedef struct dt_capture_rec {
+	uint32_t dtcr_type;		/* record type (DT_CAPTURE_*) */
+	uint32_t dtcr_id;		/* CPU or identifier, by type */
+	uint64_t dtcr_size;		/* size of payload, before padding */
+} dt_capture_rec_t;
+
+typedef struct dt_capture_buf {
+	uint64_t dtcb_drops;		/* dtbd_drops */
+	uint64_t dtcb_oldest;		/* dtbd_oldest */
+	uint32_t dtcb_errors;		/* dtbd_errors */
+	uint32_t dtcb_pad;		/* pad to 64-bit alignment */
+} dt_capture_buf_t;
+
+#define	DT_CAPTURE_DATA(rec)	\
+	((const void *)((uintptr_t)(rec) + sizeof (dt_capture_rec_t)))
+
+typedef struct dt_capture {
+	int dcap_fd;			/* capture file */
+	uint32_t dcap_maxcpu;		/* highest CPU ID to snapshot */
+	int dcap_stacktab;		/* stack table has been written */
+} dt_capture_t;
+
+typedef struct dt_replay_queue {
+	const dt_capture_rec_t **drq_recs; /* records, by order or by ID */
+	uint_t drq_nrecs;		/* number of slots in use */
+	uint_t drq_size;		/* number of slots allocated */
+	uint_t drq_next;		/* next record to replay */
+} dt_replay_queue_t;
+
+typedef struct dt_replay {
+	dtrace_hdl_t *drp_hdl;		/* handle replaying the file */
+	const dt_capture_hdr_t *drp_hdr; /* mapping of the capture file */
+	size_t drp_size;		/* size of the capture file */
+	const dt_capture_rec_t *drp_go;	/* DT_CAPTURE_GO record */
+	const dt_capture_rec_t *drp_stop; /* DT_CAPTURE_STOP record, if any */
+	const dt_capture_rec_t *drp_stacktab; /* DT_CAPTURE_STACKTAB, if any */
+	dt_replay_queue_t drp_status;	/* status, in capture order */
+	dt_replay_queue_t *drp_bufs;	/* principal snapshots, per CPU */
+	dt_replay_queue_t *drp_aggs;	/* aggregation snapshots, per CPU */
+	dt_replay_queue_t drp_epids;	/* enabled probes, by EPID */
+	dt_replay_queue_t drp_probes;	/* probes, by probe ID */
+	dt_replay_queue_t drp_formats;	/* format strings, by format ID */
+	dt_replay_queue_t drp_aggdescs;	/* aggregations, by aggregation ID */
+	uint64_t drp_pending;		/* snapshots not yet replayed */
+} dt_replay_t;
+
+static int
+dt_capture_writev(dtrace_hdl_t *dtp, struct iovec *iov, int iovcnt)
+{
+	int fd = dtp->dt_capture->dcap_fd;
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		if ((n = writev(fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return (dt_set_errno(dtp, errno));
+		}
+
+		for (; iovcnt > 0 && n >= (ssize_t)iov->iov_len; iov++, iovcnt--)
+			n -= iov->iov_len;
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Append a record whose payload is the concatenation of two buffers, either
+ * of which may be empty.
+ */
+static int
+dt_capture_write(dtrace_hdl_t *dtp, uint32_t type, uint32_t id,
+    const void *buf1, size_t size1, const void *buf2, size_t size2)
+{
+	static const char pad[sizeof (uint64_t)];
+	dt_capture_rec_t rec;
+	struct iovec iov[4];
+
+	rec.dtcr_type = type;
+	rec.dtcr_id = id;
+	rec.dtcr_size = size1 + size2;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof (rec);
+	iov[1].iov_base = (void *)buf1;
+	iov[1].iov_len = size1;
+	iov[2].iov_base = (void *)buf2;
+	iov[2].iov_len = size2;
+	iov[3].iov_base = (void *)pad;
+	iov[3].iov_len = P2ROUNDUP(rec.dtcr_size, sizeof (uint64_t)) -
+	    rec.dtcr_size;
+
+	return (dt_capture_writev(dtp, iov, 4));
+}
+
+int
+dtrace_capture(dtrace_hdl_t *dtp, const char *path)
+{
+	dt_capture_t *dcap;
+	dt_capture_hdr_t hdr;
+	struct iovec iov;
+
+	if (dtp->dt_active || dtp->dt_capture != NULL || dtp->dt_vector != NULL)
+		return (dt_set_errno(dtp, EINVAL));
+
+	if ((dcap = dt_zalloc(dtp, sizeof (dt_capture_t))) == NULL)
+		return (-1); /* dt_errno has been set for us */
+
+	if ((dcap->dcap_fd = open(path,
+	    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1) {
+		dt_free(dtp, dcap);
+		return (dt_set_errno(dtp, errno));
+	}
+
+	bzero(&hdr, sizeof (hdr));
+	bcopy(DT_CAPTURE_MAGIC, hdr.dtch_magic, sizeof (hdr.dtch_magic));
+	hdr.dtch_version = DT_CAPTURE_VERSION;
+	hdr.dtch_hdrsize = sizeof (hdr);
+	hdr.dtch_order = DT_CAPTURE_ORDER;
+	hdr.dtch_ptrsize = sizeof (void *);
+	hdr.dtch_maxcpu = dt_sysconf(dtp, _SC_CPUID_MAX);
+	hdr.dtch_ncpu = dt_sysconf(dtp, _SC_NPROCESSORS_MAX);
+
+	dcap->dcap_maxcpu = hdr.dtch_maxcpu;
+	dtp->dt_capture = dcap;
+
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof (hdr);
+
+	if (dt_capture_writev(dtp, &iov, 1) != 0) {
+		(void) close(dcap->dcap_fd);
+		dt_free(dtp, dcap);
+		dtp->dt_capture = NULL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+int
+dt_capture_go(dtrace_hdl_t *dtp)
+{
+	return (dt_capture_write(dtp, DT_CAPTURE_GO, dtp->dt_beganon,
+	    dtp->dt_options, sizeof (dtp->dt_options), NULL, 0));
+}
+
+int
+dt_capture_stop(dtrace_hdl_t *dtp)
+{
+	return (dt_capture_write(dtp, DT_CAPTURE_STOP, dtp->dt_endedon,
+	    NULL, 0, NULL, 0));
+}
+
+int
+dt_capture_status(dtrace_hdl_t *dtp, const dtrace_status_t *stat)
+{
+	return (dt_capture_write(dtp, DT_CAPTURE_STATUS, 0,
+	    stat, sizeof (*stat), NULL, 0));
+}
+
+int
+dt_capture_aggsnap(dtrace_hdl_t *dtp, const dtrace_bufdesc_t *buf)
+{
+	dt_capture_buf_t cb;
+
+	bzero(&cb, sizeof (cb));
+	cb.dtcb_drops = buf->dtbd_drops;
+	cb.dtcb_oldest = buf->dtbd_oldest;
+	cb.dtcb_errors = buf->dtbd_errors;
+
+	return (dt_capture_write(dtp, DT_CAPTURE_AGGSNAP, buf->dtbd_cpu,
+	    &cb, sizeof (cb), buf->dtbd_data, buf->dtbd_size));
+}
+
+int
+dt_capture_epid(dtrace_hdl_t *dtp, const dtrace_eprobedesc_t *epd,
+    const dtrace_probedesc_t *pd)
+{
+	if (dt_capture_write(dtp, DT_CAPTURE_EPROBE, epd->dtepd_epid,
+	    epd, DTRACE_SIZEOF_EPROBEDESC(epd), NULL, 0) != 0)
+		return (-1);
+
+	return (dt_capture_write(dtp, DT_CAPTURE_PROBE, pd->dtpd_id,
+	    pd, sizeof (*pd), NULL, 0));
+}
+
+int
+dt_capture_format(dtrace_hdl_t *dtp, int id, const char *str)
+{
+	return (dt_capture_write(dtp, DT_CAPTURE_FORMAT, id,
+	    str, strlen(str) + 1, NULL, 0));
+}
+
+/*
+ * Aggregation descriptions are written once the library has filled in the
+ * name and variable ID from the compiler's statement, since that statement
+ * won't exist on replay; an empty name stands for no name.
+ */
+int
+dt_capture_aggdesc(dtrace_hdl_t *dtp, const dtrace_aggdesc_t *agg)
+{
+	const char *name = agg->dtagd_name != NULL ? agg->dtagd_name : "";
+
+	return (dt_capture_write(dtp, DT_CAPTURE_AGGDESC, agg->dtagd_id,
+	    agg, DTRACE_SIZEOF_AGGDESC(agg), name, strlen(name) + 1));
+}
+
+/*
+ * Write out the stack table.  The kernel only ever appends to it and nothing
+ * is added once tracing has stopped, so we copy it out once, at the end.
+ */
+static int
+dt_capture_stacktab(dtrace_hdl_t *dtp)
+{
+	dtrace_stackdesc_t desc;
+	uint64_t *data;
+	int rval;
+
+	dtp->dt_capture->dcap_stacktab = 1;
+
+	bzero(&desc, sizeof (desc));
+
+	if (dt_ioctl(dtp, DTRACEIOC_STACKTAB, &desc) == -1 ||
+	    desc.dtsd_next == 0)
+		return (0);
+
+	if ((data = malloc(desc.dtsd_next * sizeof (uint64_t))) == NULL)
+		return (dt_set_errno(dtp, EDT_NOMEM));
+
+	desc.dtsd_offs = 0;
+	desc.dtsd_size = desc.dtsd_next;
+	desc.dtsd_data = data;
+
+	if (dt_ioctl(dtp, DTRACEIOC_STACKTAB, &desc) == -1) {
+		free(data);
+		return (dt_set_errno(dtp, errno));
+	}
+
+	rval = dt_capture_write(dtp, DT_CAPTURE_STACKTAB, 0,
+	    data, desc.dtsd_size * sizeof (uint64_t), NULL, 0);
+	free(data);
+
+	return (rval);
+}
+
+/*
+ * Look up the enabled probe of each record in a principal buffer snapshot,
+ * so that its description (and its format strings) make it into the file.
+ * This is the walk of dt_consume_cpu(), without the processing.
+ */
+static int
+dt_capture_epids(dtrace_hdl_t *dtp, dtrace_bufdesc_t *buf)
+{
+	dtrace_eprobedesc_t *epd;
+	dtrace_probedesc_t *pd;
+	dtrace_epid_t id;
+	size_t offs, start = buf->dtbd_oldest, end = buf->dtbd_size;
+	int rval;
+
+again:
+	for (offs = start; offs < end; ) {
+		id = *(uint32_t *)((uintptr_t)buf->dtbd_data + offs);
+
+		if (id == DTRACE_EPIDNONE) {
+			offs += sizeof (id);
+			continue;
+		}
+
+		if ((rval = dt_epid_lookup(dtp, id, &epd, &pd)) != 0)
+			return (rval);
+
+		offs += epd->dtepd_size;
+	}
+
+	if (buf->dtbd_oldest != 0 && start == buf->dtbd_oldest) {
+		end = buf->dtbd_oldest;
+		start = 0;
+		goto again;
+	}
+
+	return (0);
+}
+
+/*
+ * The capturing counterpart of the body of dtrace_consume():  snapshot each
+ * CPU's principal buffer and write it out, reporting drops as we go.  Every
+ * snapshot is written, empty or not, so that replay sees the CPUs in step.
+ */
+int
+dt_capture_consume(dtrace_hdl_t *dtp, dtrace_bufdesc_t *buf)
+{
+	dt_capture_t *dcap = dtp->dt_capture;
+	dt_capture_buf_t cb;
+	uint32_t i;
+	int rval;
+
+	for (i = 0; i <= dcap->dcap_maxcpu; i++) {
+		buf->dtbd_cpu = i;
+
+		if (dt_ioctl(dtp, DTRACEIOC_BUFSNAP, buf) == -1) {
+			if (errno == ENOENT)
+				continue;
+
+			return (dt_set_errno(dtp, errno));
+		}
+
+		bzero(&cb, sizeof (cb));
+		cb.dtcb_drops = buf->dtbd_drops;
+		cb.dtcb_oldest = buf->dtbd_oldest;
+		cb.dtcb_errors = buf->dtbd_errors;
+
+		if (dt_capture_write(dtp, DT_CAPTURE_BUFSNAP, i, &cb,
+		    sizeof (cb), buf->dtbd_data, buf->dtbd_size) != 0)
+			return (-1);
+
+		if ((rval = dt_capture_epids(dtp, buf)) != 0)
+			return (rval);
+
+		if (buf->dtbd_drops != 0 && dt_handle_cpudrop(dtp, i,
+		    DTRACEDROP_PRINCIPAL, buf->dtbd_drops) == -1)
+			return (-1);
+	}
+
+	if (dtp->dt_stopped && !dcap->dcap_stacktab)
+		return (dt_capture_stacktab(dtp));
+
+	return (0);
+}
+
+static int
+dt_replay_grow(dt_replay_queue_t *drq, uint_t n)
+{
+	const dt_capture_rec_t **recs;
+	uint_t size;
+
+	if (n <= drq->drq_size)
+		return (0);
+
+	for (size = drq->drq_size ? drq->drq_size : 16; size < n; size <<= 1)
+		continue;
+
+	if ((recs = realloc(drq->drq_recs, size * sizeof (void *))) == NULL)
+		return (-1);
+
+	bzero(recs + drq->drq_size, (size - drq->drq_size) * sizeof (void *));
+	drq->drq_recs = recs;
+	drq->drq_size = size;
+
+	return (0);
+}
+
+static int
+dt_replay_append(dt_replay_queue_t *drq, const dt_capture_rec_t *rec)
+{
+	if (dt_replay_grow(drq, drq->drq_nrecs + 1) != 0)
+		return (-1);
+
+	drq->drq_recs[drq->drq_nrecs++] = rec;
+	return (0);
+}
+
+/*
+ * Index a record by its ID.  IDs are handed out densely by the kernel, so we
+ * index them directly; a later record for the same ID replaces an earlier.
+ * As each record takes up at least its header, no ID can be as large as the
+ * number of headers the file would hold, which bounds what we allocate.
+ */
+static int
+dt_replay_insert(dt_replay_t *drp, dt_replay_queue_t *drq,
+    const dt_capture_rec_t *rec)
+{
+	if (rec->dtcr_id >= drp->drp_size / sizeof (dt_capture_rec_t))
+		return (EDT_BADCAPTURE);
+
+	if (dt_replay_grow(drq, rec->dtcr_id + 1) != 0)
+		return (EDT_NOMEM);
+
+	drq->drq_recs[rec->dtcr_id] = rec;
+	drq->drq_nrecs = MAX(drq->drq_nrecs, rec->dtcr_id + 1);
+	return (0);
+}
+
+static const dt_capture_rec_t *
+dt_replay_lookup(const dt_replay_queue_t *drq, uint32_t id)
+{
+	return (id < drq->drq_nrecs ? drq->drq_recs[id] : NULL);
+}
+
+static void
+dt_replay_free(dt_replay_t *drp)
+{
+	uint32_t i;
+
+	if (drp->drp_bufs != NULL) {
+		for (i = 0; i <= drp->drp_hdr->dtch_maxcpu; i++) {
+			free(drp->drp_bufs[i].drq_recs);
+			free(drp->drp_aggs[i].drq_recs);
+		}
+	}
+
+	free(drp->drp_bufs);
+	free(drp->drp_aggs);
+	free(drp->drp_status.drq_recs);
+	free(drp->drp_epids.drq_recs);
+	free(drp->drp_probes.drq_recs);
+	free(drp->drp_formats.drq_recs);
+	free(drp->drp_aggdescs.drq_recs);
+
+	if (drp->drp_hdr != NULL)
+		(void) munmap((void *)drp->drp_hdr, drp->drp_size);
+
+	free(drp);
+}
+
+/*
+ * Check that a record's payload is well-formed for its type, and file it
+ * where the ioctl that will ask for it can find it.  Records of types we
+ * don't know are skipped.
+ */
+static int
+dt_replay_index(dt_replay_t *drp, const dt_capture_rec_t *rec)
+{
+	const dt_capture_hdr_t *hdr = drp->drp_hdr;
+	const void *data = DT_CAPTURE_DATA(rec);
+	uint64_t size = rec->dtcr_size;
+	const dtrace_eprobedesc_t *epd;
+	const dtrace_aggdesc_t *agg;
+	const char *str;
+
+	switch (rec->dtcr_type) {
+	case DT_CAPTURE_GO:
+		if (size % sizeof (dtrace_optval_t) != 0)
+			return (EDT_BADCAPTURE);
+		drp->drp_go = rec;
+		return (0);
+
+	case DT_CAPTURE_STOP:
+		drp->drp_stop = rec;
+		return (0);
+
+	case DT_CAPTURE_STATUS:
+		if (size != sizeof (dtrace_status_t))
+			return (EDT_BADCAPTURE);
+		return (dt_replay_append(&drp->drp_status, rec) ? EDT_NOMEM : 0);
+
+	case DT_CAPTURE_BUFSNAP:
+	case DT_CAPTURE_AGGSNAP:
+		if (size < sizeof (dt_capture_buf_t) ||
+		    rec->dtcr_id > hdr->dtch_maxcpu)
+			return (EDT_BADCAPTURE);
+
+		if (dt_replay_append(rec->dtcr_type == DT_CAPTURE_BUFSNAP ?
+		    &drp->drp_bufs[rec->dtcr_id] :
+		    &drp->drp_aggs[rec->dtcr_id], rec) != 0)
+			return (EDT_NOMEM);
+
+		drp->drp_pending++;
+		return (0);
+
+	case DT_CAPTURE_EPROBE:
+		epd = data;
+		if (size < sizeof (dtrace_eprobedesc_t) ||
+		    DTRACE_SIZEOF_EPROBEDESC(epd) > size)
+			return (EDT_BADCAPTURE);
+		return (dt_replay_insert(drp, &drp->drp_epids, rec));
+
+	case DT_CAPTURE_PROBE:
+		if (size != sizeof (dtrace_probedesc_t))
+			return (EDT_BADCAPTURE);
+		return (dt_replay_insert(drp, &drp->drp_probes, rec));
+
+	case DT_CAPTURE_FORMAT:
+		str = data;
+		if (size == 0 || str[size - 1] != '\0')
+			return (EDT_BADCAPTURE);
+		return (dt_replay_insert(drp, &drp->drp_formats, rec));
+
+	case DT_CAPTURE_AGGDESC:
+		agg = data;
+		str = data;
+		if (size < sizeof (dtrace_aggdesc_t) ||
+		    DTRACE_SIZEOF_AGGDESC(agg) >= size || str[size - 1] != '\0')
+			return (EDT_BADCAPTURE);
+		return (dt_replay_insert(drp, &drp->drp_aggdescs, rec));
+
+	case DT_CAPTURE_STACKTAB:
+		if (size % sizeof (uint64_t) != 0)
+			return (EDT_BADCAPTURE);
+		drp->drp_stacktab = rec;
+		return (0);
+	}
+
+	return (0);
+}
+
+static dt_replay_t *
+dt_replay_load(const char *path, int *errp)
+{
+	const dt_capture_hdr_t *hdr;
+	const dt_capture_rec_t *rec;
+	dt_replay_t *drp;
+	struct stat st;
+	uint64_t offs;
+	void *base;
+	int fd, err;
+
+	if ((drp = calloc(1, sizeof (dt_replay_t))) == NULL) {
+		*errp = EDT_NOMEM;
+		return (NULL);
+	}
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 ||
+	    fstat(fd, &st) == -1) {
+		*errp = errno;
+		goto err;
+	}
+
+	if (st.st_size < sizeof (dt_capture_hdr_t)) {
+		*errp = EDT_BADCAPTURE;
+		goto err;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (base == MAP_FAILED) {
+		*errp = errno;
+		goto err;
+	}
+
+	(void) close(fd);
+	fd = -1;
+
+	drp->drp_hdr = hdr = base;
+	drp->drp_size = st.st_size;
+
+	if (bcmp(hdr->dtch_magic, DT_CAPTURE_MAGIC,
+	    sizeof (hdr->dtch_magic)) != 0 ||
+	    hdr->dtch_version != DT_CAPTURE_VERSION ||
+	    hdr->dtch_order != DT_CAPTURE_ORDER ||
+	    hdr->dtch_ptrsize != sizeof (void *) ||
+	    hdr->dtch_hdrsize < sizeof (dt_capture_hdr_t) ||
+	    hdr->dtch_hdrsize > drp->drp_size ||
+	    hdr->dtch_hdrsize % sizeof (uint64_t) != 0 ||
+	    hdr->dtch_maxcpu >= drp->drp_size) {
+		*errp = EDT_BADCAPTURE;
+		goto err;
+	}
+
+	if ((drp->drp_bufs = calloc(hdr->dtch_maxcpu + 1,
+	    sizeof (dt_replay_queue_t))) == NULL ||
+	    (drp->drp_aggs = calloc(hdr->dtch_maxcpu + 1,
+	    sizeof (dt_replay_queue_t))) == NULL) {
+		*errp = EDT_NOMEM;
+		goto err;
+	}
+
+	for (offs = hdr->dtch_hdrsize; offs < drp->drp_size;
+	    offs += sizeof (*rec) + P2ROUNDUP(rec->dtcr_size, sizeof (uint64_t))) {
+		rec = (const dt_capture_rec_t *)((uintptr_t)base + offs);
+
+		if (drp->drp_size - offs < sizeof (*rec) ||
+		    rec->dtcr_size > drp->drp_size - offs - sizeof (*rec)) {
+			*errp = EDT_BADCAPTURE;
+			goto err;
+		}
+
+		if ((err = dt_replay_index(drp, rec)) != 0) {
+			*errp = err;
+			goto err;
+		}
+	}
+
+	if (drp->drp_go == NULL) {
+		*errp = EDT_BADCAPTURE;
+		goto err;
+	}
+
+	return (drp);
+
+err:
+	if (fd != -1)
+		(void) close(fd);
+	dt_replay_free(drp);
+	return (NULL);
+}
+
+static int
+dt_replay_snap(dt_replay_t *drp, dt_replay_queue_t *queues,
+    dtrace_bufdesc_t *buf, dtrace_optval_t bufsize)
+{
+	const dt_capture_buf_t *cb;
+	const dt_capture_rec_t *rec;
+	dt_replay_queue_t *drq;
+
+	if (buf->dtbd_cpu > drp->drp_hdr->dtch_maxcpu ||
+	    queues[buf->dtbd_cpu].drq_nrecs == 0) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	drq = &queues[buf->dtbd_cpu];
+
+	if (drq->drq_next == drq->drq_nrecs) {
+		buf->dtbd_size = 0;
+		buf->dtbd_drops = 0;
+		buf->dtbd_errors = 0;
+		buf->dtbd_oldest = 0;
+		return (0);
+	}
+
+	rec = drq->drq_recs[drq->drq_next];
+	cb = DT_CAPTURE_DATA(rec);
+
+	if (rec->dtcr_size - sizeof (*cb) > (uint64_t)bufsize) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	drq->drq_next++;
+	drp->drp_pending--;
+
+	buf->dtbd_size = rec->dtcr_size - sizeof (*cb);
+	buf->dtbd_drops = cb->dtcb_drops;
+	buf->dtbd_errors = cb->dtcb_errors;
+	buf->dtbd_oldest = cb->dtcb_oldest;
+	bcopy(cb + 1, buf->dtbd_data, buf->dtbd_size);
+
+	return (0);
+}
+
+/*
+ * Replay the captured status in order.  Once it has all been returned, we
+ * report that tracing has exited -- but with the "switch" policy, not until
+ * every snapshot has been replayed, since those are consumed as we go; with
+ * the other policies the snapshots are consumed once we have exited.
+ * Until then, a status that said tracing was exiting or had filled a buffer
+ * is returned without saying so.
+ */
+static int
+dt_replay_status(dt_replay_t *drp, dtrace_status_t *stat)
+{
+	dt_replay_queue_t *drq = &drp->drp_status;
+	dtrace_optval_t policy =
+	    drp->drp_hdl->dt_options[DTRACEOPT_BUFPOLICY];
+
+	if (drq->drq_nrecs == 0)
+		bzero(stat, sizeof (*stat));
+	else if (drq->drq_next < drq->drq_nrecs)
+		bcopy(DT_CAPTURE_DATA(drq->drq_recs[drq->drq_next++]),
+		    stat, sizeof (*stat));
+	else
+		bcopy(DT_CAPTURE_DATA(drq->drq_recs[drq->drq_nrecs - 1]),
+		    stat, sizeof (*stat));
+
+	stat->dtst_exiting = 0;
+	stat->dtst_filled = 0;
+
+	if (drq->drq_next == drq->drq_nrecs &&
+	    (policy != DTRACEOPT_BUFPOLICY_SWITCH || drp->drp_pending == 0))
+		stat->dtst_exiting = 1;
+
+	return (0);
+}
+
+/*
+ * Return the captured options, with the rates zeroed so that dtrace_sleep()
+ * and friends don't pace the replay.
+ */
+static int
+dt_replay_dofget(dt_replay_t *drp, dof_hdr_t *dof)
+{
+	const dtrace_optval_t *opts = DT_CAPTURE_DATA(drp->drp_go);
+	uint_t nopts = drp->drp_go->dtcr_size / sizeof (dtrace_optval_t);
+	dtrace_optval_t options[DTRACEOPT_MAX];
+	uint_t i;
+
+	for (i = 0; i < DTRACEOPT_MAX; i++)
+		options[i] = i < nopts ? opts[i] : DTRACEOPT_UNSET;
+
+	options[DTRACEOPT_STATUSRATE] = 0;
+	options[DTRACEOPT_SWITCHRATE] = 0;
+	options[DTRACEOPT_AGGRATE] = 0;
+
+	dt_options_dof(dof, options);
+	return (0);
+}
+
+static int
+dt_replay_ioctl(void *arg, int cmd, void *data)
+{
+	dt_replay_t *drp = arg;
+	dtrace_hdl_t *dtp = drp->drp_hdl;
+	const dt_capture_rec_t *rec;
+	size_t hdrsize, n;
+	uint64_t nwords;
+	int i;
+
+	switch (cmd) {
+	case DTRACEIOC_GO:
+		*(processorid_t *)data = (processorid_t)drp->drp_go->dtcr_id;
+		return (0);
+
+	case DTRACEIOC_STOP:
+		*(processorid_t *)data = drp->drp_stop != NULL ?
+		    (processorid_t)drp->drp_stop->dtcr_id : DTRACE_CPUALL;
+		return (0);
+
+	case DTRACEIOC_STATUS:
+		return (dt_replay_status(drp, data));
+
+	case DTRACEIOC_BUFSNAP:
+		return (dt_replay_snap(drp, drp->drp_bufs, data,
+		    dt_options_snapsize(dtp)));
+
+	case DTRACEIOC_AGGSNAP:
+		return (dt_replay_snap(drp, drp->drp_aggs, data,
+		    dtp->dt_options[DTRACEOPT_AGGSIZE]));
+
+	case DTRACEIOC_DOFGET:
+		return (dt_replay_dofget(drp, data));
+
+	case DTRACEIOC_EPROBE: {
+		dtrace_eprobedesc_t *epd = data;
+		const dtrace_eprobedesc_t *src;
+
+		if ((rec = dt_replay_lookup(&drp->drp_epids,
+		    epd->dtepd_epid)) == NULL)
+			break;
+
+		/*
+		 * Like the kernel, copy out as many records as the caller has
+		 * room for but report how many there are.
+		 */
+		src = DT_CAPTURE_DATA(rec);
+		hdrsize = offsetof(dtrace_eprobedesc_t, dtepd_rec);
+		n = MIN(epd->dtepd_nrecs, src->dtepd_nrecs);
+		bcopy(src, epd, hdrsize + n * sizeof (dtrace_recdesc_t));
+		return (0);
+	}
+
+	case DTRACEIOC_AGGDESC: {
+		dtrace_aggdesc_t *agg = data;
+		const dtrace_aggdesc_t *src;
+
+		if ((rec = dt_replay_lookup(&drp->drp_aggdescs,
+		    agg->dtagd_id)) == NULL)
+			break;
+
+		/*
+		 * The user arguments are the capturing consumer's pointers to
+		 * its compiled statements; see dt_replay_aggvar().
+		 */
+		src = DT_CAPTURE_DATA(rec);
+		hdrsize = offsetof(dtrace_aggdesc_t, dtagd_rec);
+		n = MIN(agg->dtagd_nrecs, src->dtagd_nrecs);
+		bcopy(src, agg, hdrsize + n * sizeof (dtrace_recdesc_t));
+
+		agg->dtagd_name = NULL;
+		for (i = 0; i < n; i++)
+			agg->dtagd_rec[i].dtrd_uarg = 0;
+		return (0);
+	}
+
+	case DTRACEIOC_PROBES: {
+		dtrace_probedesc_t *pd = data;
+
+		if ((rec = dt_replay_lookup(&drp->drp_probes,
+		    pd->dtpd_id)) == NULL) {
+			errno = ESRCH;
+			return (-1);
+		}
+
+		bcopy(DT_CAPTURE_DATA(rec), pd, sizeof (*pd));
+		return (0);
+	}
+
+	case DTRACEIOC_FORMAT: {
+		dtrace_fmtdesc_t *fmt = data;
+
+		if ((rec = dt_replay_lookup(&drp->drp_formats,
+		    fmt->dtfd_format)) == NULL)
+			break;
+
+		if (fmt->dtfd_length < rec->dtcr_size) {
+			fmt->dtfd_length = rec->dtcr_size;
+			return (0);
+		}
+
+		bcopy(DT_CAPTURE_DATA(rec), fmt->dtfd_string, rec->dtcr_size);
+		return (0);
+	}
+
+	case DTRACEIOC_STACKTAB: {
+		dtrace_stackdesc_t *desc = data;
+		const uint64_t *words;
+
+		rec = drp->drp_stacktab;
+		nwords = rec != NULL ? rec->dtcr_size / sizeof (uint64_t) : 0;
+
+		if (desc->dtsd_offs > nwords)
+			break;
+
+		words = rec != NULL ? DT_CAPTURE_DATA(rec) : NULL;
+		desc->dtsd_size = MIN(desc->dtsd_size,
+		    nwords - desc->dtsd_offs);
+		desc->dtsd_next = nwords;
+
+		if (desc->dtsd_size != 0) {
+			bcopy(words + desc->dtsd_offs, desc->dtsd_data,
+			    desc->dtsd_size * sizeof (uint64_t));
+		}
+
+		return (0);
+	}
+
+	default:
+		errno = ENOTTY;
+		return (-1);
+	}
+
+	errno = EINVAL;
+	return (-1);
+}
+
+/*ARGSUSED*/
+static int
+dt_replay_lookup_by_addr(void *arg, GElf_Addr addr, GElf_Sym *symp,
+    dtrace_syminfo_t *sip)
+{
+	return (-1);
+}
+
+static int
+dt_replay_cpustatus(void *arg, processorid_t cpu)
+{
+	dt_replay_t *drp = arg;
+
+	if (cpu < 0 || cpu > drp->drp_hdr->dtch_maxcpu)
+		return (-1);
+
+	if (drp->drp_bufs[cpu].drq_nrecs == 0 &&
+	    drp->drp_aggs[cpu].drq_nrecs == 0)
+		return (-1);
+
+	return (1);
+}
+
+static long
+dt_replay_sysconf(void *arg, int name)
+{
+	dt_replay_t *drp = arg;
+
+	switch (name) {
+	case _SC_CPUID_MAX:
+		return (drp->drp_hdr->dtch_maxcpu);
+	case _SC_NPROCESSORS_MAX:
+		return (drp->drp_hdr->dtch_ncpu);
+	}
+
+	return (sysconf(name));
+}
+
+static const dtrace_vector_t dt_replay_vector = {
+	dt_replay_ioctl,
+	dt_replay_lookup_by_addr,
+	dt_replay_cpustatus,
+	dt_replay_sysconf
+};
+
+dtrace_hdl_t *
+dtrace_replay_open(int version, int flags, int *errp, const char *path)
+{
+	dtrace_hdl_t *dtp;
+	dt_replay_t *drp;
+	int err;
+
+	if ((drp = dt_replay_load(path, &err)) == NULL) {
+		if (errp != NULL)
+			*errp = err;
+		return (NULL);
+	}
+
+	if ((dtp = dtrace_vopen(version, flags | DTRACE_O_NODEV, errp,
+	    &dt_replay_vector, drp)) == NULL) {
+		dt_replay_free(drp);
+		return (NULL);
+	}
+
+	drp->drp_hdl = dtp;
+	dtp->dt_replay = drp;
+
+	return (dtp);
+}
+
+/*
+ * Fill in the aggregation name and variable ID that dt_aggid_add() would
+ * have found through the compiled statement, from the capture file.
+ */
+int
+dt_replay_aggvar(dtrace_hdl_t *dtp, dtrace_aggdesc_t *agg)
+{
+	dt_replay_t *drp = dtp->dt_replay;
+	const dtrace_aggdesc_t *src;
+	const dt_capture_rec_t *rec;
+	char *name;
+
+	if (drp == NULL ||
+	    (rec = dt_replay_lookup(&drp->drp_aggdescs, agg->dtagd_id)) == NULL)
+		return (-1);
+
+	src = DT_CAPTURE_DATA(rec);
+	name = (char *)src + DTRACE_SIZEOF_AGGDESC(src);
+
+	agg->dtagd_name = *name != '\0' ? name : NULL;
+	agg->dtagd_varid = src->dtagd_varid;
+
+	return (0);
+}
+
+void
+dt_capture_destroy(dtrace_hdl_t *dtp)
+{
+	if (dtp->dt_capture != NULL) {
+		(void) close(dtp->dt_capture->dcap_fd);
+		dt_free(dtp, dtp->dt_capture);
+		dtp->dt_capture = NULL;
+	}
+
+	if (dtp->dt_replay != NULL) {
+		dt_replay_free(dtp->dt_replay);
+		dtp->dt_replay = NULL;
+	}
+}
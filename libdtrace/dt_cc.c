@@ -1205,14 +1205,27 @@ dt_compile_agg(dtrace_hdl_t *dtp, dt_node_t *dnp, dtrace_stmtdesc_t *sdp)
 		n++;
 
 		if (anp->dn_kind == DT_NODE_FUNC) {
+			/*
+			 * Unless the stack table has been disabled (by setting
+			 * stacktabsize to 0), a stack key is recorded as the
+			 * stack's ID in the kernel's stack table rather than
+			 * as all of its frames.  A ustack() with a string
+			 * table can't be interned, and keeps all its frames.
+			 */
 			if (anp->dn_ident->di_id == DT_ACT_STACK) {
 				dt_action_stack_args(dtp, ap, anp->dn_args);
+				if (dtp->dt_options[DTRACEOPT_STACKTABSIZE] != 0)
+					ap->dtad_kind = DTRACEACT_STACKID;
 				continue;
 			}
 
 			if (anp->dn_ident->di_id == DT_ACT_USTACK ||
 			    anp->dn_ident->di_id == DT_ACT_JSTACK) {
 				dt_action_ustack_args(dtp, ap, anp);
+				if (ap->dtad_kind == DTRACEACT_USTACK &&
+				    DTRACE_USTACK_STRSIZE(ap->dtad_arg) == 0 &&
+				    dtp->dt_options[DTRACEOPT_STACKTABSIZE] != 0)
+					ap->dtad_kind = DTRACEACT_USTACKID;
 				continue;
 			}
 
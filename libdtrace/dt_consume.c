@@ -53,6 +53,38 @@ dt_fabsl(long double x)
 	return (x);
 }
 
+/*
+ * Natural logarithm for the distinct() estimator, for the same reason.  The
+ * argument is reduced to [1, 2) and the atanh series used on the remainder;
+ * the series converges quickly as its argument is then at most 1/3.
+ */
+static long double
+dt_logl(long double x)
+{
+	long double y, y2, term, sum = 0;
+	int k = 0, i;
+
+	assert(x > 0);
+
+	while (x >= 2) {
+		x /= 2;
+		k++;
+	}
+
+	while (x < 1) {
+		x *= 2;
+		k--;
+	}
+
+	y = (x - 1) / (x + 1);
+	y2 = y * y;
+
+	for (i = 1, term = y; i < 64; i += 2, term *= y2)
+		sum += term / i;
+
+	return (2 * sum + k * 0.6931471805599453094L);
+}
+
 /*
  * 128-bit arithmetic functions needed to support the stddev() aggregating
  * action.
@@ -801,6 +833,112 @@ dt_print_llquantize(dtrace_hdl_t *dtp, FILE *fp, const void *addr,
 	    total, positives, negatives));
 }
 
+/*
+ * Estimate the cardinality of a distinct() aggregation from its HyperLogLog
+ * registers, switching to linear counting for small cardinalities where the
+ * raw estimate is known to be biased.
+ */
+uint64_t
+dt_distinct_estimate(const uint8_t *regs)
+{
+	long double m = DTRACE_DISTINCT_NREGS, sum = 0, est;
+	int i, zeroes = 0;
+
+	for (i = 0; i < DTRACE_DISTINCT_NREGS; i++) {
+		sum += 1.0L / (long double)(1ULL << regs[i]);
+		zeroes += (regs[i] == 0);
+	}
+
+	est = (0.7213L / (1 + 1.079L / m)) * m * m / sum;
+
+	if (est <= 2.5L * m && zeroes != 0)
+		est = m * dt_logl(m / zeroes);
+
+	return ((uint64_t)(est + 0.5L));
+}
+
+/*ARGSUSED*/
+static int
+dt_print_distinct(dtrace_hdl_t *dtp, FILE *fp, caddr_t addr,
+    size_t size, uint64_t normal)
+{
+	if (size != DTRACE_DISTINCT_NREGS)
+		return (dt_set_errno(dtp, EDT_DMISMATCH));
+
+	return (dt_printf(dtp, fp, " %16llu", (unsigned long long)
+	    (dt_distinct_estimate((uint8_t *)addr) / normal)));
+}
+
+/*
+ * Return the value at the given percentile (expressed in tenths of a
+ * percent) of a percentiles() sketch, as the midpoint of the bucket that
+ * contains it; values less than or equal to zero are reported as zero.
+ */
+static uint64_t
+dt_percentile(const int64_t *pctl, uint64_t total, int permille)
+{
+	uint64_t base = (uint64_t)pctl[0], ndx, i;
+	long double rank = (long double)total * permille / 1000;
+	long double seen = (long double)pctl[1];
+
+	if (seen >= rank)
+		return (0);
+
+	for (i = 0; i < DTRACE_PCTL_NBUCKETS; i++) {
+		if ((seen += (long double)pctl[i + 2]) >= rank)
+			break;
+	}
+
+	if (i == DTRACE_PCTL_NBUCKETS)
+		i--;
+
+	ndx = base + i;
+
+	return (DTRACE_PCTL_BUCKETMIN(ndx) +
+	    (DTRACE_PCTL_BUCKETWIDTH(ndx) - 1) / 2);
+}
+
+int
+dt_print_percentiles(dtrace_hdl_t *dtp, FILE *fp, const void *addr,
+    size_t size, uint64_t normal)
+{
+	static const struct {
+		const char *name;
+		int permille;
+	} pcts[] = {
+		{ "p50", 500 },
+		{ "p90", 900 },
+		{ "p99", 990 },
+		{ "p99.9", 999 },
+		{ NULL }
+	};
+	const int64_t *data = addr;
+	uint64_t total = 0;
+	int i;
+
+	if (size != DTRACE_PCTL_SIZE)
+		return (dt_set_errno(dtp, EDT_DMISMATCH));
+
+	for (i = 1; i < DTRACE_PCTL_NBUCKETS + 2; i++)
+		total += data[i];
+
+	if (dt_printf(dtp, fp, "\n%16s %16s\n", "percentile", "value") < 0)
+		return (-1);
+
+	if (dt_printf(dtp, fp, "%16s %16llu\n", "count",
+	    (unsigned long long)(total / normal)) < 0)
+		return (-1);
+
+	for (i = 0; pcts[i].name != NULL; i++) {
+		if (dt_printf(dtp, fp, "%16s %16llu\n", pcts[i].name,
+		    (unsigned long long)(total == 0 ? 0 :
+		    dt_percentile(data, total, pcts[i].permille))) < 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
 /*ARGSUSED*/
 static int
 dt_print_average(dtrace_hdl_t *dtp, FILE *fp, caddr_t addr,
@@ -946,8 +1084,7 @@ int
 dt_print_stack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
     caddr_t addr, int depth, int size)
 {
-	dtrace_syminfo_t dts;
-	GElf_Sym sym;
+	const dt_symcache_ent_t *dse;
 	int i, indent;
 	char c[PATH_MAX * 2];
 	uint64_t pc;
@@ -989,34 +1126,35 @@ dt_print_stack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 
 // temp hack: we want to allow customisation of this and be on by default. but where?
 dtp->dt_options[DTRACEOPT_STACKSYMBOLS] =1;
+		/*
+		 * Both the symbol and, failing that, the containing module
+		 * come from the symbol cache, which does the lookups the
+		 * first time this pc is seen.
+		 */
+		dse = dt_symcache_lookup(dtp, NULL, 0, pc);
 #if defined(__APPLE__) || defined(linux)
-		if ((dtp->dt_options[DTRACEOPT_STACKSYMBOLS] != DTRACEOPT_UNSET) && dtrace_lookup_by_addr(dtp, pc, &sym, &dts) == 0) 
+		if ((dtp->dt_options[DTRACEOPT_STACKSYMBOLS] != DTRACEOPT_UNSET) && dse != NULL && (dse->dse_flags & DT_SYMCACHE_SYM)) 
 #else
-		if (dtrace_lookup_by_addr(dtp, pc, &sym, &dts) == 0) 
+		if (dse != NULL && (dse->dse_flags & DT_SYMCACHE_SYM)) 
 #endif
 		{
-			if (pc > sym.st_value) {
+			if (pc > dse->dse_value) {
 				(void) snprintf(c, sizeof (c), "%s`%s+0x%llx",
-				    dts.dts_object, dts.dts_name,
-				    (long long) (pc - sym.st_value));
+				    dse->dse_object, dse->dse_name,
+				    (long long) (pc - dse->dse_value));
 			} else {
 				(void) snprintf(c, sizeof (c), "%s`%s",
-				    dts.dts_object, dts.dts_name);
+				    dse->dse_object, dse->dse_name);
 			}
 		} else {
-			/*
-			 * We'll repeat the lookup, but this time we'll specify
-			 * a NULL GElf_Sym -- indicating that we're only
-			 * interested in the containing module.
-			 */
 #if defined(__APPLE__)
-			if ((dtp->dt_options[DTRACEOPT_STACKSYMBOLS] != DTRACEOPT_UNSET) && dtrace_lookup_by_addr(dtp, pc, NULL, &dts) == 0) 
+			if ((dtp->dt_options[DTRACEOPT_STACKSYMBOLS] != DTRACEOPT_UNSET) && dse != NULL && (dse->dse_flags & DT_SYMCACHE_OBJ)) 
 #else
-			if (dtrace_lookup_by_addr(dtp, pc, NULL, &dts) == 0) 
+			if (dse != NULL && (dse->dse_flags & DT_SYMCACHE_OBJ)) 
 #endif
 			{
 				(void) snprintf(c, sizeof (c), "%s`%p",
-				    dts.dts_object, (void *) pc);
+				    dse->dse_object, (void *) pc);
 			} else {
 				(void) snprintf(c, sizeof (c), "%p", (void *) pc);
 			}
@@ -1044,10 +1182,10 @@ dt_print_ustack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	const char *str = strsize ? strbase : NULL;
 	int err = 0;
 
-	char name[PATH_MAX], objname[PATH_MAX], c[PATH_MAX * 2];
-	struct ps_prochandle *P;
-	GElf_Sym sym;
-	int i, indent;
+	const dt_symcache_ent_t *dse;
+	char c[PATH_MAX * 2];
+	struct ps_prochandle *P = NULL;
+	int i, indent, grabbed = 0;
 	pid_t pid;
 
 	if (depth == 0)
@@ -1066,46 +1204,55 @@ dt_print_ustack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	else
 		indent = _dtrace_stkindent;
 
-	/*
-	 * Ultimately, we need to add an entry point in the library vector for
-	 * determining <symbol, offset> from <pid, address>.  For now, if
-	 * this is a vector open, we just print the raw address or string.
-	 */
+	for (i = 0; i < depth && pc[i] != (uint64_t) NULL; i++) {
+		if ((err = dt_printf(dtp, fp, "%*s", indent, "")) < 0)
+			break;
+
+		/*
+		 * Frames we have already symbolized come straight from the
+		 * symbol cache; the process is only grabbed (once) when we
+		 * meet a pc that isn't cached yet.  Ultimately, we need to
+		 * add an entry point in the library vector for determining
+		 * <symbol, offset> from <pid, address>.  For now, if this is
+		 * a vector open, we just print the raw address or string.
+		 */
+		dse = pid != 0 ? dt_symcache_lookup(dtp, NULL, pid, pc[i]) :
+		    NULL;
+
+		if (dse == NULL && pid != 0 && !grabbed) {
+			grabbed = 1;
 #if defined(__APPLE__)
-	if ((dtp->dt_options[DTRACEOPT_STACKSYMBOLS] != DTRACEOPT_UNSET) && dtp->dt_vector == NULL)
+			if ((dtp->dt_options[DTRACEOPT_STACKSYMBOLS] != DTRACEOPT_UNSET) && dtp->dt_vector == NULL)
 #else
-	if (dtp->dt_vector == NULL)
+			if (dtp->dt_vector == NULL)
 #endif
-		P = dt_proc_grab(dtp, pid, PGRAB_RDONLY | PGRAB_FORCE, 0);
-	else
-		P = NULL;
-
-	if (P != NULL)
-		dt_proc_lock(dtp, P); /* lock handle while we perform lookups */
+				P = dt_proc_grab(dtp, pid,
+				    PGRAB_RDONLY | PGRAB_FORCE, 0);
 
-	for (i = 0; i < depth && pc[i] != (uint64_t) NULL; i++) {
-		const prmap_t *map;
+			if (P != NULL)
+				dt_proc_lock(dtp, P); /* lock handle while we perform lookups */
+		}
 
-		if ((err = dt_printf(dtp, fp, "%*s", indent, "")) < 0)
-			break;
+		if (dse == NULL && P != NULL)
+			dse = dt_symcache_lookup(dtp, P, pid, pc[i]);
 
-		if (P != NULL && Plookup_by_addr(P, pc[i],
-		    name, sizeof (name), &sym) == 0) {
-			(void) Pobjname(P, pc[i], objname, sizeof (objname));
+		if (dse != NULL && (dse->dse_flags & DT_SYMCACHE_SYM)) {
+			const char *obj = (dse->dse_flags & DT_SYMCACHE_OBJ) ?
+			    dt_basename(dse->dse_object) : "";
 
-			if (pc[i] > sym.st_value) {
+			if (pc[i] > dse->dse_value) {
 				(void) snprintf(c, sizeof (c),
 				    "%p: %s`%s+0x%p", 
-				    (void *) pc[i],
-				    dt_basename(objname), name,
-				    (void *)(pc[i] - sym.st_value));
+				    (void *) pc[i], obj, dse->dse_name,
+				    (void *)(pc[i] - dse->dse_value));
 			} else {
 				(void) snprintf(c, sizeof (c),
-				    "%p: %s`%s", (void *) pc[i], dt_basename(objname), name);
+				    "%p: %s`%s", (void *) pc[i], obj,
+				    dse->dse_name);
 			}
 		} else if (str != NULL && str[0] != '\0' && str[0] != '@' &&
-		    (P != NULL && ((map = Paddr_to_map(P, pc[i])) == NULL ||
-		    (map->pr_mflags & MA_WRITE)))) {
+		    (dse != NULL && (!(dse->dse_flags & DT_SYMCACHE_MAP) ||
+		    (dse->dse_mflags & MA_WRITE)))) {
 			/*
 			 * If the current string pointer in the string table
 			 * does not point to an empty string _and_ the program
@@ -1121,10 +1268,11 @@ dt_print_ustack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 			 */
 			(void) snprintf(c, sizeof (c), "%s", str);
 		} else {
-			if (P != NULL && Pobjname(P, pc[i], objname,
-			    sizeof (objname)) != NULL) {
+			if (dse != NULL &&
+			    (dse->dse_flags & DT_SYMCACHE_OBJ)) {
 				(void) snprintf(c, sizeof (c), "%s`0x%llx",
-				    dt_basename(objname), (u_longlong_t)pc[i]);
+				    dt_basename(dse->dse_object),
+				    (u_longlong_t)pc[i]);
 			} else {
 				(void) snprintf(c, sizeof (c), "0x%llx",
 				    (u_longlong_t)pc[i]);
@@ -1171,6 +1319,97 @@ dt_print_ustack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	return (err);
 }
 
+/*
+ * Return the frames of an interned stack, given its stack ID.  We keep a copy
+ * of the kernel's stack table, and only go back to the kernel for the part of
+ * it that we haven't seen; as the kernel only ever appends to the table, each
+ * stack is copied out once for the life of the consumer.
+ */
+static uint64_t *
+dt_stacktab_lookup(dtrace_hdl_t *dtp, uint64_t id, uint32_t *nframes)
+{
+	dtrace_stackdesc_t desc;
+	uint64_t off = id - 1, hdr;
+
+	*nframes = 0;
+
+	if (id == 0)
+		return (NULL);
+
+	if (off >= dtp->dt_stacktab_next || dtp->dt_stacktab[off] == 0) {
+		bzero(&desc, sizeof (desc));
+
+		if (dt_ioctl(dtp, DTRACEIOC_STACKTAB, &desc) == -1 ||
+		    off >= desc.dtsd_next)
+			return (NULL);
+
+		if (desc.dtsd_next > dtp->dt_stacktab_size) {
+			uint64_t size = MAX(desc.dtsd_next,
+			    dtp->dt_stacktab_size * 2);
+			uint64_t *data = realloc(dtp->dt_stacktab,
+			    size * sizeof (uint64_t));
+
+			if (data == NULL)
+				return (NULL);
+
+			bzero(data + dtp->dt_stacktab_size,
+			    (size - dtp->dt_stacktab_size) * sizeof (uint64_t));
+			dtp->dt_stacktab = data;
+			dtp->dt_stacktab_size = size;
+		}
+
+		/*
+		 * A stack we have copied but found empty was still being
+		 * written when we copied it; fetch from there again.
+		 */
+		desc.dtsd_offs = MIN(off, dtp->dt_stacktab_next);
+		desc.dtsd_size = desc.dtsd_next - desc.dtsd_offs;
+		desc.dtsd_data = dtp->dt_stacktab + desc.dtsd_offs;
+
+		if (dt_ioctl(dtp, DTRACEIOC_STACKTAB, &desc) == -1)
+			return (NULL);
+
+		dtp->dt_stacktab_next = MAX(dtp->dt_stacktab_next,
+		    desc.dtsd_offs + desc.dtsd_size);
+	}
+
+	hdr = dtp->dt_stacktab[off];
+
+	if (hdr == 0 || off + 1 + DTRACE_STACKID_NFRAMES(hdr) >
+	    dtp->dt_stacktab_next)
+		return (NULL);
+
+	*nframes = DTRACE_STACKID_NFRAMES(hdr);
+	return (&dtp->dt_stacktab[off + 1]);
+}
+
+/*
+ * Print a stack() or ustack() aggregation key that was interned in the
+ * kernel's stack table.
+ */
+int
+dt_print_stackid(dtrace_hdl_t *dtp, FILE *fp, const char *format,
+    const dtrace_recdesc_t *rec, caddr_t addr)
+{
+	uint32_t nframes;
+	/* LINTED - alignment */
+	uint64_t *pcs = dt_stacktab_lookup(dtp, *((uint64_t *)addr), &nframes);
+
+	if (rec->dtrd_action == DTRACEACT_STACKID) {
+		return (dt_print_stack(dtp, fp, format, (caddr_t)pcs,
+		    nframes, sizeof (uint64_t)));
+	}
+
+	/*
+	 * The first "frame" of an interned ustack() is the pid.
+	 */
+	if (nframes == 0)
+		return (dt_printf(dtp, fp, "\n"));
+
+	return (dt_print_ustack(dtp, fp, format, (caddr_t)pcs,
+	    DTRACE_USTACK_ARG(nframes - 1, 0)));
+}
+
 static int
 dt_print_usym(dtrace_hdl_t *dtp, FILE *fp, caddr_t addr, dtrace_actkind_t act)
 {
@@ -1182,21 +1421,12 @@ dt_print_usym(dtrace_hdl_t *dtp, FILE *fp, caddr_t addr, dtrace_actkind_t act)
 	char *s;
 	int n, len = 256;
 
-	if (act == DTRACEACT_USYM && dtp->dt_vector == NULL) {
-		struct ps_prochandle *P;
-
-		if ((P = dt_proc_grab(dtp, pid,
-		    PGRAB_RDONLY | PGRAB_FORCE, 0)) != NULL) {
-			GElf_Sym sym;
-
-			dt_proc_lock(dtp, P);
+	if (act == DTRACEACT_USYM) {
+		const dt_symcache_ent_t *dse;
 
-			if (Plookup_by_addr(P, pc, NULL, 0, &sym) == 0)
-				pc = sym.st_value;
-
-			dt_proc_unlock(dtp, P);
-			dt_proc_release(dtp, P);
-		}
+		if ((dse = dt_symcache_ulookup(dtp, pid, pc)) != NULL &&
+		    (dse->dse_flags & DT_SYMCACHE_SYM))
+			pc = dse->dse_value;
 	}
 
 	do {
@@ -1214,10 +1444,8 @@ dt_print_umod(dtrace_hdl_t *dtp, FILE *fp, const char *format, caddr_t addr)
 	uint64_t pid = ((uint64_t *)addr)[0];
 	/* LINTED - alignment */
 	uint64_t pc = ((uint64_t *)addr)[1];
-	int err = 0;
-
-	char objname[PATH_MAX], c[PATH_MAX * 2];
-	struct ps_prochandle *P;
+	const dt_symcache_ent_t *dse;
+	char c[PATH_MAX * 2];
 
 	if (format == NULL)
 		format = "  %-50s";
@@ -1226,28 +1454,15 @@ dt_print_umod(dtrace_hdl_t *dtp, FILE *fp, const char *format, caddr_t addr)
 	 * See the comment in dt_print_ustack() for the rationale for
 	 * printing raw addresses in the vectored case.
 	 */
-	if (dtp->dt_vector == NULL)
-		P = dt_proc_grab(dtp, pid, PGRAB_RDONLY | PGRAB_FORCE, 0);
-	else
-		P = NULL;
-
-	if (P != NULL)
-		dt_proc_lock(dtp, P); /* lock handle while we perform lookups */
-
-	if (P != NULL && Pobjname(P, pc, objname, sizeof (objname)) != NULL) {
-		(void) snprintf(c, sizeof (c), "%s", dt_basename(objname));
+	if ((dse = dt_symcache_ulookup(dtp, pid, pc)) != NULL &&
+	    (dse->dse_flags & DT_SYMCACHE_OBJ)) {
+		(void) snprintf(c, sizeof (c), "%s",
+		    dt_basename(dse->dse_object));
 	} else {
 		(void) snprintf(c, sizeof (c), "0x%llx", (u_longlong_t)pc);
 	}
 
-	err = dt_printf(dtp, fp, format, c);
-
-	if (P != NULL) {
-		dt_proc_unlock(dtp, P);
-		dt_proc_release(dtp, P);
-	}
-
-	return (err);
+	return (dt_printf(dtp, fp, format, c));
 }
 
 static int
@@ -1255,25 +1470,21 @@ dt_print_sym(dtrace_hdl_t *dtp, FILE *fp, const char *format, caddr_t addr)
 {
 	/* LINTED - alignment */
 	uint64_t pc = *((uint64_t *)addr);
-	dtrace_syminfo_t dts;
-	GElf_Sym sym;
+	const dt_symcache_ent_t *dse;
 	char c[PATH_MAX * 2];
 
 	if (format == NULL)
 		format = "  %-50s";
 
-	if (dtrace_lookup_by_addr(dtp, pc, &sym, &dts) == 0) {
+	dse = dt_symcache_lookup(dtp, NULL, 0, pc);
+
+	if (dse != NULL && (dse->dse_flags & DT_SYMCACHE_SYM)) {
 		(void) snprintf(c, sizeof (c), "%s`%s",
-		    dts.dts_object, dts.dts_name);
+		    dse->dse_object, dse->dse_name);
 	} else {
-		/*
-		 * We'll repeat the lookup, but this time we'll specify a
-		 * NULL GElf_Sym -- indicating that we're only interested in
-		 * the containing module.
-		 */
-		if (dtrace_lookup_by_addr(dtp, pc, NULL, &dts) == 0) {
+		if (dse != NULL && (dse->dse_flags & DT_SYMCACHE_OBJ)) {
 			(void) snprintf(c, sizeof (c), "%s`0x%llx",
-			    dts.dts_object, (u_longlong_t)pc);
+			    dse->dse_object, (u_longlong_t)pc);
 		} else {
 			(void) snprintf(c, sizeof (c), "0x%llx",
 			    (u_longlong_t)pc);
@@ -1291,14 +1502,15 @@ dt_print_mod(dtrace_hdl_t *dtp, FILE *fp, const char *format, caddr_t addr)
 {
 	/* LINTED - alignment */
 	uint64_t pc = *((uint64_t *)addr);
-	dtrace_syminfo_t dts;
+	const dt_symcache_ent_t *dse;
 	char c[PATH_MAX * 2];
 
 	if (format == NULL)
 		format = "  %-50s";
 
-	if (dtrace_lookup_by_addr(dtp, pc, NULL, &dts) == 0) {
-		(void) snprintf(c, sizeof (c), "%s", dts.dts_object);
+	if ((dse = dt_symcache_lookup(dtp, NULL, 0, pc)) != NULL &&
+	    (dse->dse_flags & DT_SYMCACHE_OBJ)) {
+		(void) snprintf(c, sizeof (c), "%s", dse->dse_object);
 	} else {
 		(void) snprintf(c, sizeof (c), "0x%llx", (u_longlong_t)pc);
 	}
@@ -1519,6 +1731,10 @@ dt_print_datum(dtrace_hdl_t *dtp, FILE *fp, dtrace_recdesc_t *rec,
 	case DTRACEACT_JSTACK:
 		return (dt_print_ustack(dtp, fp, NULL, addr, rec->dtrd_arg));
 
+	case DTRACEACT_STACKID:
+	case DTRACEACT_USTACKID:
+		return (dt_print_stackid(dtp, fp, NULL, rec, addr));
+
 	case DTRACEACT_USYM:
 	case DTRACEACT_UADDR:
 		return (dt_print_usym(dtp, fp, addr, act));
@@ -1541,6 +1757,12 @@ dt_print_datum(dtrace_hdl_t *dtp, FILE *fp, dtrace_recdesc_t *rec,
 	case DTRACEAGG_LLQUANTIZE:
 		return (dt_print_llquantize(dtp, fp, addr, size, normal));
 
+	case DTRACEAGG_DISTINCT:
+		return (dt_print_distinct(dtp, fp, addr, size, normal));
+
+	case DTRACEAGG_PERCENTILES:
+		return (dt_print_percentiles(dtp, fp, addr, size, normal));
+
 	case DTRACEAGG_AVG:
 		return (dt_print_average(dtp, fp, addr, size, normal));
 
@@ -1931,6 +2153,14 @@ again:
 				goto nextrec;
 			}
 
+			if (act == DTRACEACT_STACKID ||
+			    act == DTRACEACT_USTACKID) {
+				if (dt_print_stackid(dtp, fp, NULL,
+				    rec, addr) < 0)
+					return (-1);
+				goto nextrec;
+			}
+
 			if (act == DTRACEACT_SYM) {
 				if (dt_print_sym(dtp, fp, NULL, addr) < 0)
 					return (-1);
@@ -2315,7 +2545,7 @@ dt_consume_begin(dtrace_hdl_t *dtp, FILE *fp, dtrace_bufdesc_t *buf,
 	 * CPU.
 	 */
 	bzero(&nbuf, sizeof (dtrace_bufdesc_t));
-	(void) dtrace_getopt(dtp, "bufsize", &size);
+	size = dt_options_snapsize(dtp);
 	if ((nbuf.dtbd_data = malloc(size)) == NULL)
 		return (dt_set_errno(dtp, EDT_NOMEM));
 
@@ -2382,6 +2612,7 @@ dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
 	dtrace_optval_t size;
 	static int max_ncpus;
 	int i, rval;
+	processorid_t begun = -1;
 	dtrace_optval_t interval = dtp->dt_options[DTRACEOPT_SWITCHRATE];
 	hrtime_t now = gethrtime();
 
@@ -2407,26 +2638,48 @@ dtrace_consume(dtrace_hdl_t *dtp, FILE *fp,
 		rf = (dtrace_consume_rec_f *)dt_nullrec;
 
 	if (buf->dtbd_data == NULL) {
-		(void) dtrace_getopt(dtp, "bufsize", &size);
+		size = dt_options_snapsize(dtp);
 		if ((buf->dtbd_data = malloc(size)) == NULL)
 			return (dt_set_errno(dtp, EDT_NOMEM));
 
 		buf->dtbd_size = size;
 	}
 
+	/*
+	 * If we are capturing, the buffers are written out for a later
+	 * replay rather than being processed here.
+	 */
+	if (dtp->dt_capture != NULL)
+		return (dt_capture_consume(dtp, buf));
+
 	/*
 	 * If we have just begun, we want to first process the CPU that
 	 * executed the BEGIN probe (if any).
 	 */
 	if (dtp->dt_active && dtp->dt_beganon != -1) {
-		buf->dtbd_cpu = dtp->dt_beganon;
+		begun = dtp->dt_beganon;
+		buf->dtbd_cpu = begun;
 		if ((rval = dt_consume_begin(dtp, fp, buf, pf, rf, arg)) != 0)
 			return (rval);
+
+		/*
+		 * On replay, a BUFSNAP takes the CPU's next captured snapshot,
+		 * and the capture holds one per CPU per pass.  Snapshotting a
+		 * CPU that dt_consume_begin() has already drained would read
+		 * ahead into the next pass:  if it also handled the END CPU,
+		 * it has drained them all.
+		 */
+		if (dtp->dt_replay != NULL && dtp->dt_stopped &&
+		    begun == dtp->dt_endedon)
+			return (0);
 	}
 
 	for (i = 0; i < max_ncpus; i++) {
 		buf->dtbd_cpu = i;
 
+		if (dtp->dt_replay != NULL && i == begun)
+			continue;
+
 		/*
 		 * If we have stopped, we want to process the CPU on which the
 		 * END probe was processed only _after_ we have processed
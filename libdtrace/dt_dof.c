@@ -63,6 +63,8 @@ dt_dof_init(dtrace_hdl_t *dtp)
 	dt_buf_create(dtp, &ddo->ddo_offs, "probe offs", 0);
 	dt_buf_create(dtp, &ddo->ddo_enoffs, "probe is-enabled offs", 0);
 	dt_buf_create(dtp, &ddo->ddo_rels, "probe rels", 0);
+	dt_buf_create(dtp, &ddo->ddo_semas, "probe semaphores", 0);
+	dt_buf_create(dtp, &ddo->ddo_semrels, "probe semaphore rels", 0);
 
 	dt_buf_create(dtp, &ddo->ddo_xlms, "xlate members", 0);
 }
@@ -85,6 +87,8 @@ dt_dof_fini(dtrace_hdl_t *dtp)
 	dt_buf_destroy(dtp, &ddo->ddo_offs);
 	dt_buf_destroy(dtp, &ddo->ddo_enoffs);
 	dt_buf_destroy(dtp, &ddo->ddo_rels);
+	dt_buf_destroy(dtp, &ddo->ddo_semas);
+	dt_buf_destroy(dtp, &ddo->ddo_semrels);
 
 	dt_buf_destroy(dtp, &ddo->ddo_xlms);
 }
@@ -125,6 +129,8 @@ dt_dof_reset(dtrace_hdl_t *dtp, dtrace_prog_t *pgp)
 	dt_buf_reset(dtp, &ddo->ddo_offs);
 	dt_buf_reset(dtp, &ddo->ddo_enoffs);
 	dt_buf_reset(dtp, &ddo->ddo_rels);
+	dt_buf_reset(dtp, &ddo->ddo_semas);
+	dt_buf_reset(dtp, &ddo->ddo_semrels);
 
 	dt_buf_reset(dtp, &ddo->ddo_xlms);
 	return (0);
@@ -401,6 +407,7 @@ dof_add_probe(dt_idhash_t *dhp, dt_ident_t *idp, void *data)
 	dof_relodesc_t dofr;
 	dt_probe_instance_t *pip;
 	dt_node_t *dnp;
+	uint64_t sema = 0;
 
 	char buf[DT_TYPE_NAMELEN];
 	uint_t i;
@@ -476,6 +483,23 @@ dof_add_probe(dt_idhash_t *dhp, dt_ident_t *idp, void *data)
 		dt_buf_write(dtp, &ddo->ddo_rels, &dofr,
 		    sizeof (dofr), sizeof (uint64_t));
 
+		/*
+		 * Each probe has an entry in the semaphore section, which if
+		 * the probe has a semaphore is relocated to its address.
+		 */
+		if (prp->pr_sema != NULL) {
+			dofr.dofr_name = dof_add_string(ddo, prp->pr_sema);
+			dofr.dofr_type = DOF_RELO_SETX;
+			dofr.dofr_offset = dt_buf_len(&ddo->ddo_semas);
+			dofr.dofr_data = 0;
+
+			dt_buf_write(dtp, &ddo->ddo_semrels, &dofr,
+			    sizeof (dofr), sizeof (uint64_t));
+		}
+
+		dt_buf_write(dtp, &ddo->ddo_semas, &sema,
+		    sizeof (sema), sizeof (uint64_t));
+
 		dt_buf_write(dtp, &ddo->ddo_probes, &dofpr,
 		    sizeof (dofpr), sizeof (uint64_t));
 	}
@@ -519,6 +543,8 @@ dof_add_provider(dt_dof_t *ddo, const dt_provider_t *pvp)
 	dt_buf_reset(dtp, &ddo->ddo_offs);
 	dt_buf_reset(dtp, &ddo->ddo_enoffs);
 	dt_buf_reset(dtp, &ddo->ddo_rels);
+	dt_buf_reset(dtp, &ddo->ddo_semas);
+	dt_buf_reset(dtp, &ddo->ddo_semrels);
 
 	(void) dt_idhash_iter(pvp->pv_probes, dof_add_probe, ddo);
 
@@ -548,6 +574,17 @@ dof_add_provider(dt_dof_t *ddo, const dt_provider_t *pvp)
 
 	dt_buf_concat(dtp, &ddo->ddo_ldata, &ddo->ddo_enoffs, sizeof (uint_t));
 
+	if (dt_buf_len(&ddo->ddo_semrels) != 0) {
+		dofpv.dofpv_prsemas = dof_add_lsect(ddo, NULL,
+		    DOF_SECT_PRSEMAS, sizeof (uint64_t), 0, sizeof (uint64_t),
+		    dt_buf_len(&ddo->ddo_semas));
+
+		dt_buf_concat(dtp, &ddo->ddo_ldata,
+		    &ddo->ddo_semas, sizeof (uint64_t));
+	} else {
+		dofpv.dofpv_prsemas = DOF_SECT_NONE;
+	}
+
 	dofpv.dofpv_strtab = ddo->ddo_strsec;
 	dofpv.dofpv_name = dof_add_string(ddo, pvp->pv_desc.dtvd_name);
 
@@ -571,6 +608,20 @@ dof_add_provider(dt_dof_t *ddo, const dt_provider_t *pvp)
 	(void) dof_add_lsect(ddo, &dofr, DOF_SECT_URELHDR,
 	    sizeof (dof_secidx_t), 0, 0, sizeof (dof_relohdr_t));
 
+	if (dofpv.dofpv_prsemas != DOF_SECT_NONE) {
+		dofr.dofr_strtab = dofpv.dofpv_strtab;
+		dofr.dofr_tgtsec = dofpv.dofpv_prsemas;
+		dofr.dofr_relsec = dof_add_lsect(ddo, NULL, DOF_SECT_RELTAB,
+		    sizeof (uint64_t), 0, sizeof (dof_relodesc_t),
+		    dt_buf_len(&ddo->ddo_semrels));
+
+		dt_buf_concat(dtp, &ddo->ddo_ldata,
+		    &ddo->ddo_semrels, sizeof (uint64_t));
+
+		(void) dof_add_lsect(ddo, &dofr, DOF_SECT_URELHDR,
+		    sizeof (dof_secidx_t), 0, 0, sizeof (dof_relohdr_t));
+	}
+
 	if (nxr != 0 && dtp->dt_xlatemode == DT_XL_DYNAMIC) {
 		(void) dof_add_lsect(ddo, dofs, DOF_SECT_PREXPORT,
 		    sizeof (dof_secidx_t), 0, sizeof (dof_secidx_t),
@@ -53,6 +53,8 @@ typedef struct dt_dof {
 	dt_buf_t ddo_offs;		/* probe offsets section data */
 	dt_buf_t ddo_enoffs;		/* is-enabled offsets section data */
 	dt_buf_t ddo_rels;		/* probe relocation section data */
+	dt_buf_t ddo_semas;		/* probe semaphore section data */
+	dt_buf_t ddo_semrels;		/* semaphore relocation section data */
 	dt_buf_t ddo_xlms;		/* xlate members section data */
 } dt_dof_t;
 
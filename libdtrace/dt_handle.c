@@ -290,6 +290,7 @@ static const struct {
 	{ DROPTAG(DTRACEDROP_SPECUNAVAIL) },
 	{ DROPTAG(DTRACEDROP_DBLERROR) },
 	{ DROPTAG(DTRACEDROP_STKSTROVERFLOW) },
+	{ DROPTAG(DTRACEDROP_STACKTAB) },
 	{ 0, NULL }
 };
 
@@ -383,6 +384,10 @@ static const struct {
 	    offsetof(dtrace_status_t, dtst_dblerrors),
 	    "error", " in ERROR probe enabling" },
 
+	{ DTRACEDROP_STACKTAB,
+	    offsetof(dtrace_status_t, dtst_stacktabdrops),
+	    "stack table overflow", " (increase stacktabsize)" },
+
 	{ 0, 0, NULL }
 };
 
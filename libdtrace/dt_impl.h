@@ -160,6 +160,11 @@ typedef struct dt_ahash {
 	size_t		dtah_size;		/* size of hash table */
 } dt_ahash_t;
 
+typedef struct dt_aggsparse {
+	uint32_t dtas_ndx;		/* index of 64-bit word in value */
+	int64_t dtas_val;		/* value of word */
+} dt_aggsparse_t;
+
 typedef struct dt_aggregate {
 	dtrace_bufdesc_t dtat_buf; 	/* buf aggregation snapshot */
 	int dtat_flags;			/* aggregate flags */
@@ -168,6 +173,10 @@ typedef struct dt_aggregate {
 	processorid_t dtat_ncpu;	/* size of dtat_cpus array */
 	processorid_t dtat_maxcpu;	/* maximum number of CPUs */
 	dt_ahash_t dtat_hash;		/* aggregate hash table */
+	caddr_t dtat_scratch;		/* expanded compact record */
+	size_t dtat_scratchsize;	/* size of dtat_scratch */
+	dt_aggsparse_t *dtat_sparse;	/* non-zero words of compact record */
+	uint_t dtat_nsparse;		/* number of valid dtat_sparse words */
 } dt_aggregate_t;
 
 typedef struct dt_print_aggdata {
@@ -177,6 +186,47 @@ typedef struct dt_print_aggdata {
 	int dtpa_allunprint;		/* print only unprinted aggregations */
 } dt_print_aggdata_t;
 
+/*
+ * The symbol cache memoizes address-to-symbol translations for the consumer
+ * so that printing stack(), ustack(), sym() and friends costs one lookup per
+ * unique pc rather than one per record.  Entries are keyed by (pid, pc) with
+ * pid 0 denoting the kernel; failed lookups are cached as well.  Entries for
+ * a pid are discarded whenever its mappings may have changed (rtld activity,
+ * exec, release of the process handle) and kernel entries are discarded by
+ * dtrace_update().  Invalidation can arrive from the process control threads,
+ * so it is only queued there and applied by the consumer on its next lookup;
+ * an entry returned by dt_symcache_lookup() therefore remains valid until
+ * that thread next calls into the cache.
+ */
+typedef struct dt_symcache_ent {
+	struct dt_symcache_ent *dse_next; /* next entry on hash chain */
+	pid_t dse_pid;			/* process id, or 0 for kernel */
+	uint_t dse_flags;		/* DT_SYMCACHE_* flags (see below) */
+	uint64_t dse_pc;		/* address that was looked up */
+	uint64_t dse_value;		/* value of containing symbol */
+	uint64_t dse_mapva;		/* base address of containing mapping */
+	long dse_mflags;		/* flags of containing mapping */
+	char *dse_object;		/* name of containing object */
+	char *dse_name;			/* name of containing symbol */
+} dt_symcache_ent_t;
+
+#define	DT_SYMCACHE_SYM	0x1	/* dse_name and dse_value are valid */
+#define	DT_SYMCACHE_OBJ	0x2	/* dse_object is valid */
+#define	DT_SYMCACHE_MAP	0x4	/* dse_mapva and dse_mflags are valid */
+
+#define	DT_SYMCACHE_NPURGE	16	/* queued invalidations before flush */
+
+typedef struct dt_symcache {
+	pthread_mutex_t dsc_lock;	/* protects dsc_purge and dsc_npurge */
+	dt_symcache_ent_t **dsc_hash;	/* hash buckets */
+	uint_t dsc_hashsize;		/* number of buckets (power of two) */
+	uint_t dsc_nents;		/* number of cached entries */
+	int dsc_npurge;			/* queued invalidations, or -1 for all */
+	pid_t dsc_purge[DT_SYMCACHE_NPURGE]; /* pids awaiting invalidation */
+	uint64_t dsc_hits;		/* lookups satisfied from the cache */
+	uint64_t dsc_misses;		/* lookups that went to the symtabs */
+} dt_symcache_t;
+
 typedef struct dt_dirpath {
 	dt_list_t dir_list;		/* linked-list forward/back pointers */
 	char *dir_path;			/* directory pathname */
@@ -245,6 +295,13 @@ struct dtrace_hdl {
 	char **dt_strdata;	/* pointer to strdata array */
 	dt_aggregate_t dt_aggregate; /* aggregate */
 	dtrace_bufdesc_t dt_buf; /* staging buffer */
+	uint64_t *dt_stacktab;	/* copy of kernel's interned stacks */
+	uint64_t dt_stacktab_size; /* words allocated at dt_stacktab */
+	uint64_t dt_stacktab_next; /* words copied into dt_stacktab */
+	struct dt_capture *dt_capture; /* capture file state, if capturing */
+	struct dt_replay *dt_replay; /* capture file state, if replaying */
+	struct dt_mock *dt_mock; /* mock backend state, if mocked */
+	dt_symcache_t dt_symcache; /* address-to-symbol cache */
 	struct dt_pfdict *dt_pfdict; /* dictionary of printf conversions */
 	dt_version_t dt_vmax;	/* optional ceiling on program API binding */
 	dtrace_attribute_t dt_amin; /* optional floor on program attributes */
@@ -255,6 +312,7 @@ struct dtrace_hdl {
 	char *dt_ld_path;	/* pathname of ld(1) to invoke if needed */
 	dt_list_t dt_lib_path;	/* linked-list forming library search path */
 	uint_t dt_lazyload;	/* boolean:  set via -xlazyload */
+	uint_t dt_semaphores;	/* boolean:  set via -xsemaphores */
 	uint_t dt_droptags;	/* boolean:  set via -xdroptags */
 	uint_t dt_active;	/* boolean:  set once tracing is active */
 	uint_t dt_stopped;	/* boolean:  set once tracing is stopped */
@@ -511,7 +569,8 @@ enum {
 	EDT_BADSTACKPC,		/* invalid stack program counter size */
 	EDT_BADAGGVAR,		/* invalid aggregation variable identifier */
 	EDT_OVERSION,		/* client is requesting deprecated version */
-	EDT_ENABLING_ERR	/* failed to enable probe */
+	EDT_ENABLING_ERR,	/* failed to enable probe */
+	EDT_BADCAPTURE		/* invalid or incompatible capture file */
 };
 
 /*
@@ -582,11 +641,15 @@ extern void dt_buffered_disable(dtrace_hdl_t *);
 extern void dt_buffered_destroy(dtrace_hdl_t *);
 
 extern uint64_t dt_stddev(uint64_t *, uint64_t);
+extern uint64_t dt_distinct_estimate(const uint8_t *);
 
 extern int dt_rw_read_held(pthread_rwlock_t *);
 extern int dt_rw_write_held(pthread_rwlock_t *);
 extern int dt_mutex_held(pthread_mutex_t *);
 extern int dt_options_load(dtrace_hdl_t *);
+extern void dt_options_parse(const dof_hdr_t *, dtrace_optval_t *);
+extern void dt_options_dof(dof_hdr_t *, const dtrace_optval_t *);
+extern dtrace_optval_t dt_options_snapsize(dtrace_hdl_t *);
 
 #define DT_RW_READ_HELD(x)	dt_rw_read_held(x)
 #define DT_RW_WRITE_HELD(x)	dt_rw_write_held(x)
@@ -608,6 +671,27 @@ extern int dt_aggregate_go(dtrace_hdl_t *);
 extern int dt_aggregate_init(dtrace_hdl_t *);
 extern void dt_aggregate_destroy(dtrace_hdl_t *);
 
+extern void dt_symcache_init(dtrace_hdl_t *);
+extern void dt_symcache_destroy(dtrace_hdl_t *);
+extern void dt_symcache_purge(dtrace_hdl_t *, pid_t);
+extern const dt_symcache_ent_t *dt_symcache_lookup(dtrace_hdl_t *,
+    struct ps_prochandle *, pid_t, uint64_t);
+extern const dt_symcache_ent_t *dt_symcache_ulookup(dtrace_hdl_t *, pid_t,
+    uint64_t);
+
+extern int dt_capture_go(dtrace_hdl_t *);
+extern int dt_capture_stop(dtrace_hdl_t *);
+extern int dt_capture_status(dtrace_hdl_t *, const dtrace_status_t *);
+extern int dt_capture_aggsnap(dtrace_hdl_t *, const dtrace_bufdesc_t *);
+extern int dt_capture_epid(dtrace_hdl_t *, const dtrace_eprobedesc_t *,
+    const dtrace_probedesc_t *);
+extern int dt_capture_format(dtrace_hdl_t *, int, const char *);
+extern int dt_capture_aggdesc(dtrace_hdl_t *, const dtrace_aggdesc_t *);
+extern int dt_capture_consume(dtrace_hdl_t *, dtrace_bufdesc_t *);
+extern int dt_replay_aggvar(dtrace_hdl_t *, dtrace_aggdesc_t *);
+extern void dt_capture_destroy(dtrace_hdl_t *);
+extern void dt_mock_destroy(dtrace_hdl_t *);
+
 extern int dt_epid_lookup(dtrace_hdl_t *, dtrace_epid_t,
     dtrace_eprobedesc_t **, dtrace_probedesc_t **);
 extern void dt_epid_destroy(dtrace_hdl_t *);
@@ -626,6 +710,8 @@ extern int dt_print_lquantize(dtrace_hdl_t *, FILE *,
     const void *, size_t, uint64_t);
 extern int dt_print_llquantize(dtrace_hdl_t *, FILE *,
     const void *, size_t, uint64_t);
+extern int dt_print_percentiles(dtrace_hdl_t *, FILE *,
+    const void *, size_t, uint64_t);
 extern int dt_print_agg(const dtrace_aggdata_t *, void *);
 
 extern int dt_handle(dtrace_hdl_t *, dtrace_probedata_t *);
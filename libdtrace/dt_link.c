@@ -84,6 +84,7 @@ static const char DTRACE_SHSTRTAB64[] = "\0"
 
 static const char DOFSTR[] = "__SUNW_dof";
 static const char DOFLAZYSTR[] = "___SUNW_dof";
+static const char DTSEMSTR[] = "__dtracesem_";
 
 typedef struct dt_link_pair {
 	struct dt_link_pair *dlp_next;	/* next pair in linked list */
@@ -1093,7 +1094,7 @@ dt_link_error(dtrace_hdl_t *dtp, Elf *elf, int fd, dt_link_pair_t *bufs,
 /*#undef linux might need this for ELF64 */
 
 static int
-process_obj(dtrace_hdl_t *dtp, const char *obj, int *eprobesp)
+process_obj(dtrace_hdl_t *dtp, const char *obj, int *eprobesp, int *semasp)
 {
 	static const char dt_prefix[] = "__dtrace";
 	static const char dt_enabled[] = "enabled";
@@ -1288,6 +1289,14 @@ process_obj(dtrace_hdl_t *dtp, const char *obj, int *eprobesp)
 		 *
 		 *   $dtrace<key>.<function>
 		 *
+		 * Relocations to a probe's is-enabled semaphore, of the form
+		 *
+		 *   __dtracesem_<prov>___<probe>
+		 *
+		 * are left alone for the linker to resolve against the
+		 * semaphore defined by the header; we note that the probe has
+		 * one so that its address goes into the DOF.
+		 *
 		 * We take a first pass through all the relocations to
 		 * populate our string table and count the number of extra
 		 * symbols we'll require.
@@ -1326,7 +1335,8 @@ process_obj(dtrace_hdl_t *dtp, const char *obj, int *eprobesp)
 			s = (char *)data_str->d_buf + rsym.st_name;
 
 //printf("looking at %d: r_info=%x '%s'\n", i, GELF_R_SYM(rela.r_info), s);
-			if (strncmp(s, dt_prefix, sizeof (dt_prefix) - 1) != 0)
+			if (strncmp(s, dt_prefix, sizeof (dt_prefix) - 1) != 0 ||
+			    strncmp(s, DTSEMSTR, sizeof (DTSEMSTR) - 1) == 0)
 				continue;
 
 			if (dt_symtab_lookup(data_sym, isym, rela.r_offset,
@@ -1478,6 +1488,53 @@ process_obj(dtrace_hdl_t *dtp, const char *obj, int *eprobesp)
 
 			if (strncmp(s, dt_prefix, sizeof (dt_prefix) - 1) != 0)
 				continue;
+
+			if (strncmp(s, DTSEMSTR, sizeof (DTSEMSTR) - 1) == 0) {
+				char prname[DTRACE_NAMELEN];
+				char *sema = s;
+
+				s += sizeof (DTSEMSTR) - 1;
+
+				if ((p = strstr(s, "___")) == NULL ||
+				    p - s >= sizeof (pname) ||
+				    strlen(p + 3) >= sizeof (prname))
+					GOTO(err);
+
+				bcopy(s, pname, p - s);
+				pname[p - s] = '\0';
+
+				/*
+				 * Unlike a probe site, the symbol must keep
+				 * its name, so unmangle a copy.
+				 */
+				(void) strcpy(prname, p + 3);
+				p = strhyphenate(prname);
+
+				if ((pvp = dt_provider_lookup(dtp,
+				    pname)) == NULL) {
+					return (dt_link_error(dtp, elf, fd,
+					    bufs, "no such provider %s",
+					    pname));
+				}
+
+				if ((prp = dt_probe_lookup(pvp, p)) == NULL) {
+					return (dt_link_error(dtp, elf, fd,
+					    bufs, "no such probe %s", p));
+				}
+
+				if (prp->pr_sema == NULL) {
+					if ((prp->pr_sema = dt_alloc(dtp,
+					    strlen(sema) + 1)) == NULL) {
+						return (dt_link_error(dtp, elf,
+						    fd, bufs, "failed to "
+						    "allocate space for probe"));
+					}
+					(void) strcpy(prp->pr_sema, sema);
+				}
+
+				*semasp = 1;
+				continue;
+			}
 /*printf("\n*** i=%d SHT_RELA=%x %x ndx=%d r_offset=%x r_addend=%d %s\n", i, SHT_RELA, shdr_rel.sh_type, ndx, rela.r_offset, rela.r_addend, s);*/
 
 			s += sizeof (dt_prefix) - 1;
@@ -1662,7 +1719,7 @@ dtrace_program_link(dtrace_hdl_t *dtp, dtrace_prog_t *pgp, uint_t dflags,
 	int fd, status, i, cur;
 	char *cmd, tmp;
 	size_t len;
-	int eprobes = 0, ret = 0;
+	int eprobes = 0, semas = 0, ret = 0;
 
 	/*
 	 * A NULL program indicates a special use in which we just link
@@ -1711,17 +1768,20 @@ dtrace_program_link(dtrace_hdl_t *dtp, dtrace_prog_t *pgp, uint_t dflags,
 	}
 
 	for (i = 0; i < objc; i++) {
-		if (process_obj(dtp, objv[i], &eprobes) != 0)
+		if (process_obj(dtp, objv[i], &eprobes, &semas) != 0)
 			return (-1); /* errno is set for us */
 	}
 
 	/*
 	 * If there are is-enabled probes then we need to force use of DOF
-	 * version 2.
+	 * version 2, and if there are semaphores, version 3.
 	 */
 	if (eprobes && pgp->dp_dofversion < DOF_VERSION_2)
 		pgp->dp_dofversion = DOF_VERSION_2;
 
+	if (semas && pgp->dp_dofversion < DOF_VERSION_3)
+		pgp->dp_dofversion = DOF_VERSION_3;
+
 	if ((dof = dtrace_dof_create(dtp, pgp, dflags)) == NULL)
 		return (-1); /* errno is set for us */
 
@@ -67,6 +67,12 @@ dt_strdata_add(dtrace_hdl_t *dtp, dtrace_recdesc_t *rec, void ***data, int *max)
 		return (dt_set_errno(dtp, errno));
 	}
 
+	if (dtp->dt_capture != NULL &&
+	    dt_capture_format(dtp, rec->dtrd_format, fmt.dtfd_string) == -1) {
+		dt_free(dtp, fmt.dtfd_string);
+		return (-1);
+	}
+
 	while (rec->dtrd_format > (maxformat = *max)) {
 		int new_max = maxformat ? (maxformat << 1) : 1;
 		size_t nsize = new_max * sizeof (void *);
@@ -216,6 +222,12 @@ dt_epid_add(dtrace_hdl_t *dtp, dtrace_epid_t id)
 
 	}
 
+	if (dtp->dt_capture != NULL &&
+	    dt_capture_epid(dtp, enabled, probe) == -1) {
+		rval = -1;
+		goto err;
+	}
+
 	dtp->dt_pdesc[id] = probe;
 	dtp->dt_edesc[id] = enabled;
 
@@ -382,6 +394,8 @@ dt_aggid_add(dtrace_hdl_t *dtp, dtrace_aggid_t id)
 		 * we're grabbing an anonymous enabling, this pointer value
 		 * is obviously meaningless -- and in this case, we can't
 		 * provide the compiler-generated aggregation information.
+		 * If we're replaying a capture file, the information was
+		 * recorded when the aggregation was captured.
 		 */
 		if (dtp->dt_options[DTRACEOPT_GRABANON] == DTRACEOPT_UNSET &&
 		    agg->dtagd_rec[0].dtrd_uarg != NULL) {
@@ -393,7 +407,7 @@ dt_aggid_add(dtrace_hdl_t *dtp, dtrace_aggid_t id)
 			aid = sdp->dtsd_aggdata;
 			agg->dtagd_name = aid->di_name;
 			agg->dtagd_varid = aid->di_id;
-		} else {
+		} else if (dt_replay_aggvar(dtp, agg) != 0) {
 			agg->dtagd_varid = DTRACE_AGGVARIDNONE;
 		}
 
@@ -405,6 +419,12 @@ dt_aggid_add(dtrace_hdl_t *dtp, dtrace_aggid_t id)
 			}
 		}
 
+		if (dtp->dt_capture != NULL &&
+		    dt_capture_aggdesc(dtp, agg) == -1) {
+			free(agg);
+			return (-1);
+		}
+
 		dtp->dt_aggdesc[id] = agg;
 	}
 
@@ -0,0 +1,467 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Mock dtrace(7D) backend.  dtrace_mock_open() returns a handle whose vector
+ * answers the consumer side of the ioctl interface in process, synthesizing
+ * trace data in the shapes described by a dtrace_mockconf_t, so that the
+ * consumer paths -- dtrace_consume(), aggregation snapshots and printing --
+ * can be exercised and timed on a machine without the driver.
+ *
+ * The mock has two enabled probes.  mock:::tick (EPID 1) fires with
+ * dtmc_nrecs 64-bit values, and each principal buffer snapshot holds as many
+ * firings as fit in dtmc_snapsize bytes.  mock:::agg (EPID 2) feeds a single
+ * aggregation (ID 1) keyed on one 64-bit value, and each aggregation buffer
+ * snapshot holds an update for each of dtmc_nkeys keys.  The records are laid
+ * out just as the kernel lays them out, so the library processes them no
+ * differently.  Tracing reports that it has exited once each CPU's principal
+ * buffer has been snapshotted dtmc_nsnaps times.
+ */
+
+#include <sys/types.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <dt_impl.h>
+
+#define	DT_MOCK_EPID_TICK	1	/* mock:::tick */
+#define	DT_MOCK_EPID_AGG	2	/* mock:::agg */
+#define	DT_MOCK_AGGID		1
+
+#define	DT_MOCK_AGG_VARID	8	/* offset of aggregation variable ID */
+#define	DT_MOCK_AGG_KEY		16	/* offset of aggregation key */
+#define	DT_MOCK_AGG_VAL		24	/* offset of aggregated value */
+
+typedef struct dt_mock {
+	dtrace_hdl_t *dmk_hdl;		/* handle using the mock */
+	dtrace_mockconf_t dmk_conf;	/* shape of the synthesized data */
+	dtrace_optval_t dmk_options[DTRACEOPT_MAX]; /* options as enabled */
+	uint64_t *dmk_nsnaps;		/* principal snapshots taken, per CPU */
+	uint_t dmk_pending;		/* CPUs with snapshots still to take */
+	uint32_t dmk_recsize;		/* size of a mock:::tick record */
+	uint32_t dmk_valsize;		/* size of the aggregated value */
+	uint64_t dmk_seed;		/* state of dt_mock_rand() */
+} dt_mock_t;
+
+static uint64_t
+dt_mock_rand(dt_mock_t *dmk)
+{
+	uint64_t x = dmk->dmk_seed;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	dmk->dmk_seed = x;
+
+	return (x * 0x2545f4914f6cdd1dULL);
+}
+
+static void
+dt_mock_rec(dtrace_recdesc_t *rec, dtrace_actkind_t act, uint32_t size,
+    uint32_t offs)
+{
+	bzero(rec, sizeof (dtrace_recdesc_t));
+	rec->dtrd_action = act;
+	rec->dtrd_size = size;
+	rec->dtrd_offset = offs;
+	rec->dtrd_alignment = sizeof (uint64_t);
+}
+
+static int
+dt_mock_eprobe(dt_mock_t *dmk, dtrace_eprobedesc_t *epd)
+{
+	int i, n = epd->dtepd_nrecs;
+
+	switch (epd->dtepd_epid) {
+	case DT_MOCK_EPID_TICK:
+		epd->dtepd_size = dmk->dmk_recsize;
+		epd->dtepd_nrecs = dmk->dmk_conf.dtmc_nrecs;
+		break;
+
+	case DT_MOCK_EPID_AGG:
+		epd->dtepd_size = sizeof (uint64_t);
+		epd->dtepd_nrecs = 0;
+		break;
+
+	default:
+		errno = EINVAL;
+		return (-1);
+	}
+
+	epd->dtepd_probeid = epd->dtepd_epid;
+	epd->dtepd_uarg = DT_ECB_DEFAULT;
+
+	/*
+	 * Like the kernel, fill in as many records as the caller has room
+	 * for, but report how many there are.
+	 */
+	for (i = 0; i < n && i < epd->dtepd_nrecs; i++) {
+		dt_mock_rec(&epd->dtepd_rec[i], DTRACEACT_DIFEXPR,
+		    sizeof (uint64_t), sizeof (uint64_t) * (i + 1));
+	}
+
+	return (0);
+}
+
+static int
+dt_mock_aggdesc(dt_mock_t *dmk, dtrace_aggdesc_t *agg)
+{
+	dtrace_recdesc_t recs[3];
+	int i, n = agg->dtagd_nrecs;
+
+	if (agg->dtagd_id != DT_MOCK_AGGID) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/*
+	 * The first record is the compiler-generated aggregation variable ID,
+	 * then comes the key, and then the aggregated value.
+	 */
+	dt_mock_rec(&recs[0], DTRACEACT_DIFEXPR, sizeof (uint64_t),
+	    DT_MOCK_AGG_VARID);
+	dt_mock_rec(&recs[1], DTRACEACT_DIFEXPR, sizeof (uint64_t),
+	    DT_MOCK_AGG_KEY);
+	dt_mock_rec(&recs[2], dmk->dmk_conf.dtmc_aggact, dmk->dmk_valsize,
+	    DT_MOCK_AGG_VAL);
+
+	agg->dtagd_epid = DT_MOCK_EPID_AGG;
+	agg->dtagd_size = DT_MOCK_AGG_VAL + dmk->dmk_valsize;
+	agg->dtagd_nrecs = 3;
+
+	for (i = 0; i < n && i < agg->dtagd_nrecs; i++)
+		agg->dtagd_rec[i] = recs[i];
+
+	return (0);
+}
+
+static int
+dt_mock_probe(dtrace_probedesc_t *pd)
+{
+	const char *name;
+
+	switch (pd->dtpd_id) {
+	case DT_MOCK_EPID_TICK:
+		name = "tick";
+		break;
+
+	case DT_MOCK_EPID_AGG:
+		name = "agg";
+		break;
+
+	default:
+		errno = ESRCH;
+		return (-1);
+	}
+
+	pd->dtpd_mod[0] = '\0';
+	pd->dtpd_func[0] = '\0';
+	(void) strlcpy(pd->dtpd_provider, "mock", sizeof (pd->dtpd_provider));
+	(void) strlcpy(pd->dtpd_name, name, sizeof (pd->dtpd_name));
+
+	return (0);
+}
+
+static int
+dt_mock_bufsnap(dt_mock_t *dmk, dtrace_bufdesc_t *buf)
+{
+	dtrace_optval_t bufsize = dmk->dmk_hdl->dt_options[DTRACEOPT_BUFSIZE];
+	uint64_t size = dmk->dmk_conf.dtmc_snapsize;
+	uint64_t *data;
+	int i, n;
+
+	if (buf->dtbd_cpu >= dmk->dmk_conf.dtmc_ncpus) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	buf->dtbd_drops = 0;
+	buf->dtbd_errors = 0;
+	buf->dtbd_oldest = 0;
+	buf->dtbd_size = 0;
+
+	if (dmk->dmk_nsnaps[buf->dtbd_cpu] == dmk->dmk_conf.dtmc_nsnaps)
+		return (0);
+
+	if (++dmk->dmk_nsnaps[buf->dtbd_cpu] == dmk->dmk_conf.dtmc_nsnaps)
+		dmk->dmk_pending--;
+
+	size = MIN(size, (uint64_t)bufsize);
+	size -= size % dmk->dmk_recsize;
+
+	for (data = (uint64_t *)buf->dtbd_data;
+	    buf->dtbd_size < size; buf->dtbd_size += dmk->dmk_recsize) {
+		/* LINTED - alignment */
+		*data++ = DT_MOCK_EPID_TICK;
+		n = dmk->dmk_conf.dtmc_nrecs;
+
+		for (i = 0; i < n; i++)
+			*data++ = dt_mock_rand(dmk);
+	}
+
+	return (0);
+}
+
+static int
+dt_mock_aggsnap(dt_mock_t *dmk, dtrace_bufdesc_t *buf)
+{
+	dtrace_optval_t aggsize = dmk->dmk_hdl->dt_options[DTRACEOPT_AGGSIZE];
+	uint32_t size = DT_MOCK_AGG_VAL + dmk->dmk_valsize;
+	uint64_t key, nkeys = dmk->dmk_conf.dtmc_nkeys, r;
+	uint64_t *val;
+	char *data;
+
+	if (buf->dtbd_cpu >= dmk->dmk_conf.dtmc_ncpus) {
+		errno = ENOENT;
+		return (-1);
+	}
+
+	nkeys = MIN(nkeys, (uint64_t)aggsize / size);
+
+	buf->dtbd_drops = 0;
+	buf->dtbd_errors = 0;
+	buf->dtbd_oldest = 0;
+	buf->dtbd_size = nkeys * size;
+
+	for (key = 0, data = buf->dtbd_data; key < nkeys; key++, data += size) {
+		bzero(data, size);
+		/* LINTED - alignment */
+		*(dtrace_aggid_t *)data = DT_MOCK_AGGID;
+		/* LINTED - alignment */
+		*(uint64_t *)(data + DT_MOCK_AGG_VARID) = 1;
+		/* LINTED - alignment */
+		*(uint64_t *)(data + DT_MOCK_AGG_KEY) = key;
+
+		/* LINTED - alignment */
+		val = (uint64_t *)(data + DT_MOCK_AGG_VAL);
+		r = dt_mock_rand(dmk);
+
+		switch (dmk->dmk_conf.dtmc_aggact) {
+		case DTRACEAGG_COUNT:
+			*val = 1 + r % 8;
+			break;
+
+		case DTRACEAGG_QUANTIZE:
+			val[DTRACE_QUANTIZE_ZEROBUCKET + 1 + r % 32] = 1 + r % 8;
+			break;
+
+		default:
+			*val = r % 1000;
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * The options are those the consumer enabled with, much as the kernel would
+ * return them, except that the buffers are made large enough for the data we
+ * synthesize and the rates are zeroed so that the consumer isn't paced.
+ */
+static int
+dt_mock_dofget(dt_mock_t *dmk, dof_hdr_t *dof)
+{
+	dtrace_optval_t *opts = dmk->dmk_options;
+	dtrace_optval_t bufsize = MAX(dmk->dmk_conf.dtmc_snapsize,
+	    dmk->dmk_recsize);
+	dtrace_optval_t aggsize = MAX(dmk->dmk_conf.dtmc_nkeys, 1) *
+	    (DT_MOCK_AGG_VAL + dmk->dmk_valsize);
+
+	if (opts[DTRACEOPT_BUFSIZE] == DTRACEOPT_UNSET ||
+	    opts[DTRACEOPT_BUFSIZE] < bufsize)
+		opts[DTRACEOPT_BUFSIZE] = bufsize;
+
+	if (opts[DTRACEOPT_AGGSIZE] == DTRACEOPT_UNSET ||
+	    opts[DTRACEOPT_AGGSIZE] < aggsize)
+		opts[DTRACEOPT_AGGSIZE] = aggsize;
+
+	if (opts[DTRACEOPT_BUFPOLICY] == DTRACEOPT_UNSET)
+		opts[DTRACEOPT_BUFPOLICY] = DTRACEOPT_BUFPOLICY_SWITCH;
+
+	opts[DTRACEOPT_STATUSRATE] = 0;
+	opts[DTRACEOPT_SWITCHRATE] = 0;
+	opts[DTRACEOPT_AGGRATE] = 0;
+
+	dt_options_dof(dof, opts);
+	return (0);
+}
+
+static int
+dt_mock_ioctl(void *arg, int cmd, void *data)
+{
+	dt_mock_t *dmk = arg;
+	dtrace_status_t *stat;
+
+	switch (cmd) {
+	case DTRACEIOC_ENABLE:
+		dt_options_parse(data, dmk->dmk_options);
+		return (0);
+
+	case DTRACEIOC_GO:
+	case DTRACEIOC_STOP:
+		*(processorid_t *)data = DTRACE_CPUALL;
+		return (0);
+
+	case DTRACEIOC_STATUS:
+		stat = data;
+		bzero(stat, sizeof (*stat));
+		stat->dtst_exiting = dmk->dmk_pending == 0;
+		return (0);
+
+	case DTRACEIOC_BUFSNAP:
+		return (dt_mock_bufsnap(dmk, data));
+
+	case DTRACEIOC_AGGSNAP:
+		return (dt_mock_aggsnap(dmk, data));
+
+	case DTRACEIOC_DOFGET:
+		return (dt_mock_dofget(dmk, data));
+
+	case DTRACEIOC_EPROBE:
+		return (dt_mock_eprobe(dmk, data));
+
+	case DTRACEIOC_AGGDESC:
+		return (dt_mock_aggdesc(dmk, data));
+
+	case DTRACEIOC_PROBES:
+		return (dt_mock_probe(data));
+	}
+
+	errno = ENOTTY;
+	return (-1);
+}
+
+/*ARGSUSED*/
+static int
+dt_mock_lookup_by_addr(void *arg, GElf_Addr addr, GElf_Sym *symp,
+    dtrace_syminfo_t *sip)
+{
+	return (-1);
+}
+
+static int
+dt_mock_status(void *arg, processorid_t cpu)
+{
+	dt_mock_t *dmk = arg;
+
+	return (cpu >= 0 && cpu < dmk->dmk_conf.dtmc_ncpus ? 1 : -1);
+}
+
+static long
+dt_mock_sysconf(void *arg, int name)
+{
+	dt_mock_t *dmk = arg;
+
+	switch (name) {
+	case _SC_CPUID_MAX:
+		return (dmk->dmk_conf.dtmc_ncpus - 1);
+	case _SC_NPROCESSORS_MAX:
+		return (dmk->dmk_conf.dtmc_ncpus);
+	}
+
+	return (sysconf(name));
+}
+
+static const dtrace_vector_t dt_mock_vector = {
+	dt_mock_ioctl,
+	dt_mock_lookup_by_addr,
+	dt_mock_status,
+	dt_mock_sysconf
+};
+
+static void
+dt_mock_free(dt_mock_t *dmk)
+{
+	free(dmk->dmk_nsnaps);
+	free(dmk);
+}
+
+dtrace_hdl_t *
+dtrace_mock_open(int version, int flags, int *errp,
+    const dtrace_mockconf_t *conf)
+{
+	dtrace_hdl_t *dtp;
+	dt_mock_t *dmk;
+	uint32_t valsize;
+	int i;
+
+	switch (conf->dtmc_aggact) {
+	case DTRACEAGG_COUNT:
+	case DTRACEAGG_SUM:
+	case DTRACEAGG_MIN:
+	case DTRACEAGG_MAX:
+		valsize = sizeof (uint64_t);
+		break;
+
+	case DTRACEAGG_QUANTIZE:
+		valsize = DTRACE_QUANTIZE_NBUCKETS * sizeof (uint64_t);
+		break;
+
+	default:
+		valsize = 0;
+	}
+
+	if (valsize == 0 || conf->dtmc_ncpus <= 0 || conf->dtmc_nrecs <= 0) {
+		if (errp != NULL)
+			*errp = EINVAL;
+		return (NULL);
+	}
+
+	if ((dmk = calloc(1, sizeof (dt_mock_t))) == NULL ||
+	    (dmk->dmk_nsnaps = calloc(conf->dtmc_ncpus,
+	    sizeof (uint64_t))) == NULL) {
+		free(dmk);
+		if (errp != NULL)
+			*errp = EDT_NOMEM;
+		return (NULL);
+	}
+
+	dmk->dmk_conf = *conf;
+	dmk->dmk_pending = conf->dtmc_nsnaps != 0 ? conf->dtmc_ncpus : 0;
+	dmk->dmk_recsize = sizeof (uint64_t) * (conf->dtmc_nrecs + 1);
+	dmk->dmk_valsize = valsize;
+	dmk->dmk_seed = 0x9e3779b97f4a7c15ULL;
+
+	for (i = 0; i < DTRACEOPT_MAX; i++)
+		dmk->dmk_options[i] = DTRACEOPT_UNSET;
+
+	if ((dtp = dtrace_vopen(version, flags | DTRACE_O_NODEV, errp,
+	    &dt_mock_vector, dmk)) == NULL) {
+		dt_mock_free(dmk);
+		return (NULL);
+	}
+
+	dmk->dmk_hdl = dtp;
+	dtp->dt_mock = dmk;
+
+	return (dtp);
+}
+
+void
+dt_mock_destroy(dtrace_hdl_t *dtp)
+{
+	if (dtp->dt_mock != NULL) {
+		dt_mock_free(dtp->dt_mock);
+		dtp->dt_mock = NULL;
+	}
+}
@@ -1219,6 +1219,8 @@ dtrace_update(dtrace_hdl_t *dtp)
 	    dmp != NULL; dmp = dt_list_next(dmp))
 		dt_module_unload(dtp, dmp);
 
+	dt_symcache_purge(dtp, 0);
+
 # if linux
 	/***********************************************/
 	/*   We  will use /proc/kallsyms for ustack()  */
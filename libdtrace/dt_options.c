@@ -245,6 +245,15 @@ dt_opt_iregs(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
 	return (0);
 }
 
+/*ARGSUSED*/
+static int
+dt_opt_semaphores(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
+{
+	dtp->dt_semaphores = 1;
+
+	return (0);
+}
+
 /*ARGSUSED*/
 static int
 dt_opt_lazyload(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
@@ -752,6 +761,9 @@ static const struct {
 } _dtrace_bufresize[] = {
 	{ "auto", DTRACEOPT_BUFRESIZE_AUTO },
 	{ "manual", DTRACEOPT_BUFRESIZE_MANUAL },
+#if defined(linux)
+	{ "adaptive", DTRACEOPT_BUFRESIZE_ADAPTIVE },
+#endif
 	{ NULL, 0 }
 };
 
@@ -780,12 +792,37 @@ dt_opt_bufresize(dtrace_hdl_t *dtp, const char *arg, uintptr_t option)
 	return (0);
 }
 
+/*
+ * Return the size of the largest principal buffer snapshot that the kernel
+ * can hand back, for sizing the staging buffer.  Adaptive buffers may grow
+ * past bufsize; see DTRACE_BUFADAPT_MAX().
+ */
+dtrace_optval_t
+dt_options_snapsize(dtrace_hdl_t *dtp)
+{
+	dtrace_optval_t size = dtp->dt_options[DTRACEOPT_BUFSIZE];
+
+#if defined(linux)
+	if (dtp->dt_options[DTRACEOPT_BUFPOLICY] ==
+	    DTRACEOPT_BUFPOLICY_SWITCH &&
+	    dtp->dt_options[DTRACEOPT_BUFRESIZE] ==
+	    DTRACEOPT_BUFRESIZE_ADAPTIVE &&
+	    dtp->dt_options[DTRACEOPT_BUFBUDGET] != DTRACEOPT_UNSET) {
+		dtrace_optval_t max = DTRACE_BUFADAPT_MAX(size,
+		    dtp->dt_options[DTRACEOPT_BUFBUDGET]);
+
+		if (max > size)
+			size = max;
+	}
+#endif
+
+	return (size);
+}
+
 int
 dt_options_load(dtrace_hdl_t *dtp)
 {
 	dof_hdr_t hdr, *dof;
-	dof_sec_t *sec;
-	size_t offs;
 	int i;
 
 	/*
@@ -811,18 +848,35 @@ dt_options_load(dtrace_hdl_t *dtp)
 	if (dt_ioctl(dtp, DTRACEIOC_DOFGET, dof) == -1)
 		return (dt_set_errno(dtp, errno));
 
+	dt_options_parse(dof, dtp->dt_options);
+
+	return (0);
+}
+
+/*
+ * Set the options in 'opts' from the first OPTDESC section of a DOF image.
+ * Options that take a string are skipped, as the kernel doesn't keep them.
+ */
+void
+dt_options_parse(const dof_hdr_t *dof, dtrace_optval_t *opts)
+{
+	const dof_sec_t *sec;
+	size_t offs;
+	int i;
+
 	for (i = 0; i < dof->dofh_secnum; i++) {
-		sec = (dof_sec_t *)(uintptr_t)((uintptr_t)dof +
+		sec = (const dof_sec_t *)(uintptr_t)((uintptr_t)dof +
 		    dof->dofh_secoff + i * dof->dofh_secsize);
 
-		if (sec->dofs_type != DOF_SECT_OPTDESC)
-			continue;
-
-		break;
+		if (sec->dofs_type == DOF_SECT_OPTDESC)
+			break;
 	}
 
+	if (i == dof->dofh_secnum)
+		return;
+
 	for (offs = 0; offs < sec->dofs_size; offs += sec->dofs_entsize) {
-		dof_optdesc_t *opt = (dof_optdesc_t *)(uintptr_t)
+		const dof_optdesc_t *opt = (const dof_optdesc_t *)(uintptr_t)
 		    ((uintptr_t)dof + sec->dofs_offset + offs);
 
 		if (opt->dofo_strtab != DOF_SECIDX_NONE)
@@ -831,10 +885,64 @@ dt_options_load(dtrace_hdl_t *dtp)
 		if (opt->dofo_option >= DTRACEOPT_MAX)
 			continue;
 
-		dtp->dt_options[opt->dofo_option] = opt->dofo_value;
+		opts[opt->dofo_option] = opt->dofo_value;
 	}
+}
 
-	return (0);
+/*
+ * Build the DOF that DTRACEIOC_DOFGET returns for a vectored open that keeps
+ * its options in 'opts':  just an OPTDESC section, which is all that
+ * dt_options_load() looks at.  As with the kernel, if the caller hasn't left
+ * room for all of it, only the header is filled in, with the size needed.
+ */
+void
+dt_options_dof(dof_hdr_t *dof, const dtrace_optval_t *opts)
+{
+	dof_optdesc_t *opt;
+	dof_sec_t *sec;
+	size_t size;
+	int i, n;
+
+	for (i = 0, n = 0; i < DTRACEOPT_MAX; i++) {
+		if (opts[i] != DTRACEOPT_UNSET)
+			n++;
+	}
+
+	size = sizeof (dof_hdr_t) + sizeof (dof_sec_t) +
+	    n * sizeof (dof_optdesc_t);
+
+	if (dof->dofh_loadsz < size) {
+		bzero(dof, sizeof (dof_hdr_t));
+		dof->dofh_loadsz = size;
+		return;
+	}
+
+	bzero(dof, size);
+	dof->dofh_hdrsize = sizeof (dof_hdr_t);
+	dof->dofh_secsize = sizeof (dof_sec_t);
+	dof->dofh_secnum = 1;
+	dof->dofh_secoff = sizeof (dof_hdr_t);
+	dof->dofh_loadsz = size;
+	dof->dofh_filesz = size;
+
+	sec = (dof_sec_t *)((uintptr_t)dof + dof->dofh_secoff);
+	sec->dofs_type = DOF_SECT_OPTDESC;
+	sec->dofs_align = sizeof (uint64_t);
+	sec->dofs_entsize = sizeof (dof_optdesc_t);
+	sec->dofs_offset = sizeof (dof_hdr_t) + sizeof (dof_sec_t);
+	sec->dofs_size = n * sizeof (dof_optdesc_t);
+
+	opt = (dof_optdesc_t *)((uintptr_t)dof + sec->dofs_offset);
+
+	for (i = 0; i < DTRACEOPT_MAX; i++) {
+		if (opts[i] == DTRACEOPT_UNSET)
+			continue;
+
+		opt->dofo_option = i;
+		opt->dofo_strtab = DOF_SECIDX_NONE;
+		opt->dofo_value = opts[i];
+		opt++;
+	}
 }
 
 /*ARGSUSED*/
@@ -901,6 +1009,7 @@ static const dt_option_t _dtrace_ctoptions[] = {
 	{ "pgmax", dt_opt_pgmax },
 	{ "preallocate", dt_opt_preallocate },
 	{ "pspec", dt_opt_cflags, DTRACE_C_PSPEC },
+	{ "semaphores", dt_opt_semaphores },
 	{ "stdc", dt_opt_stdc },
 	{ "strip", dt_opt_dflags, DTRACE_D_STRIP },
 	{ "syslibdir", dt_opt_syslibdir },
@@ -919,7 +1028,16 @@ static const dt_option_t _dtrace_ctoptions[] = {
  * Run-time options.
  */
 static const dt_option_t _dtrace_rtoptions[] = {
+#if defined(linux)
+	{ "aggcompact", dt_opt_runtime, DTRACEOPT_AGGCOMPACT },
+#endif
 	{ "aggsize", dt_opt_size, DTRACEOPT_AGGSIZE },
+#if defined(linux)
+	{ "aggtopn", dt_opt_runtime, DTRACEOPT_AGGTOPN },
+#endif
+#if defined(linux)
+	{ "bufbudget", dt_opt_size, DTRACEOPT_BUFBUDGET },
+#endif
 	{ "bufsize", dt_opt_size, DTRACEOPT_BUFSIZE },
 	{ "bufpolicy", dt_opt_bufpolicy, DTRACEOPT_BUFPOLICY },
 	{ "bufresize", dt_opt_bufresize, DTRACEOPT_BUFRESIZE },
@@ -932,6 +1050,9 @@ static const dt_option_t _dtrace_rtoptions[] = {
 	{ "jstackstrsize", dt_opt_size, DTRACEOPT_JSTACKSTRSIZE },
 	{ "nspec", dt_opt_runtime, DTRACEOPT_NSPEC },
 	{ "specsize", dt_opt_size, DTRACEOPT_SPECSIZE },
+#if defined(linux)
+	{ "stacktabsize", dt_opt_size, DTRACEOPT_STACKTABSIZE },
+#endif
 	{ "statusrate", dt_opt_rate, DTRACEOPT_STATUSRATE },
 	{ "strsize", dt_opt_strsize, DTRACEOPT_STRSIZE },
 	{ "ustackframes", dt_opt_runtime, DTRACEOPT_USTACKFRAMES },
@@ -35,12 +35,23 @@
 #include <alloca.h>
 #include <libgen.h>
 #include <stddef.h>
+#include <pthread.h>
 
 #include <dt_impl.h>
 #include <dt_program.h>
 #include <dt_pid.h>
 #include <dt_string.h>
 
+/*
+ * A function matched by a globbed probe description, held back until the whole
+ * module has been searched so that its text can be read and decoded in bulk.
+ */
+typedef struct dt_pid_sym {
+	GElf_Sym dps_sym;		/* function symbol */
+	char *dps_func;			/* function name */
+	size_t dps_isoff;		/* offset of its sizes in dpd_isize */
+} dt_pid_sym_t;
+
 typedef struct dt_pid_probe {
 	dtrace_hdl_t *dpp_dtp;
 	dt_pcb_t *dpp_pcb;
@@ -57,8 +68,37 @@ typedef struct dt_pid_probe {
 	uint64_t dpp_stret[4];
 	GElf_Sym dpp_last;
 	uint_t dpp_last_taken;
+	dt_pid_sym_t *dpp_syms;
+	uint_t dpp_nsyms;
+	uint_t dpp_symsz;
+	dt_pid_batch_t dpp_batch;
 } dt_pid_probe_t;
 
+/*
+ * Probe specs are queued in dpp_batch rather than handed to fasttrap one
+ * at a time, and are created with a single FASTTRAPIOC_MAKEPROBES once the
+ * batch grows past DT_PID_BATCH_MAX or the enabling has been processed.
+ */
+#define	DT_PID_BATCH_MAX	(1024 * 1024)
+
+/*
+ * Functions are handed to the decoding threads this many at a time.
+ */
+#define	DT_PID_DECODE_CHUNK	64
+
+typedef struct dt_pid_decode {
+	dtrace_hdl_t *dpd_dtp;
+	pid_t dpd_pid;
+	char dpd_dmodel;
+	const uint8_t *dpd_text;	/* text of the whole module */
+	uintptr_t dpd_base;		/* address of dpd_text[0] */
+	uint8_t *dpd_isize;		/* instruction sizes, by function */
+	dt_pid_sym_t *dpd_syms;
+	uint_t dpd_nsyms;
+	uint_t dpd_next;		/* next function to be decoded */
+	pthread_mutex_t dpd_lock;	/* protects dpd_next */
+} dt_pid_decode_t;
+
 /*
  * Compose the lmid and object name into the canonical representation. We
  * omit the lmid for the default link map for convenience.
@@ -99,8 +139,106 @@ dt_pid_error(dtrace_hdl_t *dtp, dt_pcb_t *pcb, dt_proc_t *dpr,
 	return (1);
 }
 
+int
+dt_pid_queue_probe(dtrace_hdl_t *dtp, dt_pid_batch_t *dpb,
+    const fasttrap_probe_spec_t *ftp)
+{
+	size_t size = FASTTRAP_PROBE_SPEC_SIZE(ftp->ftps_noffs);
+
+	if (dpb->dpb_len + size > dpb->dpb_size) {
+		size_t nsize = MAX(dpb->dpb_size * 2, dpb->dpb_len + size);
+		void *specs;
+
+		if ((specs = realloc(dpb->dpb_specs, nsize)) == NULL)
+			return (dt_set_errno(dtp, EDT_NOMEM));
+
+		dpb->dpb_specs = specs;
+		dpb->dpb_size = nsize;
+	}
+
+	bcopy(ftp, (char *)dpb->dpb_specs + dpb->dpb_len, size);
+	dpb->dpb_len += size;
+	dpb->dpb_n++;
+
+	return (0);
+}
+
 static int
-dt_pid_per_sym(dt_pid_probe_t *pp, const GElf_Sym *symp, const char *func)
+dt_pid_flush_probes(dt_pid_probe_t *pp)
+{
+	dtrace_hdl_t *dtp = pp->dpp_dtp;
+	dt_pid_batch_t *dpb = &pp->dpp_batch;
+	fasttrap_probe_batch_t ftpb;
+	fasttrap_probe_spec_t *ftp;
+	const char *what;
+	uint64_t i;
+	int err = 0;
+
+	if (dpb->dpb_n == 0)
+		return (0);
+
+	ftpb.ftpb_nspecs = dpb->dpb_n;
+	ftpb.ftpb_size = dpb->dpb_len;
+	ftpb.ftpb_specs = (uintptr_t)dpb->dpb_specs;
+	ftpb.ftpb_ndone = 0;
+
+	dpb->dpb_n = 0;
+	dpb->dpb_len = 0;
+
+	if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBES, &ftpb) == 0)
+		return (0);
+
+	err = errno;
+	ftp = dpb->dpb_specs;
+	for (i = 0; i < ftpb.ftpb_ndone; i++) {
+		ftp = (fasttrap_probe_spec_t *)((char *)ftp +
+		    FASTTRAP_PROBE_SPEC_SIZE(ftp->ftps_noffs));
+	}
+
+	/*
+	 * A fasttrap driver that predates FASTTRAPIOC_MAKEPROBES rejects the
+	 * request outright; fall back to creating the probes one at a time.
+	 */
+	if (ftpb.ftpb_ndone == 0 && (err == EINVAL || err == ENOTTY)) {
+		for (err = 0; i < ftpb.ftpb_nspecs; i++) {
+			if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE,
+			    ftp) != 0) {
+				err = errno;
+				break;
+			}
+
+			ftp = (fasttrap_probe_spec_t *)((char *)ftp +
+			    FASTTRAP_PROBE_SPEC_SIZE(ftp->ftps_noffs));
+		}
+
+		if (err == 0)
+			return (0);
+	}
+
+	dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
+	    strerror(err));
+	(void) dt_set_errno(dtp, err);
+
+	switch (ftp->ftps_type) {
+	case DTFTP_ENTRY:
+		what = "entry probe";
+		break;
+	case DTFTP_RETURN:
+		what = "return probe";
+		break;
+	default:
+		what = "offset probes";
+		break;
+	}
+
+	return (dt_pid_error(dtp, pp->dpp_pcb, pp->dpp_dpr, NULL,
+	    D_PROC_CREATEFAIL, "failed to create %s for '%s': %s", what,
+	    ftp->ftps_func, dtrace_errmsg(dtp, dtrace_errno(dtp))));
+}
+
+static int
+dt_pid_per_sym(dt_pid_probe_t *pp, const GElf_Sym *symp, const char *func,
+    const dt_pid_text_t *dpt)
 {
 	dtrace_hdl_t *dtp = pp->dpp_dtp;
 	dt_pcb_t *pcb = pp->dpp_pcb;
@@ -134,8 +272,9 @@ dt_pid_per_sym(dt_pid_probe_t *pp, const GElf_Sym *symp, const char *func)
 	    pp->dpp_obj);
 
 	if (!isdash && gmatch("return", pp->dpp_name)) {
-		if (dt_pid_create_return_probe(pp->dpp_pr, dtp, ftp, symp,
-		    pp->dpp_stret) < 0) {
+		if (dt_pid_create_return_probe(pp->dpp_pr, dtp, &pp->dpp_batch,
+		    ftp, symp,
+		    pp->dpp_stret, dpt) < 0) {
 			return (dt_pid_error(dtp, pcb, dpr, ftp,
 			    D_PROC_CREATEFAIL, "failed to create return probe "
 			    "for '%s': %s", func,
@@ -146,7 +285,8 @@ dt_pid_per_sym(dt_pid_probe_t *pp, const GElf_Sym *symp, const char *func)
 	}
 
 	if (!isdash && gmatch("entry", pp->dpp_name)) {
-		if (dt_pid_create_entry_probe(pp->dpp_pr, dtp, ftp, symp) < 0) {
+		if (dt_pid_create_entry_probe(pp->dpp_pr, dtp, &pp->dpp_batch,
+		    ftp, symp) < 0) {
 			return (dt_pid_error(dtp, pcb, dpr, ftp,
 			    D_PROC_CREATEFAIL, "failed to create entry probe "
 			    "for '%s': %s", func,
@@ -170,8 +310,8 @@ dt_pid_per_sym(dt_pid_probe_t *pp, const GElf_Sym *symp, const char *func)
 			    (u_longlong_t)off, func, symp->st_size));
 		}
 
-		err = dt_pid_create_offset_probe(pp->dpp_pr, pp->dpp_dtp, ftp,
-		    symp, off);
+		err = dt_pid_create_offset_probe(pp->dpp_pr, pp->dpp_dtp,
+		    &pp->dpp_batch, ftp, symp, off, dpt);
 
 		if (err == DT_PROC_ERR) {
 			return (dt_pid_error(dtp, pcb, dpr, ftp,
@@ -190,7 +330,8 @@ dt_pid_per_sym(dt_pid_probe_t *pp, const GElf_Sym *symp, const char *func)
 
 	} else if (glob && !isdash) {
 		if (dt_pid_create_glob_offset_probes(pp->dpp_pr,
-		    pp->dpp_dtp, ftp, symp, pp->dpp_name) < 0) {
+		    pp->dpp_dtp, &pp->dpp_batch, ftp, symp, pp->dpp_name,
+		    dpt) < 0) {
 			return (dt_pid_error(dtp, pcb, dpr, ftp,
 			    D_PROC_CREATEFAIL,
 			    "failed to create offset probes in '%s': %s", func,
@@ -204,6 +345,204 @@ dt_pid_per_sym(dt_pid_probe_t *pp, const GElf_Sym *symp, const char *func)
 
 	dt_free(dtp, ftp);
 
+	if (pp->dpp_batch.dpb_len >= DT_PID_BATCH_MAX)
+		return (dt_pid_flush_probes(pp));
+
+	return (0);
+}
+
+static void *
+dt_pid_decode_worker(void *arg)
+{
+	dt_pid_decode_t *dpd = arg;
+	dt_pid_sym_t *dps;
+	uint_t i, end;
+
+	for (;;) {
+		(void) pthread_mutex_lock(&dpd->dpd_lock);
+		i = dpd->dpd_next;
+		end = dpd->dpd_next = MIN(i + DT_PID_DECODE_CHUNK,
+		    dpd->dpd_nsyms);
+		(void) pthread_mutex_unlock(&dpd->dpd_lock);
+
+		if (i == end)
+			break;
+
+		for (; i < end; i++) {
+			dps = &dpd->dpd_syms[i];
+			dt_pid_decode_text(dpd->dpd_dtp, dpd->dpd_pid,
+			    dpd->dpd_dmodel, dpd->dpd_text +
+			    (dps->dps_sym.st_value - dpd->dpd_base),
+			    dps->dps_sym.st_value, dps->dps_sym.st_size,
+			    dpd->dpd_isize + dps->dps_isoff);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Create probes for the functions collected by dt_pid_sym_filt().  Unless only
+ * entry probes are wanted, the text spanning all of them is read with a single
+ * Pread(), and their instructions are decoded by a pool of threads up front;
+ * the probes themselves are then created in symbol order, exactly as if each
+ * function had been handled as it was found.  If the bulk read fails, each
+ * function's text is read and decoded as it is needed instead.
+ */
+static int
+dt_pid_per_syms(dt_pid_probe_t *pp)
+{
+	dtrace_hdl_t *dtp = pp->dpp_dtp;
+	const pstatus_t *psp = Pstatus(pp->dpp_pr);
+	dt_pid_decode_t dpd;
+	dt_pid_text_t dpt, *dptp = NULL;
+	dt_pid_sym_t *dps;
+	uint8_t *text = NULL;
+	uintptr_t lo = UINTPTR_MAX, hi = 0;
+	size_t isize = 0;
+	pthread_t *thr = NULL;
+	int nthr = 0, ret = 0;
+	uint_t i;
+
+	if (pp->dpp_nsyms != 0 && strcmp(pp->dpp_name, "entry") != 0) {
+		for (i = 0; i < pp->dpp_nsyms; i++) {
+			dps = &pp->dpp_syms[i];
+			dps->dps_isoff = isize;
+			isize += dps->dps_sym.st_size;
+			lo = MIN(lo, dps->dps_sym.st_value);
+			hi = MAX(hi, dps->dps_sym.st_value +
+			    dps->dps_sym.st_size);
+		}
+
+		/*
+		 * The padding lets the decoder run off the end of the last
+		 * function, as it would into the next one.
+		 */
+		dpd.dpd_isize = NULL;
+		if ((text = malloc(hi - lo + 16)) == NULL ||
+		    (dpd.dpd_isize = calloc(1, isize)) == NULL ||
+		    Pread(pp->dpp_pr, text, hi - lo, lo) != hi - lo) {
+			dt_dprintf("bulk read of %s text failed\n",
+			    pp->dpp_obj);
+			free(dpd.dpd_isize);
+			free(text);
+			text = NULL;
+		}
+	}
+
+	if (text != NULL) {
+		bzero(text + (hi - lo), 16);
+
+		dpd.dpd_dtp = dtp;
+		dpd.dpd_pid = psp->pr_pid;
+		dpd.dpd_dmodel = psp->pr_dmodel;
+		dpd.dpd_text = text;
+		dpd.dpd_base = lo;
+		dpd.dpd_syms = pp->dpp_syms;
+		dpd.dpd_nsyms = pp->dpp_nsyms;
+		dpd.dpd_next = 0;
+		(void) pthread_mutex_init(&dpd.dpd_lock, NULL);
+
+		nthr = MIN(dt_sysconf(dtp, _SC_NPROCESSORS_ONLN),
+		    (pp->dpp_nsyms + DT_PID_DECODE_CHUNK - 1) /
+		    DT_PID_DECODE_CHUNK) - 1;
+
+		if (nthr > 0 && (thr = malloc(nthr * sizeof (pthread_t))) ==
+		    NULL)
+			nthr = 0;
+
+		for (i = 0; i < nthr; i++) {
+			if (pthread_create(&thr[i], NULL,
+			    dt_pid_decode_worker, &dpd) != 0)
+				break;
+		}
+		nthr = (int)i;
+
+		/*
+		 * This thread pitches in too, and picks up all of the work
+		 * if no other threads could be created.
+		 */
+		(void) dt_pid_decode_worker(&dpd);
+
+		for (i = 0; i < (uint_t)nthr; i++)
+			(void) pthread_join(thr[i], NULL);
+
+		free(thr);
+		(void) pthread_mutex_destroy(&dpd.dpd_lock);
+
+		dt_dprintf("decoded %u functions in %s with %d threads\n",
+		    pp->dpp_nsyms, pp->dpp_obj, nthr + 1);
+
+		dptp = &dpt;
+	}
+
+	for (i = 0; i < pp->dpp_nsyms; i++) {
+		dps = &pp->dpp_syms[i];
+
+		if (dptp != NULL) {
+			dpt.dpt_text = text + (dps->dps_sym.st_value - lo);
+			dpt.dpt_isize = dpd.dpd_isize + dps->dps_isoff;
+			dpt.dpt_size = dps->dps_sym.st_size;
+		}
+
+		if (ret == 0)
+			ret = dt_pid_per_sym(pp, &dps->dps_sym, dps->dps_func,
+			    dptp);
+
+		free(dps->dps_func);
+	}
+
+	if (text != NULL) {
+		free(text);
+		free(dpd.dpd_isize);
+	}
+
+	pp->dpp_nsyms = 0;
+
+	return (ret);
+}
+
+static int
+dt_pid_per_syms_abort(dt_pid_probe_t *pp)
+{
+	uint_t i;
+
+	for (i = 0; i < pp->dpp_nsyms; i++)
+		free(pp->dpp_syms[i].dps_func);
+
+	pp->dpp_nsyms = 0;
+
+	return (1);
+}
+
+static int
+dt_pid_add_sym(dt_pid_probe_t *pp, const GElf_Sym *symp, const char *func)
+{
+	dt_pid_sym_t *dps;
+
+	if (pp->dpp_nsyms == pp->dpp_symsz) {
+		uint_t nsz = pp->dpp_symsz ? pp->dpp_symsz * 2 : 256;
+
+		if ((dps = realloc(pp->dpp_syms, nsz * sizeof (*dps))) ==
+		    NULL) {
+			(void) dt_set_errno(pp->dpp_dtp, EDT_NOMEM);
+			return (1);
+		}
+
+		pp->dpp_syms = dps;
+		pp->dpp_symsz = nsz;
+	}
+
+	dps = &pp->dpp_syms[pp->dpp_nsyms];
+
+	if ((dps->dps_func = strdup(func)) == NULL) {
+		(void) dt_set_errno(pp->dpp_dtp, EDT_NOMEM);
+		return (1);
+	}
+
+	dps->dps_sym = *symp;
+	pp->dpp_nsyms++;
+
 	return (0);
 }
 
@@ -235,7 +574,7 @@ dt_pid_sym_filt(void *arg, const GElf_Sym *symp, const char *func)
 
 		if ((pp->dpp_last_taken = gmatch(func, pp->dpp_func)) != 0) {
 			pp->dpp_last = *symp;
-			return (dt_pid_per_sym(pp, symp, func));
+			return (dt_pid_add_sym(pp, symp, func));
 		}
 	}
 
@@ -353,26 +692,26 @@ dt_pid_per_mod(void *arg, const prmap_t *pmp, const char *obj)
 		(void) Plookup_by_addr(pp->dpp_pr, sym.st_value, pp->dpp_func,
 		    DTRACE_FUNCNAMELEN, &sym);
 
-		return (dt_pid_per_sym(pp, &sym, pp->dpp_func));
+		return (dt_pid_per_sym(pp, &sym, pp->dpp_func, NULL));
 	} else {
-		uint_t nmatches = pp->dpp_nmatches;
+		pp->dpp_nsyms = 0;
 
 		if (Psymbol_iter_by_addr(pp->dpp_pr, obj, PR_SYMTAB,
 		    BIND_ANY | TYPE_FUNC, dt_pid_sym_filt, pp) == 1)
-			return (1);
+			return (dt_pid_per_syms_abort(pp));
 
-		if (nmatches == pp->dpp_nmatches) {
+		if (pp->dpp_nsyms == 0) {
 			/*
 			 * If we didn't match anything in the PR_SYMTAB, try
 			 * the PR_DYNSYM.
 			 */
 			if (Psymbol_iter_by_addr(pp->dpp_pr, obj, PR_DYNSYM,
 			    BIND_ANY | TYPE_FUNC, dt_pid_sym_filt, pp) == 1)
-				return (1);
+				return (dt_pid_per_syms_abort(pp));
 		}
-	}
 
-	return (0);
+		return (dt_pid_per_syms(pp));
+	}
 }
 
 static int
@@ -451,6 +790,7 @@ dt_pid_create_pid_probes(dtrace_probedesc_t *pdp, dtrace_hdl_t *dtp,
 	dt_pid_probe_t pp;
 	int ret = 0;
 
+	bzero(&pp.dpp_batch, sizeof (pp.dpp_batch));
 	pp.dpp_dtp = dtp;
 	pp.dpp_dpr = dpr;
 	pp.dpp_pr = dpr->dpr_proc;
@@ -470,6 +810,9 @@ dt_pid_create_pid_probes(dtrace_probedesc_t *pdp, dtrace_hdl_t *dtp,
 	pp.dpp_func = pdp->dtpd_func[0] != '\0' ? pdp->dtpd_func : "*";
 	pp.dpp_name = pdp->dtpd_name[0] != '\0' ? pdp->dtpd_name : "*";
 	pp.dpp_last_taken = 0;
+	pp.dpp_syms = NULL;
+	pp.dpp_nsyms = 0;
+	pp.dpp_symsz = 0;
 
 	if (strcmp(pp.dpp_func, "-") == 0) {
 		const prmap_t *aout, *pmp;
@@ -519,6 +862,17 @@ dt_pid_create_pid_probes(dtrace_probedesc_t *pdp, dtrace_hdl_t *dtp,
 		}
 	}
 
+	free(pp.dpp_syms);
+
+	/*
+	 * Create whatever is still queued.  If the enabling failed part way
+	 * through, the rest of it is abandoned.
+	 */
+	if (ret == 0)
+		ret = dt_pid_flush_probes(&pp);
+
+	free(pp.dpp_batch.dpb_specs);
+
 	return (ret);
 }
 
@@ -711,7 +1065,7 @@ dt_pid_create_probes(dtrace_probedesc_t *pdp, dtrace_hdl_t *dtp, dt_pcb_t *pcb)
 
 		err = dt_pid_create_pid_probes(pdp, dtp, pcb, dpr);
 
-		(void) pthread_mutex_unlock(&dpr->dpr_lock);
+		dt_proc_dpr_unlock(dtp, dpr);
 		dt_proc_release(dtp, P);
 	}
 
@@ -734,7 +1088,7 @@ dt_pid_create_probes(dtrace_probedesc_t *pdp, dtrace_hdl_t *dtp, dt_pcb_t *pcb)
 			dpr->dpr_usdt = B_TRUE;
 		}
 
-		(void) pthread_mutex_unlock(&dpr->dpr_lock);
+		dt_proc_dpr_unlock(dtp, dpr);
 		dt_proc_release(dtp, P);
 	}
 
@@ -45,17 +45,55 @@ extern int dt_pid_create_probes(dtrace_probedesc_t *, dtrace_hdl_t *,
     dt_pcb_t *pcb);
 extern int dt_pid_create_probes_module(dtrace_hdl_t *, dt_proc_t *);
 
+/*
+ * When probes are created for many functions in a module at once, the
+ * module's text is read in one go and the functions are decoded in parallel
+ * before any probes are created (see dt_pid_per_syms()).  A dt_pid_text_t
+ * describes one function's share of that work: dpt_isize[off] is the length
+ * of the instruction at offset off, DT_PID_ISIZE_BAD if it couldn't be
+ * decoded, or zero if the decoder never started an instruction there.
+ */
+typedef struct dt_pid_text {
+	const uint8_t *dpt_text;	/* function text */
+	const uint8_t *dpt_isize;	/* instruction sizes, by offset */
+	size_t dpt_size;		/* size of the function */
+} dt_pid_text_t;
+
+#define	DT_PID_ISIZE_BAD	0xff
+
+/*
+ * Probe specs waiting to be created with a single FASTTRAPIOC_MAKEPROBES.
+ * Each dt_pid_create_probes() call has its own batch, as the control thread
+ * of one process may be creating probes while the main thread compiles pid
+ * probes for another.
+ */
+typedef struct dt_pid_batch {
+	void *dpb_specs;		/* fasttrap probe specs */
+	size_t dpb_size;		/* allocated size of dpb_specs */
+	size_t dpb_len;			/* bytes of dpb_specs in use */
+	uint_t dpb_n;			/* number of specs in dpb_specs */
+} dt_pid_batch_t;
+
+extern int dt_pid_queue_probe(dtrace_hdl_t *, dt_pid_batch_t *,
+    const fasttrap_probe_spec_t *);
+
+extern void dt_pid_decode_text(dtrace_hdl_t *, pid_t, char, const uint8_t *,
+    uint64_t, size_t, uint8_t *);
+
 extern int dt_pid_create_entry_probe(struct ps_prochandle *, dtrace_hdl_t *,
-    fasttrap_probe_spec_t *, const GElf_Sym *);
+    dt_pid_batch_t *, fasttrap_probe_spec_t *, const GElf_Sym *);
 
 extern int dt_pid_create_return_probe(struct ps_prochandle *, dtrace_hdl_t *,
-    fasttrap_probe_spec_t *, const GElf_Sym *, uint64_t *);
+    dt_pid_batch_t *, fasttrap_probe_spec_t *, const GElf_Sym *, uint64_t *,
+    const dt_pid_text_t *);
 
 extern int dt_pid_create_offset_probe(struct ps_prochandle *, dtrace_hdl_t *,
-    fasttrap_probe_spec_t *, const GElf_Sym *, ulong_t);
+    dt_pid_batch_t *, fasttrap_probe_spec_t *, const GElf_Sym *, ulong_t,
+    const dt_pid_text_t *);
 
 extern int dt_pid_create_glob_offset_probes(struct ps_prochandle *,
-    dtrace_hdl_t *, fasttrap_probe_spec_t *, const GElf_Sym *, const char *);
+    dtrace_hdl_t *, dt_pid_batch_t *, fasttrap_probe_spec_t *,
+    const GElf_Sym *, const char *, const dt_pid_text_t *);
 
 #ifdef	__cplusplus
 }
@@ -435,6 +435,11 @@ pfprint_stack(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 		    rec->dtrd_size / rec->dtrd_arg);
 		break;
 
+	case DTRACEACT_STACKID:
+	case DTRACEACT_USTACKID:
+		err = dt_print_stackid(dtp, fp, format, rec, addr);
+		break;
+
 	default:
 		assert(0);
 	}
@@ -1321,6 +1326,18 @@ pfprint_stddev(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	    dt_stddev((uint64_t *)data, normal)));
 }
 
+/*ARGSUSED*/
+static int
+pfprint_distinct(dtrace_hdl_t *dtp, FILE *fp, const char *format,
+    const dt_pfargd_t *pfd, const void *addr, size_t size, uint64_t normal)
+{
+	if (size != DTRACE_DISTINCT_NREGS)
+		return (dt_set_errno(dtp, EDT_DMISMATCH));
+
+	return (dt_printf(dtp, fp, format,
+	    dt_distinct_estimate(addr) / normal));
+}
+
 /*ARGSUSED*/
 static int
 pfprint_quantize(dtrace_hdl_t *dtp, FILE *fp, const char *format,
@@ -1329,6 +1346,14 @@ pfprint_quantize(dtrace_hdl_t *dtp, FILE *fp, const char *format,
 	return (dt_print_quantize(dtp, fp, addr, size, normal));
 }
 
+/*ARGSUSED*/
+static int
+pfprint_percentiles(dtrace_hdl_t *dtp, FILE *fp, const char *format,
+    const dt_pfargd_t *pfd, const void *addr, size_t size, uint64_t normal)
+{
+	return (dt_print_percentiles(dtp, fp, addr, size, normal));
+}
+
 /*ARGSUSED*/
 static int
 pfprint_lquantize(dtrace_hdl_t *dtp, FILE *fp, const char *format,
@@ -1533,6 +1558,12 @@ dt_printf_format(dtrace_hdl_t *dtp, FILE *fp, const dt_pfargv_t *pfv,
 		case DTRACEAGG_LLQUANTIZE:
 			func = pfprint_llquantize;
 			break;
+		case DTRACEAGG_DISTINCT:
+			func = pfprint_distinct;
+			break;
+		case DTRACEAGG_PERCENTILES:
+			func = pfprint_percentiles;
+			break;
 		case DTRACEACT_MOD:
 			func = pfprint_mod;
 			break;
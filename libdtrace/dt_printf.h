@@ -125,6 +125,8 @@ extern int dt_print_stack(dtrace_hdl_t *, FILE *,
     const char *, caddr_t, int, int);
 extern int dt_print_ustack(dtrace_hdl_t *, FILE *,
     const char *, caddr_t, uint64_t);
+extern int dt_print_stackid(dtrace_hdl_t *, FILE *,
+    const char *, const dtrace_recdesc_t *, caddr_t);
 extern int dt_print_mod(dtrace_hdl_t *, FILE *, const char *, caddr_t);
 extern int dt_print_umod(dtrace_hdl_t *, FILE *, const char *, caddr_t);
 
@@ -48,8 +48,9 @@
  * to ustack() to avoid the overhead of releasing and re-grabbing processes.
  *
  * Process Control: For processes that are grabbed for control (~PGRAB_RDONLY)
- * or created by dt_proc_create(), a control thread is created to provide
- * callbacks on process exit and symbol table caching on dlopen()s.
+ * or created by dt_proc_create(), the process is handed to a single control
+ * thread shared by every such process, which provides callbacks on process
+ * exit and symbol table caching on dlopen()s.
  *
  * MT-Safety: Libproc is not MT-Safe, so dt_proc_lock() and dt_proc_unlock()
  * are provided to synchronize access to the libproc handle between libdtrace
@@ -66,10 +67,21 @@
  * The dph_lrucnt and dph_lrulim count the number of cacheable processes and
  * the current limit on the number of actively cached entries.
  *
- * The control thread for a process establishes breakpoints at the rtld_db
+ * The control thread is started the first time a process is placed under
+ * control and runs an event loop over every process on the dph_ctl list.  It
+ * sleeps in epoll_wait() on a wakeup pipe, written to whenever the list or a
+ * process's stop state changes, and on a pidfd per process so that deaths are
+ * seen immediately.  Stop events are collected with a non-blocking waitpid()
+ * sweep, run every DT_PROC_POLL msecs while any controlled process is running.
+ * Per-process state is just the dt_proc_t: there is no thread or stack per
+ * victim.  As the only tracer of every controlled process, the control thread
+ * performs all of the ptrace(2) attach, resume and detach requests on their
+ * behalf.
+ *
+ * For each process, the control loop establishes breakpoints at the rtld_db
  * locations of interest, updates mappings and symbol tables at these points,
- * and handles exec and fork (by always following the parent).  The control
- * thread automatically exits when the process dies or control is lost.
+ * and handles exec and fork (by always following the parent).  A process is
+ * dropped from the loop when it dies, control is lost, or it is released.
  *
  * A simple notification mechanism is provided for libdtrace clients using
  * dtrace_handle_proc() for notification of PS_UNDEAD or PS_LOST events.  If
@@ -80,8 +92,12 @@
 
 #include <sys/wait.h>
 #include <sys/lwp.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <strings.h>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <errno.h>
 
@@ -95,6 +111,9 @@
 			w == SYS_forkall || w == SYS_forksys)
 char *rd_errstr(int);
 
+#define	DT_PROC_POLL		10	/* msecs between sweeps while running */
+#define	DT_PROC_NEVENTS		16	/* epoll events consumed per wakeup */
+
 static dt_bkpt_t *
 dt_proc_bpcreate(dt_proc_t *dpr, uintptr_t addr, dt_bkpt_f *func, void *data)
 {
@@ -226,11 +245,50 @@ dt_proc_notify(dtrace_hdl_t *dtp, dt_proc_hash_t *dph, dt_proc_t *dpr,
 	}
 }
 
+/*
+ * Poke the control thread out of epoll_wait() so that it rescans dph_ctl.
+ * The pipe is non-blocking: if it is already full, a wakeup is pending.
+ */
+static void
+dt_proc_wakeup(dt_proc_hash_t *dph)
+{
+	char c = 0;
+
+	if (dph->dph_wakefd[1] != -1)
+		(void) write(dph->dph_wakefd[1], &c, sizeof (c));
+}
+
+/*
+ * Drop dpr_lock on behalf of a thread other than the control thread.  If the
+ * control loop found the lock held during its sweep, it set dpr_ctlwait
+ * (under dph_ctllock) and went back to sleep; wake it now so that it returns
+ * to this process at once rather than on its next sweep.
+ */
+void
+dt_proc_dpr_unlock(dtrace_hdl_t *dtp, dt_proc_t *dpr)
+{
+	dt_proc_hash_t *dph = dtp->dt_procs;
+	int err, wake;
+
+	err = pthread_mutex_unlock(&dpr->dpr_lock);
+	assert(err == 0); /* check for unheld lock */
+
+	(void) pthread_mutex_lock(&dph->dph_ctllock);
+	if ((wake = dpr->dpr_ctlwait) != 0)
+		dpr->dpr_ctlwait = B_FALSE;
+	(void) pthread_mutex_unlock(&dph->dph_ctllock);
+
+	if (wake)
+		dt_proc_wakeup(dph);
+}
+
 /*
  * Check to see if the control thread was requested to stop when the victim
  * process reached a particular event (why) rather than continuing the victim.
- * If 'why' is set in the stop mask, we wait on dpr_cv for dt_proc_continue().
- * If 'why' is not set, this function returns immediately and does nothing.
+ * If 'why' is set in the stop mask, we mark the process as held: the control
+ * loop leaves it stopped and moves on to other processes until
+ * dt_proc_continue() clears DT_PROC_STOP_IDLE.  If 'why' is not set, this
+ * function returns immediately and does nothing.
  */
 static void
 dt_proc_stop(dt_proc_t *dpr, uint8_t why)
@@ -241,20 +299,17 @@ dt_proc_stop(dt_proc_t *dpr, uint8_t why)
 	if (dpr->dpr_stop & why) {
 		dpr->dpr_stop |= DT_PROC_STOP_IDLE;
 		dpr->dpr_stop &= ~why;
+		dpr->dpr_held = B_TRUE;
 
 		(void) pthread_cond_broadcast(&dpr->dpr_cv);
 
 		/*
 		 * We disable breakpoints while stopped to preserve the
 		 * integrity of the program text for both our own disassembly
-		 * and that of the kernel.
+		 * and that of the kernel.  They are re-enabled by the control
+		 * loop when it sets the process running again.
 		 */
 		dt_proc_bpdisable(dpr);
-
-		while (dpr->dpr_stop & DT_PROC_STOP_IDLE)
-			(void) pthread_cond_wait(&dpr->dpr_cv, &dpr->dpr_lock);
-
-		dt_proc_bpenable(dpr);
 	}
 }
 
@@ -287,6 +342,7 @@ dt_proc_rdevent(dtrace_hdl_t *dtp, dt_proc_t *dpr, const char *evname)
 			break;
 
 		Pupdate_syms(dpr->dpr_proc);
+		dt_symcache_purge(dtp, dpr->dpr_pid);
 		if (dt_pid_create_probes_module(dtp, dpr) != 0)
 			dt_proc_notify(dtp, dtp->dt_procs, dpr,
 			    dpr->dpr_errmsg);
@@ -294,10 +350,12 @@ dt_proc_rdevent(dtrace_hdl_t *dtp, dt_proc_t *dpr, const char *evname)
 		break;
 	case RD_PREINIT:
 		Pupdate_syms(dpr->dpr_proc);
+		dt_symcache_purge(dtp, dpr->dpr_pid);
 		dt_proc_stop(dpr, DT_PROC_STOP_PREINIT);
 		break;
 	case RD_POSTINIT:
 		Pupdate_syms(dpr->dpr_proc);
+		dt_symcache_purge(dtp, dpr->dpr_pid);
 		dt_proc_stop(dpr, DT_PROC_STOP_POSTINIT);
 		break;
 	}
@@ -344,6 +402,7 @@ dt_proc_attach(dt_proc_t *dpr, int exec)
 
 		dt_proc_bpdestroy(dpr, B_FALSE);
 		Preset_maps(dpr->dpr_proc);
+		dt_symcache_purge(dpr->dpr_hdl, dpr->dpr_pid);
 	}
 
 	if ((dpr->dpr_rtld = Prd_agent(dpr->dpr_proc)) != NULL &&
@@ -443,57 +502,73 @@ dt_proc_waitrun(dt_proc_t *dpr)
 	(void) pthread_mutex_lock(&dpr->dpr_lock);
 }
 
-typedef struct dt_proc_control_data {
-	dtrace_hdl_t *dpcd_hdl;			/* DTrace handle */
-	dt_proc_t *dpcd_proc;			/* proccess to control */
-} dt_proc_control_data_t;
-
 /*
- * Main loop for all victim process control threads.  We initialize all the
- * appropriate /proc control mechanisms, and then enter a loop waiting for
- * the process to stop on an event or die.  We process any events by calling
- * appropriate subroutines, and exit when the victim dies or we lose control.
- *
- * The control thread synchronizes the use of dpr_proc with other libdtrace
- * threads using dpr_lock.  We hold the lock for all of our operations except
- * waiting while the process is running: this is accomplished by writing a
- * PCWSTOP directive directly to the underlying /proc/<pid>/ctl file.  If the
- * libdtrace client wishes to exit or abort our wait, SIGCANCEL can be used.
+ * Wait for the SIGSTOP we sent (or PTRACE_ATTACH sent) to a tracee to arrive,
+ * and swallow it.  Any other stop that is reported first is resumed with its
+ * signal passed on (a trap is ours, and is dropped), so that on return the
+ * SIGSTOP is no longer pending and the process is stopped.  Returns -1 if the
+ * process went away instead.
  */
-static void *
-dt_proc_control(void *arg)
+static int
+dt_proc_waitstop(pid_t pid)
 {
-	dt_proc_control_data_t *datap = arg;
-	dtrace_hdl_t *dtp = datap->dpcd_hdl;
-	dt_proc_t *dpr = datap->dpcd_proc;
-	dt_proc_hash_t *dph = dpr->dpr_hdl->dt_procs;
-	struct ps_prochandle *P = dpr->dpr_proc;
+	int status, sig;
 
-#if defined(sun)
-	int pfd = Pctlfd(P);
+	for (;;) {
+		if (waitpid(pid, &status, __WALL) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
 
-	const long wstop = PCWSTOP;
-#endif
-	int notify = B_FALSE;
+		if (!WIFSTOPPED(status))
+			return (-1);
 
-	/*
-	 * We disable the POSIX thread cancellation mechanism so that the
-	 * client program using libdtrace can't accidentally cancel our thread.
-	 * dt_proc_destroy() uses SIGCANCEL explicitly to simply poke us out
-	 * of PCWSTOP with EINTR, at which point we will see dpr_quit and exit.
-	 */
-	(void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if ((sig = WSTOPSIG(status)) == SIGSTOP)
+			return (0);
 
-	dpr->dpr_pid = proc_getpid(P);
-	int pid = dpr->dpr_pid;
+		if ((sig & 0x7f) == SIGTRAP)
+			sig = 0;
+
+		if (do_ptrace(__func__, PTRACE_CONT, pid, 0,
+		    (void *)(uintptr_t)sig) == -1)
+			return (-1);
+	}
+}
+
+/*
+ * Place a newly handed-over process under the control loop.  We attach with
+ * ptrace, initialize the appropriate /proc control mechanisms, register the
+ * process's pidfd for exit notification, and then check for the initial
+ * rendezvous requested by dt_proc_monitor().  If we cannot become the tracer,
+ * the error is recorded in dpr_attacherr and the process is let go of.
+ */
+static int
+dt_proc_ctl_attach(dtrace_hdl_t *dtp, dt_proc_t *dpr)
+{
+	dt_proc_hash_t *dph = dtp->dt_procs;
+	struct ps_prochandle *P = dpr->dpr_proc;
+	struct epoll_event ev;
+
+	assert(DT_MUTEX_HELD(&dpr->dpr_lock));
 
 	/*
 	 * Set up the corresponding process for tracing by libdtrace.  We want
 	 * to be able to catch breakpoints and efficiently single-step over
 	 * them, and we need to enable librtld_db to watch libdl activity.
+	 * The attach stop is consumed here so that the sweep in the control
+	 * loop only ever sees events of interest.
 	 */
-	do_ptrace(__func__, PTRACE_ATTACH, dpr->dpr_pid, 0, 0);
-	(void) pthread_mutex_lock(&dpr->dpr_lock);
+	if (do_ptrace(__func__, PTRACE_ATTACH, dpr->dpr_pid, 0, 0) == -1 ||
+	    dt_proc_waitstop(dpr->dpr_pid) == -1) {
+		dpr->dpr_attacherr = errno != 0 ? errno : ESRCH;
+		dt_dprintf("pid %d: failed to attach: %s\n",
+		    (int)dpr->dpr_pid, strerror(dpr->dpr_attacherr));
+		dpr->dpr_quit = B_TRUE;
+		return (-1);
+	}
+
+	dpr->dpr_attached = B_TRUE;
 
 	(void) Punsetflags(P, PR_ASYNC);	/* require synchronous mode */
 	(void) Psetflags(P, PR_BPTADJ);		/* always adjust eip on x86 */
@@ -527,9 +602,28 @@ dt_proc_control(void *arg)
 	Psync(P);				/* enable all /proc changes */
 	dt_proc_attach(dpr, B_FALSE);		/* enable rtld breakpoints */
 
+#if defined(SYS_pidfd_open)
+	/*
+	 * A pidfd becomes readable when the process exits, which lets the
+	 * control loop notice deaths without waiting for its next sweep.  If
+	 * the kernel is too old to provide one, the sweep still finds them.
+	 */
+	if ((dpr->dpr_pidfd = syscall(SYS_pidfd_open, dpr->dpr_pid, 0)) != -1) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = dpr;
+
+		if (epoll_ctl(dph->dph_epfd, EPOLL_CTL_ADD,
+		    dpr->dpr_pidfd, &ev) == -1) {
+			(void) close(dpr->dpr_pidfd);
+			dpr->dpr_pidfd = -1;
+		}
+	}
+#endif
+
 	/*
 	 * If PR_KLC is set, we created the process; otherwise we grabbed it.
-	 * Check for an appropriate stop request and wait for dt_proc_continue.
+	 * Check for an appropriate stop request: if there is one, the process
+	 * is left stopped until dt_proc_continue() is applied.
 	 */
 	dpr->dpr_stop |= DT_PROC_STOP_CREATE;
 	if (Pstatus(P)->pr_flags & PR_KLC)
@@ -537,139 +631,357 @@ dt_proc_control(void *arg)
 	else
 		dt_proc_stop(dpr, DT_PROC_STOP_GRAB);
 
-	if (Psetrun(P, 0, 0) == -1) {
+	if (!dpr->dpr_held && Psetrun(P, 0, 0) == -1) {
 		dt_dprintf("pid %d: failed to set running: %s\n",
 		    (int)dpr->dpr_pid, strerror(errno));
 	}
 
-	(void) pthread_mutex_unlock(&dpr->dpr_lock);
+	return (0);
+}
 
-	/*
-	 * Wait for the process corresponding to this control thread to stop,
-	 * process the event, and then set it running again.  We want to sleep
-	 * with dpr_lock *unheld* so that other parts of libdtrace can use the
-	 * ps_prochandle in the meantime (e.g. ustack()).  To do this, we write
-	 * a PCWSTOP directive directly to the underlying /proc/<pid>/ctl file.
-	 * Once the process stops, we wake up, grab dpr_lock, and then call
-	 * Pwait() (which will return immediately) and do our processing.
-	 */
-//printf("%s: waiting to quit\n", __func__);
-	while (!dpr->dpr_quit) {
-		const lwpstatus_t *psp;
-#if defined(sun)
+/*
+ * Take a process off the control loop: destroy any remaining breakpoints,
+ * detach from it if it is still alive, set dpr_done, and notify any waiting
+ * thread in dt_proc_destroy() or dt_proc_monitor() that we are done with it.
+ * ptrace(2) only permits a detach from a stopped tracee, so a running process
+ * is stopped first.  We wait for that SIGSTOP itself to be reported, rather
+ * than whatever stop comes first, so that it is not left pending to stop the
+ * process once we have gone; the detach then resumes it with no signal.
+ */
+static void
+dt_proc_ctl_detach(dtrace_hdl_t *dtp, dt_proc_t *dpr)
+{
+	dt_proc_hash_t *dph = dtp->dt_procs;
+	struct ps_prochandle *P = dpr->dpr_proc;
+	int status;
 
-		if (write(pfd, &wstop, sizeof (wstop)) == -1 && errno == EINTR)
-			continue; /* check dpr_quit and continue waiting */
-#else
-		/* Wait for the process to report status. */
-                proc_wait(P);
-#endif
-		(void) pthread_mutex_lock(&dpr->dpr_lock);
-pwait_locked:
-		if (Pstopstatus(P, PCNULL, 0) == -1 && errno == EINTR) {
-//printf("%s stopstatus (loop) pr_pid pid=%d\n", __func__, Pstatus(dpr->dpr_proc)->pr_pid);
-			(void) pthread_mutex_unlock(&dpr->dpr_lock);
-			continue; /* check dpr_quit and continue waiting */
+	assert(DT_MUTEX_HELD(&dpr->dpr_lock));
+
+	dt_proc_bpdestroy(dpr, B_TRUE);
+
+	if (dpr->dpr_pidfd != -1) {
+		(void) epoll_ctl(dph->dph_epfd, EPOLL_CTL_DEL,
+		    dpr->dpr_pidfd, NULL);
+		(void) close(dpr->dpr_pidfd);
+		dpr->dpr_pidfd = -1;
+	}
+
+	if (dpr->dpr_attached &&
+	    Pstate(P) != PS_UNDEAD && Pstate(P) != PS_DEAD) {
+		if (!dpr->dpr_held && waitpid(dpr->dpr_pid, &status,
+		    WNOHANG | __WALL) == 0) {
+			(void) do_kill(__func__, dpr->dpr_pid, SIGSTOP);
+			(void) dt_proc_waitstop(dpr->dpr_pid);
 		}
 
-		switch (Pstate(P)) {
-		case PS_STOP:
-			psp = &Pstatus(P)->pr_lwp;
+		(void) proc_detach(P);
+	}
+
+	dpr->dpr_attached = B_FALSE;
+	dpr->dpr_held = B_FALSE;
+	dpr->dpr_stop &= ~DT_PROC_STOP_IDLE;
+	dpr->dpr_done = B_TRUE;
+
+	(void) pthread_cond_broadcast(&dpr->dpr_cv);
+}
+
+/*
+ * Process a stop or exit event that the control loop reaped for this process.
+ * If the process died or we lost control of it, set dpr_quit and *notifyp so
+ * that the control loop enqueues a notification and lets go of the process.
+ */
+static void
+dt_proc_ctl_event(dtrace_hdl_t *dtp, dt_proc_t *dpr, int *notifyp)
+{
+	struct ps_prochandle *P = dpr->dpr_proc;
+	const lwpstatus_t *psp;
+	int pid = dpr->dpr_pid;
+
+	assert(DT_MUTEX_HELD(&dpr->dpr_lock));
+
+pwait_locked:
+	if (Pstopstatus(P, PCNULL, 0) == -1 && errno == EINTR)
+		return; /* pick it up again on the next sweep */
+
+	switch (Pstate(P)) {
+	case PS_STOP:
+		psp = &Pstatus(P)->pr_lwp;
 
-			dt_dprintf("pid %d: proc stopped showing %d/%d\n",
-			    pid, psp->pr_why, psp->pr_what);
+		dt_dprintf("pid %d: proc stopped showing %d/%d\n",
+		    pid, psp->pr_why, psp->pr_what);
 
 #if defined(sun)
-			/*
-			 * If the process stops showing PR_REQUESTED, then the
-			 * DTrace stop() action was applied to it or another
-			 * debugging utility (e.g. pstop(1)) asked it to stop.
-			 * In either case, the user's intention is for the
-			 * process to remain stopped until another external
-			 * mechanism (e.g. prun(1)) is applied.  So instead of
-			 * setting the process running ourself, we wait for
-			 * someone else to do so.  Once that happens, we return
-			 * to our normal loop waiting for an event of interest.
-			 */
-			if (psp->pr_why == PR_REQUESTED) {
-				dt_proc_waitrun(dpr);
-				(void) pthread_mutex_unlock(&dpr->dpr_lock);
-				continue;
-			}
+		/*
+		 * If the process stops showing PR_REQUESTED, then the
+		 * DTrace stop() action was applied to it or another
+		 * debugging utility (e.g. pstop(1)) asked it to stop.
+		 * In either case, the user's intention is for the
+		 * process to remain stopped until another external
+		 * mechanism (e.g. prun(1)) is applied.  So instead of
+		 * setting the process running ourself, we wait for
+		 * someone else to do so.  Once that happens, we return
+		 * to our normal loop waiting for an event of interest.
+		 */
+		if (psp->pr_why == PR_REQUESTED) {
+			dt_proc_waitrun(dpr);
+			return;
+		}
 
-			/*
-			 * If the process stops showing one of the events that
-			 * we are tracing, perform the appropriate response.
-			 * Note that we ignore PR_SUSPENDED, PR_CHECKPOINT, and
-			 * PR_JOBCONTROL by design: if one of these conditions
-			 * occurs, we will fall through to Psetrun() but the
-			 * process will remain stopped in the kernel by the
-			 * corresponding mechanism (e.g. job control stop).
-			 */
-			if (psp->pr_why == PR_FAULTED && psp->pr_what == FLTBPT)
-				dt_proc_bpmatch(dtp, dpr);
-			else if (psp->pr_why == PR_SYSENTRY &&
-			    IS_SYS_FORK(psp->pr_what))
-				dt_proc_bpdisable(dpr);
-			else if (psp->pr_why == PR_SYSEXIT &&
-			    IS_SYS_FORK(psp->pr_what))
-				dt_proc_bpenable(dpr);
-			else if (psp->pr_why == PR_SYSEXIT &&
-			    IS_SYS_EXEC(psp->pr_what))
-				dt_proc_attach(dpr, B_TRUE);
+		/*
+		 * If the process stops showing one of the events that
+		 * we are tracing, perform the appropriate response.
+		 * Note that we ignore PR_SUSPENDED, PR_CHECKPOINT, and
+		 * PR_JOBCONTROL by design: if one of these conditions
+		 * occurs, we will fall through to Psetrun() but the
+		 * process will remain stopped in the kernel by the
+		 * corresponding mechanism (e.g. job control stop).
+		 */
+		if (psp->pr_why == PR_FAULTED && psp->pr_what == FLTBPT)
+			dt_proc_bpmatch(dtp, dpr);
+		else if (psp->pr_why == PR_SYSENTRY &&
+		    IS_SYS_FORK(psp->pr_what))
+			dt_proc_bpdisable(dpr);
+		else if (psp->pr_why == PR_SYSEXIT &&
+		    IS_SYS_FORK(psp->pr_what))
+			dt_proc_bpenable(dpr);
+		else if (psp->pr_why == PR_SYSEXIT &&
+		    IS_SYS_EXEC(psp->pr_what))
+			dt_proc_attach(dpr, B_TRUE);
 #endif
-//printf("In PS_STOP dpr_stop=%x\n", dpr->dpr_stop);
-			break;
+		break;
 
-		case PS_LOST:
-//printf("in PS_LOST\n");
-			if (Preopen(P) == 0)
-				goto pwait_locked;
+	case PS_LOST:
+		if (Preopen(P) == 0)
+			goto pwait_locked;
 
-			dt_dprintf("pid %d: proc lost: %s\n",
-			    pid, strerror(errno));
+		dt_dprintf("pid %d: proc lost: %s\n",
+		    pid, strerror(errno));
 
-			dpr->dpr_quit = B_TRUE;
-			notify = B_TRUE;
-			break;
+		dpr->dpr_quit = B_TRUE;
+		*notifyp = B_TRUE;
+		break;
 
-		case PS_UNDEAD:
-		case PS_DEAD:
-			dt_dprintf("pid %d: proc died\n", pid);
-			dpr->dpr_quit = B_TRUE;
-			notify = B_TRUE;
-			break;
+	case PS_UNDEAD:
+	case PS_DEAD:
+		dt_dprintf("pid %d: proc died\n", pid);
+		dpr->dpr_quit = B_TRUE;
+		*notifyp = B_TRUE;
+		break;
+	}
 
-		}
+	if (Pstate(P) != PS_UNDEAD && !dpr->dpr_held &&
+	    Psetrun(P, 0, 0) == -1) {
+		dt_dprintf("pid %d: failed to set running: %s\n",
+		    pid, strerror(errno));
+	}
+}
 
-		if (Pstate(P) != PS_UNDEAD && Psetrun(P, 0, 0) == -1) {
+/*
+ * Do whatever work is outstanding for one process on the control loop: attach
+ * to it, resume it after a dt_proc_continue(), or reap and process a pending
+ * event.  We return the number of things done so that the control loop can
+ * sweep again at once if anything happened.
+ */
+static int
+dt_proc_ctl_poll(dtrace_hdl_t *dtp, dt_proc_t *dpr, int *notifyp)
+{
+	int status;
+	pid_t pid;
+
+	assert(DT_MUTEX_HELD(&dpr->dpr_lock));
+
+	if (dpr->dpr_quit)
+		return (0);
+
+	if (!dpr->dpr_attached) {
+		(void) dt_proc_ctl_attach(dtp, dpr);
+		return (1);
+	}
+
+	if (dpr->dpr_held) {
+		if (dpr->dpr_stop & DT_PROC_STOP_IDLE)
+			return (0);
+
+		dt_proc_bpenable(dpr);
+		dpr->dpr_held = B_FALSE;
+
+		if (Psetrun(dpr->dpr_proc, 0, 0) == -1) {
 			dt_dprintf("pid %d: failed to set running: %s\n",
 			    (int)dpr->dpr_pid, strerror(errno));
 		}
 
-		(void) pthread_mutex_unlock(&dpr->dpr_lock);
+		return (1);
 	}
 
 	/*
-	 * If the control thread detected PS_UNDEAD or PS_LOST, then enqueue
-	 * the dt_proc_t structure on the dt_proc_hash_t notification list.
+	 * If we failed to become the tracer but the process is still around,
+	 * waitpid() reports ECHILD; there is nothing to do until it dies.
 	 */
-	if (notify)
-		dt_proc_notify(dtp, dph, dpr, NULL);
+	pid = waitpid(dpr->dpr_pid, &status, WNOHANG | __WALL);
+
+	if (pid == 0 || (pid == -1 &&
+	    (errno != ECHILD || kill(dpr->dpr_pid, 0) == 0)))
+		return (0);
+
+	dt_proc_ctl_event(dtp, dpr, notifyp);
+	return (1);
+}
+
+/*
+ * Main loop for the control thread shared by all victim processes.  We sleep
+ * in epoll_wait() until we are woken through dph_wakefd, a pidfd reports that
+ * a process exited, or, while any process under control is running, the sweep
+ * interval expires: there is no way to be told of a ptrace stop without
+ * taking SIGCHLD away from the client, so stops are found by the sweep.  We
+ * then do any outstanding work for each process, sweeping again straight away
+ * while that turns anything up, and exit when dph_quit is set.
+ *
+ * dph_ctllock is only held to pick up the head of dph_ctl and to unlink the
+ * processes we are letting go of, never across the work itself, so a slow
+ * attach or event in one process does not hold up dt_proc_unlock() and
+ * friends for the others.  Walking the list unlocked is safe because other
+ * threads only ever push new entries onto the head, and only we unlink them.
+ *
+ * The control thread synchronizes the use of dpr_proc with other libdtrace
+ * threads using dpr_lock.  Since a client may hold dpr_lock for a long time
+ * (e.g. while creating pid probes), we only trylock it during the sweep,
+ * rather than stalling every other process under control behind it.  A
+ * process we could not lock sets dpr_ctlwait, and dt_proc_dpr_unlock() wakes
+ * us when the lock is dropped; a contended lock is not work, and does not
+ * keep the loop spinning.
+ */
+static void *
+dt_proc_control(void *arg)
+{
+	dtrace_hdl_t *dtp = arg;
+	dt_proc_hash_t *dph = dtp->dt_procs;
+	struct epoll_event ev[DT_PROC_NEVENTS];
+	dt_proc_t *dpr, *next, *quit, **dpp;
+	int busy = 0, running = 0, notify, timeout, locked, i, n;
+	char buf[64];
 
 	/*
-	 * Destroy and remove any remaining breakpoints, set dpr_done and clear
-	 * dpr_tid to indicate the control thread has exited, and notify any
-	 * waiting thread in dt_proc_destroy() that we have succesfully exited.
+	 * We disable the POSIX thread cancellation mechanism so that the
+	 * client program using libdtrace can't accidentally cancel our thread.
+	 * dt_proc_hash_destroy() uses dph_quit and dph_wakefd to stop us.
 	 */
-	(void) pthread_mutex_lock(&dpr->dpr_lock);
+	(void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-	dt_proc_bpdestroy(dpr, B_TRUE);
-	dpr->dpr_done = B_TRUE;
-	dpr->dpr_tid = 0;
+	(void) pthread_mutex_lock(&dph->dph_ctllock);
 
-	(void) pthread_cond_broadcast(&dpr->dpr_cv);
-	(void) pthread_mutex_unlock(&dpr->dpr_lock);
+	while (!dph->dph_quit) {
+		if (dph->dph_ctl == NULL)
+			timeout = -1;
+		else if (busy != 0)
+			timeout = 0;
+		else
+			timeout = running != 0 ? DT_PROC_POLL : -1;
+		(void) pthread_mutex_unlock(&dph->dph_ctllock);
+
+		n = epoll_wait(dph->dph_epfd, ev, DT_PROC_NEVENTS, timeout);
+
+		/*
+		 * A pidfd stays readable once its process has exited, so it
+		 * comes out of the set as soon as it fires: the exit is then
+		 * picked up by the sweep below, or, if that process is locked,
+		 * when dt_proc_dpr_unlock() wakes us.  The dt_proc_t is still
+		 * ours; only we close its pidfd and let go of it.
+		 */
+		for (i = 0; i < n; i++) {
+			if ((dpr = ev[i].data.ptr) != NULL &&
+			    dpr->dpr_pidfd != -1) {
+				(void) epoll_ctl(dph->dph_epfd, EPOLL_CTL_DEL,
+				    dpr->dpr_pidfd, NULL);
+			}
+		}
+
+		while (read(dph->dph_wakefd[0], buf, sizeof (buf)) > 0)
+			continue;
+
+		(void) pthread_mutex_lock(&dph->dph_ctllock);
+		dpr = dph->dph_ctl;
+		(void) pthread_mutex_unlock(&dph->dph_ctllock);
+
+		for (busy = 0, running = 0, quit = NULL; dpr != NULL;
+		    dpr = dpr->dpr_ctlnext) {
+			if (pthread_mutex_trylock(&dpr->dpr_lock) != 0) {
+				/*
+				 * Ask to be woken when the lock is dropped,
+				 * then try once more in case it was dropped
+				 * before the request could be seen.
+				 */
+				(void) pthread_mutex_lock(&dph->dph_ctllock);
+				dpr->dpr_ctlwait = B_TRUE;
+				locked = pthread_mutex_trylock(
+				    &dpr->dpr_lock) == 0;
+				if (locked)
+					dpr->dpr_ctlwait = B_FALSE;
+				(void) pthread_mutex_unlock(&dph->dph_ctllock);
+
+				if (!locked)
+					continue;
+			}
+
+			notify = B_FALSE;
+			busy += dt_proc_ctl_poll(dtp, dpr, &notify);
+
+			/*
+			 * If we detected PS_UNDEAD or PS_LOST, then enqueue
+			 * the dt_proc_t structure on the dt_proc_hash_t
+			 * notification list.  This is done without dpr_lock
+			 * held, as dtrace_sleep() calls the client's handler
+			 * with dph_lock held.  The dt_proc_t can't go away
+			 * meanwhile: dt_proc_destroy() waits for dpr_done.
+			 */
+			if (notify) {
+				(void) pthread_mutex_unlock(&dpr->dpr_lock);
+				dt_proc_notify(dtp, dph, dpr, NULL);
+				(void) pthread_mutex_lock(&dpr->dpr_lock);
+			}
+
+			if (dpr->dpr_quit) {
+				dpr->dpr_ctlquit = B_TRUE;
+				quit = dpr;
+			} else if (dpr->dpr_attached && !dpr->dpr_held) {
+				running++;
+			}
+
+			(void) pthread_mutex_unlock(&dpr->dpr_lock);
+		}
+
+		/*
+		 * Unlink the processes we are letting go of, then detach from
+		 * each of them with only its own dpr_lock held.  Once dpr_done
+		 * is set and dpr_lock dropped, dt_proc_destroy() may free it.
+		 */
+		(void) pthread_mutex_lock(&dph->dph_ctllock);
+		if (quit == NULL)
+			continue;
+
+		for (quit = NULL, dpp = &dph->dph_ctl; (dpr = *dpp) != NULL; ) {
+			if (dpr->dpr_ctlquit) {
+				*dpp = dpr->dpr_ctlnext;
+				dph->dph_nctl--;
+				dpr->dpr_ctlnext = quit;
+				quit = dpr;
+			} else {
+				dpp = &dpr->dpr_ctlnext;
+			}
+		}
+		(void) pthread_mutex_unlock(&dph->dph_ctllock);
+
+		for (dpr = quit; dpr != NULL; dpr = next) {
+			next = dpr->dpr_ctlnext;
+			(void) pthread_mutex_lock(&dpr->dpr_lock);
+			dt_proc_ctl_detach(dtp, dpr);
+			(void) pthread_mutex_unlock(&dpr->dpr_lock);
+			busy++;
+		}
+
+		(void) pthread_mutex_lock(&dph->dph_ctllock);
+	}
+
+	(void) pthread_mutex_unlock(&dph->dph_ctllock);
 
 	return (NULL);
 }
@@ -746,38 +1058,17 @@ dt_proc_destroy(dtrace_hdl_t *dtp, struct ps_prochandle *P)
 		rflag = 0; /* apply kill or run-on-last-close */
 	}
 
-	if (dpr->dpr_tid) {
+	if (dpr->dpr_ctl) {
 		/*
-		 * Set the dpr_quit flag to tell the daemon thread to exit.  We
-		 * send it a SIGCANCEL to poke it out of PCWSTOP or any other
-		 * long-term /proc system call.  Our daemon threads have POSIX
-		 * cancellation disabled, so EINTR will be the only effect.  We
-		 * then wait for dpr_done to indicate the thread has exited.
-		 *
-		 * We can't use pthread_kill() to send SIGCANCEL because the
-		 * interface forbids it and we can't use pthread_cancel()
-		 * because with cancellation disabled it won't actually
-		 * send SIGCANCEL to the target thread, so we use _lwp_kill()
-		 * to do the job.  This is all built on evil knowledge of
-		 * the details of the cancellation mechanism in libc.
+		 * Set the dpr_quit flag to tell the control loop to let go of
+		 * the process, and wake it up so that it does so promptly.  If
+		 * the process is currently held stopped by dt_proc_stop(), the
+		 * detach sets it running again.  We then wait for dpr_done to
+		 * indicate the control loop is finished with the process.
 		 */
 		(void) pthread_mutex_lock(&dpr->dpr_lock);
 		dpr->dpr_quit = B_TRUE;
-#if defined(sun)
-		(void) _lwp_kill(dpr->dpr_tid, SIGCANCEL);
-#else
-		(void) pthread_kill(dpr->dpr_tid, SIGUSR1);
-#endif
-
-		/*
-		 * If the process is currently idling in dt_proc_stop(), re-
-		 * enable breakpoints and poke it into running again.
-		 */
-		if (dpr->dpr_stop & DT_PROC_STOP_IDLE) {
-			dt_proc_bpenable(dpr);
-			dpr->dpr_stop &= ~DT_PROC_STOP_IDLE;
-			(void) pthread_cond_broadcast(&dpr->dpr_cv);
-		}
+		dt_proc_wakeup(dph);
 
 		while (!dpr->dpr_done)
 			(void) pthread_cond_wait(&dpr->dpr_cv, &dpr->dpr_lock);
@@ -815,105 +1106,175 @@ dt_proc_destroy(dtrace_hdl_t *dtp, struct ps_prochandle *P)
 	}
 
 	dt_list_delete(&dph->dph_lrulist, dpr);
+	dt_symcache_purge(dtp, dpr->dpr_pid);
 	Prelease(dpr->dpr_proc, rflag);
 	dt_free(dtp, dpr);
 }
 
+/*
+ * Start the control thread, along with the epoll instance and wakeup pipe
+ * that it sleeps on.  This is done when the first process is placed under
+ * control, so that handles that never control a process pay nothing for it.
+ */
 static int
-dt_proc_create_thread(dtrace_hdl_t *dtp, dt_proc_t *dpr, uint_t stop)
+dt_proc_control_start(dtrace_hdl_t *dtp)
 {
-	dt_proc_control_data_t data;
+	dt_proc_hash_t *dph = dtp->dt_procs;
+	struct epoll_event ev;
 	sigset_t nset, oset;
-	pthread_attr_t a;
-	int err;
+	int err, i;
+
+	assert(DT_MUTEX_HELD(&dph->dph_ctllock));
+
+	if ((dph->dph_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return (errno);
+
+	if (pipe(dph->dph_wakefd) == -1) {
+		err = errno;
+		goto err;
+	}
+
+	for (i = 0; i < 2; i++) {
+		(void) fcntl(dph->dph_wakefd[i], F_SETFD, FD_CLOEXEC);
+		(void) fcntl(dph->dph_wakefd[i], F_SETFL, O_NONBLOCK);
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if (epoll_ctl(dph->dph_epfd, EPOLL_CTL_ADD,
+	    dph->dph_wakefd[0], &ev) == -1) {
+		err = errno;
+		goto err;
+	}
+
+	(void) sigfillset(&nset);
+	(void) sigdelset(&nset, SIGABRT);	/* unblocked for assert() */
+
+	(void) pthread_sigmask(SIG_SETMASK, &nset, &oset);
+	err = pthread_create(&dph->dph_tid, NULL, dt_proc_control, dtp);
+	(void) pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	if (err == 0) {
+		dph->dph_running = B_TRUE;
+		return (0);
+	}
+
+err:
+	for (i = 0; i < 2; i++) {
+		if (dph->dph_wakefd[i] != -1) {
+			(void) close(dph->dph_wakefd[i]);
+			dph->dph_wakefd[i] = -1;
+		}
+	}
+
+	(void) close(dph->dph_epfd);
+	dph->dph_epfd = -1;
+
+	return (err);
+}
+
+/*
+ * Hand a process over to the control thread, starting the thread if this is
+ * the first process to be controlled, and wait for it to reach the initial
+ * rendezvous described by 'stop'.
+ */
+static int
+dt_proc_monitor(dtrace_hdl_t *dtp, dt_proc_t *dpr, uint_t stop)
+{
+	dt_proc_hash_t *dph = dtp->dt_procs;
+	int err, done, lost = B_FALSE, stat = 0;
 
 #if defined(linux)
 	/***********************************************/
 	/*   Kernel bug -- a parent which attaches to  */
 	/*   a  proc  --  cannot  share  with a child  */
 	/*   thread.   So   we  have  to  detach  and  */
-	/*   reattach  in  the child thread if we are  */
-	/*   to work properly.			       */
+	/*   let the control thread reattach if we are */
+	/*   to work properly. A process we created    */
+	/*   is  sitting  at  its  exec  stop: leave   */
+	/*   it  stopped  so  it cannot run ahead of   */
+	/*   the rendezvous.			       */
 	/***********************************************/
-	if (stop == DT_PROC_STOP_GRAB) {
+	if (stop == DT_PROC_STOP_GRAB)
 		do_ptrace(__func__, PTRACE_DETACH, dpr->dpr_pid, 0, 0);
-	}
+	else
+		do_ptrace(__func__, PTRACE_DETACH, dpr->dpr_pid, 0,
+		    (void *)SIGSTOP);
 #endif
+	dpr->dpr_pidfd = -1;
+
+	(void) pthread_mutex_lock(&dph->dph_ctllock);
+
+	if (!dph->dph_running && (err = dt_proc_control_start(dtp)) != 0) {
+		(void) pthread_mutex_unlock(&dph->dph_ctllock);
+		(void) dt_proc_error(dtp, dpr,
+		    "failed to create control thread for process-id %d: %s\n",
+		    (int)dpr->dpr_pid, strerror(err));
+		return (err);
+	}
+
 	(void) pthread_mutex_lock(&dpr->dpr_lock);
 	dpr->dpr_stop |= stop; /* set bit for initial rendezvous */
+	dpr->dpr_ctl = B_TRUE;
 
-	(void) pthread_attr_init(&a);
-	(void) pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED);
+	dpr->dpr_ctlnext = dph->dph_ctl;
+	dph->dph_ctl = dpr;
+	dph->dph_nctl++;
 
-	(void) sigfillset(&nset);
-	(void) sigdelset(&nset, SIGABRT);	/* unblocked for assert() */
-#if defined(sun)
-	(void) sigdelset(&nset, SIGCANCEL);	/* see dt_proc_destroy() */
-#else
-	(void) sigdelset(&nset, SIGUSR1);	/* see dt_proc_destroy() */
-#endif
+	(void) pthread_mutex_unlock(&dph->dph_ctllock);
+	dt_proc_wakeup(dph);
 
-	data.dpcd_hdl = dtp;
-	data.dpcd_proc = dpr;
-
-	(void) pthread_sigmask(SIG_SETMASK, &nset, &oset);
-	err = pthread_create(&dpr->dpr_tid, &a, dt_proc_control, &data);
-	(void) pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	/*
+	 * Wait on dpr_cv for either dpr_done to be set (the victim died or
+	 * could not be controlled) or DT_PROC_STOP_IDLE to be set, indicating
+	 * that the victim is now stopped and held at the rendezvous event.
+	 * On success, we return with the process stopped: the caller can then
+	 * apply dt_proc_continue() to resume it.
+	 */
+	while (!dpr->dpr_done && !(dpr->dpr_stop & DT_PROC_STOP_IDLE))
+		(void) pthread_cond_wait(&dpr->dpr_cv, &dpr->dpr_lock);
 
-do_ptrace(__func__, PTRACE_DETACH, dpr->dpr_pid, 0, 0);
 	/*
-	 * If the control thread was created, then wait on dpr_cv for either
-	 * dpr_done to be set (the victim died or the control thread failed)
-	 * or DT_PROC_STOP_IDLE to be set, indicating that the victim is now
-	 * stopped by /proc and the control thread is at the rendezvous event.
-	 * On success, we return with the process and control thread stopped:
-	 * the caller can then apply dt_proc_continue() to resume both.
+	 * If dpr_done is set, the control loop let go of the process before it
+	 * reached the rendezvous event.  This is either due to PS_LOST or
+	 * PS_UNDEAD (i.e. the process died).  We try to provide a small
+	 * amount of useful information to help figure it out.  The control
+	 * loop has already taken the process off dph_ctl.
 	 */
-	if (err == 0) {
-//printf("0..waiting for dt_proc_control....dpr_done=%d stop=%d !stop=%d\n", dpr->dpr_done, dpr->dpr_stop, !(dpr->dpr_stop & DT_PROC_STOP_IDLE));
-		while (!dpr->dpr_done && !(dpr->dpr_stop & DT_PROC_STOP_IDLE)) {
-//printf("1..waiting for dt_proc_control....dpr_done=%d stop=%d\n", dpr->dpr_done, dpr->dpr_stop);
-			(void) pthread_cond_wait(&dpr->dpr_cv, &dpr->dpr_lock);
-		}
-//printf("2..waiting for dt_proc_control....dpr_done=%d stop=%d\n", dpr->dpr_done, dpr->dpr_stop);
+	if ((done = dpr->dpr_done) != 0) {
+		const psinfo_t *prp = Ppsinfo(dpr->dpr_proc);
 
-		/*
-		 * If dpr_done is set, the control thread aborted before it
-		 * reached the rendezvous event.  This is either due to PS_LOST
-		 * or PS_UNDEAD (i.e. the process died).  We try to provide a
-		 * small amount of useful information to help figure it out.
-		 */
-		if (dpr->dpr_done) {
-			const psinfo_t *prp = Ppsinfo(dpr->dpr_proc);
-			int stat = prp ? prp->pr_wstat : 0;
-			int pid = dpr->dpr_pid;
-
-			if (Pstate(dpr->dpr_proc) == PS_LOST) {
-				(void) dt_proc_error(dpr->dpr_hdl, dpr,
-				    "failed to control pid %d: process exec'd "
-				    "set-id or unobservable program\n", pid);
-			} else if (WIFSIGNALED(stat)) {
-				(void) dt_proc_error(dpr->dpr_hdl, dpr,
-				    "failed to control pid %d: process died "
-				    "from signal %d\n", pid, WTERMSIG(stat));
-			} else {
-				(void) dt_proc_error(dpr->dpr_hdl, dpr,
-				    "failed to control pid %d: process exited "
-				    "with status %d\n", pid, WEXITSTATUS(stat));
-			}
+		stat = prp ? prp->pr_wstat : 0;
+		lost = Pstate(dpr->dpr_proc) == PS_LOST;
+	}
 
-			err = ESRCH; /* cause grab() or create() to fail */
-		}
-	} else {
-		(void) dt_proc_error(dpr->dpr_hdl, dpr,
-		    "failed to create control thread for process-id %d: %s\n",
-		    (int)dpr->dpr_pid, strerror(err));
+	dt_proc_dpr_unlock(dtp, dpr);
+
+	if (!done)
+		return (0);
+
+	if (dpr->dpr_attacherr != 0) {
+		(void) dt_proc_error(dtp, dpr, "failed to control pid %d: "
+		    "%s\n", (int)dpr->dpr_pid, strerror(dpr->dpr_attacherr));
+		return (dpr->dpr_attacherr);
 	}
 
-	(void) pthread_mutex_unlock(&dpr->dpr_lock);
-	(void) pthread_attr_destroy(&a);
+	if (lost) {
+		(void) dt_proc_error(dtp, dpr, "failed to control pid %d: "
+		    "process exec'd set-id or unobservable program\n",
+		    (int)dpr->dpr_pid);
+	} else if (WIFSIGNALED(stat)) {
+		(void) dt_proc_error(dtp, dpr, "failed to control pid %d: "
+		    "process died from signal %d\n",
+		    (int)dpr->dpr_pid, WTERMSIG(stat));
+	} else {
+		(void) dt_proc_error(dtp, dpr, "failed to control pid %d: "
+		    "process exited with status %d\n",
+		    (int)dpr->dpr_pid, WEXITSTATUS(stat));
+	}
 
-	return (err);
+	return (ESRCH); /* cause grab() or create() to fail */
 }
 
 struct ps_prochandle *
@@ -940,7 +1301,7 @@ dt_proc_create(dtrace_hdl_t *dtp, const char *file, char *const *argv)
 	(void) Punsetflags(dpr->dpr_proc, PR_RLC);
 	(void) Psetflags(dpr->dpr_proc, PR_KLC);
 
-	if (dt_proc_create_thread(dtp, dpr, dtp->dt_prcmode) != 0)
+	if (dt_proc_monitor(dtp, dpr, dtp->dt_prcmode) != 0)
 		return (NULL); /* dt_proc_error() has been called for us */
 
 	dpr->dpr_hash = dph->dph_hash[dpr->dpr_pid & (dph->dph_hashlen - 1)];
@@ -1015,8 +1376,7 @@ dt_proc_grab(dtrace_hdl_t *dtp, pid_t pid, int flags, int nomonitor)
 	 * handles than dph_lrulim permits, attempt to find the
 	 * least-recently-used handle that is currently unreferenced and
 	 * release it from the cache.  Otherwise we are grabbing the process
-	 * for control: create a control thread for this process and store
-	 * its ID in dpr->dpr_tid.
+	 * for control: hand the process over to the control thread.
 	 */
 	if (nomonitor || (flags & PGRAB_RDONLY)) {
 		if (dph->dph_lrucnt >= dph->dph_lrulim) {
@@ -1035,7 +1395,7 @@ dt_proc_grab(dtrace_hdl_t *dtp, pid_t pid, int flags, int nomonitor)
 			dph->dph_lrucnt++;
 		}
 
-	} else if (dt_proc_create_thread(dtp, dpr, DT_PROC_STOP_GRAB) != 0)
+	} else if (dt_proc_monitor(dtp, dpr, DT_PROC_STOP_GRAB) != 0)
 		return (NULL); /* dt_proc_error() has been called for us */
 
 	dpr->dpr_hash = dph->dph_hash[h];
@@ -1072,9 +1432,10 @@ dt_proc_continue(dtrace_hdl_t *dtp, struct ps_prochandle *P)
 	if (dpr->dpr_stop & DT_PROC_STOP_IDLE) {
 		dpr->dpr_stop &= ~DT_PROC_STOP_IDLE;
 		(void) pthread_cond_broadcast(&dpr->dpr_cv);
+		dt_proc_wakeup(dtp->dt_procs);
 	}
 
-	(void) pthread_mutex_unlock(&dpr->dpr_lock);
+	dt_proc_dpr_unlock(dtp, dpr);
 }
 
 void
@@ -1088,9 +1449,7 @@ dt_proc_lock(dtrace_hdl_t *dtp, struct ps_prochandle *P)
 void
 dt_proc_unlock(dtrace_hdl_t *dtp, struct ps_prochandle *P)
 {
-	dt_proc_t *dpr = dt_proc_lookup(dtp, P, B_FALSE);
-	int err = pthread_mutex_unlock(&dpr->dpr_lock);
-	assert(err == 0); /* check for unheld lock */
+	dt_proc_dpr_unlock(dtp, dt_proc_lookup(dtp, P, B_FALSE));
 }
 
 void
@@ -1101,6 +1460,11 @@ dt_proc_hash_create(dtrace_hdl_t *dtp)
 
 		(void) pthread_mutex_init(&dtp->dt_procs->dph_lock, NULL);
 		(void) pthread_cond_init(&dtp->dt_procs->dph_cv, NULL);
+		(void) pthread_mutex_init(&dtp->dt_procs->dph_ctllock, NULL);
+
+		dtp->dt_procs->dph_epfd = -1;
+		dtp->dt_procs->dph_wakefd[0] = -1;
+		dtp->dt_procs->dph_wakefd[1] = -1;
 
 		dtp->dt_procs->dph_hashlen = _dtrace_pidbuckets;
 		dtp->dt_procs->dph_lrulim = _dtrace_pidlrulim;
@@ -1116,6 +1480,19 @@ dt_proc_hash_destroy(dtrace_hdl_t *dtp)
 	while ((dpr = dt_list_next(&dph->dph_lrulist)) != NULL)
 		dt_proc_destroy(dtp, dpr->dpr_proc);
 
+	if (dph->dph_running) {
+		(void) pthread_mutex_lock(&dph->dph_ctllock);
+		dph->dph_quit = B_TRUE;
+		(void) pthread_mutex_unlock(&dph->dph_ctllock);
+
+		dt_proc_wakeup(dph);
+		(void) pthread_join(dph->dph_tid, NULL);
+
+		(void) close(dph->dph_wakefd[0]);
+		(void) close(dph->dph_wakefd[1]);
+		(void) close(dph->dph_epfd);
+	}
+
 	dtp->dt_procs = NULL;
 	dt_free(dtp, dph);
 }
@@ -51,12 +51,19 @@ typedef struct dt_proc {
 	uint_t dpr_refs;		/* reference count */
 	uint8_t dpr_cacheable;		/* cache handle using lru list */
 	uint8_t dpr_stop;		/* stop mask: see flag bits below */
-	uint8_t dpr_quit;		/* quit flag: ctl thread should quit */
-	uint8_t dpr_done;		/* done flag: ctl thread has exited */
+	uint8_t dpr_quit;		/* quit flag: ctl loop should let go */
+	uint8_t dpr_done;		/* done flag: ctl loop has let go */
 	uint8_t dpr_usdt;		/* usdt flag: usdt initialized */
 	uint8_t dpr_stale;		/* proc flag: been deprecated */
 	uint8_t dpr_rdonly;		/* proc flag: opened read-only */
-	pthread_t dpr_tid;		/* control thread (or zero if none) */
+	uint8_t dpr_ctl;		/* proc flag: on ctl loop's list */
+	uint8_t dpr_attached;		/* proc flag: traced by ctl loop */
+	uint8_t dpr_held;		/* proc flag: held stopped by ctl loop */
+	uint8_t dpr_ctlwait;		/* ctl loop wants a wakeup on unlock */
+	uint8_t dpr_ctlquit;		/* ctl loop is letting go (ctl only) */
+	int dpr_attacherr;		/* errno if ctl loop failed to attach */
+	int dpr_pidfd;			/* pidfd polled for exit (or -1) */
+	struct dt_proc *dpr_ctlnext;	/* next pointer for ctl loop list */
 	dt_list_t dpr_bps;		/* list of dt_bkpt_t structures */
 } dt_proc_t;
 
@@ -89,6 +96,14 @@ typedef struct dt_proc_hash {
 	pthread_mutex_t dph_lock;	/* lock protecting dph_notify list */
 	pthread_cond_t dph_cv;		/* cond for waiting for dph_notify */
 	dt_proc_notify_t *dph_notify;	/* list of pending proc notifications */
+	pthread_mutex_t dph_ctllock;	/* lock protecting dph_ctl list */
+	dt_proc_t *dph_ctl;		/* list of procs under ctl loop */
+	uint_t dph_nctl;		/* count of procs under ctl loop */
+	pthread_t dph_tid;		/* ctl loop thread */
+	int dph_epfd;			/* epoll fd waited on by ctl loop */
+	int dph_wakefd[2];		/* pipe used to wake the ctl loop */
+	uint8_t dph_running;		/* ctl loop thread has been started */
+	uint8_t dph_quit;		/* quit flag: ctl loop should exit */
 	dt_list_t dph_lrulist;		/* list of dt_proc_t's in lru order */
 	uint_t dph_lrulim;		/* limit on number of procs to hold */
 	uint_t dph_lrucnt;		/* count of cached process handles */
@@ -104,6 +119,7 @@ extern void dt_proc_release(dtrace_hdl_t *, struct ps_prochandle *);
 extern void dt_proc_continue(dtrace_hdl_t *, struct ps_prochandle *);
 extern void dt_proc_lock(dtrace_hdl_t *, struct ps_prochandle *);
 extern void dt_proc_unlock(dtrace_hdl_t *, struct ps_prochandle *);
+extern void dt_proc_dpr_unlock(dtrace_hdl_t *, dt_proc_t *);
 extern dt_proc_t *dt_proc_lookup(dtrace_hdl_t *, struct ps_prochandle *, int);
 
 extern void dt_proc_hash_create(dtrace_hdl_t *);
@@ -179,6 +179,7 @@ char buf[256];
 sprintf(buf, "cat /proc/%d/maps", dpr->dpr_pid);
 system(buf);
 Pupdate_syms(dpr->dpr_proc);
+dt_symcache_purge(dtp, dpr->dpr_pid);
 if (dt_pid_create_probes_module(dtp, dpr) != 0)
 	dt_proc_notify(dtp, dtp->dt_procs, dpr,
 	    dpr->dpr_errmsg);
@@ -214,6 +215,7 @@ printf("waitpid %d return ret=%d st=%x\n", dpr->dpr_pid, ret, status);
 //(void) pthread_cond_broadcast(&dpr->dpr_cv);
 				system(buf);
 				Pupdate_syms(dpr->dpr_proc);
+				dt_symcache_purge(dtp, dpr->dpr_pid);
 				if (dt_pid_create_probes_module(dtp, dpr) != 0)
 					dt_proc_notify(dtp, dtp->dt_procs, dpr,
 					    dpr->dpr_errmsg);
@@ -444,6 +444,18 @@ dt_header_decl(dt_idhash_t *dhp, dt_ident_t *idp, void *data)
 	    infop->dthi_pfname, fname, infop->dthi_pfname, fname) < 0)
 		return (dt_set_errno(dtp, errno));
 
+	/*
+	 * With -xsemaphores each probe also gets a counter which the kernel
+	 * bumps while the probe is enabled; the is-enabled macro below reads
+	 * it directly so the disabled path is a load and a branch.  It is
+	 * weak so that every object including the header shares one copy.
+	 */
+	if (dtp->dt_semaphores && fprintf(infop->dthi_out,
+	    "__attribute__((__weak__, __visibility__(\"hidden\")))\n"
+	    "volatile unsigned short __dtracesem_%s___%s;\n",
+	    infop->dthi_pfname, fname) < 0)
+		return (dt_set_errno(dtp, errno));
+
 	return (0);
 }
 
@@ -502,7 +514,15 @@ dt_header_probe(dt_idhash_t *dhp, dt_ident_t *idp, void *data)
 	if (fprintf(infop->dthi_out, ")\n") < 0)
 		return (dt_set_errno(dtp, errno));
 
-	if (!infop->dthi_empty) {
+	if (!infop->dthi_empty && dtp->dt_semaphores) {
+		if (fprintf(infop->dthi_out,
+		    "#define\t%s_%s_ENABLED() \\\n"
+		    "\t(__dtracesem_%s___%s != 0)\n",
+		    infop->dthi_pmname, mname,
+		    infop->dthi_pfname, fname) < 0)
+			return (dt_set_errno(dtp, errno));
+
+	} else if (!infop->dthi_empty) {
 		if (fprintf(infop->dthi_out,
 		    "#ifndef\t__sparc\n"
 		    "#define\t%s_%s_ENABLED() \\\n"
@@ -431,6 +431,7 @@ dt_probe_create(dtrace_hdl_t *dtp, dt_ident_t *idp, int protoc,
 	prp->pr_inst = NULL;
 	prp->pr_argv = dt_alloc(dtp, sizeof (dtrace_typeinfo_t) * xargc);
 	prp->pr_argc = xargc;
+	prp->pr_sema = NULL;
 
 	if ((prp->pr_nargc != 0 && prp->pr_nargv == NULL) ||
 	    (prp->pr_xargc != 0 && prp->pr_xargv == NULL) ||
@@ -505,6 +506,7 @@ dt_probe_destroy(dt_probe_t *prp)
 
 	dt_free(dtp, prp->pr_mapping);
 	dt_free(dtp, prp->pr_argv);
+	dt_free(dtp, prp->pr_sema);
 	dt_free(dtp, prp);
 }
 
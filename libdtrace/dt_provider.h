@@ -89,6 +89,7 @@ typedef struct dt_probe {
 	dt_probe_instance_t *pr_inst;	/* list of functions and offsets */
 	dtrace_typeinfo_t *pr_argv;	/* output argument types */
 	int pr_argc;			/* output argument count */
+	char *pr_sema;			/* is-enabled semaphore symbol */
 } dt_probe_t;
 
 extern dt_provider_t *dt_provider_lookup(dtrace_hdl_t *, const char *);
@@ -974,41 +974,32 @@ int
 dtrace_uaddr2str(dtrace_hdl_t *dtp, pid_t pid,
     uint64_t addr, char *str, int nbytes)
 {
-	char name[PATH_MAX], objname[PATH_MAX], c[PATH_MAX * 2];
-	struct ps_prochandle *P = NULL;
-	GElf_Sym sym;
+	const dt_symcache_ent_t *dse;
+	char c[PATH_MAX * 2];
 	char *obj;
 
-	if (pid != 0)
-		P = dt_proc_grab(dtp, pid, PGRAB_RDONLY | PGRAB_FORCE, 0);
-
-	if (P == NULL) {
+	if ((dse = dt_symcache_ulookup(dtp, pid, addr)) == NULL) {
 	  (void) snprintf(c, sizeof (c), "0x%jx", (uintmax_t)addr);
 		return (dt_string2str(c, str, nbytes));
 	}
 
-	dt_proc_lock(dtp, P);
-
-	if (Plookup_by_addr(P, addr, name, sizeof (name), &sym) == 0) {
-		(void) Pobjname(P, addr, objname, sizeof (objname));
+	obj = (dse->dse_flags & DT_SYMCACHE_OBJ) ?
+	    dt_basename(dse->dse_object) : "";
 
-		obj = dt_basename(objname);
-
-		if (addr > sym.st_value) {
+	if (dse->dse_flags & DT_SYMCACHE_SYM) {
+		if (addr > dse->dse_value) {
 			(void) snprintf(c, sizeof (c), "%s`%s+0x%llx", obj,
-			    name, (u_longlong_t)(addr - sym.st_value));
+			    dse->dse_name, (u_longlong_t)(addr - dse->dse_value));
 		} else {
-			(void) snprintf(c, sizeof (c), "%s`%s", obj, name);
+			(void) snprintf(c, sizeof (c), "%s`%s", obj,
+			    dse->dse_name);
 		}
-	} else if (Pobjname(P, addr, objname, sizeof (objname)) != 0) {
+	} else if (dse->dse_flags & DT_SYMCACHE_OBJ) {
 		(void) snprintf(c, sizeof (c), "%s`0x%jx",
-				dt_basename(objname), (uintmax_t)addr);
+				obj, (uintmax_t)addr);
 	} else {
 	  (void) snprintf(c, sizeof (c), "0x%jx", (uintmax_t)addr);
 	}
 
-	dt_proc_unlock(dtp, P);
-	dt_proc_release(dtp, P);
-
 	return (dt_string2str(c, str, nbytes));
 }
@@ -0,0 +1,322 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Consumer-side symbol cache.  See the comment above dt_symcache_t in
+ * dt_impl.h for the rules governing entry lifetime and invalidation.
+ */
+
+#include <sys/types.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include <dt_impl.h>
+
+#define	DT_SYMCACHE_MINHASH	1024
+
+static uint_t
+dt_symcache_hashval(pid_t pid, uint64_t pc)
+{
+	uint64_t h = (pc ^ ((uint64_t)pid << 32)) * 0x9e3779b97f4a7c15ULL;
+
+	return ((uint_t)(h >> 32));
+}
+
+static void
+dt_symcache_free(dt_symcache_ent_t *dse)
+{
+	free(dse->dse_object);
+	free(dse->dse_name);
+	free(dse);
+}
+
+/*
+ * Discard every entry belonging to 'pid', or every entry if 'all' is set.
+ */
+static void
+dt_symcache_discard(dt_symcache_t *dsc, pid_t pid, int all)
+{
+	dt_symcache_ent_t *dse, **dsep;
+	uint_t i;
+
+	for (i = 0; i < dsc->dsc_hashsize; i++) {
+		dsep = &dsc->dsc_hash[i];
+
+		while ((dse = *dsep) != NULL) {
+			if (!all && dse->dse_pid != pid) {
+				dsep = &dse->dse_next;
+				continue;
+			}
+
+			*dsep = dse->dse_next;
+			dt_symcache_free(dse);
+			dsc->dsc_nents--;
+		}
+	}
+}
+
+/*
+ * Apply any invalidations queued by dt_symcache_purge().  This is only ever
+ * called from the consuming thread, which is also the only thread that walks
+ * or modifies the hash itself.  It is called on every lookup; with nothing
+ * queued it costs one uncontended lock round trip.
+ */
+static void
+dt_symcache_flush(dt_symcache_t *dsc)
+{
+	pid_t purge[DT_SYMCACHE_NPURGE];
+	int i, npurge;
+
+	(void) pthread_mutex_lock(&dsc->dsc_lock);
+	if ((npurge = dsc->dsc_npurge) > 0)
+		bcopy(dsc->dsc_purge, purge, npurge * sizeof (pid_t));
+	dsc->dsc_npurge = 0;
+	(void) pthread_mutex_unlock(&dsc->dsc_lock);
+
+	if (npurge == 0)
+		return;
+
+	if (npurge < 0) {
+		dt_symcache_discard(dsc, 0, B_TRUE);
+		return;
+	}
+
+	for (i = 0; i < npurge; i++)
+		dt_symcache_discard(dsc, purge[i], B_FALSE);
+}
+
+static int
+dt_symcache_grow(dt_symcache_t *dsc)
+{
+	uint_t i, h, nsize = dsc->dsc_hashsize ?
+	    dsc->dsc_hashsize << 1 : DT_SYMCACHE_MINHASH;
+	dt_symcache_ent_t **nhash, *dse, *next;
+
+	if ((nhash = calloc(nsize, sizeof (dt_symcache_ent_t *))) == NULL)
+		return (-1);
+
+	for (i = 0; i < dsc->dsc_hashsize; i++) {
+		for (dse = dsc->dsc_hash[i]; dse != NULL; dse = next) {
+			next = dse->dse_next;
+			h = dt_symcache_hashval(dse->dse_pid,
+			    dse->dse_pc) & (nsize - 1);
+			dse->dse_next = nhash[h];
+			nhash[h] = dse;
+		}
+	}
+
+	free(dsc->dsc_hash);
+	dsc->dsc_hash = nhash;
+	dsc->dsc_hashsize = nsize;
+
+	return (0);
+}
+
+static void
+dt_symcache_fill_kernel(dtrace_hdl_t *dtp, dt_symcache_ent_t *dse)
+{
+	dtrace_syminfo_t dts;
+	GElf_Sym sym;
+	int found;
+
+	/*
+	 * If the symbol lookup fails we repeat it with a NULL GElf_Sym to
+	 * find just the containing module.  A kernel entry never has
+	 * DT_SYMCACHE_SYM set without DT_SYMCACHE_OBJ.
+	 */
+	if ((found = dtrace_lookup_by_addr(dtp,
+	    dse->dse_pc, &sym, &dts) == 0) == 0 &&
+	    dtrace_lookup_by_addr(dtp, dse->dse_pc, NULL, &dts) != 0)
+		return;
+
+	if ((dse->dse_object = strdup(dts.dts_object)) == NULL)
+		return;
+
+	dse->dse_flags |= DT_SYMCACHE_OBJ;
+
+	if (found && (dse->dse_name = strdup(dts.dts_name)) != NULL) {
+		dse->dse_value = sym.st_value;
+		dse->dse_flags |= DT_SYMCACHE_SYM;
+	}
+}
+
+static void
+dt_symcache_fill_user(struct ps_prochandle *P, dt_symcache_ent_t *dse)
+{
+	char name[PATH_MAX];
+	const prmap_t *map;
+	GElf_Sym sym;
+
+	if (Plookup_by_addr(P, dse->dse_pc, name, sizeof (name), &sym) == 0 &&
+	    (dse->dse_name = strdup(name)) != NULL) {
+		dse->dse_value = sym.st_value;
+		dse->dse_flags |= DT_SYMCACHE_SYM;
+	}
+
+	if (Pobjname(P, dse->dse_pc, name, sizeof (name)) != NULL &&
+	    (dse->dse_object = strdup(name)) != NULL)
+		dse->dse_flags |= DT_SYMCACHE_OBJ;
+
+	if ((map = Paddr_to_map(P, dse->dse_pc)) != NULL) {
+		dse->dse_mapva = map->pr_vaddr;
+		dse->dse_mflags = map->pr_mflags;
+		dse->dse_flags |= DT_SYMCACHE_MAP;
+	}
+}
+
+/*
+ * Return the cached translation of 'pc' in process 'pid' (0 for the kernel),
+ * performing and caching the lookup if this is the first time we have seen
+ * it.  For a user address the caller must pass a locked handle 'P' for the
+ * lookup to be performed; if 'P' is NULL and the address is not yet cached,
+ * NULL is returned so that the caller can grab the process and try again.
+ * NULL is also returned if memory for a new entry cannot be allocated.
+ */
+const dt_symcache_ent_t *
+dt_symcache_lookup(dtrace_hdl_t *dtp, struct ps_prochandle *P,
+    pid_t pid, uint64_t pc)
+{
+	dt_symcache_t *dsc = &dtp->dt_symcache;
+	dt_symcache_ent_t *dse;
+	uint_t h;
+
+	/*
+	 * dsc_npurge is written by dt_symcache_purge() from other threads, so
+	 * we only look at it under dsc_lock, in dt_symcache_flush().
+	 */
+	dt_symcache_flush(dsc);
+
+	if (dsc->dsc_hashsize != 0) {
+		h = dt_symcache_hashval(pid, pc) & (dsc->dsc_hashsize - 1);
+
+		for (dse = dsc->dsc_hash[h]; dse != NULL; dse = dse->dse_next) {
+			if (dse->dse_pc == pc && dse->dse_pid == pid) {
+				dsc->dsc_hits++;
+				return (dse);
+			}
+		}
+	}
+
+	if (pid != 0 && P == NULL)
+		return (NULL);
+
+	if (dsc->dsc_nents >= dsc->dsc_hashsize && dt_symcache_grow(dsc) != 0)
+		return (NULL);
+
+	if ((dse = calloc(1, sizeof (dt_symcache_ent_t))) == NULL)
+		return (NULL);
+
+	dse->dse_pid = pid;
+	dse->dse_pc = pc;
+
+	if (pid == 0)
+		dt_symcache_fill_kernel(dtp, dse);
+	else
+		dt_symcache_fill_user(P, dse);
+
+	h = dt_symcache_hashval(pid, pc) & (dsc->dsc_hashsize - 1);
+	dse->dse_next = dsc->dsc_hash[h];
+	dsc->dsc_hash[h] = dse;
+	dsc->dsc_nents++;
+	dsc->dsc_misses++;
+
+	return (dse);
+}
+
+/*
+ * Convenience wrapper for callers translating a single user address: if the
+ * address isn't cached, grab process 'pid' just long enough to look it up.
+ * As elsewhere, we don't attempt user lookups through a vectored open.
+ */
+const dt_symcache_ent_t *
+dt_symcache_ulookup(dtrace_hdl_t *dtp, pid_t pid, uint64_t pc)
+{
+	const dt_symcache_ent_t *dse;
+	struct ps_prochandle *P;
+
+	if (pid == 0 || dtp->dt_vector != NULL)
+		return (NULL);
+
+	if ((dse = dt_symcache_lookup(dtp, NULL, pid, pc)) != NULL)
+		return (dse);
+
+	if ((P = dt_proc_grab(dtp, pid, PGRAB_RDONLY | PGRAB_FORCE, 0)) == NULL)
+		return (NULL);
+
+	dt_proc_lock(dtp, P);
+	dse = dt_symcache_lookup(dtp, P, pid, pc);
+	dt_proc_unlock(dtp, P);
+	dt_proc_release(dtp, P);
+
+	return (dse);
+}
+
+/*
+ * Queue the invalidation of all entries for 'pid' (0 for the kernel).  This
+ * may be called from any thread; the entries are freed on the consumer's
+ * next lookup.  If too many invalidations are queued we discard everything.
+ */
+void
+dt_symcache_purge(dtrace_hdl_t *dtp, pid_t pid)
+{
+	dt_symcache_t *dsc = &dtp->dt_symcache;
+	int i;
+
+	(void) pthread_mutex_lock(&dsc->dsc_lock);
+
+	for (i = 0; i < dsc->dsc_npurge; i++) {
+		if (dsc->dsc_purge[i] == pid)
+			break;
+	}
+
+	if (dsc->dsc_npurge >= 0 && i == dsc->dsc_npurge) {
+		if (dsc->dsc_npurge == DT_SYMCACHE_NPURGE)
+			dsc->dsc_npurge = -1;
+		else
+			dsc->dsc_purge[dsc->dsc_npurge++] = pid;
+	}
+
+	(void) pthread_mutex_unlock(&dsc->dsc_lock);
+}
+
+void
+dt_symcache_init(dtrace_hdl_t *dtp)
+{
+	(void) pthread_mutex_init(&dtp->dt_symcache.dsc_lock, NULL);
+}
+
+void
+dt_symcache_destroy(dtrace_hdl_t *dtp)
+{
+	dt_symcache_t *dsc = &dtp->dt_symcache;
+
+	dt_dprintf("symcache: %u entries, %llu hits, %llu misses\n",
+	    dsc->dsc_nents, (u_longlong_t)dsc->dsc_hits,
+	    (u_longlong_t)dsc->dsc_misses);
+
+	dt_symcache_discard(dsc, 0, B_TRUE);
+	free(dsc->dsc_hash);
+	dsc->dsc_hash = NULL;
+	dsc->dsc_hashsize = 0;
+	dsc->dsc_npurge = 0;
+	(void) pthread_mutex_destroy(&dsc->dsc_lock);
+}
@@ -134,6 +134,10 @@ dtrace_status(dtrace_hdl_t *dtp)
 	if (dt_ioctl(dtp, DTRACEIOC_STATUS, &dtp->dt_status[gen]) == -1)
 		return (dt_set_errno(dtp, errno));
 
+	if (dtp->dt_capture != NULL &&
+	    dt_capture_status(dtp, &dtp->dt_status[gen]) == -1)
+		return (-1);
+
 	dtp->dt_statusgen ^= 1;
 
 	if (dt_handle_status(dtp, &dtp->dt_status[dtp->dt_statusgen],
@@ -161,6 +165,90 @@ dtrace_status(dtrace_hdl_t *dtp)
 	return (DTRACE_STATUS_FILLED);
 }
 
+/*
+ * Report where the kernel found the per-CPU buffers relative to their CPUs'
+ * NUMA nodes, as of the most recent status.
+ */
+int
+dtrace_numastat(dtrace_hdl_t *dtp, uint64_t *local, uint64_t *remote)
+{
+	dtrace_status_t *stat = &dtp->dt_status[dtp->dt_statusgen];
+
+	if (!dtp->dt_active)
+		return (dt_set_errno(dtp, EINVAL));
+
+	*local = stat->dtst_numalocal;
+	*remote = stat->dtst_numaremote;
+
+	return (0);
+}
+
+/*
+ * Report how many aggregation records the "aggtopn" option has held back in
+ * the kernel, and how many snapshots it could not filter, as of the most
+ * recent status.
+ */
+int
+dtrace_aggtopnstat(dtrace_hdl_t *dtp, uint64_t *held, uint64_t *unfiltered)
+{
+	dtrace_status_t *stat = &dtp->dt_status[dtp->dt_statusgen];
+
+	if (!dtp->dt_active)
+		return (dt_set_errno(dtp, EINVAL));
+
+	*held = stat->dtst_aggheld;
+	*unfiltered = stat->dtst_aggunfiltered;
+
+	return (0);
+}
+
+#define	DT_SPECSTAT_CHUNK	1024
+
+int
+dtrace_specstat_iter(dtrace_hdl_t *dtp, dtrace_specstat_f *func, void *arg)
+{
+	dtrace_specdesc_t desc;
+	dtrace_specstat_t *stats;
+	uint32_t i;
+	int rval = 0;
+
+	if (!dtp->dt_active)
+		return (dt_set_errno(dtp, EINVAL));
+
+	if ((stats = dt_alloc(dtp, DT_SPECSTAT_CHUNK *
+	    sizeof (dtrace_specstat_t))) == NULL)
+		return (-1); /* dt_errno has been set for us */
+
+	bzero(&desc, sizeof (desc));
+	desc.dtspd_first = 1;
+
+	do {
+		desc.dtspd_count = DT_SPECSTAT_CHUNK;
+		desc.dtspd_data = stats;
+
+		if (dt_ioctl(dtp, DTRACEIOC_SPECSTAT, &desc) == -1) {
+			rval = dt_set_errno(dtp, errno);
+			break;
+		}
+
+		for (i = 0; i < desc.dtspd_count && rval == 0; i++) {
+			dtrace_specstat_t *ss = &stats[i];
+
+			if (ss->dtss_drops == 0 && ss->dtss_busy == 0 &&
+			    ss->dtss_unavail == 0)
+				continue;
+
+			rval = func(dtp, desc.dtspd_first + i, ss, arg);
+		}
+
+		desc.dtspd_first += desc.dtspd_count;
+	} while (rval == 0 && desc.dtspd_count != 0 &&
+	    desc.dtspd_first <= desc.dtspd_nspec);
+
+	dt_free(dtp, stats);
+	return (rval);
+}
+
 int
 dtrace_go(dtrace_hdl_t *dtp)
 {
@@ -215,6 +303,9 @@ dtrace_go(dtrace_hdl_t *dtp)
 	if (dt_options_load(dtp) == -1)
 		return (dt_set_errno(dtp, errno));
 
+	if (dtp->dt_capture != NULL && dt_capture_go(dtp) == -1)
+		return (-1);
+
 	return (dt_aggregate_go(dtp));
 }
 
@@ -231,12 +322,19 @@ dtrace_stop(dtrace_hdl_t *dtp)
 
 	dtp->dt_stopped = 1;
 
+	if (dtp->dt_capture != NULL && dt_capture_stop(dtp) == -1)
+		return (-1);
+
 	/*
 	 * Now that we're stopped, we're going to get status one final time.
 	 */
 	if (dt_ioctl(dtp, DTRACEIOC_STATUS, &dtp->dt_status[gen]) == -1)
 		return (dt_set_errno(dtp, errno));
 
+	if (dtp->dt_capture != NULL &&
+	    dt_capture_status(dtp, &dtp->dt_status[gen]) == -1)
+		return (-1);
+
 	if (dt_handle_status(dtp, &dtp->dt_status[gen ^ 1],
 	    &dtp->dt_status[gen]) == -1)
 		return (-1);
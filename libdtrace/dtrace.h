@@ -57,6 +57,7 @@ struct ps_prochandle;
 typedef struct dtrace_hdl dtrace_hdl_t;
 typedef struct dtrace_prog dtrace_prog_t;
 typedef struct dtrace_vector dtrace_vector_t;
+typedef struct dtrace_mockconf dtrace_mockconf_t;
 typedef struct dtrace_aggdata dtrace_aggdata_t;
 
 #define	DTRACE_O_NODEV		0x01	/* do not open dtrace(7D) device */
@@ -68,6 +69,10 @@ typedef struct dtrace_aggdata dtrace_aggdata_t;
 extern dtrace_hdl_t *dtrace_open(int, int, int *);
 extern dtrace_hdl_t *dtrace_vopen(int, int, int *,
     const dtrace_vector_t *, void *);
+extern dtrace_hdl_t *dtrace_replay_open(int, int, int *, const char *);
+extern dtrace_hdl_t *dtrace_mock_open(int, int, int *,
+    const dtrace_mockconf_t *);
+extern int dtrace_capture(dtrace_hdl_t *, const char *);
 
 extern int dtrace_go(dtrace_hdl_t *);
 extern int dtrace_stop(dtrace_hdl_t *);
@@ -210,6 +215,30 @@ extern int dtrace_consume(dtrace_hdl_t *, FILE *,
 
 extern int dtrace_status(dtrace_hdl_t *);
 
+/*
+ * dtrace_specstat_iter() calls the function for each speculation ID that has
+ * suffered drops since tracing began, in ID order.
+ */
+typedef int dtrace_specstat_f(dtrace_hdl_t *, uint32_t,
+    const dtrace_specstat_t *, void *);
+
+extern int dtrace_specstat_iter(dtrace_hdl_t *, dtrace_specstat_f *, void *);
+
+/*
+ * dtrace_numastat() returns the number of per-CPU buffers that were on and off
+ * their CPU's NUMA node at the last status check.  Both are zero when the
+ * machine has only one node.
+ */
+extern int dtrace_numastat(dtrace_hdl_t *, uint64_t *, uint64_t *);
+
+/*
+ * dtrace_aggtopnstat() returns the number of aggregation records that the
+ * "aggtopn" option has held back in the kernel (each is copied out once it
+ * ranks, or when tracing stops) and the number of snapshots that were copied
+ * out unfiltered because the kernel was short of memory.
+ */
+extern int dtrace_aggtopnstat(dtrace_hdl_t *, uint64_t *, uint64_t *);
+
 /*
  * DTrace Formatted Output Interfaces
  *
@@ -297,7 +326,8 @@ typedef enum {
 	DTRACEDROP_SPECBUSY,			/* spec drop due to busy */
 	DTRACEDROP_SPECUNAVAIL,			/* spec drop due to unavail */
 	DTRACEDROP_STKSTROVERFLOW,		/* stack string tab overflow */
-	DTRACEDROP_DBLERROR			/* error in ERROR probe */
+	DTRACEDROP_DBLERROR,			/* error in ERROR probe */
+	DTRACEDROP_STACKTAB			/* stack table overflow */
 } dtrace_dropkind_t;
 
 typedef struct dtrace_dropdata {
@@ -543,6 +573,25 @@ struct dtrace_vector {
 	long (*dtv_sysconf)(void *, int);
 };
 
+/*
+ * DTrace Mock Interface
+ *
+ * dtrace_mock_open() returns a handle that is vectored to a mock of dtrace(7D)
+ * inside the library, so that consumers can be tested and benchmarked without
+ * the driver.  The mock synthesizes trace data for a fixed program -- a probe
+ * recording dtmc_nrecs 64-bit values, and an aggregation of type dtmc_aggact
+ * (count, sum, min, max or quantize) keyed on one 64-bit value -- in the
+ * amounts given by the rest of the dtrace_mockconf_t.
+ */
+struct dtrace_mockconf {
+	int dtmc_ncpus;			/* number of CPUs to simulate */
+	int dtmc_nrecs;			/* 64-bit values per probe firing */
+	uint64_t dtmc_snapsize;		/* bytes per principal snapshot */
+	uint64_t dtmc_nkeys;		/* keys per aggregation snapshot */
+	uint64_t dtmc_nsnaps;		/* principal snapshots per CPU */
+	dtrace_actkind_t dtmc_aggact;	/* aggregating action */
+};
+
 /*
  * DTrace Utility Functions
  *
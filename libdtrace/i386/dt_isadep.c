@@ -37,10 +37,80 @@
 
 static int dt_instr_size(uchar_t *, dtrace_hdl_t *, pid_t, uintptr_t, char);
 
+/*
+ * Return the size of the instruction at offset off in the function, using the
+ * result of dt_pid_decode_text() if it already decoded that instruction.
+ */
+static int
+dt_pid_instr_size(const dt_pid_text_t *dpt, uint8_t *text, ulong_t off,
+    dtrace_hdl_t *dtp, pid_t pid, uintptr_t addr, char dmodel)
+{
+	uint8_t size;
+
+	if (dpt != NULL && dpt->dpt_isize != NULL && off < dpt->dpt_size &&
+	    (size = dpt->dpt_isize[off]) != 0)
+		return (size == DT_PID_ISIZE_BAD ? -1 : size);
+
+	return (dt_instr_size(&text[off], dtp, pid, addr, dmodel));
+}
+
+/*
+ * Get a private copy of the function's text, followed by pad bytes of zeroes,
+ * either from the module's bulk read or straight from the process.
+ */
+static uint8_t *
+dt_pid_get_text(struct ps_prochandle *P, const GElf_Sym *symp,
+    const dt_pid_text_t *dpt, size_t pad)
+{
+	uint8_t *text;
+
+	if ((text = calloc(1, symp->st_size + pad)) == NULL) {
+		dt_dprintf("mr sparkle: malloc() failed\n");
+		return (NULL);
+	}
+
+	if (dpt != NULL && dpt->dpt_text != NULL) {
+		bcopy(dpt->dpt_text, text, symp->st_size);
+	} else if (Pread(P, text, symp->st_size, symp->st_value) !=
+	    symp->st_size) {
+		dt_dprintf("mr sparkle: Pread() failed\n");
+		free(text);
+		return (NULL);
+	}
+
+	return (text);
+}
+
+/*
+ * Record the size of each instruction in the function on a linear sweep from
+ * its first byte, stopping at the first one that can't be decoded.  This is
+ * called from several threads at once, so it must not touch anything but its
+ * arguments.
+ */
+void
+dt_pid_decode_text(dtrace_hdl_t *dtp, pid_t pid, char dmodel,
+    const uint8_t *text, uint64_t pc, size_t len, uint8_t *isize)
+{
+	ulong_t i;
+	int size;
+
+	for (i = 0; i < len; i += size) {
+		size = dt_instr_size((uchar_t *)&text[i], dtp, pid, pc + i,
+		    dmodel);
+
+		if (size <= 0 || size >= DT_PID_ISIZE_BAD) {
+			isize[i] = DT_PID_ISIZE_BAD;
+			break;
+		}
+
+		isize[i] = size;
+	}
+}
+
 /*ARGSUSED*/
 int
 dt_pid_create_entry_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
-    fasttrap_probe_spec_t *ftp, const GElf_Sym *symp)
+    dt_pid_batch_t *dpb, fasttrap_probe_spec_t *ftp, const GElf_Sym *symp)
 {
 	ftp->ftps_type = DTFTP_ENTRY;
 	ftp->ftps_pc = (uintptr_t)symp->st_value;
@@ -48,18 +118,16 @@ dt_pid_create_entry_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 	ftp->ftps_noffs = 1;
 	ftp->ftps_offs[0] = 0;
 
-	if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE, ftp) != 0) {
-		dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
-		    strerror(errno));
-		return (dt_set_errno(dtp, errno));
-	}
+	if (dt_pid_queue_probe(dtp, dpb, ftp) != 0)
+		return (-1); /* errno is set for us */
 
 	return (1);
 }
 
 static int
 dt_pid_has_jump_table(struct ps_prochandle *P, dtrace_hdl_t *dtp,
-    uint8_t *text, fasttrap_probe_spec_t *ftp, const GElf_Sym *symp)
+    uint8_t *text, fasttrap_probe_spec_t *ftp, const GElf_Sym *symp,
+    const dt_pid_text_t *dpt)
 {
 	ulong_t i;
 	int size;
@@ -72,8 +140,8 @@ dt_pid_has_jump_table(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 	 * ultra conservative.
 	 */
 	for (i = 0; i < ftp->ftps_size; i += size) {
-		size = dt_instr_size(&text[i], dtp, pid, symp->st_value + i,
-		    dmodel);
+		size = dt_pid_instr_size(dpt, text, i, dtp, pid,
+		    symp->st_value + i, dmodel);
 
 		/*
 		 * Assume the worst if we hit an illegal instruction.
@@ -96,7 +164,8 @@ dt_pid_has_jump_table(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 /*ARGSUSED*/
 int
 dt_pid_create_return_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
-    fasttrap_probe_spec_t *ftp, const GElf_Sym *symp, uint64_t *stret)
+    dt_pid_batch_t *dpb, fasttrap_probe_spec_t *ftp, const GElf_Sym *symp,
+    uint64_t *stret, const dt_pid_text_t *dpt)
 {
 	uint8_t *text;
 	ulong_t i, end;
@@ -108,16 +177,8 @@ dt_pid_create_return_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 	 * We allocate a few extra bytes at the end so we don't have to check
 	 * for overrunning the buffer.
 	 */
-	if ((text = calloc(1, symp->st_size + 4)) == NULL) {
-		dt_dprintf("mr sparkle: malloc() failed\n");
+	if ((text = dt_pid_get_text(P, symp, dpt, 4)) == NULL)
 		return (DT_PROC_ERR);
-	}
-
-	if (Pread(P, text, symp->st_size, symp->st_value) != symp->st_size) {
-		dt_dprintf("mr sparkle: Pread() failed\n");
-		free(text);
-		return (DT_PROC_ERR);
-	}
 
 	ftp->ftps_type = DTFTP_RETURN;
 	ftp->ftps_pc = (uintptr_t)symp->st_value;
@@ -137,9 +198,9 @@ dt_pid_create_return_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 	 * We do this to avoid accidentally interpreting jump table
 	 * offsets as actual instructions.
 	 */
-	if (dt_pid_has_jump_table(P, dtp, text, ftp, symp)) {
+	if (dt_pid_has_jump_table(P, dtp, text, ftp, symp, dpt)) {
 		for (i = 0, end = ftp->ftps_size; i < end; i += size) {
-			size = dt_instr_size(&text[i], dtp, pid,
+			size = dt_pid_instr_size(dpt, text, i, dtp, pid,
 			    symp->st_value + i, dmodel);
 
 			/* bail if we hit an invalid opcode */
@@ -170,7 +231,7 @@ dt_pid_create_return_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 		}
 	} else {
 		for (i = 0, end = ftp->ftps_size; i < end; i += size) {
-			size = dt_instr_size(&text[i], dtp, pid,
+			size = dt_pid_instr_size(dpt, text, i, dtp, pid,
 			    symp->st_value + i, dmodel);
 
 			/* bail if we hit an invalid opcode */
@@ -225,11 +286,8 @@ is_ret:
 
 	free(text);
 	if (ftp->ftps_noffs > 0) {
-		if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE, ftp) != 0) {
-			dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
-			    strerror(errno));
-			return (dt_set_errno(dtp, errno));
-		}
+		if (dt_pid_queue_probe(dtp, dpb, ftp) != 0)
+			return (-1); /* errno is set for us */
 	}
 
 	return (ftp->ftps_noffs);
@@ -238,7 +296,8 @@ is_ret:
 /*ARGSUSED*/
 int
 dt_pid_create_offset_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
-    fasttrap_probe_spec_t *ftp, const GElf_Sym *symp, ulong_t off)
+    dt_pid_batch_t *dpb, fasttrap_probe_spec_t *ftp, const GElf_Sym *symp,
+    ulong_t off, const dt_pid_text_t *dpt)
 {
 	ftp->ftps_type = DTFTP_OFFSETS;
 	ftp->ftps_pc = (uintptr_t)symp->st_value;
@@ -254,24 +313,15 @@ dt_pid_create_offset_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 		pid_t pid = Pstatus(P)->pr_pid;
 		char dmodel = Pstatus(P)->pr_dmodel;
 
-		if ((text = malloc(symp->st_size)) == NULL) {
-			dt_dprintf("mr sparkle: malloc() failed\n");
+		if ((text = dt_pid_get_text(P, symp, dpt, 0)) == NULL)
 			return (DT_PROC_ERR);
-		}
-
-		if (Pread(P, text, symp->st_size, symp->st_value) !=
-		    symp->st_size) {
-			dt_dprintf("mr sparkle: Pread() failed\n");
-			free(text);
-			return (DT_PROC_ERR);
-		}
 
 		/*
 		 * We can't instrument offsets in functions with jump tables
 		 * as we might interpret a jump table offset as an
 		 * instruction.
 		 */
-		if (dt_pid_has_jump_table(P, dtp, text, ftp, symp)) {
+		if (dt_pid_has_jump_table(P, dtp, text, ftp, symp, dpt)) {
 			free(text);
 			return (0);
 		}
@@ -292,7 +342,7 @@ dt_pid_create_offset_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 				return (DT_PROC_ALIGN);
 			}
 
-			size = dt_instr_size(&text[i], dtp, pid,
+			size = dt_pid_instr_size(dpt, text, i, dtp, pid,
 			    symp->st_value + i, dmodel);
 
 			/*
@@ -308,11 +358,8 @@ dt_pid_create_offset_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 		free(text);
 	}
 
-	if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE, ftp) != 0) {
-		dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
-		    strerror(errno));
-		return (dt_set_errno(dtp, errno));
-	}
+	if (dt_pid_queue_probe(dtp, dpb, ftp) != 0)
+		return (-1); /* errno is set for us */
 
 	return (ftp->ftps_noffs);
 }
@@ -320,7 +367,8 @@ dt_pid_create_offset_probe(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 /*ARGSUSED*/
 int
 dt_pid_create_glob_offset_probes(struct ps_prochandle *P, dtrace_hdl_t *dtp,
-    fasttrap_probe_spec_t *ftp, const GElf_Sym *symp, const char *pattern)
+    dt_pid_batch_t *dpb, fasttrap_probe_spec_t *ftp, const GElf_Sym *symp,
+    const char *pattern, const dt_pid_text_t *dpt)
 {
 	uint8_t *text;
 	ulong_t i, end;
@@ -328,22 +376,14 @@ dt_pid_create_glob_offset_probes(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 	pid_t pid = Pstatus(P)->pr_pid;
 	char dmodel = Pstatus(P)->pr_dmodel;
 
-	if ((text = malloc(symp->st_size)) == NULL) {
-		dt_dprintf("mr sparkle: malloc() failed\n");
-		return (DT_PROC_ERR);
-	}
-
-	if (Pread(P, text, symp->st_size, symp->st_value) != symp->st_size) {
-		dt_dprintf("mr sparkle: Pread() failed\n");
-		free(text);
+	if ((text = dt_pid_get_text(P, symp, dpt, 0)) == NULL)
 		return (DT_PROC_ERR);
-	}
 
 	/*
 	 * We can't instrument offsets in functions with jump tables as
 	 * we might interpret a jump table offset as an instruction.
 	 */
-	if (dt_pid_has_jump_table(P, dtp, text, ftp, symp)) {
+	if (dt_pid_has_jump_table(P, dtp, text, ftp, symp, dpt)) {
 		free(text);
 		return (0);
 	}
@@ -359,7 +399,7 @@ dt_pid_create_glob_offset_probes(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 		for (i = 0; i < end; i += size) {
 			ftp->ftps_offs[ftp->ftps_noffs++] = i;
 
-			size = dt_instr_size(&text[i], dtp, pid,
+			size = dt_pid_instr_size(dpt, text, i, dtp, pid,
 			    symp->st_value + i, dmodel);
 
 			/* bail if we hit an invalid opcode */
@@ -374,7 +414,7 @@ dt_pid_create_glob_offset_probes(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 			if (gmatch(name, pattern))
 				ftp->ftps_offs[ftp->ftps_noffs++] = i;
 
-			size = dt_instr_size(&text[i], dtp, pid,
+			size = dt_pid_instr_size(dpt, text, i, dtp, pid,
 			    symp->st_value + i, dmodel);
 
 			/* bail if we hit an invalid opcode */
@@ -385,11 +425,8 @@ dt_pid_create_glob_offset_probes(struct ps_prochandle *P, dtrace_hdl_t *dtp,
 
 	free(text);
 	if (ftp->ftps_noffs > 0) {
-		if (ioctl(dtp->dt_ftfd, FASTTRAPIOC_MAKEPROBE, ftp) != 0) {
-			dt_dprintf("fasttrap probe creation ioctl failed: %s\n",
-			    strerror(errno));
-			return (dt_set_errno(dtp, errno));
-		}
+		if (dt_pid_queue_probe(dtp, dpb, ftp) != 0)
+			return (-1); /* errno is set for us */
 	}
 
 	return (ftp->ftps_noffs);
@@ -84,6 +84,11 @@ typedef struct sym_tbl {	/* symbol table */
 	uint_t	*sym_byname;	/* symbols sorted by name */
 	uint_t	*sym_byaddr;	/* symbols sorted by addr */
 	size_t	sym_count;	/* number of symbols in each sorted list */
+	GElf_Addr *sym_addrlo;	/* st_value of each sym_byaddr entry */
+	GElf_Xword *sym_addrsz;	/* st_size of each sym_byaddr entry */
+	GElf_Addr *sym_addrend;	/* max st_value + st_size up to each entry */
+	GElf_Addr *sym_eytz;	/* sym_addrlo in Eytzinger order, from [1] */
+	uint_t	*sym_eytzrank;	/* sym_byaddr rank of each sym_eytz entry */
 } sym_tbl_t;
 
 typedef struct file_info {	/* symbol information for a mapped file */
@@ -210,6 +215,8 @@ struct ps_prochandle {
 	map_info_t *mappings;	/* cached process mappings */
 	size_t	map_count;	/* number of mappings */
 	size_t	map_alloc;	/* number of mappings allocated */
+	char	*map_text;	/* /proc/<pid>/maps as of last update */
+	size_t	map_textlen;	/* length of map_text */
 	uint_t	num_files;	/* number of file elements in file_info */
 	plist_t	file_head;	/* head of mapped files w/ symbol table info */
 	char	*execname;	/* name of the executable file */
@@ -249,6 +249,23 @@ file_info_new(struct ps_prochandle *P, map_info_t *mptr)
 	return (fptr);
 }
 
+/*
+ * Free the address index built by addr_index_build() for one symbol table.
+ * Safe to call on a table that has no index, or only part of one.
+ */
+static void
+addr_index_free(sym_tbl_t *symtab)
+{
+	free(symtab->sym_addrlo);
+	free(symtab->sym_addrsz);
+	free(symtab->sym_addrend);
+	free(symtab->sym_eytz);
+	free(symtab->sym_eytzrank);
+	symtab->sym_addrlo = symtab->sym_addrend = symtab->sym_eytz = NULL;
+	symtab->sym_addrsz = NULL;
+	symtab->sym_eytzrank = NULL;
+}
+
 /*
  * Deallocation function for a file_info_t
  */
@@ -265,6 +282,7 @@ file_info_free(struct ps_prochandle *P, file_info_t *fptr)
 			free(fptr->file_symtab.sym_byname);
 		if (fptr->file_symtab.sym_byaddr)
 			free(fptr->file_symtab.sym_byaddr);
+		addr_index_free(&fptr->file_symtab);
 
 		if (fptr->file_dynsym.sym_elf) {
 			(void) elf_end(fptr->file_dynsym.sym_elf);
@@ -274,6 +292,7 @@ file_info_free(struct ps_prochandle *P, file_info_t *fptr)
 			free(fptr->file_dynsym.sym_byname);
 		if (fptr->file_dynsym.sym_byaddr)
 			free(fptr->file_dynsym.sym_byaddr);
+		addr_index_free(&fptr->file_dynsym);
 
 		if (fptr->file_lo)
 			free(fptr->file_lo);
@@ -447,6 +466,149 @@ load_static_maps(struct ps_prochandle *P)
 		map_set(P, mptr, "ld.so.1");
 }
 
+# if linux
+/*
+ * Read the whole of /proc/<pid>/maps in as few read(2) calls as we can.
+ * procfs reports a size of zero for the file, so we size the buffer from
+ * the previous read and double it as needed until EOF.  The text is returned
+ * NUL-terminated, with its length (excluding the NUL) in *lenp.
+ */
+static char *
+read_maps_text(struct ps_prochandle *P, size_t *lenp)
+{
+	char mapfile[PATH_MAX];
+	size_t size, len = 0;
+	char *buf, *nbuf;
+	ssize_t n;
+	int fd;
+
+	(void) snprintf(mapfile, sizeof (mapfile), "%s/%d/maps",
+	    procfs_path, (int)P->pid);
+	if ((fd = open(mapfile, O_RDONLY)) < 0)
+		return (NULL);
+
+	size = P->map_textlen > BUFSIZ ? P->map_textlen + BUFSIZ : 4 * BUFSIZ;
+	if ((buf = malloc(size)) == NULL) {
+		(void) close(fd);
+		return (NULL);
+	}
+
+	for (;;) {
+		if (len + 1 == size) {
+			if ((nbuf = realloc(buf, size * 2)) == NULL) {
+				free(buf);
+				(void) close(fd);
+				return (NULL);
+			}
+			buf = nbuf;
+			size *= 2;
+		}
+
+		if ((n = read(fd, buf + len, size - len - 1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			(void) close(fd);
+			return (NULL);
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	(void) close(fd);
+	buf[len] = '\0';
+	*lenp = len;
+	return (buf);
+}
+
+/*
+ * Parse the text of /proc/<pid>/maps into an array of prmap_t, which is
+ * returned through *mapp.  Each line has the form
+ *
+ *	lo-hi perms offset major:minor inode [pathname]
+ *
+ * where the pathname is absent for anonymous mappings and may itself contain
+ * spaces.  The array grows geometrically; the number of entries is returned.
+ */
+static ssize_t
+parse_maps_text(const char *text, size_t len, prmap_t **mapp)
+{
+	const char *p = text, *end = text + len, *eol, *name;
+	prmap_t *map = NULL, *nbuf, *pmap;
+	size_t n = 0, alloc = 0, namelen;
+	char *q;
+
+	for (; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			if ((nbuf = realloc(map, alloc * sizeof (prmap_t))) ==
+			    NULL) {
+				free(map);
+				return (-1);
+			}
+			map = nbuf;
+		}
+
+		pmap = &map[n];
+		(void) memset(pmap, 0, sizeof (prmap_t));
+
+		pmap->pr_vaddr = strtoul(p, &q, 16);
+		if (*q++ != '-')
+			continue;	/* malformed line; skip it */
+		pmap->pr_size = strtoul(q, &q, 16) - pmap->pr_vaddr;
+		while (*q == ' ')
+			q++;
+		if (q + 3 < eol) {
+			if (q[0] == 'r')
+				pmap->pr_mflags |= MA_READ;
+			if (q[1] == 'w')
+				pmap->pr_mflags |= MA_WRITE;
+			if (q[2] == 'x')
+				pmap->pr_mflags |= MA_EXEC;
+		}
+		while (q < eol && *q != ' ')
+			q++;
+		pmap->pr_offset = strtoul(q, &q, 16);
+		pmap->pr_pagesize = 4096;
+
+		/*
+		 * Skip the device and inode fields; whatever follows is the
+		 * pathname.  The kernel marks unlinked files with a trailing
+		 * " (deleted)", which we drop so the name still matches the
+		 * object that rtld_db and the symbol tables know about.
+		 */
+		while (q < eol && *q == ' ')
+			q++;
+		while (q < eol && *q != ' ')
+			q++;
+		while (q < eol && *q == ' ')
+			q++;
+		while (q < eol && *q != ' ')
+			q++;
+		while (q < eol && *q == ' ')
+			q++;
+
+		name = q;
+		namelen = eol - name;
+		if (namelen > 10 && memcmp(eol - 10, " (deleted)", 10) == 0)
+			namelen -= 10;
+		if (namelen >= sizeof (pmap->pr_mapname))
+			namelen = sizeof (pmap->pr_mapname) - 1;
+		(void) memcpy(pmap->pr_mapname, name, namelen);
+		pmap->pr_mapname[namelen] = '\0';
+
+		n++;
+	}
+
+	*mapp = map;
+	return (n);
+}
+# endif
+
 /*
  * Go through all the address space mappings, validating or updating
  * the information already gathered, or gathering new information.
@@ -457,9 +619,6 @@ load_static_maps(struct ps_prochandle *P)
 void
 Pupdate_maps(struct ps_prochandle *P)
 {
-	char mapfile[PATH_MAX];
-	int mapfd;
-	struct stat statb;
 	prmap_t *Pmap = NULL;
 	prmap_t *pmap;
 	ssize_t nmap;
@@ -467,6 +626,14 @@ Pupdate_maps(struct ps_prochandle *P)
 	uint_t oldmapcount;
 	map_info_t *newmap, *newp;
 	map_info_t *mptr;
+# if linux
+	char *text;
+	size_t textlen;
+# else
+	char mapfile[PATH_MAX];
+	int mapfd;
+	struct stat statb;
+# endif
 
 	if (P->info_valid || P->state == PS_UNDEAD)
 		return;
@@ -479,38 +646,32 @@ Pupdate_maps(struct ps_prochandle *P)
 		printf("in Pupdate_maps (check: pr_mapname is big enough PRMAPSZ=%d)\n", PRMAPSZ);
 	}
 
-	FILE *fp;
-	char	buf[BUFSIZ];
-	(void) snprintf(mapfile, sizeof (mapfile), "%s/%d/maps",
-	    procfs_path, (int)P->pid);
-	if ((fp = fopen(mapfile, "r")) == NULL) {
+	if ((text = read_maps_text(P, &textlen)) == NULL) {
+		Preset_maps(P);	/* utter failure; destroy tables */
+		return;
+	}
+
+	/*
+	 * rtld activity very often leaves the address space exactly as it
+	 * was.  If the maps file hasn't changed since we last parsed it,
+	 * the existing mappings (and the file and symbol table information
+	 * hanging off them) are still correct, and we only need to give
+	 * rtld_db another chance to name them.
+	 */
+	if (P->map_text != NULL && textlen == P->map_textlen &&
+	    memcmp(text, P->map_text, textlen) == 0) {
+		free(text);
+		P->info_valid = 1;
+		if (P->rap != NULL)
+			(void) rd_loadobj_iter(P->rap, map_iter, P);
+		return;
+	}
+
+	if ((nmap = parse_maps_text(text, textlen, &Pmap)) <= 0) {
+		free(text);
 		Preset_maps(P);	/* utter failure; destroy tables */
 		return;
 	}
-	Pmap = calloc(sizeof *Pmap, 1);
-	for (i = 0; fgets(buf, sizeof buf, fp); i++) {
-		unsigned long lo, hi, offset, inode;
-		char	perms[128];
-		char	majmin[128];
-		char	filename[BUFSIZ];
-		Pmap = realloc(Pmap, (i + 1) * sizeof *Pmap);
-		sscanf(buf, "%lx-%lx %s %lx %s %ld %s",
-			&lo, &hi, perms, &offset, majmin, &inode, filename);
-		memset(&Pmap[i], 0, sizeof Pmap[i]);
-		Pmap[i].pr_vaddr = lo;
-		Pmap[i].pr_size = hi - lo;
-		Pmap[i].pr_offset = offset;
-		Pmap[i].pr_pagesize = 4096;
-		if (perms[0] == 'r')
-			Pmap[i].pr_mflags |= MA_READ;
-		if (perms[1] == 'w')
-			Pmap[i].pr_mflags |= MA_WRITE;
-		if (perms[2] == 'x')
-			Pmap[i].pr_mflags |= MA_EXEC;
-		strncpy(Pmap[i].pr_mapname, filename, sizeof(Pmap[i].pr_mapname));
-		nmap = i + 1;
-	}
-	(void) fclose(fp);
 # else
 	(void) snprintf(mapfile, sizeof (mapfile), "%s/%d/map",
 	    procfs_path, (int)P->pid);
@@ -529,8 +690,13 @@ Pupdate_maps(struct ps_prochandle *P)
 	}
 	(void) close(mapfd);
 # endif
-	if ((newmap = calloc(1, nmap * sizeof (map_info_t))) == NULL)
+	if ((newmap = calloc(1, nmap * sizeof (map_info_t))) == NULL) {
+		free(Pmap);
+# if linux
+		free(text);
+# endif
 		return;
+	}
 
 	/*
 	 * We try to merge any file information we may have for existing
@@ -614,6 +780,11 @@ Pupdate_maps(struct ps_prochandle *P)
 	P->mappings = newmap;
 	P->map_count = P->map_alloc = nmap;
 	P->info_valid = 1;
+# if linux
+	free(P->map_text);
+	P->map_text = text;
+	P->map_textlen = textlen;
+# endif
 
 	/*
 	 * Consult librtld_db to get the load object
@@ -1642,6 +1813,70 @@ symtab_getsym(sym_tbl_t *symtab, int ndx, GElf_Sym *dst)
 	return (gelf_getsym(symtab->sym_data_aux, ndx, dst));
 }
 
+/*
+ * Lay the sorted symbol values out in Eytzinger (breadth-first) order: the
+ * children of slot k are 2k and 2k + 1.  An in-order walk of that implicit
+ * tree visits the slots in sorted order, so we fill them as we go.
+ */
+static uint_t
+addr_index_fill(sym_tbl_t *symtab, uint_t rank, uint_t k)
+{
+	if (k <= symtab->sym_count) {
+		rank = addr_index_fill(symtab, rank, 2 * k);
+		symtab->sym_eytz[k] = symtab->sym_addrlo[rank];
+		symtab->sym_eytzrank[k] = rank++;
+		rank = addr_index_fill(symtab, rank, 2 * k + 1);
+	}
+
+	return (rank);
+}
+
+/*
+ * Build the address index used by sym_by_addr_eytz(): the value and size of
+ * every symbol in sym_byaddr order, stored as separate arrays so a lookup
+ * only touches the data it compares, the highest end address of any symbol
+ * up to each position, plus an Eytzinger copy of the values to search.
+ * 'syms' is the decoded symbol array from optimize_symtab().
+ * If we can't allocate the index we just fall back to sym_by_addr_binary().
+ */
+static void
+addr_index_build(sym_tbl_t *symtab, const GElf_Sym *syms)
+{
+	size_t i, count = symtab->sym_count;
+	GElf_Addr end, maxend = 0;
+
+	symtab->sym_addrlo = malloc(sizeof (GElf_Addr) * count);
+	symtab->sym_addrsz = malloc(sizeof (GElf_Xword) * count);
+	symtab->sym_addrend = malloc(sizeof (GElf_Addr) * count);
+	symtab->sym_eytz = malloc(sizeof (GElf_Addr) * (count + 1));
+	symtab->sym_eytzrank = malloc(sizeof (uint_t) * (count + 1));
+
+	if (symtab->sym_addrlo == NULL || symtab->sym_addrsz == NULL ||
+	    symtab->sym_addrend == NULL || symtab->sym_eytz == NULL ||
+	    symtab->sym_eytzrank == NULL) {
+		p_dprintf("optimize_symtab: failed to malloc address index");
+		addr_index_free(symtab);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		const GElf_Sym *symp = &syms[symtab->sym_byaddr[i]];
+
+		symtab->sym_addrlo[i] = symp->st_value;
+		symtab->sym_addrsz[i] = symp->st_size;
+
+		/* A size that wraps the address space covers the rest of it. */
+		end = symp->st_value + symp->st_size;
+		if (end < symp->st_value)
+			end = (GElf_Addr)-1;
+		if (end > maxend)
+			maxend = end;
+		symtab->sym_addrend[i] = maxend;
+	}
+
+	(void) addr_index_fill(symtab, 0, 1);
+}
+
 void
 optimize_symtab(sym_tbl_t *symtab)
 {
@@ -1724,6 +1959,9 @@ optimize_symtab(sym_tbl_t *symtab)
 		sort_strs = NULL;
 		sort_syms = NULL;
 		(void) mutex_unlock(&sort_mtx);
+
+		if (count != 0)
+			addr_index_build(symtab, syms);
 	}
 
 	free(syms);
@@ -2387,6 +2625,70 @@ sym_by_addr_binary(sym_tbl_t *symtab, GElf_Addr addr, GElf_Sym *symp,
 	return (symp);
 }
 
+/*
+ * Use the address index built by optimize_symtab() to do the work of
+ * sym_by_addr().  The descent through sym_eytz is branch-free and touches
+ * the top levels of the tree, which stay in cache across lookups, before
+ * it touches anything else; only the symbol we finally choose is decoded
+ * from the ELF data.
+ */
+static GElf_Sym *
+sym_by_addr_eytz(sym_tbl_t *symtab, GElf_Addr addr, GElf_Sym *symp,
+    uint_t *idp)
+{
+	const GElf_Addr *eytz = symtab->sym_eytz;
+	const GElf_Addr *lo = symtab->sym_addrlo;
+	const GElf_Xword *sz = symtab->sym_addrsz;
+	const GElf_Addr *end = symtab->sym_addrend;
+	uint_t n = symtab->sym_count;
+	uint_t k = 1, j, i;
+	int found;
+
+	/*
+	 * Find the first entry whose value exceeds 'addr'; every entry before
+	 * it in sorted order is a candidate.  On exit the path taken is
+	 * encoded in the bits of k, and shifting off the trailing one bits
+	 * (and the zero above them) leaves the slot where we last went left.
+	 */
+	while (k <= n) {
+#if defined(__GNUC__)
+		__builtin_prefetch(&eytz[k * 16]);
+#endif
+		k = 2 * k + (eytz[k] <= addr);
+	}
+	k >>= ffs(~k);
+	j = k == 0 ? n : symtab->sym_eytzrank[k];
+
+	/*
+	 * Walk back from the nearest predecessor to the closest symbol that
+	 * contains 'addr', then to the earliest (that is, most preferred by
+	 * byaddr_cmp()) symbol with the same value that also contains it.
+	 * Once no symbol at or below j - 1 ends beyond 'addr' none of them
+	 * can contain it, which usually stops the walk at the first step.
+	 */
+	for (found = 0; j > 0 && end[j - 1] > addr; ) {
+		j--;
+		if (addr - lo[j] < sz[j]) {
+			found = 1;
+			break;
+		}
+	}
+
+	if (!found)
+		return (NULL);
+
+	while (j > 0 && lo[j - 1] == lo[j] && addr - lo[j - 1] < sz[j - 1])
+		j--;
+
+	i = symtab->sym_byaddr[j];
+	if (symtab_getsym(symtab, i, symp) == NULL)
+		return (NULL);
+
+	if (idp != NULL)
+		*idp = i;
+	return (symp);
+}
+
 /*
  * Use a linear search to do the work of sym_by_addr().
  */
@@ -2441,6 +2743,8 @@ sym_by_addr(sym_tbl_t *symtab, GElf_Addr addr, GElf_Sym *symp, uint_t *idp)
 {
 	if (_libproc_no_qsort) {
 		return (sym_by_addr_linear(symtab, addr, symp, idp));
+	} else if (symtab->sym_eytz != NULL) {
+		return (sym_by_addr_eytz(symtab, addr, symp, idp));
 	} else {
 		return (sym_by_addr_binary(symtab, addr, symp, idp));
 	}
@@ -3133,6 +3437,12 @@ Preset_maps(struct ps_prochandle *P)
 	}
 	P->map_count = P->map_alloc = 0;
 
+	if (P->map_text != NULL) {
+		free(P->map_text);
+		P->map_text = NULL;
+		P->map_textlen = 0;
+	}
+
 	P->info_valid = 0;
 }
 
@@ -108,6 +108,7 @@ typedef struct trap_instr_t {
 	int		t_modrm;
 	instr_t		t_opcode;
 	unsigned char	t_inslen;
+	uintptr_t	t_resume;	/* If set, resume here instead of stepping */
 	} trap_instr_t;
 
 /**********************************************************************/
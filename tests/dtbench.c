@@ -0,0 +1,170 @@
+/**********************************************************************/
+/*   Benchmark  the  consumer  side  of  libdtrace  against the mock  */
+/*   backend  (dtrace_mock_open),  so  we  can  get numbers for the  */
+/*   library without loading the driver.			      */
+/*   								      */
+/*   We  time  three  things:  records/sec  through dtrace_consume  */
+/*   (formatting  to  /dev/null),  the  cost of dtrace_aggregate_snap  */
+/*   merging  the  per-CPU  aggregation  buffers,  and the sort and  */
+/*   print of the resulting aggregation.			      */
+/*   								      */
+/*   Usage: dtbench [-q] [-c ncpus] [-r nrecs] [-b snapsize]	      */
+/*                  [-k nkeys] [-n nsnaps]			      */
+/**********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dtrace.h>
+
+static unsigned long long	nfired;
+static unsigned long long	nrecs;
+
+static double
+now(void)
+{	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+fatal(dtrace_hdl_t *dtp, char *msg)
+{
+	fprintf(stderr, "dtbench: %s: %s\n", msg,
+		dtrace_errmsg(dtp, dtrace_errno(dtp)));
+	exit(1);
+}
+
+/*ARGSUSED*/
+static int
+chew(const dtrace_probedata_t *data, void *arg)
+{
+	nfired++;
+	return DTRACE_CONSUME_THIS;
+}
+
+/*ARGSUSED*/
+static int
+chewrec(const dtrace_probedata_t *data, const dtrace_recdesc_t *rec, void *arg)
+{
+	if (rec == NULL)
+		return DTRACE_CONSUME_NEXT;
+
+	nrecs++;
+	return DTRACE_CONSUME_THIS;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: dtbench [-q] [-c ncpus] [-r nrecs] [-b snapsize]\n");
+	fprintf(stderr, "               [-k nkeys] [-n nsnaps]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -c ncpus     CPUs to simulate (default 4)\n");
+	fprintf(stderr, "  -r nrecs     64-bit values per probe firing (default 4)\n");
+	fprintf(stderr, "  -b snapsize  bytes per principal buffer snapshot (default 4m)\n");
+	fprintf(stderr, "  -k nkeys     aggregation keys per snapshot (default 10000)\n");
+	fprintf(stderr, "  -n nsnaps    snapshots of each CPU (default 16)\n");
+	fprintf(stderr, "  -q           aggregate with quantize() rather than count()\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{	dtrace_mockconf_t conf;
+	dtrace_hdl_t *dtp;
+	FILE	*fp;
+	double	t, t_consume, t_snap, t_print;
+	uint64_t i;
+	int	c, err;
+
+	memset(&conf, 0, sizeof conf);
+	conf.dtmc_ncpus = 4;
+	conf.dtmc_nrecs = 4;
+	conf.dtmc_snapsize = 4 * 1024 * 1024;
+	conf.dtmc_nkeys = 10000;
+	conf.dtmc_nsnaps = 16;
+	conf.dtmc_aggact = DTRACEAGG_COUNT;
+
+	while ((c = getopt(argc, argv, "b:c:k:n:qr:")) != EOF) {
+		switch (c) {
+		  case 'b':
+			conf.dtmc_snapsize = strtoull(optarg, NULL, 0);
+			break;
+		  case 'c':
+			conf.dtmc_ncpus = atoi(optarg);
+			break;
+		  case 'k':
+			conf.dtmc_nkeys = strtoull(optarg, NULL, 0);
+			break;
+		  case 'n':
+			conf.dtmc_nsnaps = strtoull(optarg, NULL, 0);
+			break;
+		  case 'q':
+			conf.dtmc_aggact = DTRACEAGG_QUANTIZE;
+			break;
+		  case 'r':
+			conf.dtmc_nrecs = atoi(optarg);
+			break;
+		  default:
+			usage();
+		  }
+	}
+
+	if ((dtp = dtrace_mock_open(DTRACE_VERSION, 0, &err, &conf)) == NULL) {
+		fprintf(stderr, "dtbench: cannot open mock: %s\n",
+			dtrace_errmsg(NULL, err));
+		exit(1);
+	}
+
+	if ((fp = fopen("/dev/null", "w")) == NULL) {
+		perror("/dev/null");
+		exit(1);
+	}
+
+	if (dtrace_go(dtp) != 0)
+		fatal(dtp, "dtrace_go");
+
+	/***********************************************/
+	/*   Principal buffers.			       */
+	/***********************************************/
+	t = now();
+	while (dtrace_status(dtp) != DTRACE_STATUS_EXITED) {
+		if (dtrace_consume(dtp, fp, chew, chewrec, NULL) == -1)
+			fatal(dtp, "dtrace_consume");
+	}
+	t_consume = now() - t;
+
+	/***********************************************/
+	/*   Aggregation  snapshots  -- each merges a  */
+	/*   fresh buffer from every CPU.	       */
+	/***********************************************/
+	t = now();
+	for (i = 0; i < conf.dtmc_nsnaps; i++) {
+		if (dtrace_aggregate_snap(dtp) != 0)
+			fatal(dtp, "dtrace_aggregate_snap");
+	}
+	t_snap = now() - t;
+
+	t = now();
+	if (dtrace_aggregate_print(dtp, fp, NULL) != 0)
+		fatal(dtp, "dtrace_aggregate_print");
+	t_print = now() - t;
+
+	printf("consume: %llu firings, %llu records in %.3fs (%.0f records/sec)\n",
+		nfired, nrecs, t_consume,
+		t_consume > 0 ? nrecs / t_consume : 0.0);
+	printf("aggsnap: %llu snapshots of %d cpus x %llu keys in %.3fs (%.3fms/snap)\n",
+		(unsigned long long) conf.dtmc_nsnaps, conf.dtmc_ncpus,
+		(unsigned long long) conf.dtmc_nkeys, t_snap,
+		conf.dtmc_nsnaps ? t_snap * 1000 / conf.dtmc_nsnaps : 0.0);
+	printf("printa:  %llu keys sorted and printed in %.3fs\n",
+		(unsigned long long) conf.dtmc_nkeys, t_print);
+
+	fclose(fp);
+	dtrace_close(dtp);
+	return 0;
+}
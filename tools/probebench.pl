@@ -0,0 +1,250 @@
+#! /usr/bin/perl
+
+# $Header:$
+
+# Measure the cost of a probe firing, per provider, for a handful of
+# enabling styles. The workload is build/probebench (usdt/c/probebench.c)
+# which runs a tight loop of one operation and reports how long it took.
+# We run it untraced, then under dtrace -c for each case, and charge the
+# difference to the probe firings counted in the "action" case.
+#
+# Output is CSV so runs from different releases can be diffed.
+
+use strict;
+use warnings;
+
+use FileHandle;
+use Getopt::Long;
+use POSIX;
+
+#######################################################################
+#   Command line switches.					      #
+#######################################################################
+my %opts = (
+	bin => "build/probebench",
+	dtrace => "build/dtrace",
+	n => 1000000,
+	runs => 3,
+	);
+
+######################################################################
+#   The  benchmarks.  Each  names  the  workload  operation,  the  #
+#   probe  it  hits, and a probe in the same provider it does not  #
+#   hit, which is enabled for the disabled-but-patched case. Where  #
+#   there is no such thing (io, profile) the case is skipped.	     #
+#   FBT and FBT_OTHER are filled in from /proc/kallsyms.	     #
+######################################################################
+my @benches = (
+	{ provider => "syscall", op => "getppid",
+	  probe => "syscall::getppid:entry",
+	  disabled => "syscall::sync:entry" },
+	{ provider => "fbt", op => "getppid",
+	  probe => "fbt::FBT:entry",
+	  disabled => "fbt::FBT_OTHER:entry" },
+	{ provider => "io", op => "io", n => 10000,
+	  probe => "io:::start" },
+	{ provider => "pid", op => "func",
+	  probe => 'pid$target::bench_func:entry',
+	  disabled => 'pid$target::bench_other:entry' },
+	{ provider => "usdt", op => "usdt",
+	  probe => 'bench$target:::tick',
+	  disabled => 'bench$target:::idle' },
+	{ provider => "profile", op => "spin", n => 100000,
+	  probe => "profile-4999" },
+	);
+
+######################################################################
+#   The  enabling  styles,  from cheapest to most expensive. "base"  #
+#   runs without dtrace at all.					     #
+######################################################################
+my @cases = (
+	[ "base", undef ],
+	[ "disabled", "DISABLED {}" ],
+	[ "empty", "PROBE {}" ],
+	[ "predicate", "PROBE /pid == -1/ {}" ],
+	[ "action", "PROBE /pid == \$target/ { \@c[probefunc, execname] = count(); \@n = count(); }
+		END { printa(\"firings=%\@d\\n\", \@n); }" ],
+	);
+
+######################################################################
+#   Find the kernel name for a syscall - varies by kernel and arch.  #
+######################################################################
+sub kernel_func
+{	my $name = shift;
+
+	my $fh = new FileHandle("/proc/kallsyms");
+	return undef if !$fh;
+	while (<$fh>) {
+		chomp;
+		my $sym = (split(" "))[2];
+		return $sym if $sym =~ /^(__x64_|__ia32_|__arm64_)?sys_$name$/;
+	}
+	return undef;
+}
+
+######################################################################
+#   Run  the  workload,  optionally  under  dtrace, and return the  #
+#   loop time and number of firings we saw.			     #
+######################################################################
+sub run
+{	my $bench = shift;
+	my $d = shift;
+	my $n = shift;
+
+	my $cmd = "$opts{bin} -n $n $bench->{op}";
+	if (defined($d)) {
+		my $z = $bench->{provider} eq "usdt" ? "-Z " : "";
+		$cmd = "$opts{dtrace} -q $z-n '$d' -c '$cmd'";
+	}
+	print STDERR "$cmd\n" if $opts{v};
+
+	my ($ns, $firings);
+	my $fh = new FileHandle("$cmd 2>&1 |");
+	die "Cannot run $cmd -- $!" if !$fh;
+	while (<$fh>) {
+		$ns = $1 if /^probebench: .* ns=(\d+)/;
+		$firings = $1 if /^firings=\s*(\d+)/;
+	}
+	$fh->close();
+	if (!defined($ns)) {
+		print STDERR "probebench: no result from: $cmd\n";
+		return;
+	}
+	return ($ns, $firings);
+}
+
+######################################################################
+#   Main entry point.						     #
+######################################################################
+sub main
+{
+	Getopt::Long::Configure('no_ignore_case');
+	usage() unless GetOptions(\%opts,
+		'bin=s',
+		'dtrace=s',
+		'help',
+		'n=s',
+		'o=s',
+		'runs=s',
+		'v',
+		);
+
+	usage() if $opts{help};
+	$| = 1;
+
+	die "probebench: $opts{bin} not found - build usdt/c first\n" if ! -x $opts{bin};
+	die "probebench: $opts{dtrace} not found\n" if ! -x $opts{dtrace};
+
+	my $fbt = kernel_func("getppid");
+	my $fbt_other = kernel_func("sync");
+
+	my $out = \*STDOUT;
+	if ($opts{o}) {
+		$out = new FileHandle(">$opts{o}");
+		die "Cannot create $opts{o} -- $!" if !$out;
+	}
+
+	my $kernel = (POSIX::uname())[2];
+	my $date = strftime("%Y%m%d", localtime);
+	print $out "date,kernel,provider,case,iterations,firings,ns_per_iter,ns_per_firing\n";
+
+	foreach my $bench (@benches) {
+		next if @ARGV && !grep($_ eq $bench->{provider}, @ARGV);
+
+		if ($bench->{provider} eq "fbt") {
+			if (!$fbt || !$fbt_other) {
+				print STDERR "probebench: cannot find sys_getppid/sys_sync, skipping fbt\n";
+				next;
+			}
+			$bench = { %$bench };
+			$bench->{probe} =~ s/FBT/$fbt/;
+			$bench->{disabled} =~ s/FBT_OTHER/$fbt_other/;
+		}
+
+		my $n = $opts{n};
+		$n = $bench->{n} if $bench->{n} && $bench->{n} < $n;
+
+		###############################################
+		#   Best  of  N runs for each case - we want  #
+		#   the cost, not the noise.		      #
+		###############################################
+		my %ns;
+		my $firings;
+		foreach my $c (@cases) {
+			my ($case, $d) = @$c;
+			if (defined($d)) {
+				next if $d =~ /DISABLED/ && !$bench->{disabled};
+				$d =~ s/DISABLED/$bench->{disabled}/;
+				$d =~ s/PROBE/$bench->{probe}/;
+			}
+			for (my $i = 0; $i < $opts{runs}; $i++) {
+				my ($ns, $f) = run($bench, $d, $n);
+				next if !defined($ns);
+				$ns{$case} = $ns if !defined($ns{$case}) || $ns < $ns{$case};
+				$firings = $f if defined($f);
+			}
+		}
+
+		###############################################
+		#   The  action  case  tells  us  how  many  #
+		#   times  the probe fires in the workload;  #
+		#   we assume the other cases match it.     #
+		###############################################
+		$firings = $n if !$firings;
+		foreach my $c (@cases) {
+			my $case = $c->[0];
+			next if !defined($ns{$case}) || !defined($ns{base});
+			my $delta = $ns{$case} - $ns{base};
+			my $f = $case eq "base" ? 0 : $firings;
+			printf $out "%s,%s,%s,%s,%d,%d,%.1f,%s\n",
+				$date, $kernel, $bench->{provider}, $case, $n, $f,
+				$ns{$case} / $n,
+				$f ? sprintf("%.1f", $delta / $f) : "";
+		}
+	}
+}
+
+#######################################################################
+#   Print out command line usage.				      #
+#######################################################################
+sub usage
+{
+	print <<EOF;
+probebench.pl - measure per-probe overhead for each provider.
+Usage: probebench.pl [switches] [provider ...]
+
+  Runs build/probebench under dtrace for each provider (syscall, fbt,
+  io, pid, usdt, profile) and each enabling style:
+
+    base       no dtrace
+    disabled   another probe in the provider enabled, not this one
+    empty      probe enabled with no action
+    predicate  probe enabled with a predicate that is never true
+    action     probe enabled with a count() aggregation
+
+  and prints CSV with the nanoseconds per loop iteration and the
+  nanoseconds per firing over the untraced run.
+
+  Needs the driver loaded, and to run as a user who can use dtrace.
+
+Switches:
+
+  -bin path     Workload binary (default $opts{bin}).
+  -dtrace path  dtrace binary (default $opts{dtrace}).
+  -n NN         Loop iterations (default $opts{n}; io and profile use fewer).
+  -o file       Write CSV to file rather than stdout.
+  -runs NN      Take the best of NN runs of each case (default $opts{runs}).
+  -v            Print the commands as we run them.
+
+Examples:
+
+   \$ tools/probebench.pl -o /tmp/bench.csv
+   \$ tools/probebench.pl -runs 5 syscall fbt
+
+EOF
+
+	exit(1);
+}
+
+main();
+0;
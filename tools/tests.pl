@@ -108,7 +108,8 @@ sub do_tests
 			}
 			next;
 		}
-		if (/^d:/) {
+		if (/^(d|sh):/) {
+			my $type = $1;
 			my $d = '';
 			while (<$fh>) {
 				chomp;
@@ -118,7 +119,7 @@ sub do_tests
 			my %info;
 			$info{name} = $name;
 			$info{note} = $note;
-			$info{d} = $d;
+			$info{$type} = $d;
 			push @tests, \%info;
 			next;
 		}
@@ -173,14 +174,31 @@ sub do_tests
 
 
 		print time_string() . "Test: ", $info->{name}, "\n";
-		my $d = $info->{d};
+		my $d = defined($info->{sh}) ? $info->{sh} : $info->{d};
 		my $loop = $opts{loop};
+		my $dtrace = $opts{dtrace} ? "dtrace" : "build/dtrace";
 		$d =~ s/\${loop}/$loop/g;
+		$d =~ s/\${dtrace}/$dtrace/g;
 		if ($d eq '') {
 			print "Something wrong with this test. Came out as blank!\n";
 			exit(1);
 		}
-		my $cmd = $opts{dtrace} ? "dtrace -n '$d'" : "build/dtrace -n '$d'";
+		my $cmd = "$dtrace -n '$d'";
+
+		###############################################
+		#   sh:  tests  are  a  shell  script  which  #
+		#   runs  dtrace  itself  and  checks  the    #
+		#   output, exiting non-zero on failure.      #
+		###############################################
+		if (defined($info->{sh})) {
+			my $user = getpwuid(getuid());
+			my $sname = "/tmp/test-$user.$info->{name}.sh";
+			my $sfh = new FileHandle(">$sname");
+			die "Cannot create $sname -- $!" if !$sfh;
+			print $sfh $d;
+			$sfh->close();
+			$cmd = "sh $sname";
+		}
 		my $ret = spawn($cmd, $info->{name});
 		$exit_code ||= $ret;
 		dump_stats();
@@ -372,6 +390,9 @@ Usage: tests.pl [<test-name>]
 
   When run with no arguments, the list of test names is listed.
 
+  A test with an "sh:" body instead of "d:" is a shell script which
+  runs \${dtrace} itself; a non-zero exit status fails the test.
+
   Testing will be aborted if this script detects a problem, e.g.
   kernel messages as a result of probing.
 
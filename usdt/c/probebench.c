@@ -0,0 +1,138 @@
+/**********************************************************************/
+/*   Workload  for  tools/probebench.pl.  Runs  a tight loop of one  */
+/*   operation  which  hits a known probe site, and reports how long  */
+/*   the  loop  took,  so  the  harness  can  work  out the cost per  */
+/*   probe firing by comparing against an untraced run.		      */
+/*   								      */
+/*   Operations:						      */
+/*   								      */
+/*     getppid  - one getppid() syscall (syscall and fbt providers)  */
+/*     io       - write and fdatasync a block (io provider)	      */
+/*     func     - call bench_func() (pid provider)		      */
+/*     usdt     - hit the bench:::tick USDT probe (fasttrap)	      */
+/*     spin     - burn CPU with no probe sites (profile provider)   */
+/*   								      */
+/*   This  lives  here,  rather  than in tests/, because it needs the  */
+/*   DOF built by dtrace -G.					      */
+/**********************************************************************/
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <time.h>
+# include <sys/sdt.h>
+
+static volatile unsigned long sink;
+
+/**********************************************************************/
+/*   Keep  these out of line so pid$target::bench_func:entry has a    */
+/*   real function to land on.					      */
+/**********************************************************************/
+__attribute__((noinline)) void
+bench_func(unsigned long n)
+{
+	sink += n;
+}
+__attribute__((noinline)) void
+bench_other(unsigned long n)
+{
+	sink -= n;
+}
+
+static unsigned long long
+now(void)
+{	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: probebench [-n iterations] getppid|io|func|usdt|spin\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{	unsigned long n, i, j;
+	unsigned long long t;
+	char	buf[4096];
+	char	fname[64];
+	int	c, fd = -1;
+	char	*op;
+
+	n = 1000000;
+	while ((c = getopt(argc, argv, "n:")) != EOF) {
+		switch (c) {
+		  case 'n':
+		  	n = strtoul(optarg, NULL, 0);
+			break;
+		  default:
+		  	usage();
+		  }
+	}
+	if (optind != argc - 1)
+		usage();
+	op = argv[optind];
+
+	if (strcmp(op, "io") == 0) {
+		snprintf(fname, sizeof fname, "/tmp/probebench.%d", getpid());
+		if ((fd = open(fname, O_CREAT | O_TRUNC | O_WRONLY, 0600)) < 0) {
+			perror(fname);
+			exit(1);
+		}
+		unlink(fname);
+		memset(buf, 'x', sizeof buf);
+	} else if (strcmp(op, "getppid") && strcmp(op, "func") &&
+	    strcmp(op, "usdt") && strcmp(op, "spin")) {
+		usage();
+	}
+
+	t = now();
+	switch (*op) {
+	  case 'g':
+		for (i = 0; i < n; i++)
+			getppid();
+		break;
+	  case 'i':
+		for (i = 0; i < n; i++) {
+			if (pwrite(fd, buf, sizeof buf, 0) != sizeof buf ||
+			    fdatasync(fd) < 0) {
+				perror("probebench: io");
+				exit(1);
+			}
+		}
+		break;
+	  case 'f':
+		for (i = 0; i < n; i++)
+			bench_func(i);
+		break;
+	  case 'u':
+		for (i = 0; i < n; i++) {
+			DTRACE_PROBE1(bench, tick, i);
+		}
+		if (n == 0) {
+			DTRACE_PROBE(bench, idle);
+		}
+		break;
+	  case 's':
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < 1000; j++)
+				sink += j;
+		}
+		break;
+	  }
+	t = now() - t;
+
+	/***********************************************/
+	/*   Keep  bench_other  referenced  so  it is  */
+	/*   not discarded.			       */
+	/***********************************************/
+	if (n == 0)
+		bench_other(n);
+
+	printf("probebench: op=%s iterations=%lu ns=%llu\n", op, n, t);
+	return 0;
+}
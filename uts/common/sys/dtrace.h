@@ -410,6 +410,7 @@ typedef struct dtrace_difv {
 #define	DTRACEACT_USYM			(DTRACEACT_PROC + 3)
 #define	DTRACEACT_UMOD			(DTRACEACT_PROC + 4)
 #define	DTRACEACT_UADDR			(DTRACEACT_PROC + 5)
+#define	DTRACEACT_USTACKID		(DTRACEACT_PROC + 6)
 
 #define	DTRACEACT_PROC_DESTRUCTIVE	0x0200
 #define	DTRACEACT_STOP			(DTRACEACT_PROC_DESTRUCTIVE + 1)
@@ -423,6 +424,7 @@ typedef struct dtrace_difv {
 #define	DTRACEACT_STACK			(DTRACEACT_KERNEL + 1)
 #define	DTRACEACT_SYM			(DTRACEACT_KERNEL + 2)
 #define	DTRACEACT_MOD			(DTRACEACT_KERNEL + 3)
+#define	DTRACEACT_STACKID		(DTRACEACT_KERNEL + 4)
 # if linux
 #define	DTRACEACT_TEST1			(DTRACEACT_KERNEL + 0x80)
 #define	DTRACEACT_TEST2			(DTRACEACT_KERNEL + 0x81)
@@ -473,6 +475,8 @@ typedef struct dtrace_difv {
 #define	DTRACEAGG_QUANTIZE		(DTRACEACT_AGGREGATION + 7)
 #define	DTRACEAGG_LQUANTIZE		(DTRACEACT_AGGREGATION + 8)
 #define	DTRACEAGG_LLQUANTIZE		(DTRACEACT_AGGREGATION + 9)
+#define	DTRACEAGG_DISTINCT		(DTRACEACT_AGGREGATION + 10)
+#define	DTRACEAGG_PERCENTILES		(DTRACEACT_AGGREGATION + 11)
 
 #define	DTRACEACT_ISAGG(x)		\
 	(DTRACEACT_CLASS(x) == DTRACEACT_AGGREGATION)
@@ -532,6 +536,75 @@ typedef struct dtrace_difv {
 	(uint16_t)(((x) & DTRACE_LLQUANTIZE_NSTEPMASK) >> \
 	DTRACE_LLQUANTIZE_NSTEPSHIFT)
 
+/*
+ * distinct() is a HyperLogLog cardinality estimator.  Its value is an array
+ * of DTRACE_DISTINCT_NREGS one-byte registers; a value is hashed, the top
+ * DTRACE_DISTINCT_PRECISION bits of the hash select a register, and the
+ * register keeps the maximum observed position of the first set bit in the
+ * remaining bits.  Merging two estimators is a bytewise maximum.  The
+ * standard error of the estimate is roughly 1.04 / sqrt(NREGS), or about
+ * 3% with the precision below.
+ */
+#define	DTRACE_DISTINCT_PRECISION	10
+#define	DTRACE_DISTINCT_NREGS		(1 << DTRACE_DISTINCT_PRECISION)
+
+/*
+ * percentiles() is a mergeable relative-error quantile sketch.  Positive
+ * values are bucketed by their most significant bit plus the next
+ * DTRACE_PCTL_SUBBITS bits, bounding the relative error of any reported
+ * percentile to 2^-(SUBBITS + 1).  Only a window of DTRACE_PCTL_NBUCKETS
+ * consecutive buckets is kept; when a value lands above the window, the
+ * window slides up and the buckets falling off the bottom are folded into
+ * the lowest bucket (so accuracy is traded away at the low end, not the
+ * tail).  The value is laid out as:
+ *
+ *	index of the lowest bucket in the window	(uint64_t)
+ *	count of values less than or equal to zero	(uint64_t)
+ *	bucket counts					(uint64_t[NBUCKETS])
+ */
+#define	DTRACE_PCTL_SUBBITS		4
+#define	DTRACE_PCTL_NBUCKETS		256
+#define	DTRACE_PCTL_NSUB		(1 << DTRACE_PCTL_SUBBITS)
+
+#define	DTRACE_PCTL_SIZE		\
+	((DTRACE_PCTL_NBUCKETS + 2) * sizeof (uint64_t))
+
+#define	DTRACE_PCTL_BUCKETMIN(i)	\
+	((i) < DTRACE_PCTL_NSUB ? (uint64_t)(i) : \
+	(uint64_t)(DTRACE_PCTL_NSUB | ((i) & (DTRACE_PCTL_NSUB - 1))) << \
+	(((i) >> DTRACE_PCTL_SUBBITS) - 1))
+
+#define	DTRACE_PCTL_BUCKETWIDTH(i)	\
+	((i) < DTRACE_PCTL_NSUB ? (uint64_t)1 : \
+	(uint64_t)1 << (((i) >> DTRACE_PCTL_SUBBITS) - 1))
+
+/*
+ * When the "aggcompact" option is set, the kernel rewrites quantize(),
+ * lquantize() and llquantize() records in an aggregation snapshot so that
+ * only their non-zero buckets are copied out.  A compacted record carries
+ * DTRACE_AGGCOMPACT_FLAG in its aggregation ID and is laid out as:
+ *
+ *	aggid | DTRACE_AGGCOMPACT_FLAG		(dtrace_aggid_t)
+ *	key data, exactly as in the dense record
+ *	number of bytes of bucket data		(uint32_t)
+ *	bucket data
+ *
+ * The bucket data is a sequence of (index delta, value) pairs, one per
+ * non-zero 64-bit word of the dense value, each written as an unsigned
+ * base-128 varint; values are zig-zag encoded first so that negative
+ * increments stay short.  The record is zero-padded to a 32-bit boundary.
+ * A record is only compacted if the result is smaller than the dense form,
+ * so dense and compacted records may be freely mixed within a snapshot.
+ */
+#define	DTRACE_AGGCOMPACT_FLAG		0x80000000
+#define	DTRACE_AGGCOMPACT_VARINTMAX	10
+
+#define	DTRACE_AGGCOMPACT_ZIGZAG(x)		\
+	(((uint64_t)(x) << 1) ^ (uint64_t)((int64_t)(x) >> 63))
+
+#define	DTRACE_AGGCOMPACT_UNZIGZAG(x)		\
+	((int64_t)((uint64_t)(x) >> 1) ^ -(int64_t)((x) & 1))
+
 #define	DTRACE_USTACK_NFRAMES(x)	(uint32_t)((x) & UINT32_MAX)
 #define	DTRACE_USTACK_STRSIZE(x)	(uint32_t)((x) >> 32)
 #define	DTRACE_USTACK_ARG(x, y)		\
@@ -656,7 +729,8 @@ typedef struct dof_hdr {
 
 #define	DOF_VERSION_1	1	/* DOF version 1: Solaris 10 FCS */
 #define	DOF_VERSION_2	2	/* DOF version 2: Solaris Express 6/06 */
-#define	DOF_VERSION	DOF_VERSION_2	/* Latest DOF version */
+#define	DOF_VERSION_3	3	/* DOF version 3: is-enabled semaphores */
+#define	DOF_VERSION	DOF_VERSION_2	/* Default DOF version */
 
 #define	DOF_FL_VALID	0	/* mask of all valid dofh_flags bits */
 
@@ -702,6 +776,7 @@ typedef struct dof_sec {
 #define	DOF_SECT_XLEXPORT	24	/* dof_xlator_t */
 #define	DOF_SECT_PREXPORT	25	/* dof_secidx_t array (exported objs) */
 #define	DOF_SECT_PRENOFFS	26	/* uint32_t array (enabled offsets) */
+#define	DOF_SECT_PRSEMAS	27	/* uint64_t array (probe semaphores) */
 
 #define	DOF_SECF_LOAD		1	/* section should be loaded */
 
@@ -717,7 +792,8 @@ typedef struct dof_sec {
 	((x) == DOF_SECT_INTTAB) || ((x) == DOF_SECT_XLTAB) ||		\
 	((x) == DOF_SECT_XLMEMBERS) || ((x) == DOF_SECT_XLIMPORT) ||	\
 	((x) == DOF_SECT_XLIMPORT) || ((x) == DOF_SECT_XLEXPORT) ||	\
-	((x) == DOF_SECT_PREXPORT) || ((x) == DOF_SECT_PRENOFFS))
+	((x) == DOF_SECT_PREXPORT) || ((x) == DOF_SECT_PRENOFFS) ||	\
+	((x) == DOF_SECT_PRSEMAS))
 
 typedef struct dof_ecbdesc {
 	dof_secidx_t dofe_probes;	/* link to DOF_SECT_PROBEDESC */
@@ -791,6 +867,7 @@ typedef struct dof_provider {
 	dof_attr_t dofpv_nameattr;	/* name attributes */
 	dof_attr_t dofpv_argsattr;	/* args attributes */
 	dof_secidx_t dofpv_prenoffs;	/* link to DOF_SECT_PRENOFFS section */
+	dof_secidx_t dofpv_prsemas;	/* link to DOF_SECT_PRSEMAS section */
 } dof_provider_t;
 
 typedef struct dof_probe {
@@ -1027,7 +1104,11 @@ typedef struct dtrace_fmtdesc {
 #define	DTRACEOPT_AGGSORTKEYPOS	26	/* agg. key position to sort on */
 #if linux
 #define DTRACEOPT_STACKSYMBOLS  27      /* clear to prevent stack symbolication */
-#define	DTRACEOPT_MAX		28	/* number of options */
+#define	DTRACEOPT_AGGCOMPACT	28	/* compact aggregation snapshots */
+#define	DTRACEOPT_AGGTOPN	29	/* keys per agg. in each snapshot */
+#define	DTRACEOPT_STACKTABSIZE	30	/* size of interned stack table */
+#define	DTRACEOPT_BUFBUDGET	31	/* bytes for all principal buffers */
+#define	DTRACEOPT_MAX		32	/* number of options */
 #else
 #define	DTRACEOPT_MAX		27	/* number of options */
 #endif
@@ -1040,6 +1121,20 @@ typedef struct dtrace_fmtdesc {
 
 #define	DTRACEOPT_BUFRESIZE_AUTO	0	/* automatic resizing */
 #define	DTRACEOPT_BUFRESIZE_MANUAL	1	/* manual resizing */
+#define	DTRACEOPT_BUFRESIZE_ADAPTIVE	2	/* resize on observed fill */
+
+/*
+ * With bufresize set to "adaptive" and the "switch" buffer policy, each CPU's
+ * principal buffers grow and shrink between snapshots according to how full
+ * they were, while the sum of all principal buffers is kept within the
+ * bufbudget option (by default, the memory first allocated for them).  No
+ * buffer grows beyond DTRACE_BUFADAPT_MAX() of the bufsize and bufbudget in
+ * effect when tracing began; user-level must snapshot into a buffer at least
+ * that large.
+ */
+#define	DTRACE_BUFADAPT_MAX(bufsize, budget)			\
+	(((bufsize) * 16 < (budget) / 2 ? (bufsize) * 16 :	\
+	(budget) / 2) & ~(dtrace_optval_t)(sizeof (uint64_t) - 1))
 
 /*
  * DTrace Buffer Interface
@@ -1065,6 +1160,61 @@ typedef struct dtrace_bufdesc {
 	uint64_t dtbd_oldest;			/* offset of oldest record */
 } dtrace_bufdesc_t;
 
+/*
+ * DTrace Stack Table
+ *
+ * When stack() or ustack() is used as an aggregation key, the stack is
+ * interned in a per-consumer stack table and the key records (as a
+ * DTRACEACT_STACKID or DTRACEACT_USTACKID) only the 64-bit stack ID.  The
+ * table is an append-only array of 64-bit words; each stack is a header
+ * word -- the stack's hash in the upper 32 bits and its number of frames in
+ * the lower 32 -- followed by its frames.  (For ustack(), the first frame
+ * is the pid.)  A stack ID is the offset of the header word plus one; an ID
+ * of zero denotes a stack that could not be interned.  DTRACEIOC_STACKTAB
+ * copies out the words from dtsd_offs up to the current end of the table,
+ * which is returned in dtsd_next.  Space is reserved before it is filled in,
+ * so the copy may include stacks that are still being written; their header
+ * words are zero, as the header is always written after the frames.  (An
+ * empty stack has a hash of DTRACE_STACKID_EMPTYHASH so that its header word
+ * is not zero.)
+ */
+typedef struct dtrace_stackdesc {
+	uint64_t dtsd_offs;			/* first word to copy */
+	uint64_t dtsd_size;			/* words at dtsd_data */
+	uint64_t dtsd_next;			/* words in use */
+	DTRACE_PTR(uint64_t, dtsd_data);	/* data */
+} dtrace_stackdesc_t;
+
+#define	DTRACE_STACKID_HASH(w)		((uint32_t)((w) >> 32))
+#define	DTRACE_STACKID_NFRAMES(w)	((uint32_t)(w))
+#define	DTRACE_STACKID_EMPTYHASH	0xffffffff
+
+/*
+ * DTrace Speculation Statistics
+ *
+ * The status structure (below) only totals speculative drops.  To find which
+ * speculations are suffering, DTRACEIOC_SPECSTAT copies out one
+ * dtrace_specstat structure per speculation ID, starting at ID dtspd_first
+ * (IDs start at 1) and copying at most dtspd_count entries; dtspd_count is
+ * set to the number copied and dtspd_nspec to the number of speculations.
+ * dtss_drops counts capacity drops, dtss_busy counts speculate() on the ID
+ * while it was being committed or discarded, and dtss_unavail counts
+ * speculate() on the ID while it was not allocated.
+ */
+typedef struct dtrace_specstat {
+	uint64_t dtss_drops;			/* capacity drops */
+	uint32_t dtss_busy;			/* drops due to busy */
+	uint32_t dtss_unavail;			/* drops due to unavailable */
+} dtrace_specstat_t;
+
+typedef struct dtrace_specdesc {
+	uint32_t dtspd_first;			/* first ID to copy */
+	uint32_t dtspd_count;			/* entries at dtspd_data */
+	uint32_t dtspd_nspec;			/* number of speculations */
+	uint32_t dtspd_pad;			/* pad to 64-bit alignment */
+	DTRACE_PTR(dtrace_specstat_t, dtspd_data); /* data */
+} dtrace_specdesc_t;
+
 /*
  * DTrace Status
  *
@@ -1080,6 +1230,15 @@ typedef struct dtrace_bufdesc {
  * further data will be generated until tracing is stopped (at which time any
  * enablings of the END action will be processed); if user-level sees that
  * this field is non-zero, tracing should be stopped as soon as possible.
+ *
+ * The dtst_numalocal and dtst_numaremote fields are not drops:  they count
+ * the per-CPU principal and aggregation buffers, and the per-CPU slices of the
+ * dynamic variable space, that were found on and off their CPU's NUMA node
+ * respectively.  Both are zero on a machine with a single node.  Nor are
+ * dtst_aggheld and dtst_aggunfiltered:  with the "aggtopn" option, they count
+ * the aggregation records held back in the kernel (to be copied out later) and
+ * the snapshots that held records of an aggregation created after tracing
+ * started, which are copied out unfiltered.
  */
 typedef struct dtrace_status {
 	uint64_t dtst_dyndrops;			/* dynamic drops */
@@ -1092,6 +1251,11 @@ typedef struct dtrace_status {
 	uint64_t dtst_filled;			/* number of filled bufs */
 	uint64_t dtst_stkstroverflows;		/* stack string tab overflows */
 	uint64_t dtst_dblerrors;		/* errors in ERROR probes */
+	uint64_t dtst_stacktabdrops;		/* stack table overflows */
+	uint64_t dtst_numalocal;		/* per-CPU bufs on CPU's node */
+	uint64_t dtst_numaremote;		/* per-CPU bufs off CPU's node */
+	uint64_t dtst_aggheld;			/* agg. records held by aggtopn */
+	uint64_t dtst_aggunfiltered;		/* aggtopn snapshots unfiltered */
 	char dtst_killed;			/* non-zero if killed */
 	char dtst_exiting;			/* non-zero if exit() called */
 	char dtst_pad[6];			/* pad out to 64-bit align */
@@ -1248,6 +1412,8 @@ typedef struct dtrace_providerdesc {
 #define	DTRACEIOC_FORMAT	(DTRACEIOC | 16)	/* get format str */
 #define	DTRACEIOC_DOFGET	(DTRACEIOC | 17)	/* get DOF */
 #define	DTRACEIOC_REPLICATE	(DTRACEIOC | 18)	/* replicate enab */
+#define	DTRACEIOC_STACKTAB	(DTRACEIOC | 19)	/* get stack table */
+#define	DTRACEIOC_SPECSTAT	(DTRACEIOC | 20)	/* get spec. stats */
 
 /*
  * DTrace Helpers
@@ -2189,6 +2355,7 @@ typedef struct dtrace_helper_probedesc {
 	uint8_t dthpb_nargc;			/* native argument count */
 	char *dthpb_xtypes;			/* translated types strings */
 	char *dthpb_ntypes;			/* native types strings */
+	uint64_t dthpb_semaphore;		/* is-enabled semaphore or 0 */
 } dtrace_helper_probedesc_t;
 
 typedef struct dtrace_helper_provdesc {
@@ -115,6 +115,19 @@ struct dtrace_probe {
 
 typedef int dtrace_probekey_f(const char *, const char *, int);
 
+/*
+ * For a glob pattern, dtrace_probekey() also records the longest run of
+ * literal characters in the pattern.  Any string matching the pattern must
+ * contain that run (and, if the run begins the pattern, must begin with it),
+ * which allows dtrace_match() to discard most distinct module, function or
+ * name strings with a cheap comparison before evaluating the glob.
+ */
+typedef struct dtrace_probehint {
+	const char *dtph_str;			/* literal run in pattern */
+	size_t dtph_len;			/* length of literal run */
+	int dtph_anchored;			/* run begins the pattern */
+} dtrace_probehint_t;
+
 typedef struct dtrace_probekey {
 	const char *dtpk_prov;			/* provider name to match */
 	dtrace_probekey_f *dtpk_pmatch;		/* provider matching function */
@@ -125,6 +138,9 @@ typedef struct dtrace_probekey {
 	const char *dtpk_name;			/* name to match */
 	dtrace_probekey_f *dtpk_nmatch;		/* name matching function */
 	dtrace_id_t dtpk_id;			/* identifier to match */
+	dtrace_probehint_t dtpk_mhint;		/* module literal hint */
+	dtrace_probehint_t dtpk_fhint;		/* func literal hint */
+	dtrace_probehint_t dtpk_nhint;		/* name literal hint */
 } dtrace_probekey_t;
 
 typedef struct dtrace_hashbucket {
@@ -133,6 +149,13 @@ typedef struct dtrace_hashbucket {
 	int dthb_len;				/* number of probes here */
 } dtrace_hashbucket_t;
 
+/*
+ * A probe hash grows by doubling, but the rehash is spread over subsequent
+ * operations:  while dth_oldtab is non-NULL, the slots of the old table below
+ * dth_migrate have been moved to dth_tab and the rest have not, and every
+ * add, lookup and remove moves a few more.  Because a slot is moved whole, a
+ * given string is only ever found in one of the two tables.
+ */
 typedef struct dtrace_hash {
 	dtrace_hashbucket_t **dth_tab;		/* hash table */
 	int dth_size;				/* size of hash table */
@@ -141,8 +164,30 @@ typedef struct dtrace_hash {
 	uintptr_t dth_nextoffs;			/* offset of next in probe */
 	uintptr_t dth_prevoffs;			/* offset of prev in probe */
 	uintptr_t dth_stroffs;			/* offset of str in probe */
+	dtrace_hashbucket_t **dth_oldtab;	/* table being migrated */
+	int dth_oldsize;			/* size of old table */
+	int dth_migrate;			/* next old slot to migrate */
+	uint64_t dth_lookups;			/* number of slot searches */
+	uint64_t dth_steps;			/* buckets compared in them */
+	uint64_t dth_resizes;			/* number of resizes */
 } dtrace_hash_t;
 
+/*
+ * Statistics for one of the framework's probe hashes, as reported by
+ * dtrace_hash_stats() (and, on Linux, /proc/dtrace/stats).
+ */
+typedef struct dtrace_hashstat {
+	const char *dths_name;			/* "mod", "func" or "name" */
+	uint64_t dths_size;			/* slots in the table */
+	uint64_t dths_nbuckets;			/* distinct strings */
+	uint64_t dths_used;			/* non-empty slots */
+	uint64_t dths_maxchain;			/* most strings in one slot */
+	uint64_t dths_maxlen;			/* most probes on one string */
+	uint64_t dths_lookups;			/* slot searches */
+	uint64_t dths_steps;			/* buckets compared */
+	uint64_t dths_resizes;			/* resizes */
+} dtrace_hashstat_t;
+
 /*
  * DTrace Enabling Control Blocks
  *
@@ -259,6 +304,12 @@ typedef struct dtrace_aggregation {
  * dtrace_buffer structure; to prevent false sharing of the structure, it must
  * always be aligned to the coherence granularity -- generally 64 bytes.)
  *
+ * The twin buffers are normally the same size.  Adaptive principal buffers
+ * (DTRACEBUF_ADAPTIVE) are the exception:  the inactive buffer is resized
+ * after each snapshot has been copied out, so dtb_size describes only the
+ * active buffer, dtb_xamot_size describes the inactive buffer, and the two
+ * are exchanged along with the buffers on each switch.
+ *
  * One of the critical design decisions of DTrace is that a given ECB always
  * stores the same quantity and type of data.  This is done to assure that the
  * only metadata required for an ECB's traced data is the EPID.  That is, from
@@ -407,6 +458,7 @@ typedef struct dtrace_aggregation {
 #define	DTRACEBUF_FULL		0x0040		/* "fill" buffer is full */
 #define	DTRACEBUF_CONSUMED	0x0080		/* buffer has been consumed */
 #define	DTRACEBUF_INACTIVE	0x0100		/* buffer is not yet active */
+#define	DTRACEBUF_ADAPTIVE	0x0200		/* resized at each switch */
 
 typedef struct dtrace_buffer {
 	uint64_t dtb_offset;			/* current offset in buffer */
@@ -425,7 +477,9 @@ typedef struct dtrace_buffer {
 #endif
 	uint64_t dtb_switched;			/* time of last switch */
 	uint64_t dtb_interval;			/* observed switch interval */
-	uint64_t dtb_pad2[6];			/* pad to avoid false sharing */
+	uint64_t dtb_xamot_size;		/* size of inactive buffer */
+	uint64_t dtb_xamot_carry;		/* bytes held in inactive buffer */
+	uint64_t dtb_pad2[4];			/* pad to avoid false sharing */
 } dtrace_buffer_t;
 
 /*
@@ -498,6 +552,31 @@ typedef struct dtrace_aggbuffer {
 	dtrace_aggkey_t **dtagb_hash;		/* hash table */
 } dtrace_aggbuffer_t;
 
+/*
+ * When the "aggtopn" option is set, each aggregation snapshot is filtered so
+ * that only the N heaviest keys of each aggregation are copied out.  The
+ * selection is made with a bounded min-heap of dtrace_aggtopn structures per
+ * aggregation; records that lose are marked in the (inactive) buffer so that
+ * the copyout skips them.  Nothing is thrown away:  once the snapshot has been
+ * copied out, the records that were held back are moved to the front of the
+ * inactive buffer and rehashed, and dtb_xamot_carry is set so that when the
+ * buffer next becomes active it carries on aggregating into them.  A held key
+ * is copied out (with everything it has accumulated) as soon as it ranks in a
+ * later snapshot, and every held record is copied out once tracing stops,
+ * when snapshots are no longer filtered.  So the consumer's final totals are
+ * exact; while tracing is running, the totals of keys outside a CPU's top N
+ * lag behind, and held records take space from new keys in the buffer (which
+ * shows up as aggregation drops).  The number of records held back is kept in
+ * dts_aggheld.  The heaps are allocated once, in dtrace_state_go(), for the
+ * aggregations that exist then; records of an aggregation created later (by
+ * a probe that appears after tracing has started) are copied out unfiltered,
+ * and snapshots that hold any are counted in dts_aggunfiltered.
+ */
+typedef struct dtrace_aggtopn {
+	int64_t dtat_weight;			/* weight of record */
+	uintptr_t dtat_offs;			/* offset of record in buffer */
+} dtrace_aggtopn_t;
+
 /*
  * DTrace Speculations
  *
@@ -565,8 +644,30 @@ typedef struct dtrace_speculation {
 	dtrace_speculation_state_t dtsp_state;	/* current speculation state */
 	int dtsp_cleaning;			/* non-zero if being cleaned */
 	dtrace_buffer_t *dtsp_buffer;		/* speculative buffer */
+	dtrace_specid_t dtsp_next;		/* next on free/dirty list */
+	uint32_t dtsp_busy;			/* speculate() while busy */
+	uint32_t dtsp_unavail;			/* speculate() while inactive */
 } dtrace_speculation_t;
 
+/*
+ * INACTIVE speculations are kept on a free list, and speculations that have
+ * entered the COMMITTINGMANY or DISCARDING state are kept on a dirty list,
+ * so that neither speculation() nor the cleaner need scan every speculation.
+ * Both lists are threaded through dtsp_next and are manipulated from probe
+ * context with compare-and-swap.  The head of each list holds the ID of its
+ * first speculation in the low DTRACESPEC_IDBITS bits, and a generation
+ * count in the remaining bits that is advanced on every update; the
+ * generation keeps a pop from succeeding against a head that has been
+ * popped and pushed again in the meantime.  An ID of zero denotes an empty
+ * list.  (On 32-bit kernels the generation is only eight bits wide, which
+ * narrows but does not close that window.)
+ */
+#define	DTRACESPEC_IDBITS	24
+#define	DTRACESPEC_IDMASK	((1 << DTRACESPEC_IDBITS) - 1)
+#define	DTRACESPEC_LISTID(h)	((dtrace_specid_t)((h) & DTRACESPEC_IDMASK))
+#define	DTRACESPEC_LISTNEXT(h, id)	\
+	((((h) & ~(uintptr_t)DTRACESPEC_IDMASK) + DTRACESPEC_IDMASK + 1) | (id))
+
 /*
  * DTrace Dynamic Variables
  *
@@ -825,6 +926,9 @@ typedef struct dtrace_dstate {
 	dtrace_dynhash_t *dtds_hash;		/* pointer to hash table */
 	dtrace_dstate_state_t dtds_state;	/* current dynamic var. state */
 	dtrace_dstate_percpu_t *dtds_percpu;	/* per-CPU dyn. var. state */
+	void *dtds_stripe;			/* node-striped pages, if any */
+	uint32_t dtds_numalocal;		/* CPU slices on local node */
+	uint32_t dtds_numaremote;		/* CPU slices on remote node */
 } dtrace_dstate_t;
 
 /*
@@ -997,6 +1101,11 @@ typedef enum dtrace_activity {
  * containing pointers to the objects needed to execute the helper.  Note that
  * helpers are _duplicated_ across fork(2), and destroyed on exec(2).  No more
  * than dtrace_helpers_max are allowed per-process.
+ *
+ * Unless dtrace_helper_lazy is zero, a process's helper providers are not
+ * passed to the meta provider when they are registered; the helpers are kept
+ * on a lazy list (linked through dthps_next and dthps_prev, as the deferred
+ * list is) until a consumer looks for or enables a probe that they describe.
  */
 #define	DTRACE_HELPER_ACTION_USTACK	0
 #define	DTRACE_NHELPER_ACTIONS		1
@@ -1009,10 +1118,27 @@ typedef struct dtrace_helper_action {
 	struct dtrace_helper_action *dtha_next;	/* next helper action */
 } dtrace_helper_action_t;
 
+/*
+ * Processes running the same object hand us byte-for-byte identical DOF, so
+ * helper provider DOF is validated once and kept in a dtrace_dofcache_t keyed
+ * by a hash of its contents.  Later processes share the relocated copy; the
+ * only per-process state is the load address, and probe addresses are biased
+ * by the difference between it and dtdc_ubase when the providers are created.
+ */
+typedef struct dtrace_dofcache {
+	struct dtrace_dofcache *dtdc_next;	/* next cached DOF */
+	uint64_t dtdc_hash;			/* hash of DOF as copied in */
+	dof_hdr_t *dtdc_raw;			/* DOF as copied in */
+	dof_hdr_t *dtdc_dof;			/* validated, relocated DOF */
+	uint64_t dtdc_ubase;			/* base dtdc_dof relocated to */
+	uint32_t dtdc_ref;			/* helper providers sharing it */
+} dtrace_dofcache_t;
+
 typedef struct dtrace_helper_provider {
 	int dthp_generation;			/* helper provider generation */
 	uint32_t dthp_ref;			/* reference count */
 	dof_helper_t dthp_prov;			/* DOF w/ provider and probes */
+	dtrace_dofcache_t *dthp_cache;		/* shared DOF, if any */
 } dtrace_helper_provider_t;
 
 typedef struct dtrace_helpers {
@@ -1024,6 +1150,8 @@ typedef struct dtrace_helpers {
 	int dthps_generation;			/* current generation */
 	pid_t dthps_pid;			/* pid of associated proc */
 	int dthps_deferred;			/* helper in deferred list */
+	int dthps_lazy;				/* helper in lazy list */
+	int dthps_provided;			/* provs passed to meta prov */
 	struct dtrace_helpers *dthps_next;	/* next pointer */
 	struct dtrace_helpers *dthps_prev;	/* prev pointer */
 } dtrace_helpers_t;
@@ -1094,6 +1222,27 @@ typedef struct dtrace_cred {
 	uint16_t		dcr_action;
 } dtrace_cred_t;
 
+/*
+ * DTrace Stack Table
+ *
+ * Stacks used as aggregation keys are interned in a per-state table so that
+ * the key carries a 64-bit ID rather than the frames themselves; see the
+ * description of dtrace_stackdesc_t in <sys/dtrace.h> for the layout of
+ * dtstk_data.  Interning is lock-free:  a stack is written into space
+ * reserved at the end of dtstk_data, and only then published by a
+ * compare-and-swap of its ID into an empty slot of the open-addressed
+ * dtstk_hash.  Space reserved by a CPU that loses the race to publish the
+ * same stack is simply wasted.  Nothing is ever removed; when the table
+ * fills, stacks are dropped (and counted in dts_stacktabdrops).
+ */
+typedef struct dtrace_stacktab {
+	uint64_t *dtstk_data;			/* interned stacks */
+	uint32_t *dtstk_hash;			/* hash slots; stack ID or 0 */
+	uint32_t dtstk_size;			/* words in dtstk_data */
+	uint32_t dtstk_hashsize;		/* slots in dtstk_hash */
+	uint32_t dtstk_next;			/* next free word */
+} dtrace_stacktab_t;
+
 /*
  * DTrace Consumer State
  *
@@ -1117,6 +1266,9 @@ struct dtrace_state {
 	dtrace_buffer_t *dts_aggbuffer;		/* aggregation buffer */
 	dtrace_speculation_t *dts_speculations;	/* speculation array */
 	int dts_nspeculations;			/* number of speculations */
+	uintptr_t dts_specfree;			/* free speculation list */
+	uintptr_t dts_specdirty;		/* speculations to be cleaned */
+	dtrace_specid_t dts_specclean;		/* list being cleaned */
 	int dts_naggregations;			/* number of aggregations */
 	dtrace_aggregation_t **dts_aggregations; /* aggregation array */
 	vmem_t *dts_aggid_arena;		/* arena for aggregation IDs */
@@ -1125,13 +1277,24 @@ struct dtrace_state {
 	uint32_t dts_speculations_unavail;	/* number of spec unavail */
 	uint32_t dts_stkstroverflows;		/* stack string tab overflows */
 	uint32_t dts_dblerrors;			/* errors in ERROR probes */
+	uint32_t dts_stacktabdrops;		/* stacks not interned */
 	uint32_t dts_reserve;			/* space reserved for END */
+	uint64_t dts_bufbytes;			/* bytes in principal buffers */
+	uint64_t dts_bufmin;			/* adaptive buffer minimum */
+	uint64_t dts_bufmax;			/* adaptive buffer maximum */
+	uint64_t dts_aggheld;			/* agg. records held by aggtopn */
+	uint64_t dts_aggunfiltered;		/* aggtopn snapshots unfiltered */
+	dtrace_aggtopn_t *dts_aggtopn;		/* aggtopn heaps, then counts */
+	size_t dts_aggtopnsize;			/* size of dts_aggtopn */
+	int dts_aggtopnaggs;			/* aggregations in dts_aggtopn */
 	hrtime_t dts_laststatus;		/* time of last status */
 	cyclic_id_t dts_cleaner;		/* cleaning cyclic */
 	cyclic_id_t dts_deadman;		/* deadman cyclic */
 	hrtime_t dts_alive;			/* time last alive */
 	char dts_speculates;			/* boolean: has speculations */
 	char dts_destructive;			/* boolean: has dest. actions */
+	char dts_stackids;			/* boolean: has stack IDs */
+	dtrace_stacktab_t dts_stacktab;		/* interned stacks */
 	int dts_nformats;			/* number of formats */
 	char **dts_formats;			/* format string array */
 	dtrace_optval_t dts_options[DTRACEOPT_MAX]; /* options */
@@ -1242,6 +1405,7 @@ typedef struct dtrace_toxrange {
 	uintptr_t	dtt_limit;		/* limit of toxic range */
 } dtrace_toxrange_t;
 
+extern int dtrace_hash_stats(int, dtrace_hashstat_t *);
 extern uint64_t dtrace_getarg(int, int);
 extern greg_t dtrace_getfp(void);
 extern int dtrace_getipl(void);
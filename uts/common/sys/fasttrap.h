@@ -23,6 +23,7 @@ extern "C" {
 #define	FASTTRAPIOC		(('m' << 24) | ('r' << 16) | ('f' << 8))
 #define	FASTTRAPIOC_MAKEPROBE	(FASTTRAPIOC | 1)
 #define	FASTTRAPIOC_GETINSTR	(FASTTRAPIOC | 2)
+#define	FASTTRAPIOC_MAKEPROBES	(FASTTRAPIOC | 3)
 
 typedef enum fasttrap_probe_type {
 	DTFTP_NONE = 0,
@@ -46,6 +47,28 @@ typedef struct fasttrap_probe_spec {
 	uint64_t		ftps_offs[1];
 } fasttrap_probe_spec_t;
 
+/*
+ * A fasttrap_probe_spec_t is variable-length: ftps_offs[] holds ftps_noffs
+ * entries.  Since every member is naturally aligned, specs may be packed back
+ * to back.
+ */
+#define	FASTTRAP_PROBE_SPEC_SIZE(noffs)					\
+	(sizeof (fasttrap_probe_spec_t) +				\
+	((noffs) - 1) * sizeof (((fasttrap_probe_spec_t *)0)->ftps_offs[0]))
+
+/*
+ * FASTTRAPIOC_MAKEPROBES creates ftpb_nspecs probes with a single ioctl.  The
+ * specs are packed back to back in the ftpb_size bytes at ftpb_specs.  On
+ * return ftpb_ndone holds the number of probes created; if the ioctl fails,
+ * the offending spec is the one after those.
+ */
+typedef struct fasttrap_probe_batch {
+	uint64_t		ftpb_nspecs;
+	uint64_t		ftpb_size;
+	uint64_t		ftpb_specs;
+	uint64_t		ftpb_ndone;
+} fasttrap_probe_batch_t;
+
 typedef struct fasttrap_instr_query {
 	uint64_t		ftiq_pc;
 	pid_t			ftiq_pid;
@@ -117,6 +117,7 @@ struct fasttrap_probe {
 	uint64_t ftp_gen;			/* modification generation */
 	uint64_t ftp_ntps;			/* number of tracepoints */
 	uint8_t *ftp_argmap;			/* native to translated args */
+	uintptr_t ftp_semaphore;		/* is-enabled semaphore or 0 */
 	uint8_t ftp_nargs;			/* translated argument count */
 	uint8_t ftp_enabled;			/* is this probe enabled */
 	char *ftp_xtypes;			/* translated types index */